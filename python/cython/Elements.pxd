@@ -107,7 +107,7 @@ cdef extern from "fisx_elements.h" namespace "fisx":
                                               double, double, double, int, double, double) except +
 
         void updateEscapeCache(std_map[std_string, double],\
-                                       std_vector[double], double, double, int, double, double) except +
+                                       std_vector[double], double, double, int, double, double) except + nogil
         
         std_map[std_string, double] getEmittedXRayLines(std_string, double) except +
 
@@ -133,9 +133,9 @@ cdef extern from "fisx_elements.h" namespace "fisx":
 
         void emptyElementCascadeCache(std_string) except +
 
-        void fillCache(std_string, std_vector[double]) except +
+        void fillCache(std_string, std_vector[double]) except + nogil
 
-        void updateCache(std_string, std_vector[double]) except +
+        void updateCache(std_string, std_vector[double]) except + nogil
 
         void setCacheEnabled(std_string, int) except +
 
@@ -149,4 +149,8 @@ cdef extern from "fisx_elements.h" namespace "fisx":
 
         int getCacheSize(std_string) except+
 
+        int getExcitationCacheSize(std_string) except+
+
+        unsigned long long getGeneration()
+
         void removeMaterials()
@@ -45,6 +45,8 @@ cdef extern from "fisx_math.h" namespace "fisx":
 
         double deBoerX(double, double, double, double, double, double, double) except +
 
+        double deBoerXDerivatives(double, double, double, double, double, double, double, double *) except +
+
         double erf(double)
 
         double erfc(double)
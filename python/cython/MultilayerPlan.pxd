@@ -0,0 +1,81 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#import numpy as np
+#cimport numpy as np
+cimport cython
+
+from libcpp.string cimport string as std_string
+from libcpp.vector cimport vector as std_vector
+from libcpp.map cimport map as std_map
+from libcpp cimport bool
+
+from Elements cimport *
+from MultilayerResult cimport *
+
+cdef extern from "fisx_multilayerplan.h" namespace "fisx":
+    cdef cppclass MultilayerPlan:
+        MultilayerPlan() except +
+
+        std_map[std_string, std_map[int, std_map[std_string, std_map[std_string, double]]]] \
+                getMultilayerFluorescence() except + nogil
+
+        void getMultilayerFluorescence(MultilayerResult &) except + nogil
+
+        bool keepsResultLayout(MultilayerResult &)
+
+        void getMultilayerFluorescence(std_vector[std_map[std_string, double]], int, Elements, \
+                                       std_vector[MultilayerResult] &) except + nogil
+
+        void getMultilayerFluorescenceScan(std_vector[MultilayerResult] &) except + nogil
+        std_vector[double] getScanEnergies() except +
+
+        void setLayerComposition(int, std_map[std_string, double], Elements) except + nogil
+        std_map[std_string, double] getLayerComposition(int) except +
+        void setLayerDensityAndThickness(int, double, double) except + nogil
+        double getLayerDensity(int) except +
+        double getLayerThickness(int) except +
+        void setGeometry(double, double) except + nogil
+        double getAlphaIn()
+        double getAlphaOut()
+        void getMultilayerFluorescenceGeometries(std_vector[double], std_vector[double], \
+                                                 std_vector[MultilayerResult] &) except + nogil
+
+        std_vector[std_string] getElementFamilies() except +
+        int getNumberOfLayers()
+        int getNumberOfRays()
+        int getSecondary()
+        void setNumberOfThreads(int) except +
+        int getNumberOfThreads()
+        void setOutputLevel(int) except +
+        int getOutputLevel()
+        void setSecondaryTolerance(double) except +
+        double getSecondaryTolerance()
+        double getBeamCompressionTolerance()
+        int getMassFractionDerivatives()
+        int getMassThicknessDerivatives()
+        std_vector[std_string] getParameterNames()
@@ -360,8 +360,14 @@ cdef class PyElements:
                                         int nThreshold=4 ,
                                         double alphaIn=90.,
                                         double thickness=0.0):
-        self.thisptr.updateEscapeCache(toBytesKeys(composition), energyList, energyThreshold, intensityThreshold, nThreshold,
-                                      alphaIn, thickness)
+        """
+        Calculate the escape peaks at the given energies and keep them into cache. The cache is
+        replaced once filled, so other threads can use the library meanwhile.
+        """
+        cdef std_map[std_string, double] compositionMap = toBytesKeys(composition)
+        with nogil:
+            self.thisptr.updateEscapeCache(compositionMap, energyList, energyThreshold, intensityThreshold,
+                                           nThreshold, alphaIn, thickness)
 
     def getShellConstants(self, elementName, subshell):
         if sys.version < "3.0":
@@ -398,16 +404,21 @@ cdef class PyElements:
         Optimization methods to keep the calculations at a set of energies
         in cache.
         Clear the calculation cache of given element and fill it at the
-        selected energies
+        selected energies. The cache is replaced once filled, so other
+        threads can use the library meanwhile.
         """
-        self.thisptr.fillCache(toBytes(elementName), energy)
+        cdef std_string name = toBytes(elementName)
+        with nogil:
+            self.thisptr.fillCache(name, energy)
 
     def updateCache(self, elementName, std_vector[double] energy):
         """
         Update the element cache with those energy values not already present.
         The existing values will be kept.
         """
-        self.thisptr.updateCache(toBytes(elementName), energy)
+        cdef std_string name = toBytes(elementName)
+        with nogil:
+            self.thisptr.updateCache(name, energy)
 
     def setCacheEnabled(self, elementName, int flag = 1):
         """
@@ -447,6 +458,21 @@ cdef class PyElements:
         """
         return self.thisptr.getCacheSize(toBytes(elementName))
 
+    def getExcitationCacheSize(self, elementName):
+        """
+        Return the number of energies kept by the excitation cache of the element.
+        That cache is only used when the calculation cache of the element is enabled
+        (see setCacheEnabled) and it is emptied when the element data are modified.
+        """
+        return self.thisptr.getExcitationCacheSize(toBytes(elementName))
+
+    def getGeneration(self):
+        """
+        Return a number identifying the data of the library. It changes whenever the
+        elements, their data or the materials are modified.
+        """
+        return self.thisptr.getGeneration()
+
     def removeMaterials(self):
         self.thisptr.removeMaterials()
 
@@ -73,6 +73,15 @@ cdef class PyMath:
         """
         return self.thisptr.deBoerX(p, q, d1, d2, mu_1_j, mu_2_j, mu_b_d_t)
 
+    def deBoerXDerivatives(self, double p, double q, double d1, double d2, double mu_1_j, double mu_2_j, double mu_b_d_t = 0.0):
+        """
+        Same as deBoerX but returning a tuple with the value and the list of its partial derivatives
+        with respect to p, q, d1, d2, mu_1_j, mu_2_j and mu_b_d_t
+        """
+        cdef double derivatives[7]
+        value = self.thisptr.deBoerXDerivatives(p, q, d1, d2, mu_1_j, mu_2_j, mu_b_d_t, derivatives)
+        return value, [derivatives[i] for i in range(7)]
+
     def erf(self, double x):
         """
         Calculate the error function erf(x)
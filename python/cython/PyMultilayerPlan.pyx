@@ -0,0 +1,268 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#import numpy as np
+#cimport numpy as np
+cimport cython
+
+from cython.operator cimport dereference as deref
+
+from libcpp.string cimport string as std_string
+from libcpp.vector cimport vector as std_vector
+from libcpp.map cimport map as std_map
+
+from Elements cimport *
+from MultilayerPlan cimport *
+from MultilayerResult cimport *
+
+cdef class PyMultilayerPlan:
+    cdef MultilayerPlan *thisptr
+
+    def __cinit__(self):
+        self.thisptr = new MultilayerPlan()
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    def getMultilayerFluorescence(self):
+        """
+        Evaluate the plan. The output is the same as the one of the XRF getMultilayerFluorescence
+        method used with the same arguments as those used to obtain the plan.
+        """
+        cdef std_map[std_string, std_map[int, std_map[std_string, std_map[std_string, double]]]] result
+        with nogil:
+            result = self.thisptr.getMultilayerFluorescence()
+        return toStringKeysAndValues(result)
+
+    def getMultilayerResult(self, PyMultilayerResult result=None):
+        """
+        Evaluate the plan filling a dense PyMultilayerResult. If a result is supplied, its storage is
+        reused and the NumPy views previously obtained from it are updated. If the plan would change
+        the layout of the supplied result (after a change of the elements of a layer or of the output
+        level, or for a different plan) its storage has to be reallocated, which is refused with a
+        RuntimeError while NumPy views of it are alive.
+        """
+        if result is None:
+            result = PyMultilayerResult()
+        elif (result.exportedBuffers > 0) and (not self.thisptr.keepsResultLayout(result.thisptr[0])):
+            raise RuntimeError("The layout of the result changes while NumPy views of it are in use. " + \
+                               "Delete them or evaluate into a new result.")
+        with nogil:
+            self.thisptr.getMultilayerFluorescence(result.thisptr[0])
+        return result
+
+    def getMultilayerResultBatch(self, compositions, int layerIndex, PyElements elementsLibrary):
+        """
+        Mapping mode. Evaluate the plan for each of the supplied compositions of the sample layer
+        layerIndex. Each composition is a dictionary of element mass fractions replacing the
+        composition of that layer. Only the terms depending on the sample composition are calculated
+        again and the compositions are distributed among the threads of the plan.
+
+        Return a list of PyMultilayerResult instances, one per composition.
+        """
+        cdef std_vector[std_map[std_string, double]] compositionsVector
+        cdef std_map[std_string, double] compositionMap
+        cdef std_vector[MultilayerResult] results
+        cdef PyMultilayerResult pyResult
+        for composition in compositions:
+            compositionMap.clear()
+            for key in composition:
+                compositionMap[toBytes(key)] = composition[key]
+            compositionsVector.push_back(compositionMap)
+        with nogil:
+            self.thisptr.getMultilayerFluorescence(compositionsVector, layerIndex, \
+                                                   deref(elementsLibrary.thisptr), results)
+        output = []
+        for i in range(results.size()):
+            pyResult = PyMultilayerResult()
+            pyResult.thisptr[0] = results[i]
+            output.append(pyResult)
+        return output
+
+    def getMultilayerResultScan(self):
+        """
+        Incident energy scan. Evaluate a plan obtained by the XRF getMultilayerScanPlan method at each of
+        its incident energies. Only the terms depending on the incident energy are evaluated at each
+        point and the points are distributed among the threads of the plan.
+
+        Return a list of PyMultilayerResult instances, one per incident energy.
+        """
+        cdef std_vector[MultilayerResult] results
+        cdef PyMultilayerResult pyResult
+        with nogil:
+            self.thisptr.getMultilayerFluorescenceScan(results)
+        output = []
+        for i in range(results.size()):
+            pyResult = PyMultilayerResult()
+            pyResult.thisptr[0] = results[i]
+            output.append(pyResult)
+        return output
+
+    def getScanEnergies(self):
+        """
+        Incident energies of a plan obtained by the XRF getMultilayerScanPlan method
+        """
+        return self.thisptr.getScanEnergies()
+
+    def setLayerComposition(self, int layerIndex, composition, PyElements elementsLibrary):
+        """
+        Replace the composition of the sample layer layerIndex by the given dictionary of element
+        mass fractions. Only the terms depending on the sample composition are updated and the
+        element data already obtained by the plan are reused.
+        """
+        cdef std_map[std_string, double] compositionMap
+        for key in composition:
+            compositionMap[toBytes(key)] = composition[key]
+        with nogil:
+            self.thisptr.setLayerComposition(layerIndex, compositionMap, deref(elementsLibrary.thisptr))
+
+    def getLayerComposition(self, int layerIndex):
+        return toStringKeys(self.thisptr.getLayerComposition(layerIndex))
+
+    def setLayerDensityAndThickness(self, int layerIndex, double density, double thickness):
+        """
+        Change the density and thickness of the sample layer layerIndex updating only the terms
+        depending on them: the beam reaching the layers below, their secondary sources and the
+        detection efficiencies of the lines they emit.
+        """
+        with nogil:
+            self.thisptr.setLayerDensityAndThickness(layerIndex, density, thickness)
+
+    def getLayerDensity(self, int layerIndex):
+        return self.thisptr.getLayerDensity(layerIndex)
+
+    def getLayerThickness(self, int layerIndex):
+        return self.thisptr.getLayerThickness(layerIndex)
+
+    def setGeometry(self, double alphaIn, double alphaOut):
+        """
+        Change the incident and exit angles (in degrees) updating only the terms depending on them:
+        the beam reaching each layer, the secondary sources and the detection efficiencies.
+        """
+        with nogil:
+            self.thisptr.setGeometry(alphaIn, alphaOut)
+
+    def getAlphaIn(self):
+        return self.thisptr.getAlphaIn()
+
+    def getAlphaOut(self):
+        return self.thisptr.getAlphaOut()
+
+    def getMultilayerResultGeometries(self, alphaIn, alphaOut):
+        """
+        Angle sweep. Evaluate the plan for each of the (alphaIn[i], alphaOut[i]) pairs of incident and
+        exit angles. Only the terms depending on the angles are calculated again and the geometries are
+        distributed among the threads of the plan.
+
+        Return a list of PyMultilayerResult instances, one per geometry.
+        """
+        cdef std_vector[double] alphaInVector = alphaIn
+        cdef std_vector[double] alphaOutVector = alphaOut
+        cdef std_vector[MultilayerResult] results
+        cdef PyMultilayerResult pyResult
+        with nogil:
+            self.thisptr.getMultilayerFluorescenceGeometries(alphaInVector, alphaOutVector, results)
+        output = []
+        for i in range(results.size()):
+            pyResult = PyMultilayerResult()
+            pyResult.thisptr[0] = results[i]
+            output.append(pyResult)
+        return output
+
+    def getElementFamilies(self):
+        """
+        Element families (ex. "Cr K") considered by the plan
+        """
+        return [toString(x) for x in self.thisptr.getElementFamilies()]
+
+    def getNumberOfLayers(self):
+        return self.thisptr.getNumberOfLayers()
+
+    def getNumberOfRays(self):
+        """
+        Number of beam rays able to excite at least one of the requested element families
+        """
+        return self.thisptr.getNumberOfRays()
+
+    def getSecondary(self):
+        return self.thisptr.getSecondary()
+
+    def setNumberOfThreads(self, int nThreads):
+        """
+        Number of threads used to evaluate the plan. The element families, the beam rays and, in
+        mapping mode, the compositions are distributed among them.
+        The result does not depend on the number of threads.
+        """
+        self.thisptr.setNumberOfThreads(nThreads)
+
+    def getNumberOfThreads(self):
+        return self.thisptr.getNumberOfThreads()
+
+    def setOutputLevel(self, int outputLevel):
+        """
+        Amount of information produced by the evaluation of the plan (see XRF setOutputLevel)
+        """
+        self.thisptr.setOutputLevel(outputLevel)
+
+    def getOutputLevel(self):
+        return self.thisptr.getOutputLevel()
+
+    def setSecondaryTolerance(self, double tolerance):
+        """
+        Relative tolerance used to neglect secondary excitation sources (see XRF setSecondaryTolerance)
+        """
+        self.thisptr.setSecondaryTolerance(tolerance)
+
+    def getSecondaryTolerance(self):
+        return self.thisptr.getSecondaryTolerance()
+
+    def getBeamCompressionTolerance(self):
+        """
+        Relative tolerance used to reduce the number of beam rays when the plan was built (see XRF
+        setBeamCompressionTolerance)
+        """
+        return self.thisptr.getBeamCompressionTolerance()
+
+    def getMassFractionDerivatives(self):
+        """
+        Non-zero if the evaluation calculates the derivatives with respect to the layer mass fractions
+        (see XRF setMassFractionDerivatives)
+        """
+        return self.thisptr.getMassFractionDerivatives()
+
+    def getMassThicknessDerivatives(self):
+        """
+        Non-zero if the evaluation calculates the derivatives with respect to the layer mass thicknesses
+        (see XRF setMassThicknessDerivatives)
+        """
+        return self.thisptr.getMassThicknessDerivatives()
+
+    def getParameterNames(self):
+        """
+        Names of the parameters of the derivatives (ex. "Fe 01" for the mass fraction of iron in layer 1)
+        """
+        return [toString(x) for x in self.thisptr.getParameterNames()]
@@ -0,0 +1,197 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+import numpy
+#cimport numpy as np
+cimport cython
+
+from libcpp.string cimport string as std_string
+from libcpp.vector cimport vector as std_vector
+from libcpp.map cimport map as std_map
+
+from MultilayerResult cimport *
+
+cdef class PyMultilayerResult
+
+cdef class PyMultilayerResultArray:
+    """
+    Buffer exposing one of the contiguous arrays of a PyMultilayerResult.
+    It keeps the result alive while in use and counts the buffers exported from it.
+    """
+    cdef PyMultilayerResult owner
+    cdef char *data
+    cdef int ndim
+    cdef Py_ssize_t itemsize
+    cdef Py_ssize_t shape[4]
+    cdef Py_ssize_t strides[4]
+    cdef bytes format
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        buffer.buf = self.data
+        buffer.format = self.format
+        buffer.internal = NULL
+        buffer.itemsize = self.itemsize
+        buffer.len = self.itemsize
+        for i in range(self.ndim):
+            buffer.len *= self.shape[i]
+        buffer.ndim = self.ndim
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+        self.owner.exportedBuffers += 1
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        self.owner.exportedBuffers -= 1
+
+cdef object multilayerResultArray(PyMultilayerResult owner, char *data, bytes format, Py_ssize_t itemsize, shape):
+    cdef PyMultilayerResultArray view = PyMultilayerResultArray()
+    cdef int i
+    view.owner = owner
+    view.data = data
+    view.format = format
+    view.itemsize = itemsize
+    view.ndim = len(shape)
+    for i in range(view.ndim):
+        view.shape[i] = shape[i]
+    view.strides[view.ndim - 1] = itemsize
+    for i in range(view.ndim - 2, -1, -1):
+        view.strides[i] = view.strides[i + 1] * view.shape[i + 1]
+    if data == NULL:
+        return numpy.zeros(shape, dtype=numpy.dtype(format))
+    return numpy.asarray(view)
+
+cdef class PyMultilayerResult:
+    cdef MultilayerResult *thisptr
+    # number of buffers handed to NumPy views still alive
+    cdef int exportedBuffers
+
+    def __cinit__(self):
+        self.thisptr = new MultilayerResult()
+        self.exportedBuffers = 0
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    def getElementFamilies(self):
+        return [toString(x) for x in self.thisptr.getElementFamilies()]
+
+    def getNumberOfLayers(self):
+        return self.thisptr.getNumberOfLayers()
+
+    def getLineNames(self):
+        """
+        Sorted line names, escape peaks included
+        """
+        return [toString(x) for x in self.thisptr.getLineNames()]
+
+    def getLineParents(self):
+        """
+        Index of the parent line of each escape peak, -1 for fluorescence lines
+        """
+        return self.thisptr.getLineParents()
+
+    def getContributorNames(self):
+        """
+        Sorted names of the secondary excitation contributors (ex. "Fe KL3 01")
+        """
+        return [toString(x) for x in self.thisptr.getContributorNames()]
+
+    def getParameterNames(self):
+        """
+        Names of the parameters of the derivatives (ex. "Fe 01" for the mass fraction of iron in layer 1)
+        """
+        return [toString(x) for x in self.thisptr.getParameterNames()]
+
+    def getOutputLevel(self):
+        """
+        Amount of information of the result: 0 rates only, 1 no secondary excitation contributions,
+        2 full breakdown
+        """
+        return self.thisptr.getOutputLevel()
+
+    def getQuantityNames(self):
+        return [toString(x) for x in MultilayerResult.getQuantityNames()]
+
+    def getValues(self):
+        """
+        NumPy view of the values with shape (element families, layers, lines, quantities)
+        The view reflects subsequent evaluations into this result as long as they keep its layout
+        (same element families, layers, lines, contributors and parameters). Evaluations changing
+        the layout are refused while views of the result are alive.
+        """
+        shape = (len(self.getElementFamilies()), self.getNumberOfLayers(),
+                 len(self.getLineNames()), len(self.getQuantityNames()))
+        return multilayerResultArray(self, <char *> self.thisptr.getValues(),
+                                     b"d", sizeof(double), shape)
+
+    def getContributions(self):
+        """
+        NumPy view of the secondary excitation contributions with shape
+        (element families, layers, lines, contributors)
+        """
+        shape = (len(self.getElementFamilies()), self.getNumberOfLayers(),
+                 len(self.getLineNames()), len(self.getContributorNames()))
+        return multilayerResultArray(self, <char *> self.thisptr.getContributions(),
+                                     b"d", sizeof(double), shape)
+
+    def getDerivatives(self):
+        """
+        NumPy view of the derivatives of the rates with respect to the parameters with shape
+        (element families, layers, lines, parameters). None if they have not been calculated.
+        """
+        if self.thisptr.getDerivatives() == NULL:
+            return None
+        shape = (len(self.getElementFamilies()), self.getNumberOfLayers(),
+                 len(self.getLineNames()), len(self.getParameterNames()))
+        return multilayerResultArray(self, <char *> self.thisptr.getDerivatives(),
+                                     b"d", sizeof(double), shape)
+
+    def getLineMask(self):
+        """
+        NumPy view of the mask of the calculated (element family, layer, line) combinations
+        """
+        shape = (len(self.getElementFamilies()), self.getNumberOfLayers(),
+                 len(self.getLineNames()))
+        return multilayerResultArray(self, self.thisptr.getLineMask(),
+                                     b"b", sizeof(char), shape)
+
+    def getContributorMask(self):
+        """
+        NumPy view of the mask of the contributions present in the output
+        """
+        shape = (len(self.getElementFamilies()), self.getNumberOfLayers(),
+                 len(self.getLineNames()), len(self.getContributorNames()))
+        return multilayerResultArray(self, self.thisptr.getContributorMask(),
+                                     b"b", sizeof(char), shape)
+
+    def getAsMap(self):
+        """
+        Output in the form returned by XRF getMultilayerFluorescence
+        """
+        return toStringKeysAndValues(self.thisptr.getAsMap())
@@ -0,0 +1,119 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#import numpy as np
+#cimport numpy as np
+cimport cython
+
+from cython.operator cimport dereference as deref
+
+from libcpp.string cimport string as std_string
+from libcpp.vector cimport vector as std_vector
+from libcpp.map cimport map as std_map
+
+from Elements cimport *
+from XRF cimport *
+from Quantification cimport *
+
+cdef class PyQuantification:
+    cdef Quantification *thisptr
+
+    def __cinit__(self):
+        self.thisptr = new Quantification()
+
+    def __dealloc__(self):
+        del self.thisptr
+
+    def setConfiguration(self, PyXRF xrf, PyElements elementsLibrary, elementFamilies, \
+                         int layerIndex=0, int secondary=0):
+        """
+        Take the configuration (beam, filters, geometry, sample, attenuators and detector) of the
+        XRF instance.
+
+        elementFamilies - List of element families to be quantified (ex. ["Fe K", "Cr K"])
+        layerIndex - Sample layer containing the quantified elements
+        secondary - Secondary excitation level (0, 1 or 2)
+        """
+        if hasattr(elementFamilies, "lower"):
+            elementFamilies = [elementFamilies]
+        elementFamilies = [toBytes(x) for x in elementFamilies]
+        self.thisptr.setConfiguration(deref(xrf.thisptr), deref(elementsLibrary.thisptr), \
+                                      elementFamilies, layerIndex, secondary)
+
+    def setMaximumNumberOfIterations(self, int nIterations):
+        self.thisptr.setMaximumNumberOfIterations(nIterations)
+
+    def getMaximumNumberOfIterations(self):
+        return self.thisptr.getMaximumNumberOfIterations()
+
+    def setTolerance(self, double tolerance):
+        """
+        Maximum relative change of the mass fractions between two iterations to consider the
+        quantification converged.
+        """
+        self.thisptr.setTolerance(tolerance)
+
+    def getTolerance(self):
+        return self.thisptr.getTolerance()
+
+    def quantify(self, peakAreas, double fluxTime, PyElements elementsLibrary):
+        """
+        Obtain the mass fractions of the quantified elements from the dictionary of measured areas
+        keyed by element family (ex. {"Fe K": 1.0e5}). fluxTime is the product of the incident
+        flux and the acquisition time.
+
+        Return a dictionary of mass fractions keyed by element name.
+        """
+        cdef std_map[std_string, double] areas
+        cdef std_map[std_string, double] result
+        for key in peakAreas:
+            areas[toBytes(key)] = peakAreas[key]
+        with nogil:
+            result = self.thisptr.quantify(areas, fluxTime, deref(elementsLibrary.thisptr))
+        return toStringKeys(result)
+
+    def getMassFractions(self):
+        return toStringKeys(self.thisptr.getMassFractions())
+
+    def getMatrixFactors(self):
+        """
+        Detected rate of each element family per unit mass fraction and unit flux obtained in the
+        last iteration.
+        """
+        return toStringKeys(self.thisptr.getMatrixFactors())
+
+    def getLayerComposition(self):
+        """
+        Composition of the quantified layer obtained in the last quantification
+        """
+        return toStringKeys(self.thisptr.getLayerComposition())
+
+    def getNumberOfIterations(self):
+        return self.thisptr.getNumberOfIterations()
+
+    def hasConverged(self):
+        return self.thisptr.hasConverged()
@@ -38,6 +38,7 @@ from XRF cimport *
 from Layer cimport *
 from TransmissionTable cimport *
 from Beam cimport *
+from MultilayerPlan cimport *
 
 cdef class PyXRF:
     cdef XRF *thisptr
@@ -220,6 +221,78 @@ cdef class PyXRF:
         else:
             self.thisptr.setGeometry(alphaIn, alphaOut, scatteringAngle)
 
+    def setNumberOfThreads(self, int nThreads):
+        """
+        Number of threads used to evaluate the multilayer fluorescence.
+        The result does not depend on the number of threads.
+        """
+        self.thisptr.setNumberOfThreads(nThreads)
+
+    def getNumberOfThreads(self):
+        return self.thisptr.getNumberOfThreads()
+
+    def setOutputLevel(self, int outputLevel):
+        """
+        Amount of information returned by getMultilayerFluorescence:
+        0 - Only the rate of each line
+        1 - All the quantities of each line but the secondary excitation contributions
+        2 - Everything, including the contribution of each secondary excitation source (default)
+        The secondary excitation contributions are not calculated if they are not requested, unless
+        they are needed to approximate the tertiary excitation.
+        """
+        self.thisptr.setOutputLevel(outputLevel)
+
+    def getOutputLevel(self):
+        return self.thisptr.getOutputLevel()
+
+    def setSecondaryTolerance(self, double tolerance):
+        """
+        Relative tolerance used to neglect secondary excitation sources. If zero (default), the
+        original fixed cutoffs are used. Otherwise, an upper bound of the contribution of each source
+        is evaluated first and the source is neglected as long as the sum of the neglected bounds
+        does not exceed the tolerance times the primary rate of the line. That sum is returned under
+        the key "secondary_neglected" of each line.
+        """
+        self.thisptr.setSecondaryTolerance(tolerance)
+
+    def getSecondaryTolerance(self):
+        return self.thisptr.getSecondaryTolerance()
+
+    def setBeamCompressionTolerance(self, double tolerance):
+        """
+        Relative tolerance used to reduce the number of beam rays. If zero (default), every ray is
+        evaluated. Otherwise, adjacent rays not separated by an absorption edge are merged into one
+        representative ray as long as the primary rate of every requested line changes by less than
+        the tolerance.
+        """
+        self.thisptr.setBeamCompressionTolerance(tolerance)
+
+    def getBeamCompressionTolerance(self):
+        return self.thisptr.getBeamCompressionTolerance()
+
+    def setMassFractionDerivatives(self, int flag):
+        """
+        If non-zero, the plans returned by getMultilayerPlan also calculate the derivatives of the rates
+        with respect to the mass fraction of every element of every sample layer. They are given by the
+        getDerivatives method of the result, the parameters being named as "Fe 01" for the mass
+        fraction of iron in layer 1.
+        """
+        self.thisptr.setMassFractionDerivatives(flag)
+
+    def getMassFractionDerivatives(self):
+        return self.thisptr.getMassFractionDerivatives()
+
+    def setMassThicknessDerivatives(self, int flag):
+        """
+        If non-zero, the plans returned by getMultilayerPlan also calculate the derivatives of the rates
+        with respect to the mass thickness (density * thickness) of every sample layer. The parameters
+        are named as "massThickness 01" for layer 1 and follow the mass fraction ones if requested.
+        """
+        self.thisptr.setMassThicknessDerivatives(flag)
+
+    def getMassThicknessDerivatives(self):
+        return self.thisptr.getMassThicknessDerivatives()
+
     def getLayerComposition(self, PyLayer layerInstance, PyElements elementsLibrary):
         return toStringKeys(self.thisptr.getLayerComposition(deref(layerInstance.thisptr),
                                                 deref(elementsLibrary.thisptr)))
@@ -352,6 +425,118 @@ cdef class PyXRF:
                             secondary, useGeometricEfficiency, \
                             useMassFractions, secondaryCalculationLimit, deref(overwritingBeam.thisptr))
 
+    def getMultilayerPlan(self, elementFamilyLayer, PyElements elementsLibrary, \
+                            int secondary = 0, int useGeometricEfficiency = 1, int useMassFractions = 0, \
+                            double secondaryCalculationLimit = 0.0, PyBeam overwritingBeam=PyBeam()):
+        """
+        Precalculate everything needed by getMultilayerFluorescence called with the same arguments.
+        The returned plan can be evaluated as many times as needed calling its getMultilayerFluorescence
+        method.
+        """
+        cdef std_vector[std_string] elementFamilyLayerVector
+        cdef PyMultilayerPlan plan = PyMultilayerPlan()
+        for x in elementFamilyLayer:
+            elementFamilyLayerVector.push_back(toBytes(x))
+        with nogil:
+            plan.thisptr[0] = self.thisptr.getMultilayerPlan(elementFamilyLayerVector, \
+                                    deref(elementsLibrary.thisptr), \
+                                    secondary, useGeometricEfficiency, \
+                                    useMassFractions, secondaryCalculationLimit, \
+                                    deref(overwritingBeam.thisptr))
+        return plan
+
+    def getMultilayerScanPlan(self, incidentEnergies, elementFamilyLayer, PyElements elementsLibrary, \
+                            int secondary = 0, int useGeometricEfficiency = 1, int useMassFractions = 0, \
+                            double secondaryCalculationLimit = 0.0):
+        """
+        Incident energy scan. Precalculate everything needed by getMultilayerFluorescence called with
+        the same arguments for a monochromatic beam at each of the supplied incident energies. The
+        quantities depending on the energies of the emitted lines are calculated once. The returned
+        plan is evaluated calling its getMultilayerResultScan method.
+        """
+        cdef std_vector[double] energiesVector
+        cdef std_vector[std_string] elementFamilyLayerVector
+        cdef PyMultilayerPlan plan = PyMultilayerPlan()
+        for x in incidentEnergies:
+            energiesVector.push_back(x)
+        for x in elementFamilyLayer:
+            elementFamilyLayerVector.push_back(toBytes(x))
+        with nogil:
+            plan.thisptr[0] = self.thisptr.getMultilayerScanPlan(energiesVector, \
+                                    elementFamilyLayerVector, \
+                                    deref(elementsLibrary.thisptr), \
+                                    secondary, useGeometricEfficiency, \
+                                    useMassFractions, secondaryCalculationLimit)
+        return plan
+
+    def getMultilayerFluorescenceScan(self, incidentEnergies, elementFamilyLayer, PyElements elementsLibrary, \
+                            int secondary = 0, int useGeometricEfficiency = 1, int useMassFractions = 0, \
+                            double secondaryCalculationLimit = 0.0):
+        """
+        Incident energy scan. Return a list with the output of getMultilayerFluorescence for a
+        monochromatic beam at each of the supplied incident energies, as if the beam had been set by
+        setBeam with that single energy. The emission lines are those excited by at least one of the
+        energies.
+        """
+        plan = self.getMultilayerScanPlan(incidentEnergies, elementFamilyLayer, elementsLibrary, \
+                                          secondary, useGeometricEfficiency, useMassFractions, \
+                                          secondaryCalculationLimit)
+        return [result.getAsMap() for result in plan.getMultilayerResultScan()]
+
+    def getMultilayerFluorescenceGeometries(self, alphaIn, alphaOut, elementFamilyLayer, \
+                            PyElements elementsLibrary, \
+                            int secondary = 0, int useGeometricEfficiency = 1, int useMassFractions = 0, \
+                            double secondaryCalculationLimit = 0.0, PyBeam overwritingBeam=PyBeam()):
+        """
+        Angle sweep. Return a list with the output of getMultilayerFluorescence for each of the
+        (alphaIn[i], alphaOut[i]) pairs of incident and exit angles, as if they had been set by
+        setGeometry. The quantities not depending on the angles are calculated once.
+        """
+        plan = self.getMultilayerPlan(elementFamilyLayer, elementsLibrary, \
+                                      secondary, useGeometricEfficiency, useMassFractions, \
+                                      secondaryCalculationLimit, overwritingBeam)
+        return [result.getAsMap() for result in \
+                plan.getMultilayerResultGeometries(alphaIn, alphaOut)]
+
+    def setMultilayerCacheEnabled(self, int flag=1):
+        """
+        Keep the plan of the last getMultilayerFluorescence call. If the next call uses the same
+        arguments and only the density, thickness or material of some sample layers changed, only
+        the affected terms are calculated again. The plan is discarded if the elements library or
+        its materials are modified.
+        """
+        self.thisptr.setMultilayerCacheEnabled(flag)
+
+    def isMultilayerCacheEnabled(self):
+        return self.thisptr.isMultilayerCacheEnabled()
+
+    def clearMultilayerCache(self):
+        self.thisptr.clearMultilayerCache()
+
+    def setResultCacheSize(self, int size):
+        """
+        Keep the results of the last size getMultilayerFluorescence calls. A call with the same
+        arguments, settings and configuration returns the kept result without any calculation.
+        The least recently used result is discarded first. Zero (default) disables the cache.
+        The cache has to be cleared by the user if the elements library is modified.
+        """
+        self.thisptr.setResultCacheSize(size)
+
+    def getResultCacheSize(self):
+        return self.thisptr.getResultCacheSize()
+
+    def clearResultCache(self):
+        """
+        Discard the kept results and reset the hit and miss counters
+        """
+        self.thisptr.clearResultCache()
+
+    def getResultCacheHits(self):
+        return self.thisptr.getResultCacheHits()
+
+    def getResultCacheMisses(self):
+        return self.thisptr.getResultCacheMisses()
+
     def getFluorescence(self, elementNames, PyElements elementsLibrary, \
                             sampleLayer = 0, lineFamily="K", int secondary = 0, \
                             int useGeometricEfficiency = 1, int useMassFractions = 0, \
@@ -37,6 +37,7 @@ from Beam cimport *
 from Detector cimport *
 from Elements cimport *
 from Layer cimport *
+from MultilayerPlan cimport *
 from TransmissionTable cimport *
 
 cdef extern from "fisx_xrf.h" namespace "fisx":
@@ -54,6 +55,18 @@ cdef extern from "fisx_xrf.h" namespace "fisx":
         void setGeometry(double, double, double) except +
         void setDetector(Detector) except +
         double getGeometricEfficiency(int) except +
+        void setNumberOfThreads(int) except +
+        int getNumberOfThreads()
+        void setOutputLevel(int) except +
+        int getOutputLevel()
+        void setSecondaryTolerance(double) except +
+        double getSecondaryTolerance()
+        void setBeamCompressionTolerance(double) except +
+        double getBeamCompressionTolerance()
+        void setMassFractionDerivatives(int)
+        int getMassFractionDerivatives()
+        void setMassThicknessDerivatives(int)
+        int getMassThicknessDerivatives()
 
         std_map[std_string, double] getLayerComposition(Layer , Elements) except +
         std_map[std_string, double] getLayerMassAttenuationCoefficients(Layer, double, Elements, \
@@ -87,3 +100,16 @@ cdef extern from "fisx_xrf.h" namespace "fisx":
         std_map[std_string, std_map[int, std_map[std_string, std_map[std_string, double]]]] \
                 getMultilayerFluorescence(std_vector[std_string], Elements, int, int, int, double, Beam) except + nogil
 
+        MultilayerPlan getMultilayerPlan(std_vector[std_string], Elements, int, int, int, double, Beam) except + nogil
+
+        MultilayerPlan getMultilayerScanPlan(std_vector[double], std_vector[std_string], Elements, \
+                                             int, int, int, double) except + nogil
+
+        void setMultilayerCacheEnabled(int)
+        int isMultilayerCacheEnabled()
+        void clearMultilayerCache()
+        void setResultCacheSize(int) except +
+        int getResultCacheSize()
+        void clearResultCache()
+        long getResultCacheHits()
+        long getResultCacheMisses()
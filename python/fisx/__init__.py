@@ -35,6 +35,9 @@ from ._fisx import PyElements as Elements
 from ._fisx import PyLayer as Layer
 from ._fisx import PyDetector as Detector
 from ._fisx import PyXRF as XRF
+from ._fisx import PyMultilayerPlan as MultilayerPlan
+from ._fisx import PyMultilayerResult as MultilayerResult
+from ._fisx import PyQuantification as Quantification
 from ._fisx import PyMath as Math
 from ._fisx import PyMaterial as Material
 from ._fisx import PyTransmissionTable as TransmissionTable
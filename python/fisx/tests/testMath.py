@@ -0,0 +1,111 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2018 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+__author__ = "V.A. Sole - ESRF Data Analysis"
+import unittest
+import sys
+import random
+
+class testMath(unittest.TestCase):
+    def setUp(self):
+        """
+        import the module
+        """
+        try:
+            from fisx import Math
+            self._module = Math
+        except:
+            self._module = None
+
+    def tearDown(self):
+        self._module = None
+
+    def testMathImport(self):
+        self.assertTrue(self._module is not None,
+                        'Unsuccessful fisx.Math import')
+
+    def testMathDeBoerXDerivatives(self):
+        math = self._module()
+        generator = random.Random(0)
+        names = ["p", "q", "d1", "d2", "mu_1_j", "mu_2_j", "mu_b_j_d_t"]
+        nChecked = 0
+        for i in range(300):
+            # p and q positive for a source layer below the fluorescing one, negative above it
+            sign = 1.0 if (i % 2) else -1.0
+            args = [sign * 10.0 ** (3 * generator.random()),
+                    sign * 10.0 ** (3 * generator.random()),
+                    10.0 ** (-5 + 5 * generator.random()),
+                    10.0 ** (-5 + 5 * generator.random()),
+                    10.0 ** (3 * generator.random()),
+                    10.0 ** (3 * generator.random()),
+                    10.0 ** (-5 + 5 * generator.random()) * 10.0 ** (3 * generator.random())]
+            try:
+                value, derivatives = math.deBoerXDerivatives(*args)
+            except RuntimeError:
+                # not finite
+                continue
+            for k in range(7):
+                estimates = []
+                for step in [1.0e-4, 1.0e-6]:
+                    h = step * abs(args[k])
+                    plus = args[:]
+                    minus = args[:]
+                    plus[k] += h
+                    minus[k] -= h
+                    try:
+                        estimates.append((math.deBoerX(*plus) - math.deBoerX(*minus)) / (2 * h))
+                    except RuntimeError:
+                        break
+                if len(estimates) < 2:
+                    continue
+                if abs(estimates[0] - estimates[1]) > 1.0e-5 * abs(estimates[0]):
+                    # finite differences not reliable
+                    continue
+                nChecked += 1
+                # contributions below 1.0e-6 of the value are not resolved by the finite differences
+                tolerance = 1.0e-3 * abs(estimates[0]) + 1.0e-6 * abs(value / args[k])
+                self.assertTrue(abs(derivatives[k] - estimates[0]) <= tolerance,
+                    "Derivative with respect to %s: expected %g and got %g for %s" % \
+                    (names[k], estimates[0], derivatives[k], args))
+        self.assertTrue(nChecked > 1000, "Only %d derivatives checked" % nChecked)
+
+def getSuite(auto=True):
+    testSuite = unittest.TestSuite()
+    if auto:
+        testSuite.addTest(\
+            unittest.TestLoader().loadTestsFromTestCase(testMath))
+    else:
+        # use a predefined order
+        testSuite.addTest(testMath("testMathImport"))
+        testSuite.addTest(testMath("testMathDeBoerXDerivatives"))
+    return testSuite
+
+def test(auto=False):
+    unittest.TextTestRunner(verbosity=2).run(getSuite(auto=auto))
+
+if __name__ == '__main__':
+    test()
@@ -29,6 +29,7 @@ __author__ = "V.A. Sole - ESRF Data Analysis"
 import unittest
 import sys
 import os
+import threading
 
 ElementList= ['H', 'He',
             'Li', 'Be', 'B', 'C', 'N', 'O', 'F', 'Ne',
@@ -231,6 +232,519 @@ class testXRF(unittest.TestCase):
                         "Expected to measure a 1 ratio and not %f" % \
                             (after / before))
 
+        # check the evaluation of a precalculated plan
+        plan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                     elementsInstance,
+                                     secondary=2,
+                                     useMassFractions=1)
+        self.assertTrue(plan.getElementFamilies() == ["Cr K", "Fe K", "Ni K"],
+                        "Unexpected plan element families")
+        for i in range(2):
+            fluo2 = plan.getMultilayerFluorescence()
+            for key in ["rate", "primary", "secondary", "tertiary"]:
+                before = fluo["Cr K"][0]["KL3"][key]
+                after = fluo2["Cr K"][0]["KL3"][key]
+                self.assertTrue(abs( before - after) < 1.0e-8,
+                            "Expected to obtain a 1 ratio and not %f" % \
+                                (after / before))
+
+        # check the result does not depend on the number of threads
+        from fisx import Beam
+        beam = Beam()
+        beam.setBeam([6.0 + 0.25 * i for i in range(80)])
+        polyPlan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                         elementsInstance,
+                                         secondary=2,
+                                         useMassFractions=1,
+                                         overwritingBeam=beam)
+        fluo3 = polyPlan.getMultilayerFluorescence()
+        for nThreads in [2, 5]:
+            polyPlan.setNumberOfThreads(nThreads)
+            fluo2 = polyPlan.getMultilayerFluorescence()
+            for key in fluo3:
+                for peak in fluo3[key][0]:
+                    for quantity in fluo3[key][0][peak]:
+                        self.assertTrue(fluo2[key][0][peak][quantity] == \
+                                        fluo3[key][0][peak][quantity],
+                                        "Result depends on the number of threads")
+
+        # check the dense output
+        result = plan.getMultilayerResult()
+        values = result.getValues()
+        self.assertTrue(values.shape == (3, 1, len(result.getLineNames()),
+                                         len(result.getQuantityNames())),
+                        "Unexpected shape %s" % (values.shape,))
+        iFamily = result.getElementFamilies().index("Cr K")
+        iLine = result.getLineNames().index("KL3")
+        self.assertTrue(result.getLineMask()[iFamily, 0, iLine],
+                        "Cr KL3 not present in dense output")
+        for key in ["rate", "primary", "secondary", "tertiary"]:
+            before = fluo["Cr K"][0]["KL3"][key]
+            after = values[iFamily, 0, iLine, result.getQuantityNames().index(key)]
+            self.assertTrue(abs( before - after) < 1.0e-8,
+                        "Expected to obtain a 1 ratio and not %f" % \
+                            (after / before))
+        contributors = result.getContributorNames()
+        for key in contributors:
+            if key in fluo["Cr K"][0]["KL3"]:
+                before = fluo["Cr K"][0]["KL3"][key]
+                after = result.getContributions()[iFamily, 0, iLine, contributors.index(key)]
+                self.assertTrue(abs( before - after) < 1.0e-8,
+                        "Expected to obtain the same %s contribution" % key)
+
+        # the views follow the evaluations keeping the layout of the result
+        contributions = result.getContributions()
+        values[:] = 0.0
+        plan.getMultilayerResult(result)
+        self.assertTrue(values[iFamily, 0, iLine, result.getQuantityNames().index("rate")] == \
+                        fluo["Cr K"][0]["KL3"]["rate"], "View not updated")
+        # a change of layout is refused while views of the result are alive
+        composition = plan.getLayerComposition(0)
+        modified = dict(composition)
+        modified["Zn"] = 0.3
+        plan.setLayerComposition(0, modified, elementsInstance)
+        self.assertRaises(RuntimeError, plan.getMultilayerResult, result)
+        self.assertTrue(contributions.shape[-1] == len(result.getContributorNames()),
+                        "Result modified by a refused evaluation")
+        del values, contributions
+        plan.getMultilayerResult(result)
+        self.assertTrue(result.getContributions().shape[-1] == len(result.getContributorNames()),
+                        "Unexpected contributions shape")
+        plan.setLayerComposition(0, composition, elementsInstance)
+
+        # check the mapping mode against the calculation with each sample
+        steel2 = dict(steel)
+        steel2["Cr"] = 9.0
+        SRM_1155b = Material("SRM_1155b", 1.0, 1.0)
+        SRM_1155b.setComposition(steel2)
+        elementsInstance.addMaterial(SRM_1155b)
+        xrf.setSample([["SRM_1155b", 1.0, 1.0]])
+        fluo2 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                             elementsInstance,
+                                             secondary=2,
+                                             useMassFractions=1)
+        xrf.setSample([["SRM_1155", 1.0, 1.0]])
+        compositions = [elementsInstance.getComposition("SRM_1155"),
+                        elementsInstance.getComposition("SRM_1155b"),
+                        elementsInstance.getComposition("SRM_1155")]
+        plan.setNumberOfThreads(2)
+        results = plan.getMultilayerResultBatch(compositions, 0, elementsInstance)
+        self.assertTrue(len(results) == 3, "Expected one result per composition")
+        for result, expected in zip(results, [fluo, fluo2, fluo]):
+            iFamily = result.getElementFamilies().index("Cr K")
+            iLine = result.getLineNames().index("KL3")
+            for key in ["rate", "primary", "secondary", "tertiary", "massFraction"]:
+                before = expected["Cr K"][0]["KL3"][key]
+                after = result.getValues()[iFamily, 0, iLine,
+                                           result.getQuantityNames().index(key)]
+                self.assertTrue(abs( before - after) < 1.0e-8 * abs(before),
+                        "Expected to obtain a 1 ratio and not %f" % \
+                            (after / before))
+
+        # check the update of the composition of a plan
+        for composition, expected in zip(compositions, [fluo, fluo2, fluo]):
+            plan.setLayerComposition(0, composition, elementsInstance)
+            fluo3 = plan.getMultilayerFluorescence()
+            for key in ["rate", "primary", "secondary", "tertiary", "massFraction"]:
+                before = expected["Cr K"][0]["KL3"][key]
+                after = fluo3["Cr K"][0]["KL3"][key]
+                self.assertTrue(abs( before - after) < 1.0e-8 * abs(before),
+                        "Expected to obtain a 1 ratio and not %f" % \
+                            (after / before))
+
+        # check the update of the thickness of a layer, directly and keeping the plan in the XRF instance
+        xrf.setSample([["SRM_1155b", 1.0, 0.001], ["SRM_1155", 1.0, 1.0]])
+        plan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                     elementsInstance,
+                                     secondary=2,
+                                     useMassFractions=1)
+        xrf.setMultilayerCacheEnabled(1)
+        xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                      elementsInstance,
+                                      secondary=2,
+                                      useMassFractions=1)
+        xrf.setSample([["SRM_1155b", 1.0, 0.002], ["SRM_1155", 1.0, 1.0]])
+        fluo3 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                              elementsInstance,
+                                              secondary=2,
+                                              useMassFractions=1)
+        xrf.setMultilayerCacheEnabled(0)
+        fluo2 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                              elementsInstance,
+                                              secondary=2,
+                                              useMassFractions=1)
+        plan.setLayerDensityAndThickness(0, 1.0, 0.002)
+        for fluo4 in [plan.getMultilayerFluorescence(), fluo3]:
+            for layer in [0, 1]:
+                for key in ["rate", "primary", "secondary", "tertiary", "efficiency"]:
+                    before = fluo2["Cr K"][layer]["KL3"][key]
+                    after = fluo4["Cr K"][layer]["KL3"][key]
+                    self.assertTrue(abs( before - after) < 1.0e-8 * abs(before),
+                            "Expected to obtain a 1 ratio and not %f" % \
+                                (after / before))
+        xrf.setSample([["SRM_1155", 1.0, 1.0]])
+
+        # recover the steel composition from the calculated areas starting from a wrong one
+        from fisx import Quantification
+        fluxTime = 1.0e10
+        areas = {}
+        for family in ["Cr K", "Fe K", "Ni K"]:
+            areas[family] = fluxTime * sum([fluo[family][0][line]["rate"] \
+                                            for line in fluo[family][0] if " " not in line])
+        composition = elementsInstance.getComposition("SRM_1155")
+        guess = dict(composition)
+        guess["Cr"] -= 0.09
+        guess["Fe"] += 0.09
+        SRM_1155c = Material("SRM_1155c", 1.0, 1.0)
+        SRM_1155c.setComposition(guess)
+        elementsInstance.addMaterial(SRM_1155c)
+        xrf.setSample([["SRM_1155c", 1.0, 1.0]])
+        quantification = Quantification()
+        quantification.setConfiguration(xrf, elementsInstance, ["Cr K", "Fe K", "Ni K"],
+                                        layerIndex=0, secondary=2)
+        quantification.setTolerance(1.0e-7)
+        massFractions = quantification.quantify(areas, fluxTime, elementsInstance)
+        self.assertTrue(quantification.hasConverged(), "Quantification not converged")
+        self.assertTrue(quantification.getNumberOfIterations() > 1,
+                        "Expected more than one iteration")
+        for element in ["Cr", "Fe", "Ni"]:
+            before = composition[element]
+            after = massFractions[element]
+            self.assertTrue(abs( before - after) < 1.0e-5 * before,
+                    "Expected to obtain a 1 ratio and not %f" % \
+                        (after / before))
+        xrf.setSample([["SRM_1155", 1.0, 1.0]])
+
+        # reduced output levels give the same rates
+        for outputLevel in [0, 1]:
+            xrf.setOutputLevel(outputLevel)
+            fluo3 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                                  elementsInstance,
+                                                  secondary=2,
+                                                  useMassFractions=1)
+            for line in fluo["Cr K"][0]:
+                before = fluo["Cr K"][0][line]["rate"]
+                after = fluo3["Cr K"][0][line]["rate"]
+                self.assertTrue(abs( before - after) < 1.0e-8 * abs(before),
+                        "Expected to obtain a 1 ratio and not %f" % \
+                            (after / before))
+            keys = list(fluo3["Cr K"][0]["KL3"].keys())
+            if outputLevel == 0:
+                self.assertTrue(keys == ["rate"], "Expected only the rate")
+            else:
+                self.assertTrue("primary" in keys, "Expected the primary rate")
+                self.assertTrue(len([x for x in keys if x.endswith(" 00")]) == 0,
+                                "Unexpected secondary excitation contributions")
+        xrf.setOutputLevel(2)
+
+        # neglected secondary excitation sources are bounded by the requested tolerance
+        xrf.setSecondaryTolerance(1.0e-3)
+        fluo3 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                              elementsInstance,
+                                              secondary=2,
+                                              useMassFractions=1)
+        xrf.setSecondaryTolerance(0.0)
+        for family in fluo3:
+            for line in fluo3[family][0]:
+                if " " in line:
+                    continue
+                result = fluo3[family][0][line]
+                self.assertTrue(result["secondary_neglected"] <= 1.0e-3 * result["primary"],
+                                "Neglected secondary excitation above tolerance")
+                before = fluo[family][0][line]["rate"]
+                after = result["rate"]
+                self.assertTrue(abs( before - after) < 2.0e-3 * abs(before),
+                        "Expected to obtain a 1 ratio and not %f" % \
+                            (after / before))
+
+        # a compressed beam reproduces the primary rates within the requested tolerance
+        beam = Beam()
+        beam.setBeam([6.0 + 0.05 * i for i in range(400)],
+                     [1.0 + 0.001 * i for i in range(400)])
+        polyPlan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                         elementsInstance,
+                                         secondary=2,
+                                         useMassFractions=1,
+                                         overwritingBeam=beam)
+        fluo3 = polyPlan.getMultilayerFluorescence()
+        xrf.setBeamCompressionTolerance(1.0e-3)
+        compressedPlan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                               elementsInstance,
+                                               secondary=2,
+                                               useMassFractions=1,
+                                               overwritingBeam=beam)
+        xrf.setBeamCompressionTolerance(0.0)
+        self.assertTrue(compressedPlan.getNumberOfRays() < polyPlan.getNumberOfRays() / 4,
+                        "Expected a reduced beam and not %d rays" % \
+                            compressedPlan.getNumberOfRays())
+        fluo2 = compressedPlan.getMultilayerFluorescence()
+        for family in fluo3:
+            for line in fluo3[family][0]:
+                if " " in line:
+                    continue
+                for key in ["primary", "rate"]:
+                    before = fluo3[family][0][line][key]
+                    after = fluo2[family][0][line][key]
+                    self.assertTrue(abs( before - after) < 2.0e-3 * abs(before),
+                            "Expected to obtain a 1 ratio and not %f" % \
+                                (after / before))
+
+        # identical calls are answered by the result cache
+        xrf.setResultCacheSize(2)
+        for i in range(2):
+            fluo2 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                                  elementsInstance,
+                                                  secondary=2,
+                                                  useMassFractions=1)
+        self.assertTrue(xrf.getResultCacheHits() == 1, "Expected one cache hit")
+        self.assertTrue(xrf.getResultCacheMisses() == 1, "Expected one cache miss")
+        self.assertTrue(fluo2 == fluo, "Unexpected cached result")
+        xrf.setGeometry(45., 30.)
+        fluo2 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                              elementsInstance,
+                                              secondary=2,
+                                              useMassFractions=1)
+        self.assertTrue(xrf.getResultCacheMisses() == 2, "Configuration change not detected")
+        self.assertTrue(fluo2 != fluo, "Unexpected cached result")
+        xrf.setGeometry(45., 45.)
+        # redefining a material used by an attenuator changes the library generation
+        generation = elementsInstance.getGeneration()
+        denseAir = Material("Air", 0.0012048, 1.0)
+        denseAir.setCompositionFromLists(["Ar1"], [1.0])
+        elementsInstance.addMaterial(denseAir, errorOnReplace=0)
+        self.assertTrue(elementsInstance.getGeneration() != generation,
+                        "Material change not reflected by the generation")
+        fluo2 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                              elementsInstance,
+                                              secondary=2,
+                                              useMassFractions=1)
+        self.assertTrue(xrf.getResultCacheMisses() == 3, "Material change not detected")
+        self.assertTrue(fluo2 != fluo, "Unexpected cached result")
+        elementsInstance.addMaterial(Air, errorOnReplace=0)
+        xrf.setResultCacheSize(0)
+        xrf.clearResultCache()
+
+        # derivatives with respect to the mass fractions against finite differences
+        xrf.setMassFractionDerivatives(1)
+        plan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                     elementsInstance,
+                                     secondary=1,
+                                     useMassFractions=1)
+        xrf.setMassFractionDerivatives(0)
+        result = plan.getMultilayerResult()
+        names = result.getParameterNames()
+        self.assertTrue(names == plan.getParameterNames(), "Unexpected parameter names")
+        self.assertTrue("Cr 00" in names, "Missing mass fraction parameter")
+        iFamily = result.getElementFamilies().index("Fe K")
+        iLine = result.getLineNames().index("KL3")
+        iRate = result.getQuantityNames().index("rate")
+        rate = result.getValues()[iFamily, 0, iLine, iRate]
+        composition = plan.getLayerComposition(0)
+        for element in ["Cr", "Fe", "Ni"]:
+            derivative = result.getDerivatives()[iFamily, 0, iLine, names.index(element + " 00")]
+            delta = 1.0e-4 * composition[element]
+            rates = []
+            for sign in [1.0, -1.0]:
+                modified = dict(composition)
+                modified[element] += sign * delta
+                plan.setLayerComposition(0, modified, elementsInstance)
+                rates.append(plan.getMultilayerFluorescence()["Fe K"][0]["KL3"]["rate"])
+            after = (rates[0] - rates[1]) / (2 * delta)
+            self.assertTrue(abs(derivative - after) < 1.0e-5 * rate,
+                    "Expected %g and not %g" % (after, derivative))
+        plan.setLayerComposition(0, composition, elementsInstance)
+
+        # derivatives with respect to the layer mass thicknesses
+        xrf.setSample([["SRM_1155b", 1.0, 0.002], ["SRM_1155", 1.0, 0.01]])
+        xrf.setMassThicknessDerivatives(1)
+        plan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                     elementsInstance,
+                                     secondary=1,
+                                     useMassFractions=1)
+        xrf.setMassThicknessDerivatives(0)
+        result = plan.getMultilayerResult()
+        names = result.getParameterNames()
+        self.assertTrue(names == ["massThickness 00", "massThickness 01"],
+                        "Unexpected parameter names %s" % names)
+        iFamily = result.getElementFamilies().index("Fe K")
+        for layer in [0, 1]:
+            rate = result.getValues()[iFamily, 1, iLine, iRate]
+            density = plan.getLayerDensity(layer)
+            thickness = plan.getLayerThickness(layer)
+            derivative = result.getDerivatives()[iFamily, 1, iLine, layer]
+            delta = 1.0e-4 * thickness
+            rates = []
+            for sign in [1.0, -1.0]:
+                plan.setLayerDensityAndThickness(layer, density, thickness + sign * delta)
+                rates.append(plan.getMultilayerFluorescence()["Fe K"][1]["KL3"]["rate"])
+            plan.setLayerDensityAndThickness(layer, density, thickness)
+            after = (rates[0] - rates[1]) / (2 * density * delta)
+            self.assertTrue(abs(derivative - after) < 1.0e-5 * rate / (density * thickness),
+                    "Expected %g and not %g" % (after, derivative))
+
+        # three layers, the middle one exciting the layers above and below it, the last one thick
+        # the secondary excitation is larger just above the Ni K edge
+        # the tertiary excitation (secondary=2) is scaled with the rates, hence the larger tolerance
+        sample = [["SRM_1155b", 7.9, 0.001], ["Ni1", 8.9, 0.002], ["SRM_1155", 7.9, 0.01]]
+        xrf.setSample(sample)
+        for energy, secondary, tolerance in [(16.0, 1, 1.0e-5), (8.5, 1, 1.0e-5), (16.0, 2, 0.1)]:
+            xrf.setBeam(energy)
+            xrf.setMassThicknessDerivatives(1)
+            plan = xrf.getMultilayerPlan(["Cr K", "Fe K", "Ni K"],
+                                         elementsInstance,
+                                         secondary=secondary,
+                                         useMassFractions=1)
+            xrf.setMassThicknessDerivatives(0)
+            result = plan.getMultilayerResult()
+            families = result.getElementFamilies()
+            lines = result.getLineNames()
+            values = result.getValues()
+            for layer in range(len(sample)):
+                density = plan.getLayerDensity(layer)
+                thickness = plan.getLayerThickness(layer)
+                delta = 1.0e-5 * thickness
+                fluo3 = []
+                for sign in [1.0, -1.0]:
+                    plan.setLayerDensityAndThickness(layer, density, thickness + sign * delta)
+                    fluo3.append(plan.getMultilayerFluorescence())
+                plan.setLayerDensityAndThickness(layer, density, thickness)
+                for iFamily, family in enumerate(families):
+                    for excited in fluo3[0][family]:
+                        for iLine, line in enumerate(lines):
+                            if line not in fluo3[0][family][excited]:
+                                continue
+                            rate = values[iFamily, excited, iLine, iRate]
+                            derivative = result.getDerivatives()[iFamily, excited, iLine, layer]
+                            after = (fluo3[0][family][excited][line]["rate"] - \
+                                     fluo3[1][family][excited][line]["rate"]) / (2 * density * delta)
+                            self.assertTrue(abs(derivative - after) < \
+                                            tolerance * rate / (density * thickness),
+                                "%s %s of layer %d, secondary %d: expected %g and not %g" % \
+                                (family, line, excited, secondary, after, derivative))
+        xrf.setBeam(16.0)
+        xrf.setSample([["SRM_1155", 1.0, 1.0]])
+
+        # incident energy scan equivalent to one calculation per energy
+        energies = [12.0, 6.5, 8.0, 12.0]
+        scan = xrf.getMultilayerFluorescenceScan(energies, ["Cr K", "Fe K", "Ni K"],
+                                                 elementsInstance,
+                                                 secondary=2,
+                                                 useMassFractions=1)
+        self.assertTrue(len(scan) == len(energies), "Expected one output per energy")
+        for i, energy in enumerate(energies):
+            xrf.setBeam(energy)
+            fluo3 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                                  elementsInstance,
+                                                  secondary=2,
+                                                  useMassFractions=1)
+            for family in ["Cr K", "Fe K", "Ni K"]:
+                for line in scan[i][family][0]:
+                    after = scan[i][family][0][line]["rate"]
+                    if (family in fluo3) and (line in fluo3[family][0]):
+                        before = fluo3[family][0][line]["rate"]
+                        self.assertTrue(abs(before - after) <= 1.0e-10 * abs(before),
+                                "Expected %g and not %g" % (before, after))
+                    else:
+                        self.assertTrue(after == 0.0, "Expected a zero rate of unexcited line")
+        self.assertTrue(scan[1]["Ni K"][0]["KL3"]["rate"] == 0.0, "Ni K excited at 6.5 keV")
+
+        # angle sweep equivalent to one calculation per geometry
+        xrf.setSample([["SRM_1155b", 1.0, 0.002], ["SRM_1155", 1.0, 0.01]])
+        alphaIn = [45.0, 10.0, 70.0]
+        alphaOut = [45.0, 80.0, 5.0]
+        sweep = xrf.getMultilayerFluorescenceGeometries(alphaIn, alphaOut,
+                                                        ["Cr K", "Fe K", "Ni K"],
+                                                        elementsInstance,
+                                                        secondary=2,
+                                                        useMassFractions=1)
+        self.assertTrue(len(sweep) == len(alphaIn), "Expected one output per geometry")
+        for i in range(len(alphaIn)):
+            xrf.setGeometry(alphaIn[i], alphaOut[i])
+            fluo3 = xrf.getMultilayerFluorescence(["Cr K", "Fe K", "Ni K"],
+                                                  elementsInstance,
+                                                  secondary=2,
+                                                  useMassFractions=1)
+            for family in fluo3:
+                for layer in fluo3[family]:
+                    for line in fluo3[family][layer]:
+                        before = fluo3[family][layer][line]["rate"]
+                        after = sweep[i][family][layer][line]["rate"]
+                        self.assertTrue(abs(before - after) <= 1.0e-10 * abs(before),
+                                "Expected %g and not %g" % (before, after))
+        xrf.setGeometry(45., 45.)
+        xrf.setSample([["SRM_1155", 1.0, 1.0]])
+
+        # several threads sharing one library while the element caches are replaced
+        def getXRF():
+            instance = XRF()
+            instance.setBeam(12.0)
+            instance.setSample([["SRM_1155", 1.0, 1.0]])
+            return instance
+        families = ["Cr K", "Fe K", "Ni K"]
+        reference = getXRF().getMultilayerFluorescence(families, elementsInstance, secondary=2)
+        outputs = [None] * 4
+        def worker(i):
+            outputs[i] = getXRF().getMultilayerFluorescence(families, elementsInstance, secondary=2)
+        elementsInstance.setCacheEnabled("Fe", 1)
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(len(outputs))]
+        for thread in threads:
+            thread.start()
+        for energy in [12.0, 7.0, 8.0]:
+            elementsInstance.updateCache("Fe", [energy, energy - 0.5])
+        elementsInstance.fillCache("Fe", [12.0, 6.4])
+        for thread in threads:
+            thread.join()
+        elementsInstance.clearCache("Fe")
+        elementsInstance.setCacheEnabled("Fe", 0)
+        for output in outputs:
+            for family in families:
+                for line in reference[family][0]:
+                    before = reference[family][0][line]["rate"]
+                    after = output[family][0][line]["rate"]
+                    self.assertTrue(abs(before - after) <= 1.0e-10 * abs(before),
+                            "Expected %g and not %g" % (before, after))
+
+        # the excitation cache is only filled with the calculation cache enabled
+        self.assertEqual(elementsInstance.getExcitationCacheSize("Fe"), 0)
+        fluo = getXRF().getMultilayerFluorescence(families, elementsInstance, secondary=2)
+        self.assertEqual(elementsInstance.getExcitationCacheSize("Fe"), 0)
+
+        # then it is filled on demand and emptied when the element changes
+        elementsInstance.setCacheEnabled("Fe", 1)
+        fluo = getXRF().getMultilayerFluorescence(families, elementsInstance, secondary=2)
+        self.assertTrue(elementsInstance.getExcitationCacheSize("Fe") > 0)
+        for family in families:
+            for line in reference[family][0]:
+                self.assertEqual(reference[family][0][line]["rate"],
+                                 fluo[family][0][line]["rate"])
+        elementsInstance.clearCache("Fe")
+        self.assertEqual(elementsInstance.getExcitationCacheSize("Fe"), 0)
+        elementsInstance.setCacheEnabled("Fe", 0)
+
+        # with the multilayer cache a monochromatic beam keeps its plan while only the sample changes
+        xrf = getXRF()
+        self.assertEqual(xrf.isMultilayerCacheEnabled(), 0)
+        xrf.setMultilayerCacheEnabled(1)
+        xrf.setAttenuators([["Air", 0.0012048, 5.0, 1.0]])
+        # the last calculation follows the redefinition of the attenuator material
+        for thickness, material in [(1.0, None), (0.01, None), (0.2, None), (0.2, denseAir)]:
+            if material is not None:
+                elementsInstance.addMaterial(material, errorOnReplace=0)
+            previous = fluo
+            xrf.setSample([["SRM_1155", 1.0, thickness]])
+            fluo = xrf.getMultilayerFluorescence(families, elementsInstance, secondary=2)
+            other = XRF()
+            other.setBeam(12.0)
+            other.setAttenuators([["Air", 0.0012048, 5.0, 1.0]])
+            other.setSample([["SRM_1155", 1.0, thickness]])
+            reference = other.getMultilayerFluorescence(families, elementsInstance, secondary=2)
+            for family in families:
+                for line in reference[family][0]:
+                    self.assertEqual(reference[family][0][line]["rate"],
+                                     fluo[family][0][line]["rate"])
+        self.assertTrue(fluo != previous, "Attenuator material change not detected")
+        elementsInstance.addMaterial(Air, errorOnReplace=0)
+
 def getSuite(auto=True):
     testSuite = unittest.TestSuite()
     if auto:
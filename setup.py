@@ -241,8 +241,9 @@ if sys.platform == 'win32':
     extra_compile_args = ['/EHsc']
     extra_link_args = []
 else:
-    extra_compile_args = []
-    extra_link_args = []
+    # the multilayer calculation can use several threads
+    extra_compile_args = ['-pthread']
+    extra_link_args = ['-pthread']
 
 def buildExtension():
     module = Extension(name="fisx._fisx",
@@ -150,6 +150,7 @@ void Element::setBindingEnergies(std::map<std::string, double> bindingEnergies)
     // get rid of any shell definition
     this->shellInstance.clear();
     this->bindingEnergy.clear();
+    this->clearCache();
 
     for (it = bindingEnergies.begin(); it != bindingEnergies.end(); ++it)
     {
@@ -342,10 +343,14 @@ std::map<std::string, double> Element::getMassAttenuationCoefficients(const doub
 
     if (this->isCacheEnabled())
     {
-        c_it2 = this->muCache.find(energy);
-        if (c_it2 != this->muCache.end())
+        std::shared_ptr<const CalculationCache> cache = this->getCalculationCache();
+        if (cache)
         {
-            return c_it2->second;
+            c_it2 = cache->mu.find(energy);
+            if (c_it2 != cache->mu.end())
+            {
+                return c_it2->second;
+            }
         }
     }
 
@@ -983,6 +988,7 @@ void Element::setRadiativeTransitions(std::string subshell, \
         throw std::invalid_argument(msg);
     }
     this->shellInstance[subshell].setRadiativeTransitions(labels, values);
+    this->clearCache();
 }
 
 void Element::setRadiativeTransitions(std::string subshell, std::map<std::string, double> values)
@@ -1312,7 +1318,12 @@ Element::getXRayLinesFromVacancyDistribution(const std::map<std::string, double>
 
     if (cascade != 0)
     {
-        if (this->cascadeCacheEnabledFlag &&  useFluorescenceYield && (this->cascadeCache.size() > 0))
+        std::shared_ptr<const CascadeCache> cache;
+        if (this->cascadeCacheEnabledFlag && useFluorescenceYield)
+        {
+            cache = this->getCascadeCache();
+        }
+        if (cache && (cache->size() > 0))
         {
             // we are in conditions to use the cached emission
             std::map<std::string, std::map<std::string, \
@@ -1326,8 +1337,8 @@ Element::getXRayLinesFromVacancyDistribution(const std::map<std::string, double>
                     // no vacancies created in that shell
                     continue;
                 }
-                cacheKey = cascadeCache.find(c_it->first);
-                if (cacheKey == cascadeCache.end())
+                cacheKey = cache->find(c_it->first);
+                if (cacheKey == cache->end())
                 {
                     std::cout << this->name << " Error processing vacancy on shell " << c_it->first << std::endl;
                     throw std::runtime_error("Vacancy in a shell not present in the cache!");
@@ -1535,10 +1546,11 @@ std::map<std::string, std::map<std::string, double> > Element::getPhotoelectricE
 
     if (this->isCacheEnabled())
     {
-        if (this->excitationFactorsCache.size())
+        std::shared_ptr<const CalculationCache> cache = this->getCalculationCache();
+        if (cache)
         {
-            c_it = this->excitationFactorsCache.find(energy);
-            if (c_it != this->excitationFactorsCache.end())
+            c_it = cache->excitationFactors.find(energy);
+            if (c_it != cache->excitationFactors.end())
             {
                 result = c_it->second;
                 for(it = result.begin(); it != result.end(); ++it)
@@ -1550,14 +1562,46 @@ std::map<std::string, std::map<std::string, double> > Element::getPhotoelectricE
             }
         }
     }
-    //we have to calculate it
-    vacancyDistribution = this->getInitialPhotoelectricVacancyDistribution(energy);
-    result = this->getXRayLinesFromVacancyDistribution(vacancyDistribution, 1, 1);
+    //we have to calculate it unless it is already in the excitation cache, used with the calculation cache
+    std::shared_ptr<ExcitationCache> cache;
+    bool cached = false;
+    if (this->isCacheEnabled())
+    {
+        cache = std::atomic_load(&this->excitationCache);
+    }
+    double photoelectric = 0.0;
+    if (cache)
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        std::map<double, std::pair<double, std::map<std::string, std::map<std::string, double> > > >\
+                                                            ::const_iterator entryIt;
+        entryIt = cache->entries.find(energy);
+        if (entryIt != cache->entries.end())
+        {
+            photoelectric = entryIt->second.first;
+            result = entryIt->second.second;
+            cached = true;
+        }
+    }
+    if (!cached)
+    {
+        vacancyDistribution = this->getInitialPhotoelectricVacancyDistribution(energy);
+        result = this->getXRayLinesFromVacancyDistribution(vacancyDistribution, 1, 1);
+        photoelectric = this->getMassAttenuationCoefficients(energy)["photoelectric"];
+        if (cache)
+        {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            // once full the kept energies stay, a larger beam does not keep emptying and refilling it
+            if (cache->entries.size() < this->excitationCacheMaximumSize)
+            {
+                cache->entries[energy] = std::make_pair(photoelectric, result);
+            }
+        }
+    }
     for(it = result.begin(); it != result.end(); ++it)
     {
         it->second["factor"] = it->second["rate"] * weight;
-        it->second["rate"] = it->second["factor"] *\
-                        this->getMassAttenuationCoefficients(energy)["photoelectric"];
+        it->second["rate"] = it->second["factor"] * photoelectric;
     }
     return result;
 }
@@ -1603,19 +1647,27 @@ void Element::setCascadeCacheEnabled(const int & flag)
     }
     else
     {
-        if (this->cascadeCache.size() < 1)
+        if (this->isCascadeCacheFilled() < 1)
         {
             this->fillCascadeCache();
         }
         this->cascadeCacheEnabledFlag = true;
     }
+    this->resetExcitationCache();
+}
+
+std::shared_ptr<const Element::CascadeCache> Element::getCascadeCache() const
+{
+    return std::atomic_load(&this->cascadeCache);
 }
 
 void Element::fillCascadeCache()
 {
     std::map<std::string, Shell>::const_iterator shellIterator;
-    bool oldFlag;
-    this->cascadeCache.clear();
+    std::shared_ptr<CascadeCache> cache(new CascadeCache());
+
+    // the cache is emptied first because otherways it uses the cache when filling the cache :-)
+    this->emptyCascadeCache();
     // std::cout << "filling cache for element " << this->name << std::endl;
     for (shellIterator = shellInstance.begin(); shellIterator != shellInstance.end(); ++shellIterator)
     {
@@ -1623,26 +1675,24 @@ void Element::fillCascadeCache()
         std::map<std::string, double> tmpDistribution;
         tmpDistribution.clear();
         tmpDistribution[subshell] = 1.0;
-        oldFlag = this->cascadeCacheEnabledFlag;
-        if (oldFlag)
-        {
-            // this is needed because otherways it uses the cache when filling the cache :-)
-            this->cascadeCacheEnabledFlag = false;
-        }
-        this->cascadeCache[subshell] = this->getXRayLinesFromVacancyDistribution(tmpDistribution, 1, 1);
-        this->cascadeCacheEnabledFlag = oldFlag;
+        (*cache)[subshell] = this->getXRayLinesFromVacancyDistribution(tmpDistribution, 1, 1);
     }
+    std::atomic_store(&this->cascadeCache, std::shared_ptr<const CascadeCache>(cache));
+    // the emitted X-rays may differ by rounding once the cascade cache is used
+    this->resetExcitationCache();
     //std::cout << "cache filled for element " << this->name << std::endl;
 }
 
 void Element::emptyCascadeCache()
 {
-    this->cascadeCache.clear();
+    std::atomic_store(&this->cascadeCache, std::shared_ptr<const CascadeCache>());
+    this->resetExcitationCache();
 }
 
 int Element::isCascadeCacheFilled() const
 {
-    return (int) this->cascadeCache.size();
+    std::shared_ptr<const CascadeCache> cache = this->getCascadeCache();
+    return cache ? (int) cache->size() : 0;
 }
 
 void Element::setCacheEnabled(const int & flag)
@@ -1665,16 +1715,42 @@ const int Element::isCacheEnabled() const
     }
 }
 
+std::shared_ptr<const Element::CalculationCache> Element::getCalculationCache() const
+{
+    return std::atomic_load(&this->calculationCache);
+}
+
+void Element::setCalculationCache(const std::shared_ptr<const CalculationCache> & cache)
+{
+    std::atomic_store(&this->calculationCache, cache);
+}
+
 void Element::clearCache()
 {
-    this->excitationFactorsCache.clear();
-    this->muCache.clear();
+    this->setCalculationCache(std::shared_ptr<const CalculationCache>());
+    this->resetExcitationCache();
+}
+
+void Element::resetExcitationCache()
+{
+    std::atomic_store(&this->excitationCache, std::shared_ptr<ExcitationCache>(new ExcitationCache()));
+}
+
+int Element::getExcitationCacheSize() const
+{
+    std::shared_ptr<ExcitationCache> cache = std::atomic_load(&this->excitationCache);
+    if (!cache)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    return (int) cache->entries.size();
 }
 
 void Element::fillCache(const std::vector<double> & energy)
 {
     std::vector<double>::size_type i, maxSize;
-    int status;
+    std::shared_ptr<CalculationCache> cache(new CalculationCache());
 
     this->clearCache();
 
@@ -1686,64 +1762,44 @@ void Element::fillCache(const std::vector<double> & energy)
     {
         maxSize = this->cacheMaximumSize;
     }
-    status = this->isCacheEnabled();
-    try
+    // the new cache is only visible once filled
+    for (i = 0; i < maxSize; i++)
     {
-        // This is necessary because clang pushes return value optimization to the limit
-        // and creates the key into muCache prior to call getMassAttenuationCoefficients
-        this->setCacheEnabled(0);
-        for (i = 0; i < maxSize; i++)
-        {
-            this->muCache[energy[i]] = this->getMassAttenuationCoefficients(energy[i]);
-            this->excitationFactorsCache[energy[i]] = this->getPhotoelectricExcitationFactors(energy[i], 1.0);
-        }
-        this->setCacheEnabled(status);
-    }
-    catch(...)
-    {
-        this->setCacheEnabled(status);
-        throw;
+        cache->mu[energy[i]] = this->getMassAttenuationCoefficients(energy[i]);
+        cache->excitationFactors[energy[i]] = this->getPhotoelectricExcitationFactors(energy[i], 1.0);
     }
+    this->setCalculationCache(cache);
 }
 
 void Element::updateCache(const std::vector< double> & energy)
 {
     std::vector<double>::size_type i, eSize;
-    int status;
+    std::shared_ptr<const CalculationCache> oldCache = this->getCalculationCache();
+    std::shared_ptr<CalculationCache> cache(oldCache ? new CalculationCache(*oldCache) : new CalculationCache());
 
-    // This is necessary because clang pushes return value optimization to the limit
-    // and creates the key into muCache prior to call getMassAttenuationCoefficients
-    status = this->isCacheEnabled();
-    this->setCacheEnabled(0);
+    // the new cache is only visible once updated, the values already present in the old one
+    // being identical to those calculated
     eSize = energy.size();
-    try
+    for (i = 0; i < eSize; i++)
     {
-        for (i = 0; i < eSize; i++)
+        if (cache->mu.size() < this->cacheMaximumSize)
         {
-            if (this->muCache.size() < this->cacheMaximumSize)
+            if (cache->mu.find(energy[i]) == cache->mu.end())
             {
-                if (this->muCache.find(energy[i]) == this->muCache.end())
-                {
-                    this->muCache[energy[i]] = this->getMassAttenuationCoefficients(energy[i]);
-                }
-                if (this->excitationFactorsCache.find(energy[i]) == this->excitationFactorsCache.end())
-                {
-                    this->excitationFactorsCache[energy[i]] = this->getPhotoelectricExcitationFactors(energy[i], 1.0);
-                }
+                cache->mu[energy[i]] = this->getMassAttenuationCoefficients(energy[i]);
+            }
+            if (cache->excitationFactors.find(energy[i]) == cache->excitationFactors.end())
+            {
+                cache->excitationFactors[energy[i]] = this->getPhotoelectricExcitationFactors(energy[i], 1.0);
             }
         }
-        this->setCacheEnabled(status);
-    }
-    catch(...)
-    {
-        this->setCacheEnabled(status);
-        throw;
     }
-    if (this->muCache.size() >= this->cacheMaximumSize)
+    this->setCalculationCache(cache);
+    if (cache->mu.size() >= this->cacheMaximumSize)
     {
         std::cout << "Mass attenuation coefficients cache full" << std::endl;
     }
-    if (this->excitationFactorsCache.size() >= this->cacheMaximumSize)
+    if (cache->excitationFactors.size() >= this->cacheMaximumSize)
     {
         std::cout << "Excitation factors cache full" << std::endl;
     }
@@ -1751,7 +1807,8 @@ void Element::updateCache(const std::vector< double> & energy)
 
 int Element::getCacheSize() const
 {
-    return (int) this->muCache.size();
+    std::shared_ptr<const CalculationCache> cache = this->getCalculationCache();
+    return cache ? (int) cache->mu.size() : 0;
 }
 
 } // namespace fisx
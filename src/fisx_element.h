@@ -31,6 +31,8 @@
 #include <ctype.h>
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
 #include "fisx_shell.h"
 #include "fisx_epdl97.h"
 
@@ -312,6 +314,11 @@ public:
     corrected for cascade and fluorescence yield. If the weight is one, that
     corresponds to the different emitted x-rays per incident photon following photoelectric
     interaction.
+    If the calculation cache is enabled (see setCacheEnabled), the emitted X-rays and the photoelectric
+    mass attenuation coefficient at the energies not present in it are kept in a bounded excitation
+    cache, so the de-excitation cascade is only calculated the first time an energy is requested.
+    Once the bound is reached, new energies are calculated without being kept. The excitation cache
+    is emptied by the methods modifying the element data or the cascade cache and by clearCache.
     */
     std::map<std::string, std::map<std::string, double> > getPhotoelectricExcitationFactors( \
                                                     const double & energy,
@@ -339,6 +346,12 @@ public:
         - With less excitation energies than element shells it may be slower
         - For the time being is the responsibility of the user to reset the cache (due to a change of
         fluorescence, auger or CosterKronig yields,  of emission ratios or binding energies.
+
+    The caches of the element (cascade and calculation caches) are never modified once stored. The
+    methods filling, updating or clearing them store a new cache, so the const methods can be called
+    from several threads even while one thread fills a cache. Copies of the element share the caches
+    until one of them stores a new one. The methods enabling or disabling the caches are not meant to
+    be called while other threads use the element.
     */
     void setCascadeCacheEnabled(const int & flag = 1);
     int isCascadeCacheFilled() const;
@@ -365,7 +378,7 @@ public:
 
 
     /*!
-    Clear the calculation cache
+    Clear the calculation cache and the excitation cache
     */
     void clearCache();
 
@@ -379,6 +392,11 @@ public:
     */
     int getCacheSize() const;
 
+    /*!
+    Return the number of energies kept by the excitation cache (see getPhotoelectricExcitationFactors)
+    */
+    int getExcitationCacheSize() const;
+
 private:
     std::string name;
     int atomicNumber;
@@ -403,11 +421,32 @@ private:
     std::map<std::string, std::vector<double> > muPartialPhotoelectricEnergy;
     std::map<std::string, std::vector<double> > muPartialPhotoelectricValue;
 
-    // A cache for storing calculations
+    // A cache for storing calculations. It is read via getCalculationCache and replaced as a whole
+    // via setCalculationCache
+    struct CalculationCache
+    {
+        std::map< double, std::map< std::string, double> > mu;
+        std::map< double, std::map<std::string, std::map<std::string, double> > > excitationFactors;
+    };
     static const unsigned int cacheMaximumSize = 10000;
     bool calculationCacheEnabledFlag;
-    std::map< double, std::map< std::string, double> > muCache;
-    std::map< double, std::map<std::string, std::map<std::string, double> > > excitationFactorsCache;
+    std::shared_ptr<const CalculationCache> calculationCache;
+    std::shared_ptr<const CalculationCache> getCalculationCache() const;
+    void setCalculationCache(const std::shared_ptr<const CalculationCache> & cache);
+
+    // Emitted X-rays at unit weight and photoelectric mass attenuation coefficient at the energies
+    // requested to getPhotoelectricExcitationFactors, filled on demand if the calculation cache is enabled.
+    // The entries are accessed under the mutex and no more are added once the maximum size is reached.
+    // The methods modifying the element replace the cache instead of clearing it, so the copies of
+    // the element sharing it are not affected.
+    struct ExcitationCache
+    {
+        std::mutex mutex;
+        std::map<double, std::pair<double, std::map<std::string, std::map<std::string, double> > > > entries;
+    };
+    static const unsigned int excitationCacheMaximumSize = 1000;
+    std::shared_ptr<ExcitationCache> excitationCache;
+    void resetExcitationCache();
 
     // Shell instance to handle cascade
     std::map<std::string, Shell> shellInstance;
@@ -427,7 +466,9 @@ private:
     // map[(sub)shell][emission_line]["energy"]
     // Providing the emitted X-rays following a single vacancy on a particular (sub)shell considering
     // cascade and fluorescence yields
-    std::map<std::string, std::map<std::string, std::map<std::string, double> > > cascadeCache;
+    typedef std::map<std::string, std::map<std::string, std::map<std::string, double> > > CascadeCache;
+    std::shared_ptr<const CascadeCache> cascadeCache;
+    std::shared_ptr<const CascadeCache> getCascadeCache() const;
 };
 
 } // namespace fisx
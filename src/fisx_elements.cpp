@@ -33,11 +33,15 @@
 #include <sstream>
 #include <algorithm>
 #include <cstdlib>
+#include <atomic>
 #include "fisx_elements.h"
 
 namespace fisx
 {
 
+// shared by all the instances, so that two library states never get the same generation
+static std::atomic<unsigned long long> elementsGenerationCounter(0);
+
 
 const std::string Elements::defaultDataDir()
 {
@@ -133,6 +137,11 @@ Elements::Elements(std::string directoryName, short pymca)
     }
 }
 
+void Elements::newGeneration()
+{
+    this->generation = ++elementsGenerationCounter;
+}
+
 void Elements::initialize(std::string epdl97Directory, std::string bindingEnergiesFile)
 {
 #include "fisx_defaultelementsinfo.h"
@@ -155,6 +164,8 @@ void Elements::initialize(std::string epdl97Directory, std::string bindingEnergi
     std::string joinSymbol;
     std::string filename;
 
+    this->newGeneration();
+
     // Indicate we are going to configure everything
     this->shellConstantsFile["K"] = "";
     this->shellConstantsFile["L"] = "";
@@ -303,6 +314,8 @@ void Elements::addElement(const Element & element)
     std::string name;
     name = element.getName();
 
+    this->newGeneration();
+
     if (this->elementDict.find(name) != this->elementDict.end())
     {
         // an element with that name already exists
@@ -328,6 +341,8 @@ void Elements::setShellConstantsFile(const std::string & mainShellName, \
     std::map<std::string, double > tmpDict;
     std::string msg;
 
+    this->newGeneration();
+
     if ((mainShellName == "K") || (mainShellName == "L") || (mainShellName == "M"))
     {
         // We have received a valid main shell and not a subshell
@@ -435,6 +450,8 @@ void Elements::setShellNonradiativeTransitionsFile(const std::string & mainShell
     std::string subshell;
     std::string msg;
 
+    this->newGeneration();
+
     if ((mainShellName == "K") || (mainShellName == "L") || (mainShellName == "M"))
     {
         // We have received a valid main shell and not a subshell
@@ -531,6 +548,8 @@ void Elements::setShellRadiativeTransitionsFile(const std::string & mainShellNam
     std::string subshell;
     std::string msg;
 
+    this->newGeneration();
+
     if ((mainShellName == "K") || (mainShellName == "L") || (mainShellName == "M"))
     {
         // We have received a valid main shell and not a subshell
@@ -627,6 +646,8 @@ void Elements::setMassAttenuationCoefficientsFile(const std::string & fileName)
     std::vector<double> muPhotoelectric;
     std::string key;
 
+    this->newGeneration();
+
     sf = SimpleSpecfile(fileName);
     nScans = sf.getNumberOfScans();
     if (nScans < 1)
@@ -734,6 +755,7 @@ void Elements::setMassAttenuationCoefficients(const std::string & name,
     double tmpDouble;
     int atomicNumber, idx;
 
+    this->newGeneration();
 
     if (this->elementDict.find(name) == this->elementDict.end())
     {
@@ -1190,6 +1212,8 @@ void Elements::addMaterial(const std::string & name, const double & density, \
     Material material;
     std::map<std::string, double> composition;
 
+    this->newGeneration();
+
     if (this->getMaterialIndexFromName(name) < this->materialList.size())
     {
         if (errorOnReplace)
@@ -1220,6 +1244,8 @@ void Elements::setMaterialComposition(const std::string & materialName, \
     std::string msg;
     std::vector<Material>::size_type i;
 
+    this->newGeneration();
+
     i = this->getMaterialIndexFromName(materialName);
     if (i == this->materialList.size())
     {
@@ -1235,6 +1261,8 @@ void Elements::setMaterialComposition(const std::string & materialName, \
     std::string msg;
     std::vector<Material>::size_type i;
 
+    this->newGeneration();
+
     i = this->getMaterialIndexFromName(materialName);
     if (i >= this->materialList.size())
     {
@@ -1293,6 +1321,7 @@ void Elements::addMaterial(const Material & material, const int & errorOnReplace
     std::string materialName;
     std::vector<Material>::size_type i;
 
+    this->newGeneration();
 
     materialName = material.getName();
 
@@ -1322,6 +1351,7 @@ void Elements::addMaterial(const Material & material, const int & errorOnReplace
 
 void Elements::removeMaterials()
 {
+    this->newGeneration();
     this->materialList.clear();
 }
 
@@ -2028,12 +2058,13 @@ std::map<std::string,std::map<std::string, double> > Elements::getEscape( \
     std::string tmpString;
     double intrinsicEfficiency;
 
-    if (this->isEscapeCacheCompatible(composition,energyThreshold,intensityThreshold, \
+    std::shared_ptr<const EscapeCache> cache = std::atomic_load(&this->escapeCache);
+    if (this->isEscapeCacheCompatible(cache, composition,energyThreshold,intensityThreshold, \
                                         nThreshold , alphaIn, thickness))
     {
         std::map< double, std::map<std::string,std::map<std::string, double> > >::const_iterator it;
-        it = this->detectorEscapeCache.find(energy);
-        if ( it != this->detectorEscapeCache.end())
+        it = cache->detectorEscapeCache.find(energy);
+        if ( it != cache->detectorEscapeCache.end())
         {
             // std::cout << "USING CACHE" <<  energy << std::endl;
             return it->second;
@@ -2126,6 +2157,9 @@ void Elements::removeMaterial(const std::string & name)
 {
     std::string msg;
     std::vector<Material>::size_type i;
+
+    this->newGeneration();
+
     i = this->getMaterialIndexFromName(name);
     if ( i >= this->materialList.size())
     {
@@ -2247,11 +2281,11 @@ void Elements::clearCache(const std::string & elementName)
 
 void Elements::clearEscapeCache(void)
 {
-    this->detectorEscapeCache.clear();
+    std::atomic_store(&this->escapeCache, std::shared_ptr<const EscapeCache>());
 }
 
 
-bool Elements::isEscapeCacheCompatible(\
+bool Elements::isEscapeCacheCompatible(const std::shared_ptr<const EscapeCache> & cache, \
                                         const std::map<std::string, double> & composition,
                                         const double & energyThreshold, \
                                         const double & intensityThreshold, \
@@ -2264,31 +2298,31 @@ bool Elements::isEscapeCacheCompatible(\
     {
         return false;
     }
-    if (this->detectorEscapeCache.size() > 0)
+    if (cache && (cache->detectorEscapeCache.size() > 0))
     {
         // std::cout << 1 << std::endl;
-        if (energyThreshold == this->detectorEnergyThresholdUsedInCache)
+        if (energyThreshold == cache->detectorEnergyThresholdUsedInCache)
         {
             // std::cout << 2 << std::endl;
-            if (intensityThreshold == this->detectorIntensityThresholdUsedInCache)
+            if (intensityThreshold == cache->detectorIntensityThresholdUsedInCache)
             {
                 // std::cout << 3 << std::endl;
-                // std::cout << " input " << nThreshold << " cached " << this->detectorNThresholdUsedInCache << std::endl;
-                if(nThreshold == this->detectorNThresholdUsedInCache)
+                // std::cout << " input " << nThreshold << " cached " << cache->detectorNThresholdUsedInCache << std::endl;
+                if(nThreshold == cache->detectorNThresholdUsedInCache)
                 {
                     // std::cout << 4 << std::endl;
-                    if (alphaIn == this->detectorAlphaInUsedInCache)
+                    if (alphaIn == cache->detectorAlphaInUsedInCache)
                     {
                         //std::cout << 5 << std::endl;
-                        //std::cout << " input " << thickness << " cached " << this->detectorThicknessUsedInCache << std::endl;
-                        if (thickness == this->detectorThicknessUsedInCache)
+                        //std::cout << " input " << thickness << " cached " << cache->detectorThicknessUsedInCache << std::endl;
+                        if (thickness == cache->detectorThicknessUsedInCache)
                         {
                             //std::cout << 6 << std::endl;
                             // we have to compare the composition
-                            if (composition.size() == this->detectorCompositionUsedInCache.size())
+                            if (composition.size() == cache->detectorCompositionUsedInCache.size())
                             {
                                 // std::cout << 7 << std::endl;
-                                if (std::equal(composition.begin(), composition.end(), this->detectorCompositionUsedInCache.begin()))
+                                if (std::equal(composition.begin(), composition.end(), cache->detectorCompositionUsedInCache.begin()))
                                 {
                                     // std::cout << 8 << std::endl;
                                     return true;
@@ -2314,35 +2348,39 @@ void Elements::updateEscapeCache(\
 {
     std::vector<double>::size_type i;
     double energy;
+    std::shared_ptr<const EscapeCache> oldCache = std::atomic_load(&this->escapeCache);
+    std::shared_ptr<EscapeCache> cache(new EscapeCache());
 
     if (this->isEscapeCacheEnabled() == 0)
     {
         std::cout << "WARNING: Filling escape cache when escape cache is disabled" << std::endl;
     }
 
-    if (!this->isEscapeCacheCompatible(composition, energyThreshold, \
+    if (this->isEscapeCacheCompatible(oldCache, composition, energyThreshold, \
                                         intensityThreshold, nThreshold, alphaIn, thickness))
     {
-        // not compatible, clear the detector cache
-        this->clearEscapeCache();
+        // keep the energies already calculated, otherwise start from an empty cache
+        *cache = *oldCache;
     }
+    cache->detectorCompositionUsedInCache = composition;
+    cache->detectorEnergyThresholdUsedInCache = energyThreshold;
+    cache->detectorIntensityThresholdUsedInCache = intensityThreshold;
+    cache->detectorNThresholdUsedInCache = nThreshold;
+    // std::cout << "Storing cache " << nThreshold << std::endl;
+    cache->detectorAlphaInUsedInCache = alphaIn;
+    cache->detectorThicknessUsedInCache = thickness;
     for (i = 0; i < energyList.size(); ++i)
     {
         energy = energyList[i];
-        if (this->detectorEscapeCache.find(energy) == this->detectorEscapeCache.end())
+        if (cache->detectorEscapeCache.find(energy) == cache->detectorEscapeCache.end())
         {
             // std::cout << "filling energy " << energy << std::endl;
-            this->detectorEscapeCache[energy] = this->getEscape(composition, energy, energyThreshold, \
-                                                                intensityThreshold, nThreshold, alphaIn, thickness);
+            cache->detectorEscapeCache[energy] = this->getEscape(composition, energy, energyThreshold, \
+                                                                 intensityThreshold, nThreshold, alphaIn, thickness);
         }
-        this->detectorCompositionUsedInCache = composition;
-        this->detectorEnergyThresholdUsedInCache = energyThreshold;
-        this->detectorIntensityThresholdUsedInCache = intensityThreshold;
-        this->detectorNThresholdUsedInCache = nThreshold;
-        // std::cout << "Storing cache " << nThreshold << std::endl;
-        this->detectorAlphaInUsedInCache = alphaIn;
-        this->detectorThicknessUsedInCache = thickness;
     }
+    // the new cache is only visible once filled
+    std::atomic_store(&this->escapeCache, std::shared_ptr<const EscapeCache>(cache));
 }
 
 
@@ -2374,5 +2412,19 @@ int Elements::getCacheSize(const std::string & elementName) const
         throw std::invalid_argument("Invalid element: " + elementName);
 }
 
+int Elements::getExcitationCacheSize(const std::string & elementName) const
+{
+    std::map<std::string, int>::const_iterator it;
+    int i;
+    if (this->isElementNameDefined(elementName))
+    {
+        it = this->elementDict.find(elementName);
+        i = it->second;
+        return this->elementList[i].getExcitationCacheSize();
+    }
+    else
+        throw std::invalid_argument("Invalid element: " + elementName);
+}
+
 
 } // namespace fisx
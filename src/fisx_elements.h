@@ -37,6 +37,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include "fisx_simplespecfile.h"
 #include "fisx_element.h"
 #include "fisx_epdl97.h"
@@ -503,6 +504,8 @@ public:
     /*!
     Calculate the expected escape and stores it into cache.
     The cache will be emptied if needed.
+    As the element calculation caches, the escape cache is replaced as a whole once updated, so the
+    const methods can be called from other threads meanwhile.
     */
     void updateEscapeCache(const std::map<std::string, double> & composition, \
                                         const std::vector<double> & energy, \
@@ -561,6 +564,21 @@ public:
     */
     int getCacheSize(const std::string & elementName) const;
 
+    /*!
+    Return the number of energies kept by the excitation cache of the element. That cache is
+    only used when the calculation cache of the element is enabled (see setCacheEnabled) and
+    it is emptied when the element data are modified.
+    */
+    int getExcitationCacheSize(const std::string & elementName) const;
+
+    /*!
+    Return a number identifying the data of the library. It changes whenever the elements, their
+    data or the materials are modified, and two different library states never share it, even when
+    they belong to different instances. Results calculated with the library can be kept as long as
+    it does not change.
+    */
+    unsigned long long getGeneration() const {return this->generation;};
+
     /*!
     Utility to convert from string to double.
     */
@@ -575,6 +593,10 @@ private:
 
     void initialize(std::string, std::string);
 
+    // Generation of the library data, renewed by every modifying method
+    unsigned long long generation;
+    void newGeneration();
+
     // The EPDL97 library
     EPDL97 epdl97;
 
@@ -596,16 +618,21 @@ private:
     std::map<std::string, std::string> shellRadiativeTransitionsFile;
     std::map<std::string, std::string> shellNonradiativeTransitionsFile;
 
-    // A cache of escape peaks
-    std::map< double, std::map<std::string,std::map<std::string, double> > > detectorEscapeCache;
-    std::map< std::string, double> detectorCompositionUsedInCache;
-    double detectorEnergyThresholdUsedInCache;
-    double detectorIntensityThresholdUsedInCache;
-    int detectorNThresholdUsedInCache;
-    double detectorAlphaInUsedInCache;
-    double detectorThicknessUsedInCache;
+    // A cache of escape peaks and the detector used to calculate them. It is never modified once
+    // stored, updateEscapeCache and clearEscapeCache store a new one.
+    struct EscapeCache
+    {
+        std::map< double, std::map<std::string,std::map<std::string, double> > > detectorEscapeCache;
+        std::map< std::string, double> detectorCompositionUsedInCache;
+        double detectorEnergyThresholdUsedInCache;
+        double detectorIntensityThresholdUsedInCache;
+        int detectorNThresholdUsedInCache;
+        double detectorAlphaInUsedInCache;
+        double detectorThicknessUsedInCache;
+    };
+    std::shared_ptr<const EscapeCache> escapeCache;
     int escapeCacheEnabled;
-    bool isEscapeCacheCompatible(\
+    bool isEscapeCacheCompatible(const std::shared_ptr<const EscapeCache> & cache, \
                                         const std::map<std::string, double> & composition,
                                         const double & energyThreshold, \
                                         const double & intensityThreshold, \
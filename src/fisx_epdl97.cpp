@@ -777,7 +777,8 @@ std::string EPDL97::toUpperCaseString(const std::string & str) const
 
 std::pair<long, long> EPDL97::getInterpolationIndices(const std::vector<double> & vec, const double & x) const
 {
-    static long lastI0 = 0L;
+    // last index found by the calling thread, a hint that can be used concurrently
+    static thread_local long lastI0 = 0L;
     std::vector<double>::size_type length, iMin, iMax, distance;
     int counter;
     std::pair<long, long> result;
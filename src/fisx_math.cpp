@@ -30,6 +30,7 @@
 #include <cfloat>
 #include <stdexcept>
 #include <iostream>
+#include <string>
 
 namespace fisx
 {
@@ -204,112 +205,239 @@ double Math::deBoerD(const double & x)
 }
 
 
+void Math::deBoerD(const double * x, double * result, const std::size_t & n)
+{
+#ifndef NDEBUG
+    // keep the checks of the single value version
+    std::size_t i;
+    for (i = 0; i < n; i++)
+    {
+        result[i] = Math::deBoerD(x[i]);
+    }
+#else
+    // Same modified Lentz algorithm as _deBoerD, applied to nLanes values at once.
+    // Each lane stops being updated when it converges, what gives the same result
+    // as the single value evaluation.
+    const std::size_t nLanes = 4;
+    const double epsilon = 1.0e-7;
+    const int maxIter = 100;
+    std::size_t index[nLanes];
+    double b[nLanes];
+    double f[nLanes];
+    double C[nLanes];
+    double D[nLanes];
+    bool active[nLanes];
+    double a, bNew, cNew, dNew, delta, fNew;
+    double limit0, limit1;
+    std::size_t i, k, nPending, nActive;
+    int iter;
+
+    nPending = 0;
+    for (i = 0; i <= n; i++)
+    {
+        if (i < n)
+        {
+            if (x[i] < 0)
+            {
+                result[i] = std::exp(x[i]) * E1(x[i]);
+                continue;
+            }
+            if (x[i] <= 1)
+            {
+                result[i] = std::exp(x[i]) * (Math::AS_5_1_53(x[i]) - log(x[i]));
+                continue;
+            }
+            index[nPending] = i;
+            nPending++;
+            if (nPending < nLanes)
+            {
+                continue;
+            }
+        }
+        else if (nPending == 0)
+        {
+            break;
+        }
+        for (k = 0; k < nLanes; k++)
+        {
+            active[k] = (k < nPending);
+            b[k] = active[k] ? 1 + x[index[k]] : 2.0;
+            f[k] = b[k];
+            C[k] = f[k];
+            D[k] = 0.0;
+        }
+        nActive = nPending;
+        for (iter = 1; (iter < maxIter) && (nActive > 0); iter++)
+        {
+            a = - iter * iter;
+            for (k = 0; k < nLanes; k++)
+            {
+                bNew = b[k] + 2;
+                cNew = bNew + a / C[k];
+                dNew = 1.0 / (bNew + a * D[k]);
+                delta = cNew * dNew;
+                fNew = f[k] * delta;
+                if (active[k])
+                {
+                    b[k] = bNew;
+                    C[k] = cNew;
+                    D[k] = dNew;
+                    f[k] = fNew;
+                    if (std::abs(delta - 1) < epsilon)
+                    {
+                        result[index[k]] = 1.0 / fNew;
+                        active[k] = false;
+                        nActive--;
+                    }
+                }
+            }
+        }
+        for (k = 0; (nActive > 0) && (k < nPending); k++)
+        {
+            if (active[k])
+            {
+                std::cout << " Continued fraction failed to converge for x = " << x[index[k]] << std::endl;
+                limit0 = 0.5 * log(1 + 2.0/x[index[k]]);
+                limit1 = log(1 + 1.0 /x[index[k]]);
+                result[index[k]] = 0.5 * (limit0 + limit1);
+            }
+        }
+        nPending = 0;
+    }
+#endif
+}
+
+
 double Math::deBoerL0(const double & mu1, const double & mu2, const double & muj, \
                                const double & density, const double & thickness)
 {
+    double result;
+
+    Math::deBoerL0(&mu1, &mu2, muj, density, thickness, &result, 1);
+    return result;
+}
+
+void Math::deBoerL0(const double * mu1, const double * mu2, const double & muj, \
+                    const double & density, const double & thickness, \
+                    double * result, const std::size_t & n)
+{
+    // the pairs not corresponding to thick or very thin targets need three de Boer
+    // functions each, evaluated together by chunks
+    const std::size_t chunkSize = 64;
+    double x[3 * chunkSize];
+    double D[3 * chunkSize];
+    std::size_t pending[chunkSize];
+    std::size_t first, last, i, k, nPending;
     double d;
     double tmpDouble;
 
-    if (!Math::isFiniteNumber(mu1))
-    {
-        std::cout << "mu1 = " << mu1 << std::endl;
-        throw std::runtime_error("Math::deBoerL0. Received not finite mu1 < 0");
-    }
-    if (!Math::isFiniteNumber(mu2))
-    {
-        std::cout << "mu2 = " << mu2 << std::endl;
-        throw std::runtime_error("Math::deBoerL0. Received not finite mu2 < 0");
-    }
     if (!Math::isFiniteNumber(muj))
     {
         std::cout << "muj = " << muj << std::endl;
         throw std::runtime_error("Math::deBoerL0. Received non finite muj < 0");
     }
-    if ((mu1 <= 0.0) || (mu2 <= 0.0) || (muj <= 0.0))
-    {
-        std::cout << "mu1 = " << mu1 << std::endl;
-        std::cout << "mu2 = " << mu2 << std::endl;
-        std::cout << "muj = " << muj << std::endl;
-        throw std::runtime_error("Math::deBoerL0 received negative input");
-    }
 
     // express the thickness in g/cm2
     d = thickness * density;
-    if (((mu1 + mu2) * d) > 10.)
+    for (first = 0; first < n; first += chunkSize)
     {
-        // thick target
-        tmpDouble = (muj/mu1) * std::log(1 + mu1/muj) / ((mu1 + mu2) * muj);
-        //std::cout << "THICK TARGET = " << tmpDouble << std::endl;
-        if (!Math::isFiniteNumber(tmpDouble))
+        last = (first + chunkSize < n) ? first + chunkSize : n;
+        nPending = 0;
+        for (i = first; i < last; i++)
         {
-            std::cout << "Math::deBoerL0. Thick target. Not a finite result" << std::endl;
-            std::cout << "Received parameters " << std::endl;
-            std::cout << "mu1 = " << mu1 << std::endl;
-            std::cout << "mu2 = " << mu2 << std::endl;
-            std::cout << "muj = " << muj << std::endl;
-            std::cout << "thickness = " << thickness << std::endl;
-            std::cout << "density = " << density << std::endl;
-            throw std::runtime_error("Math::deBoerL0. Thick target. Non-finite result");
+            if (!Math::isFiniteNumber(mu1[i]))
+            {
+                std::cout << "mu1 = " << mu1[i] << std::endl;
+                throw std::runtime_error("Math::deBoerL0. Received not finite mu1 < 0");
+            }
+            if (!Math::isFiniteNumber(mu2[i]))
+            {
+                std::cout << "mu2 = " << mu2[i] << std::endl;
+                throw std::runtime_error("Math::deBoerL0. Received not finite mu2 < 0");
+            }
+            if ((mu1[i] <= 0.0) || (mu2[i] <= 0.0) || (muj <= 0.0))
+            {
+                std::cout << "mu1 = " << mu1[i] << std::endl;
+                std::cout << "mu2 = " << mu2[i] << std::endl;
+                std::cout << "muj = " << muj << std::endl;
+                throw std::runtime_error("Math::deBoerL0 received negative input");
+            }
+            if (((mu1[i] + mu2[i]) * d) > 10.)
+            {
+                // thick target
+                tmpDouble = (muj/mu1[i]) * std::log(1 + mu1[i]/muj) / ((mu1[i] + mu2[i]) * muj);
+                if (!Math::isFiniteNumber(tmpDouble))
+                {
+                    std::cout << "Math::deBoerL0. Thick target. Not a finite result" << std::endl;
+                    std::cout << "Received parameters " << std::endl;
+                    std::cout << "mu1 = " << mu1[i] << std::endl;
+                    std::cout << "mu2 = " << mu2[i] << std::endl;
+                    std::cout << "muj = " << muj << std::endl;
+                    std::cout << "thickness = " << thickness << std::endl;
+                    std::cout << "density = " << density << std::endl;
+                    throw std::runtime_error("Math::deBoerL0. Thick target. Non-finite result");
+                }
+                result[i] = tmpDouble;
+                continue;
+            }
+            if (((mu1[i] + mu2[i]) * d) < 0.01)
+            {
+                // very thin target, neglect enhancement
+                result[i] = 0.0;
+                continue;
+            }
+            x[3 * nPending] = (muj - mu2[i]) * d;
+            x[3 * nPending + 1] = muj * d;
+            x[3 * nPending + 2] = (muj + mu1[i]) * d;
+            pending[nPending] = i;
+            nPending++;
         }
-        return tmpDouble;
-    }
-    // std::cout << " (mu1 + mu2) * d = " << (mu1 + mu2) * d << std::endl;
-    if (((mu1 + mu2) * d) < 0.01)
-    {
-        // very thin target, neglect enhancement
-        //std::cout << "Very thin target, not considered = " << 0.0 << std::endl;
-        return 0.0;
-    }
-
-    /*
-    if ((mu1*d < 0.1) && (muj * d < 1) )
-    {
-        // thin target (this approximation only gives the order of magnitude.
-        // it is not as good as the thick target one
-        // std::cout << " d = " << d << " muj * d " << muj * d << " ";
-        tmpDouble = -0.5 * (muj * d) * std::log(muj * d) / ((mu1 + mu2) * muj);
-        tmpDouble *= (1.0 - exp(-(mu1 + mu2) * d));
-        std::cout << "THIN TARGET = " << tmpDouble << std::endl;
-        return tmpDouble;
-    }
-    */
-
-    tmpDouble = Math::deBoerD((muj - mu2) * d) / (mu2 * (mu1 + mu2));
-    tmpDouble = tmpDouble -(Math::deBoerD(muj * d) / (mu1 * mu2)) + \
-                 (Math::deBoerD((muj + mu1) * d) / (mu1 * (mu1 + mu2)));
-    tmpDouble *= std::exp(-(mu1 + muj) * d);
+        if (nPending == 0)
+        {
+            continue;
+        }
+        Math::deBoerD(x, D, 3 * nPending);
+        for (k = 0; k < nPending; k++)
+        {
+            i = pending[k];
+            tmpDouble = D[3 * k] / (mu2[i] * (mu1[i] + mu2[i]));
+            tmpDouble = tmpDouble -(D[3 * k + 1] / (mu1[i] * mu2[i])) + \
+                         (D[3 * k + 2] / (mu1[i] * (mu1[i] + mu2[i])));
+            tmpDouble *= std::exp(-(mu1[i] + muj) * d);
 
-    tmpDouble += std::log(1.0 + (mu1/muj)) / (mu1 * (mu1 + mu2));
+            tmpDouble += std::log(1.0 + (mu1[i]/muj)) / (mu1[i] * (mu1[i] + mu2[i]));
 
-    if (mu2 < muj)
-    {
-        tmpDouble += (std::exp(-(mu1 + mu2) * d) / (mu2 * (mu1 + mu2))) * \
-                      std::log(1.0 - (mu2 / muj));
-    }
-    else
-    {
-        tmpDouble += (std::exp(-(mu1 + mu2) * d) / (mu2 * (mu1 + mu2))) * \
-                      std::log((mu2 / muj) - 1.0);
-    }
-    if (tmpDouble < 0)
-    {
-        std::cout << " Math::deBoerL0 CALCULATED = " << tmpDouble << std::endl;
-        std::cout << " mu1 = " << mu1 << std::endl;
-        std::cout << " mu2 = " << mu2 << std::endl;
-        std::cout << " muj = " << muj << std::endl;
-        std::cout << " d = " << d << std::endl;
-        throw std::runtime_error("Math::deBoerL0. Negative result");
-    }
-    if (!Math::isFiniteNumber(tmpDouble))
-    {
-        std::cout << " Math::deBoerL0 CALCULATED = " << tmpDouble << std::endl;
-        std::cout << " mu1 = " << mu1 << std::endl;
-        std::cout << " mu2 = " << mu2 << std::endl;
-        std::cout << " muj = " << muj << std::endl;
-        std::cout << " d = " << d << std::endl;
-        throw std::runtime_error("Math::deBoerL0. Non-finite result");
+            if (mu2[i] < muj)
+            {
+                tmpDouble += (std::exp(-(mu1[i] + mu2[i]) * d) / (mu2[i] * (mu1[i] + mu2[i]))) * \
+                              std::log(1.0 - (mu2[i] / muj));
+            }
+            else
+            {
+                tmpDouble += (std::exp(-(mu1[i] + mu2[i]) * d) / (mu2[i] * (mu1[i] + mu2[i]))) * \
+                              std::log((mu2[i] / muj) - 1.0);
+            }
+            if (tmpDouble < 0)
+            {
+                std::cout << " Math::deBoerL0 CALCULATED = " << tmpDouble << std::endl;
+                std::cout << " mu1 = " << mu1[i] << std::endl;
+                std::cout << " mu2 = " << mu2[i] << std::endl;
+                std::cout << " muj = " << muj << std::endl;
+                std::cout << " d = " << d << std::endl;
+                throw std::runtime_error("Math::deBoerL0. Negative result");
+            }
+            if (!Math::isFiniteNumber(tmpDouble))
+            {
+                std::cout << " Math::deBoerL0 CALCULATED = " << tmpDouble << std::endl;
+                std::cout << " mu1 = " << mu1[i] << std::endl;
+                std::cout << " mu2 = " << mu2[i] << std::endl;
+                std::cout << " muj = " << muj << std::endl;
+                std::cout << " d = " << d << std::endl;
+                throw std::runtime_error("Math::deBoerL0. Non-finite result");
+            }
+            result[i] = tmpDouble;
+        }
     }
-    return tmpDouble;
 }
 
 double Math::deBoerX(const double & p, const double & q, const double & d1, const double & d2, \
@@ -373,11 +501,98 @@ double Math::deBoerX(const double & p, const double & q, const double & d1, cons
      }
      else
      {
-        return Math::deBoerV(p, q, d1, d2, mu1j, mu2j, mubj_dt) - \
-               Math::deBoerV(p, q, d1, 0.0, mu1j, mu2j, mubj_dt) - \
-               Math::deBoerV(p, q, 0.0, d2, mu1j, mu2j, mubj_dt) + \
-               Math::deBoerV(p, q, 0.0, 0.0, mu1j, mu2j, mubj_dt);
+        double result;
+        Math::deBoerX(p, q, d1, d2, &mu1j, &mu2j, &mubj_dt, &result, 1);
+        return result;
+    }
+}
 
+void Math::deBoerX(const double & p, const double & q, const double & d1, const double & d2, \
+                   const double * mu1j, const double * mu2j, const double * mubj_dt, \
+                   double * result, const std::size_t & n)
+{
+    // X(p, q, d1, d2) = V(d1, d2) - V(d1, 0) - V(0, d2) + V(0, 0)
+    // Each of the four V terms needs three de Boer functions. Those of a chunk of
+    // sources are evaluated together.
+    const std::size_t chunkSize = 16;
+    const std::size_t nTerms = 4;
+    const double termD1[nTerms] = {d1, d1, 0.0, 0.0};
+    const double termD2[nTerms] = {d2, 0.0, d2, 0.0};
+    double x[3 * nTerms * chunkSize];
+    double D[3 * nTerms * chunkSize];
+    double V[nTerms];
+    double factor1, factor2, sum;
+    double tmpDouble1;
+    double tmpDouble2;
+    double tmpHelp;
+    std::size_t first, last, i, j, t;
+
+    auto report = [&](const std::size_t & k, const std::size_t & term, const std::string & message)
+    {
+        std::cout << "p    " << p << std::endl;
+        std::cout << "q    " << q << std::endl;
+        std::cout << "d1   " << termD1[term] << std::endl;
+        std::cout << "d2   " << termD2[term] << std::endl;
+        std::cout << "mu1j " << mu1j[k] << std::endl;
+        std::cout << "mu2j " << mu2j[k] << std::endl;
+        std::cout << "mubjdt " << mubj_dt[k] << std::endl;
+        std::cout << " " << message << " " << std::endl;
+        throw std::runtime_error(message);
+    };
+
+    for (first = 0; first < n; first += chunkSize)
+    {
+        last = (first + chunkSize < n) ? first + chunkSize : n;
+        for (i = first; i < last; i++)
+        {
+            j = 3 * nTerms * (i - first);
+            for (t = 0; t < nTerms; t++)
+            {
+                tmpHelp = mu1j[i] * termD1[t] + mubj_dt[i] + mu2j[i] * termD2[t];
+                x[j + 3 * t] = (1.0 + (p / mu2j[i])) * tmpHelp;
+                x[j + 3 * t + 1] = ( 1.0 - (q / mu1j[i])) * tmpHelp;
+                x[j + 3 * t + 2] = tmpHelp;
+            }
+        }
+        Math::deBoerD(x, D, 3 * nTerms * (last - first));
+        for (i = first; i < last; i++)
+        {
+            j = 3 * nTerms * (i - first);
+            sum = p * mu1j[i] + q * mu2j[i];
+            factor1 = mu2j[i] / (p * sum);
+            factor2 = mu1j[i] / (q * sum);
+            for (t = 0; t < nTerms; t++)
+            {
+                if ((mubj_dt[i] == 0) && (termD1[t] == 0) && (termD2[t] == 0))
+                {
+                    // closed form without de Boer functions
+                    V[t] = Math::deBoerV(p, q, 0.0, 0.0, mu1j[i], mu2j[i], 0.0);
+                    continue;
+                }
+                tmpDouble1 = factor1 * D[j + 3 * t];
+                if (!Math::isFiniteNumber(tmpDouble1))
+                {
+                    report(i, t, "error1");
+                }
+                tmpDouble2 = factor2 * D[j + 3 * t + 1];
+                if (!Math::isFiniteNumber(tmpDouble2))
+                {
+                    report(i, t, "error3");
+                }
+                tmpDouble2 -= D[j + 3 * t + 2] / (p * q);
+                if (!Math::isFiniteNumber(tmpDouble2))
+                {
+                    report(i, t, "error4");
+                }
+                V[t] = std::exp((q - mu1j[i]) * termD1[t] - (p + mu2j[i]) * termD2[t] - mubj_dt[i]) * \
+                       (tmpDouble1 + tmpDouble2);
+                if (!Math::isFiniteNumber(V[t]))
+                {
+                    report(i, t, "error5");
+                }
+            }
+            result[i] = V[0] - V[1] - V[2] + V[3];
+        }
     }
 }
 
@@ -491,6 +706,236 @@ double Math::deBoerV(const double & p, const double & q, const double & d1, cons
     return tmpHelp;
 }
 
+double Math::deBoerL0Derivatives(const double & mu1, const double & mu2, const double & muj, \
+                                 const double & density, const double & thickness, \
+                                 double * derivatives)
+{
+    double d;
+    double sum;
+    double result;
+    double logTerm;
+    double e1, e3;
+    double x1, x2, x3;
+    double D1, D2, D3;
+    double dD1, dD2, dD3;
+    double B;
+
+    if ((mu1 <= 0.0) || (mu2 <= 0.0) || (muj <= 0.0))
+    {
+        std::cout << "mu1 = " << mu1 << std::endl;
+        std::cout << "mu2 = " << mu2 << std::endl;
+        std::cout << "muj = " << muj << std::endl;
+        throw std::runtime_error("Math::deBoerL0Derivatives received negative input");
+    }
+    derivatives[0] = 0.0;
+    derivatives[1] = 0.0;
+    derivatives[2] = 0.0;
+    derivatives[3] = 0.0;
+
+    // same branches as deBoerL0
+    d = thickness * density;
+    sum = mu1 + mu2;
+    if ((sum * d) < 0.01)
+    {
+        // very thin target, neglect enhancement
+        return 0.0;
+    }
+
+    // the thick target result is also one of the terms of the general expression
+    logTerm = std::log(1.0 + (mu1/muj));
+    derivatives[0] = 1.0 / ((muj + mu1) * mu1 * sum) - \
+                     (logTerm / (mu1 * sum)) * (2.0 * mu1 + mu2) / (mu1 * sum);
+    derivatives[1] = - (logTerm / (mu1 * sum)) / sum;
+    derivatives[2] = - 1.0 / (muj * (muj + mu1) * sum);
+    if ((sum * d) > 10.)
+    {
+        // thick target
+        return (muj/mu1) * logTerm / (sum * muj);
+    }
+
+    x1 = (muj - mu2) * d;
+    x2 = muj * d;
+    x3 = (muj + mu1) * d;
+    D1 = Math::deBoerD(x1);
+    D2 = Math::deBoerD(x2);
+    D3 = Math::deBoerD(x3);
+    dD1 = Math::deBoerDDerivative(x1, D1);
+    dD2 = Math::deBoerDDerivative(x2, D2);
+    dD3 = Math::deBoerDDerivative(x3, D3);
+    B = D1 / (mu2 * sum);
+    B = B - (D2 / (mu1 * mu2)) + (D3 / (mu1 * sum));
+    e1 = std::exp(-(mu1 + muj) * d);
+    result = B * e1;
+    derivatives[0] += e1 * (- D1 / (mu2 * sum * sum) + D2 / (mu1 * mu1 * mu2) + \
+                            dD3 * d / (mu1 * sum) - D3 * (2.0 * mu1 + mu2) / (mu1 * mu1 * sum * sum) - \
+                            d * B);
+    derivatives[1] += e1 * (- dD1 * d / (mu2 * sum) - D1 * (mu1 + 2.0 * mu2) / (mu2 * mu2 * sum * sum) + \
+                            D2 / (mu1 * mu2 * mu2) - D3 / (mu1 * sum * sum));
+    derivatives[2] += e1 * (d * (dD1 / (mu2 * sum) - dD2 / (mu1 * mu2) + dD3 / (mu1 * sum)) - d * B);
+    derivatives[3] += e1 * (dD1 * (muj - mu2) / (mu2 * sum) - dD2 * muj / (mu1 * mu2) + \
+                            dD3 * (muj + mu1) / (mu1 * sum) - (mu1 + muj) * B);
+
+    result += logTerm / (mu1 * sum);
+
+    e3 = std::exp(-sum * d);
+    if (mu2 < muj)
+    {
+        logTerm = std::log(1.0 - (mu2 / muj));
+    }
+    else
+    {
+        logTerm = std::log((mu2 / muj) - 1.0);
+    }
+    result += (e3 / (mu2 * sum)) * logTerm;
+    logTerm = (e3 / (mu2 * sum)) * logTerm;
+    derivatives[0] += logTerm * (- d - 1.0 / sum);
+    derivatives[1] += logTerm * (- d - (mu1 + 2.0 * mu2) / (mu2 * sum)) - \
+                      e3 / ((muj - mu2) * mu2 * sum);
+    derivatives[2] += e3 / (muj * (muj - mu2) * sum);
+    derivatives[3] += - sum * logTerm;
+    if (!Math::isFiniteNumber(result))
+    {
+        std::cout << " Math::deBoerL0Derivatives CALCULATED = " << result << std::endl;
+        std::cout << " mu1 = " << mu1 << std::endl;
+        std::cout << " mu2 = " << mu2 << std::endl;
+        std::cout << " muj = " << muj << std::endl;
+        std::cout << " d = " << d << std::endl;
+        throw std::runtime_error("Math::deBoerL0Derivatives. Non-finite result");
+    }
+    return result;
+}
+
+double Math::deBoerXDerivatives(const double & p, const double & q, const double & d1, const double & d2, \
+                                const double & mu1j, const double & mu2j, const double & mubj_dt, \
+                                double * derivatives)
+{
+    // X(p, q, d1, d2) = V(d1, d2) - V(d1, 0) - V(0, d2) + V(0, 0)
+    double result;
+    double tmpDerivatives[4][7];
+    int i;
+
+    result = Math::deBoerVDerivatives(p, q, d1, d2, mu1j, mu2j, mubj_dt, tmpDerivatives[0]) - \
+             Math::deBoerVDerivatives(p, q, d1, 0.0, mu1j, mu2j, mubj_dt, tmpDerivatives[1]) - \
+             Math::deBoerVDerivatives(p, q, 0.0, d2, mu1j, mu2j, mubj_dt, tmpDerivatives[2]) + \
+             Math::deBoerVDerivatives(p, q, 0.0, 0.0, mu1j, mu2j, mubj_dt, tmpDerivatives[3]);
+    for (i = 0; i < 7; i++)
+    {
+        derivatives[i] = tmpDerivatives[0][i] - tmpDerivatives[1][i] - \
+                         tmpDerivatives[2][i] + tmpDerivatives[3][i];
+    }
+    // the thicknesses set to zero are not variables
+    derivatives[2] = tmpDerivatives[0][2] - tmpDerivatives[1][2];
+    derivatives[3] = tmpDerivatives[0][3] - tmpDerivatives[2][3];
+    return result;
+}
+
+double Math::deBoerVDerivatives(const double & p, const double & q, const double & d1, const double & d2, \
+                                const double & mu1j, const double & mu2j, const double & mubjdt, \
+                                double * derivatives)
+{
+    // derivatives of the arguments p, q, d1, d2, mu1j, mu2j and mubjdt with respect to each of them
+    static const double dp[7] = {1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    static const double dq[7] = {0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    static const double dmu1[7] = {0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0};
+    static const double dmu2[7] = {0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0};
+    double dK[7];
+    double ds[7];
+    double dE[7];
+    double K;
+    double s, u1, u2;
+    double Du1, Du2, Ds;
+    double dDu1, dDu2, dDs;
+    double f1, f2, f3;
+    double t1, t2;
+    double tmpDouble1;
+    double tmpDouble2;
+    double tmpHelp;
+    double du1, du2, df1, df2, df3;
+    int i;
+
+    K = p * mu1j + q * mu2j;
+    if ((mubjdt == 0) && (d1 == 0) && (d2 == 0))
+    {
+        // V(0, 0) with db = 0;
+        double N;
+        tmpDouble1 = 1.0 - (q / mu1j);
+        tmpDouble2 = 1.0 + (p / mu2j);
+        if (tmpDouble1 < 0)
+            tmpDouble1 = - tmpDouble1;
+        if (tmpDouble2 < 0)
+            tmpDouble2 = - tmpDouble2;
+        tmpDouble1 = std::log(tmpDouble1);
+        tmpDouble2 = std::log(tmpDouble2);
+        N = (mu2j / p) * tmpDouble2 + (mu1j/q) * tmpDouble1;
+        tmpHelp = -N / (p * mu1j + q * mu2j);
+        if (!Math::isFiniteNumber(tmpHelp))
+        {
+            std::cout << "p    " << p << std::endl;
+            std::cout << "q    " << q << std::endl;
+            std::cout << "mu1j " << mu1j << std::endl;
+            std::cout << "mu2j " << mu2j << std::endl;
+            throw std::runtime_error("Math::deBoerVDerivatives. Error on V(0,0) with no intermediate layer");
+        }
+        // V = -N / K, dV = -(dN + V * dK) / K
+        derivatives[0] = -((-mu2j * tmpDouble2 / (p * p) + mu2j / (p * (mu2j + p))) + tmpHelp * mu1j) / K;
+        derivatives[1] = -((-mu1j * tmpDouble1 / (q * q) - mu1j / (q * (mu1j - q))) + tmpHelp * mu2j) / K;
+        derivatives[2] = 0.0;
+        derivatives[3] = 0.0;
+        derivatives[4] = -((tmpDouble1 / q + 1.0 / (mu1j - q)) + tmpHelp * p) / K;
+        derivatives[5] = -((tmpDouble2 / p - 1.0 / (mu2j + p)) + tmpHelp * q) / K;
+        // limit of the general expression when mubjdt tends to zero, the logarithmic
+        // terms of the three de Boer functions cancelling each other
+        derivatives[6] = -((mu2j + p) * tmpDouble2 / p + (mu1j - q) * tmpDouble1 / q) / K - tmpHelp;
+        return tmpHelp;
+    }
+
+    // same expression as deBoerV
+    s = mu1j * d1 + mubjdt + mu2j * d2;
+    u1 = (1.0 + (p / mu2j)) * s;
+    u2 = (1.0 - (q / mu1j)) * s;
+    Du1 = Math::deBoerD(u1);
+    Du2 = Math::deBoerD(u2);
+    Ds = Math::deBoerD(s);
+    dDu1 = Math::deBoerDDerivative(u1, Du1);
+    dDu2 = Math::deBoerDDerivative(u2, Du2);
+    dDs = Math::deBoerDDerivative(s, Ds);
+    f1 = mu2j / (p * K);
+    f2 = mu1j / (q * K);
+    f3 = 1.0 / (p * q);
+    t1 = f1 * Du1;
+    t2 = f2 * Du2;
+    t2 -= Ds / (p * q);
+    tmpHelp = std::exp((q - mu1j) * d1 - (p + mu2j) * d2 - mubjdt);
+    if (!Math::isFiniteNumber(tmpHelp * (t1 + t2)))
+    {
+        std::cout << "p    " << p << std::endl;
+        std::cout << "q    " << q << std::endl;
+        std::cout << "d1   " << d1 << std::endl;
+        std::cout << "d2   " << d2 << std::endl;
+        std::cout << "mu1j " << mu1j << std::endl;
+        std::cout << "mu2j " << mu2j << std::endl;
+        std::cout << "mubjdt " << mubjdt << std::endl;
+        throw std::runtime_error("Math::deBoerVDerivatives. Non-finite result");
+    }
+
+    dK[0] = mu1j; dK[1] = mu2j; dK[2] = 0.0; dK[3] = 0.0; dK[4] = p; dK[5] = q; dK[6] = 0.0;
+    ds[0] = 0.0; ds[1] = 0.0; ds[2] = mu1j; ds[3] = mu2j; ds[4] = d1; ds[5] = d2; ds[6] = 1.0;
+    dE[0] = -d2; dE[1] = d1; dE[2] = q - mu1j; dE[3] = -(p + mu2j); dE[4] = -d1; dE[5] = -d2; dE[6] = -1.0;
+    for (i = 0; i < 7; i++)
+    {
+        du1 = (1.0 + (p / mu2j)) * ds[i] + s * (dp[i] / mu2j - dmu2[i] * p / (mu2j * mu2j));
+        du2 = (1.0 - (q / mu1j)) * ds[i] - s * (dq[i] / mu1j - dmu1[i] * q / (mu1j * mu1j));
+        df1 = f1 * (dmu2[i] / mu2j - dp[i] / p - dK[i] / K);
+        df2 = f2 * (dmu1[i] / mu1j - dq[i] / q - dK[i] / K);
+        df3 = - f3 * (dp[i] / p + dq[i] / q);
+        derivatives[i] = tmpHelp * (dE[i] * (t1 + t2) + \
+                                    df1 * Du1 + f1 * dDu1 * du1 + \
+                                    df2 * Du2 + f2 * dDu2 * du2 - \
+                                    df3 * Ds - f3 * dDs * ds[i]);
+    }
+    return tmpHelp * (t1 + t2);
+}
+
 bool Math::isNumber(const double & x)
 {
     return (x == x);
@@ -501,6 +946,70 @@ bool Math::isFiniteNumber(const double & x)
     return (x <= DBL_MAX && x >= -DBL_MAX);
 }
 
+double Math::deBoerDDerivative(const double & x, const double & D)
+{
+    // same coefficients as AS_5_1_53
+    static const double coefficients[6] = {-0.57721566, 0.99999193, -0.24991055,\
+                                            0.05519968, -0.00976004, 0.00107857};
+    double factorial[11] = {1.0, 1.0, 2.0, 6.0, 24., 120.0, 720., 5040., 40320., 362880., 3628800.};
+    double result;
+
+    if (x > 1)
+    {
+        // differentiate the continued fraction of _deBoerD along its iterations, the number of
+        // them being the same as when evaluating it
+        double f, C, E, a, b, delta;
+        double df, dC, dE, dDelta;
+        b = 1 + x;
+        f = b;
+        C = f;
+        E = 0.0;
+        df = 1.0;
+        dC = 1.0;
+        dE = 0.0;
+        for (int i = 1; i < 100; i++)
+        {
+            b = b + 2;
+            a = - i * i;
+            dC = 1.0 - a * dC / (C * C);
+            C = b + a / C;
+            dE = 1.0 + a * dE;
+            E = b + a * E;
+            dE = - dE / (E * E);
+            E = 1.0 / E;
+            delta = C * E;
+            dDelta = dC * E + C * dE;
+            df = df * delta + f * dDelta;
+            f *= delta;
+            if (std::abs(delta - 1) < 1.0e-7)
+            {
+                return - df / (f * f);
+            }
+        }
+        return D - 1.0 / x;
+    }
+    if (x < 0)
+    {
+        // derivative of the ten terms series of E1
+        result = 0.0;
+        for(int n = 10; n > 0; --n)
+        {
+            result += pow(-x, n - 1) / factorial[n];
+        }
+    }
+    else
+    {
+        // derivative of the polynomial
+        result = 5 * coefficients[5] * x;
+        for (int i = 4; i > 1; --i)
+        {
+            result = (result + i * coefficients[i]) * x;
+        }
+        result = result + coefficients[1];
+    }
+    return D + std::exp(x) * (result - 1.0 / x);
+}
+
 double Math::_deBoerD(const double &x, const double & epsilon, const int & maxIter)
 {
     // Evaluate exp(x) * E1(x) for x > 1
@@ -27,6 +27,7 @@
 #############################################################################*/
 #ifndef FISX_DEBOER_H
 #define FISX_DEBOER_H
+#include <cstddef>
 
 namespace fisx
 {
@@ -80,6 +81,15 @@ class Math
         */
         static double deBoerD(const double & x);
 
+        /*!
+        Calculates exp(x) * E1(x) for the n values of the array x.
+
+        The values requiring the continued fraction are evaluated together, their
+        iterations being run in lockstep. The results are those of the single
+        value version.
+        */
+        static void deBoerD(const double * x, double * result, const std::size_t & n);
+
 
         /*!
         Calculates the integral part of expression 6 of the article
@@ -92,6 +102,14 @@ class Math
         static double deBoerL0(const double & mu1, const double & mu2, const double & muj, \
                                const double & density, const double & thickness);
 
+        /*!
+        Calculates deBoerL0 for the n pairs (mu1[i], mu2[i]) of a layer sharing the same muj.
+        The de Boer functions needed by all of them are evaluated in a single call.
+        */
+        static void deBoerL0(const double * mu1, const double * mu2, const double & muj, \
+                             const double & density, const double & thickness, \
+                             double * result, const std::size_t & n);
+
 
         /*!
         For multilayers
@@ -107,11 +125,53 @@ class Math
                               const double & mu_1_j, const double & mu_2_j, \
                               const double & mu_b_j_d_t = 0.0);
 
+        /*!
+        Calculates deBoerX for the n sources (mu_1_j[i], mu_2_j[i], mu_b_j_d_t[i]) of the same
+        pair of layers and the same p and q.
+        The four V terms of each source are evaluated together, sharing their common factors,
+        and the de Boer functions they need are evaluated in a single call.
+        */
+        static void deBoerX(const double & p, const double & q, \
+                            const double & d1, const double & d2, \
+                            const double * mu_1_j, const double * mu_2_j, \
+                            const double * mu_b_j_d_t, double * result, const std::size_t & n);
+
         static double deBoerV(const double & p, const double & q, \
                               const double & d1, const double & d2, \
                               const double & mu_1_j, const double & mu_2_j, \
                               const double & mu_b_j_d_t);
 
+        /*!
+        Same as deBoerL0 but also filling the partial derivatives of the result with respect
+        to mu1, mu2, muj and the product density * thickness (four values).
+        The derivatives are analytic, those of deBoerD being consistent with its implementation.
+        */
+        static double deBoerL0Derivatives(const double & mu1, const double & mu2, const double & muj, \
+                                          const double & density, const double & thickness, \
+                                          double * derivatives);
+
+        /*!
+        Same as deBoerX but also filling the partial derivatives of the result with respect to
+        p, q, d1, d2, mu_1_j, mu_2_j and mu_b_j_d_t (seven values, following the order of the
+        arguments). If mu_b_j_d_t is zero, the derivative with respect to it is the limit for
+        mu_b_j_d_t tending to zero from above, intermediate layers being only able to add
+        attenuation.
+        */
+        static double deBoerXDerivatives(const double & p, const double & q, \
+                                         const double & d1, const double & d2, \
+                                         const double & mu_1_j, const double & mu_2_j, \
+                                         const double & mu_b_j_d_t, \
+                                         double * derivatives);
+
+        /*!
+        Same as deBoerV but also filling the seven partial derivatives as deBoerXDerivatives
+        */
+        static double deBoerVDerivatives(const double & p, const double & q, \
+                                         const double & d1, const double & d2, \
+                                         const double & mu_1_j, const double & mu_2_j, \
+                                         const double & mu_b_j_d_t, \
+                                         double * derivatives);
+
         /*!
         Returns false is x is NaN
         */
@@ -176,6 +236,15 @@ class Math
         static double _deBoerD(const double &x, \
                         const double & epsilon = 1.0e-7, \
                         const int & maxIter = 100);
+
+        /*!
+        Derivative of deBoerD at x given D = deBoerD(x).
+
+        It differentiates the continued fraction (x > 1), the polynomial (0 < x <= 1) or the
+        truncated series (x < 0) used by deBoerD instead of making use of
+        d(exp(x) * E1(x))/dx = exp(x) * E1(x) - 1/x, that identity not being fulfilled by them.
+        */
+        static double deBoerDDerivative(const double & x, const double & D);
 };
 
 } // namespace fisx
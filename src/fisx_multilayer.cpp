@@ -29,7 +29,7 @@
 #include "fisx_math.h"
 #include <cmath>
 #include <stdexcept>
-//#include <iostream>
+#include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
@@ -48,1168 +48,1124 @@ std::map<std::string, std::map<int, std::map<std::string, std::map<std::string,
                                                const double & secondaryCalculationLimit, \
                                                const Beam & overwritingBeam) const
 {
-    // get all the needed configuration
-    std::vector<std::vector<double> >actualRays = overwritingBeam.getBeamAsDoubleVectors();
-    if (actualRays[0].size() < 1)
-        actualRays = this->configuration.getBeam().getBeamAsDoubleVectors();
-    std::vector<double>::size_type iRay;
-    const std::vector<Layer> & filters = this->configuration.getBeamFilters();
-    const std::vector<TransmissionTable> & userFilters = this->configuration.getUserBeamFilters();
-    const std::vector<Layer> & sample = this->configuration.getSample();
-    const std::vector<Layer> & attenuators = this->configuration.getAttenuators();
-    const std::vector<TransmissionTable> & userAttenuators = this->configuration.getUserAttenuators();
-    const Layer* layerPtr;
-    std::vector<Layer>::size_type iLayer;
-    std::vector<Layer>::size_type jLayer;
-    std::vector<Layer>::size_type bLayer;
-    std::vector<TransmissionTable>::size_type iTransmissionTable;
-    Detector detector = this->configuration.getDetector();
-    std::string msg;
-    const double PI = acos(-1.0);
-    const double & alphaIn = this->configuration.getAlphaIn();
-    const double & alphaOut = this->configuration.getAlphaOut();
-    std::vector<double> geometricEfficiency;
-    double sinAlphaIn = sin(alphaIn*(PI/180.));
-    double sinAlphaOut = sin(alphaOut*(PI/180.));
-    double tmpDouble;
-    const std::vector<double> & energies = actualRays[0];
-    std::vector<double> weights;
-    std::vector<double> doubleVector;
-    std::map<std::string, std::map<std::string, double> > result;
-    std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > actualResult;
-    std::vector<std::map<std::string, double> > sampleLayerCompositionList;
-    std::vector<double> energyThresholdList;
+    // this->printConfiguration();
+    return this->getMultilayerPlan(elementList, elementsLibrary, layerList, familyList, \
+                                   secondary, useGeometricEfficiency, useMassFractions, \
+                                   secondaryCalculationLimit, overwritingBeam).getMultilayerFluorescence();
+}
+
+MultilayerPlan XRF::getMultilayerPlan(const std::vector<std::string> & elementList,
+                                      const Elements & elementsLibrary, \
+                                      const std::vector<int> & layerList, \
+                                      const std::vector<std::string> &  familyList, \
+                                      const int & secondary, \
+                                      const int & useGeometricEfficiency,
+                                      const int & useMassFractions, \
+                                      const double & secondaryCalculationLimit, \
+                                      const Beam & overwritingBeam) const
+{
+    MultilayerPlan plan;
+    this->setMultilayerPlanSettings(plan);
+    plan.build(this->configuration, elementsLibrary, elementList, layerList, familyList, \
+               secondary, useGeometricEfficiency, useMassFractions, \
+               secondaryCalculationLimit, overwritingBeam);
+    return plan;
+}
 
-    energyThresholdList.clear();
-    // beam is ordered
-    // maxEnergy = energies[energies.size() - 1];
+void XRF::setMultilayerPlanSettings(MultilayerPlan & plan) const
+{
+    // the element families are prepared in parallel too
+    plan.setNumberOfThreads(this->nThreads);
+    plan.setOutputLevel(this->outputLevel);
+    plan.setSecondaryTolerance(this->secondaryTolerance);
+    plan.setBeamCompressionTolerance(this->beamCompressionTolerance);
+    plan.setMassFractionDerivatives(this->massFractionDerivatives);
+    plan.setMassThicknessDerivatives(this->massThicknessDerivatives);
+}
 
-    // use a cache for the sample layers composition
-    for (iLayer = 0; iLayer < sample.size(); iLayer++)
+std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > \
+                MultilayerPlan::getMultilayerFluorescence() const
+{
+    MultilayerResult result;
+    this->getMultilayerFluorescence(result);
+    return result.getAsMap();
+}
+
+std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                MultilayerPlan::getMultilayerFluorescence( \
+                                const std::vector<std::map<std::string, double> > & compositions, \
+                                const int & layerIndex, \
+                                const Elements & elementsLibrary) const
+{
+    std::vector<MultilayerResult> results;
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                output;
+    std::vector<MultilayerResult>::size_type i;
+
+    this->getMultilayerFluorescence(compositions, layerIndex, elementsLibrary, results);
+    output.resize(results.size());
+    for (i = 0; i < results.size(); i++)
     {
-        sampleLayerCompositionList.push_back(this->getLayerComposition(sample[iLayer], elementsLibrary));
+        output[i] = results[i].getAsMap();
     }
+    return output;
+}
 
+void MultilayerPlan::getMultilayerFluorescence(const std::vector<std::map<std::string, double> > & compositions, \
+                                               const int & layerIndex, \
+                                               const Elements & elementsLibrary, \
+                                               std::vector<MultilayerResult> & results) const
+{
+    std::vector<std::map<std::string, double> >::size_type nCompositions = compositions.size();
+    std::vector<std::map<std::string, double> >::size_type i;
+    std::vector<double>::size_type nTasks;
+    std::vector<MultilayerPlan> plans;
 
-    // get the beam after the beam filters
-    std::vector<double> muTotal;
-    muTotal.resize(energies.size());
-    doubleVector.resize(energies.size());
-    std::fill(muTotal.begin(), muTotal.end(), 0.0);
-    for (iLayer = 0; iLayer < filters.size(); iLayer++)
+    for (i = 0; i < nCompositions; i++)
     {
-        doubleVector = this->getLayerTransmission(filters[iLayer], energies, elementsLibrary);
-        for (iRay = 0; iRay < energies.size(); iRay++)
-        {
-            actualRays[1][iRay] *= doubleVector[iRay];
-        }
+        this->checkLayerComposition(layerIndex, compositions[i], elementsLibrary);
     }
-    // account for user beam filters
-    for (iTransmissionTable = 0; iTransmissionTable < userFilters.size(); iTransmissionTable++)
+
+    // every thread works on its own copy of the plan, only the sample dependent terms are updated.
+    // The element data needed by the first composition are already kept by the plan
+    results.resize(nCompositions);
+    nTasks = (this->nThreads > 1) ? (std::vector<double>::size_type) this->nThreads : 1;
+    if (nTasks > nCompositions)
     {
-        doubleVector = userFilters[iTransmissionTable].getTransmission(energies);
-        for (iRay = 0; iRay < energies.size(); iRay++)
+        nTasks = nCompositions;
+    }
+    plans.resize(nTasks, *this);
+    MultilayerPlan::runTasks(nTasks, this->nThreads, [&](const std::vector<double>::size_type & iTask)
+    {
+        MultilayerPlan & plan = plans[iTask];
+        std::vector<std::map<std::string, double> >::size_type j;
+        plan.nThreads = 1;
+        for (j = iTask; j < nCompositions; j += nTasks)
         {
-            actualRays[1][iRay] *= doubleVector[iRay];
+            plan.layerComposition[layerIndex] = compositions[j];
+            plan.buildSampleTerms(elementsLibrary);
+            plan.getMultilayerFluorescence(results[j]);
         }
+    });
+}
+
+std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                MultilayerPlan::getMultilayerFluorescenceGeometries(const std::vector<double> & alphaIn, \
+                                                                    const std::vector<double> & alphaOut) const
+{
+    std::vector<MultilayerResult> results;
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                output;
+    std::vector<MultilayerResult>::size_type i;
+
+    this->getMultilayerFluorescenceGeometries(alphaIn, alphaOut, results);
+    output.resize(results.size());
+    for (i = 0; i < results.size(); i++)
+    {
+        output[i] = results[i].getAsMap();
     }
+    return output;
+}
 
+void MultilayerPlan::getMultilayerFluorescenceGeometries(const std::vector<double> & alphaIn, \
+                                                         const std::vector<double> & alphaOut, \
+                                                         std::vector<MultilayerResult> & results) const
+{
+    std::vector<double>::size_type nGeometries = alphaIn.size();
+    std::vector<double>::size_type nTasks;
+    std::vector<MultilayerPlan> plans;
 
-    // we can already calculate the geometric efficiency
-    geometricEfficiency.resize(sample.size());
-    if (useGeometricEfficiency != 0)
+    if (alphaOut.size() != nGeometries)
     {
-        for (iLayer = 0; iLayer < sample.size(); iLayer++)
-        {
-            geometricEfficiency[iLayer] = this->getGeometricEfficiency(iLayer);
-        }
+        std::cout << "Number of incident angles " << nGeometries << std::endl;
+        std::cout << "Number of exit angles " << alphaOut.size() << std::endl;
+        throw std::invalid_argument("Number of incident and exit angles do not match");
     }
-    else
+
+    // every thread works on its own copy of the plan, only the terms depending on the angles are updated.
+    // The attenuation coefficients needed by the detection efficiencies are already kept by the plan
+    results.resize(nGeometries);
+    nTasks = (this->nThreads > 1) ? (std::vector<double>::size_type) this->nThreads : 1;
+    if (nTasks > nGeometries)
     {
-        for (iLayer = 0; iLayer < sample.size(); iLayer++)
+        nTasks = nGeometries;
+    }
+    plans.resize(nTasks, *this);
+    MultilayerPlan::runTasks(nTasks, this->nThreads, [&](const std::vector<double>::size_type & iTask)
+    {
+        MultilayerPlan & plan = plans[iTask];
+        std::vector<double>::size_type j;
+        plan.nThreads = 1;
+        for (j = iTask; j < nGeometries; j += nTasks)
         {
-            geometricEfficiency[iLayer] = 1.0;
+            plan.setGeometry(alphaIn[j], alphaOut[j]);
+            plan.getMultilayerFluorescence(results[j]);
         }
-    }
+    });
+}
 
-    std::vector<std::vector<double> >sampleLayerEnergies;
-    std::vector<std::vector<std::string> > sampleLayerEnergyNames;
-    std::vector<std::vector<double> >sampleLayerRates;
-    std::vector<std::vector<double> >sampleLayerMuTotal;
-    std::map<std::string, double> sampleLayerComposition;
-    std::vector<double> muTotalCacheEnergies;
-    std::vector<std::vector<double> > muTotalCacheLayer;
-    std::vector<double>::size_type iLambda;
-    std::vector<std::string> sampleLayerFamilies;
-    std::vector<std::vector<std::pair<std::string, double> > >sampleLayerPeakFamilies;
-    std::vector<std::pair<std::string, double> >::size_type iPeakFamily;
-    std::vector<double> sampleLayerDensity;
-    std::vector<double> sampleLayerThickness;
-    std::vector<double> sampleLayerWeight;
-    std::map< std::string, std::map<std::string, double> > escapeRates;
+bool MultilayerPlan::keepsResultLayout(const MultilayerResult & result) const
+{
+    return result.hasLayout(this->familyKey, this->layerDensity.size(), this->resultLineNames, \
+                            this->resultLineParents, this->contributorNames, this->secondary, \
+                            this->outputLevel, this->parameterNames);
+}
 
+void MultilayerPlan::getMultilayerFluorescence(MultilayerResult & result) const
+{
+    this->evaluateRays(result, 0, this->rayEnergy.size(), this->nThreads);
+}
 
-    // * implement a cache
-    std::map< std::string, std::map< double, std::map<std::string, std::map<std::string, double> > > > \
-                                        excitationFactorsCache;
+std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                MultilayerPlan::getMultilayerFluorescenceScan() const
+{
+    std::vector<MultilayerResult> results;
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                output;
+    std::vector<MultilayerResult>::size_type i;
 
-    int updateEscape;
-    updateEscape = 1;
+    this->getMultilayerFluorescenceScan(results);
+    output.resize(results.size());
+    for (i = 0; i < results.size(); i++)
+    {
+        output[i] = results[i].getAsMap();
+    }
+    return output;
+}
 
-    sampleLayerEnergies.resize(sample.size());
-    sampleLayerEnergyNames.resize(sample.size());
-    sampleLayerRates.resize(sample.size());
-    sampleLayerFamilies.resize(sample.size());
-    sampleLayerPeakFamilies.resize(sample.size());
-    sampleLayerMuTotal.resize(sample.size());
-    sampleLayerDensity.resize(sample.size());
-    sampleLayerThickness.resize(sample.size());
-    sampleLayerWeight.resize(sample.size());
-    muTotalCacheEnergies.resize(0);
-    muTotalCacheLayer.resize(0);
-    escapeRates.clear();
+void MultilayerPlan::getMultilayerFluorescenceScan(std::vector<MultilayerResult> & results) const
+{
+    std::vector<double>::size_type nPoints = this->scanEnergy.size();
+    std::vector<double>::size_type nRays = this->rayEnergy.size();
 
-    iRay = energies.size();
-    muTotal.resize(sample.size());
-    weights.resize(actualRays[1].size());
-    double minimumExcitationEnergy = -1.0;
-    while (iRay > 0)
+    // every point evaluates its own ray in a single thread, the points are distributed among the threads.
+    // The points not exciting any family keep the quantities not depending on the incident beam
+    results.resize(nPoints);
+    MultilayerPlan::runTasks(nPoints, this->nThreads, [&](const std::vector<double>::size_type & iPoint)
     {
-        muTotalCacheLayer.resize(0);
-        muTotalCacheEnergies.resize(0);
-        if (minimumExcitationEnergy < 0.0)
+        const std::vector<double>::size_type & iRay = this->scanRay[iPoint];
+        this->evaluateRays(results[iPoint], iRay, (iRay < nRays) ? iRay + 1 : iRay, 1);
+    });
+}
+
+void MultilayerPlan::evaluateRays(MultilayerResult & result, \
+                                  const std::vector<double>::size_type & firstRay, \
+                                  const std::vector<double>::size_type & lastRay, \
+                                  const int & nThreads) const
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nRays = lastRay - firstRay;
+    std::vector<double>::size_type nCalculations = this->calculationFamily.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type iCalculation;
+    std::vector<double>::size_type iCalculationLine;
+    std::vector<double>::size_type iLine;
+    std::vector<double>::size_type iEscape;
+    std::vector<std::string>::size_type iFamily;
+    std::vector<double>::size_type index;
+    std::vector<double>::size_type escapeIndex;
+    std::vector<double>::size_type lineOffset;
+    std::vector<double>::size_type nBlocks;
+    std::vector<double>::size_type iBlock;
+    std::vector<double>::size_type i;
+    const int nQuantities = MultilayerResult::N_QUANTITIES;
+    double *values;
+    double *contributions;
+    double *derivatives;
+    char *lineMask;
+    char *contributorMask;
+
+    result.initialize(this->familyKey, nLayers, this->resultLineNames, this->resultLineParents, \
+                      this->contributorNames, this->secondary, this->outputLevel, \
+                      this->secondaryTolerance, this->parameterNames);
+    values = result.getValues();
+    contributions = result.getContributions();
+    derivatives = result.getDerivatives();
+    lineMask = result.getLineMask();
+    contributorMask = result.getContributorMask();
+
+    // quantities not depending on the incident beam
+    for (iCalculation = 0; iCalculation < nCalculations; iCalculation++)
+    {
+        iFamily = this->calculationFamily[iCalculation];
+        iLayer = this->calculationLayer[iCalculation];
+        lineOffset = this->familyLineOffset[iFamily];
+        for (iLine = lineOffset; iLine < this->familyLineOffset[iFamily + 1]; iLine++)
         {
-            for (std::vector<std::string>::size_type iElement = 0; iElement < energyThresholdList.size(); iElement++)
+            iCalculationLine = this->calculationLineOffset[iCalculation] + iLine - lineOffset;
+            index = this->calculationLineResultIndex[iCalculationLine];
+            lineMask[index] = 1;
+            values[index * nQuantities + MultilayerResult::EFFICIENCY] = \
+                                this->calculationLineEfficiency[iCalculationLine];
+            values[index * nQuantities + MultilayerResult::ENERGY] = this->lineEnergy[iLine];
+            values[index * nQuantities + MultilayerResult::ENERGY_THRESHOLD] = \
+                                this->familyEnergyThreshold[iFamily];
+            values[index * nQuantities + MultilayerResult::MU_1_I] = \
+                                this->calculationLineMuTotal[iCalculationLine];
+            values[index * nQuantities + MultilayerResult::MASS_FRACTION] = \
+                                this->calculationMassFraction[iCalculation];
+            for (iEscape = this->lineEscapeOffset[iLine]; iEscape < this->lineEscapeOffset[iLine + 1]; iEscape++)
             {
-                if ((energyThresholdList[iElement] < minimumExcitationEnergy) ||
-                    (minimumExcitationEnergy < 0.0))
-                {
-                    minimumExcitationEnergy = energyThresholdList[iElement];
-                }
+                escapeIndex = result.getLineIndex(iFamily, iLayer, this->escapeResultIndex[iEscape]);
+                lineMask[escapeIndex] = 1;
+                values[escapeIndex * nQuantities + MultilayerResult::ENERGY] = this->escapeEnergy[iEscape];
+                values[escapeIndex * nQuantities + MultilayerResult::RATIO] = this->escapeRatio[iEscape];
             }
         }
-        --iRay;
-        if (energies[iRay] < minimumExcitationEnergy)
+    }
+
+    // The rays are split in blocks only depending on the number of rays. Each block is accumulated
+    // in its own buffers and the buffers are added to the result in block order, therefore the
+    // result does not depend on the number of threads.
+    std::vector<double>::size_type nValues = result.getElementFamilies().size() * nLayers * \
+                                             this->resultLineNames.size();
+    // no contributions are calculated if the result does not keep them
+    std::vector<double>::size_type nContributions = (contributions != NULL) ? \
+                                                    nValues * this->contributorNames.size() : 0;
+    std::vector<double>::size_type nParameters = this->parameterNames.size();
+    std::vector<double>::size_type nDerivatives = (derivatives != NULL) ? nValues * nParameters : 0;
+    std::vector<std::vector<double> > blockValues;
+    std::vector<std::vector<double> > blockContributions;
+    std::vector<std::vector<double> > blockDerivatives;
+    std::vector<std::vector<char> > blockContributorMask;
+    std::vector<std::vector<double>::size_type> blockFirstRay;
+    nBlocks = nRays;
+    if (nBlocks > maximumNumberOfRayBlocks)
+    {
+        nBlocks = maximumNumberOfRayBlocks;
+    }
+    if (nValues == 0)
+    {
+        // nothing to be calculated
+        nBlocks = 0;
+    }
+    for (iBlock = 0; (iBlock <= nBlocks) && (nBlocks > 0); iBlock++)
+    {
+        blockFirstRay.push_back(firstRay + (iBlock * nRays) / nBlocks);
+    }
+    // the calculations of each element family are consecutive
+    std::vector<std::vector<double>::size_type> familyCalculationOffset;
+    familyCalculationOffset.resize(this->familyKey.size() + 1, 0);
+    for (iCalculation = 0; iCalculation < nCalculations; iCalculation++)
+    {
+        familyCalculationOffset[this->calculationFamily[iCalculation] + 1] = iCalculation + 1;
+    }
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        if (familyCalculationOffset[iFamily + 1] < familyCalculationOffset[iFamily])
         {
-            // std::cout << "Stopped at Ray " << iRay << std::endl;
-            continue;
+            familyCalculationOffset[iFamily + 1] = familyCalculationOffset[iFamily];
         }
-        weights[iRay] = actualRays[1][iRay];
-        tmpDouble = 0.0;
-        for(iLayer = 0; iLayer < sample.size(); iLayer++)
+    }
+    // a single block, as with a monochromatic beam, is accumulated directly into the result
+    // without intermediate buffers. The element families write into different parts of it.
+    bool direct = (nBlocks == 1);
+    if (direct)
+    {
+        std::vector<std::string>::size_type nTasks = (nThreads > 1) ? this->familyKey.size() : 1;
+        MultilayerPlan::runTasks(nTasks, nThreads, [&](const std::vector<double>::size_type & iTask)
         {
-            // get muTotal at the incident energy
-            layerPtr = &sample[iLayer];
-            if (iLayer == 0)
-                sampleLayerWeight[iLayer] = 1.0;
-            else
-                sampleLayerWeight[iLayer] = exp(-tmpDouble);
-            muTotal[iLayer] = this->getLayerMassAttenuationCoefficients( *layerPtr, \
-                                                            energies[iRay], \
-                                                            elementsLibrary, \
-                                                            sampleLayerCompositionList[iLayer])["total"];
-            // layer thickness and density
-            sampleLayerDensity[iLayer] = (*layerPtr).getDensity();
-            sampleLayerThickness[iLayer] = (*layerPtr).getThickness();
-            tmpDouble += sampleLayerDensity[iLayer] * sampleLayerThickness[iLayer] *\
-                         muTotal[iLayer]/sinAlphaIn;
+            std::vector<double>::size_type first = (nTasks > 1) ? familyCalculationOffset[iTask] : 0;
+            std::vector<double>::size_type last = (nTasks > 1) ? familyCalculationOffset[iTask + 1] : nCalculations;
+            if (first == last)
+            {
+                return;
+            }
+            this->accumulateRays(blockFirstRay[0], blockFirstRay[1], first, last, values, \
+                                 nContributions ? contributions : NULL, \
+                                 nContributions ? contributorMask : NULL, \
+                                 nDerivatives ? derivatives : NULL);
+        });
+    }
+    bool threaded = (nThreads > 1) && (nBlocks > 0) && (!direct);
+    if (threaded)
+    {
+        // one set of buffers per block and one task per block and element family.
+        // The element families write into different parts of the buffers.
+        blockValues.resize(nBlocks);
+        blockContributions.resize(nBlocks);
+        blockContributorMask.resize(nBlocks);
+        blockDerivatives.resize(nBlocks);
+        for (iBlock = 0; iBlock < nBlocks; iBlock++)
+        {
+            blockValues[iBlock].resize(nValues * nQuantities, 0.0);
+            blockContributions[iBlock].resize(nContributions, 0.0);
+            blockContributorMask[iBlock].resize(nContributions, 0);
+            blockDerivatives[iBlock].resize(nDerivatives, 0.0);
         }
-
-        if (secondary > 0)
+        std::vector<std::string>::size_type nFamilies = this->familyKey.size();
+        MultilayerPlan::runTasks(nBlocks * nFamilies, nThreads, \
+                                 [&](const std::vector<double>::size_type & iTask)
         {
-            // get the excitation factor for each layer at incident energy
-            for(iLayer = 0; iLayer < sample.size(); iLayer++)
+            std::vector<double>::size_type jBlock = iTask / nFamilies;
+            std::vector<std::string>::size_type jFamily = iTask % nFamilies;
+            if (familyCalculationOffset[jFamily] == familyCalculationOffset[jFamily + 1])
             {
-                sampleLayerEnergies[iLayer].clear();
-                sampleLayerEnergyNames[iLayer].clear();
-                sampleLayerRates[iLayer].clear();
-                sampleLayerFamilies[iLayer].clear();
-                sampleLayerMuTotal[iLayer].clear();
-                layerPtr = &sample[iLayer];
-                // sampleLayerPeakFamilies[iLayer] = (*layerPtr).getPeakFamilies(energies[iRay], elementsLibrary);
-                sampleLayerPeakFamilies[iLayer] = this->getLayerPeakFamilies(*layerPtr,
-                                                                             energies[iRay],
-                                                                             elementsLibrary,
-                                                                             sampleLayerCompositionList[iLayer]);
-
-                // They are ordered by increasing binding energy
-                std::string::size_type iString;
-                std::string ele;
-                std::string lastEle="dummytext";
-                std::string family;
-                std::map<std::string, std::map<std::string, double> > tmpResult;
-                std::map<std::string, std::map<std::string, double> >::const_iterator c_it;
-                std::map<std::string, double> sampleLayerComposition;
-                std::map<std::string, double>::const_iterator mapIt;
-                std::map<std::string, double>::const_iterator mapIt2;
-
-                sampleLayerComposition = sampleLayerCompositionList[iLayer];
-
-                if (sampleLayerComposition.size() < 1)
-                {
-                    std::cout << (*layerPtr).getMaterial().getName() << std::endl;
-                    std::cout << "sample composition empty!" << std::endl;
-                }
-                for (iPeakFamily = 0 ; iPeakFamily < sampleLayerPeakFamilies[iLayer].size(); iPeakFamily++)
-                {
-                    iString = sampleLayerPeakFamilies[iLayer][iPeakFamily].first.find(' ');
-                    family = sampleLayerPeakFamilies[iLayer][iPeakFamily].first.substr(iString + 1, \
-                                    sampleLayerPeakFamilies[iLayer][iPeakFamily].first.size() - iString - 1);
-                    ele = sampleLayerPeakFamilies[iLayer][iPeakFamily].first.substr(0, iString);
-                    if (ele != lastEle)
-                    {
-                        // The secondary rates NOT corrected for the beam intensity reaching the layer
-                        // The secondary rates NOT corrected for mass of element fraction in layer
-                        tmpResult = elementsLibrary.getExcitationFactors(ele, \
-                                                                     energies[iRay], \
-                                                                     1.0);
-                        lastEle = ele;
-                    }
-                    // and add the energies and rates to the sampleLayerLines
-                    for (c_it = tmpResult.begin(); c_it != tmpResult.end(); ++c_it)
-                    {
-                        // be carefull not to add twice an element
-                        if (c_it->first.compare(0, family.length(), family) == 0)
-                        {
-                            mapIt2 = c_it->second.find("rate");
-                            if ((mapIt2->second * sampleLayerComposition[ele]) <= 0.0)
-                            {
-                                // std::cout << " Lower equal zero " << mapIt2->second << std::endl;
-                                continue;
-                            }
-                            if (secondaryCalculationLimit > 0.0)
-                            {
-                                //if ((mapIt2->second * sampleLayerComposition[ele]) < secondaryCalculationLimit)
-                                // unfortunately the mass fraction of the element is not a good criterium
-                                // for instance, we can have 20 elements with a mass fraction of 1 % but all
-                                // together make 20 % of the sample.
-                                if (mapIt2->second < secondaryCalculationLimit)
-                                {
-                                    continue;
-                                };
-                            }
-                            mapIt2 = c_it->second.find("energy");
-                            if (mapIt2->second < minimumExcitationEnergy)
-                            {
-                                continue;
-                            }
-                            tmpDouble = mapIt2->second;
-                            mapIt2 = c_it->second.find("rate");
-                            /* Another possible optimization
-                            if (mapIt2->second < 0.0001)
-                            {
-                                // low intensity line, skip it
-                                continue;
-                            }
-                            */
-                            sampleLayerEnergies[iLayer].push_back(tmpDouble);
-                            // Store rates already corrected for the beam intensity reaching the layer
-                            // Store rates already corrected for the element mass fraction
-                            sampleLayerRates[iLayer].push_back(mapIt2->second * sampleLayerComposition[ele] * \
-                                                               weights[iRay] * sampleLayerWeight[iLayer]);
-                            sampleLayerFamilies[iLayer].push_back(iString);
-                            sampleLayerEnergyNames[iLayer].push_back(ele + \
-                                                                     " " +\
-                                                                     c_it->first);
-                        }
-                    }
-                }
-                // We have to add the contribution of coherent scattering
-                // We do so by assuming an isotropic emission of the same energy as the
-                // incident beam
-                sampleLayerEnergyNames[iLayer].push_back("coherent scattering");
-                sampleLayerEnergies[iLayer].push_back(energies[iRay]);
-                // calculate sample mu total at all those energies
-                std::map<std::string, std::vector<double> > tmpStringDoubleVecMap;
-                // tmpStringDoubleVecMap = (*layerPtr).getMassAttenuationCoefficients(
-                tmpStringDoubleVecMap = this->getLayerMassAttenuationCoefficients( *layerPtr, \
-                                                                sampleLayerEnergies[iLayer], \
-                                                                elementsLibrary, \
-                                                                sampleLayerCompositionList[iLayer]);
-                sampleLayerMuTotal[iLayer] = tmpStringDoubleVecMap["total"];
-                sampleLayerRates[iLayer].push_back((weights[iRay] * sampleLayerWeight[iLayer])*\
-                tmpStringDoubleVecMap["coherent"].back());
+                return;
             }
+            this->accumulateRays(blockFirstRay[jBlock], blockFirstRay[jBlock + 1], \
+                                 familyCalculationOffset[jFamily], familyCalculationOffset[jFamily + 1], \
+                                 &(blockValues[jBlock][0]), \
+                                 nContributions ? &(blockContributions[jBlock][0]) : NULL, \
+                                 nContributions ? &(blockContributorMask[jBlock][0]) : NULL, \
+                                 nDerivatives ? &(blockDerivatives[jBlock][0]) : NULL);
+        });
+    }
+    else
+    {
+        // a single set of buffers reused by all the blocks
+        blockValues.resize(1);
+        blockContributions.resize(1);
+        blockContributorMask.resize(1);
+        blockDerivatives.resize(1);
+    }
+    for (iBlock = 0; (iBlock < nBlocks) && (!direct); iBlock++)
+    {
+        std::vector<double> & bufferValues = blockValues[threaded ? iBlock : 0];
+        std::vector<double> & bufferContributions = blockContributions[threaded ? iBlock : 0];
+        std::vector<char> & bufferContributorMask = blockContributorMask[threaded ? iBlock : 0];
+        std::vector<double> & bufferDerivatives = blockDerivatives[threaded ? iBlock : 0];
+        if (!threaded)
+        {
+            bufferValues.assign(nValues * nQuantities, 0.0);
+            bufferContributions.assign(nContributions, 0.0);
+            bufferContributorMask.assign(nContributions, 0);
+            bufferDerivatives.assign(nDerivatives, 0.0);
+            this->accumulateRays(blockFirstRay[iBlock], blockFirstRay[iBlock + 1], \
+                                 0, nCalculations, \
+                                 &(bufferValues[0]), \
+                                 nContributions ? &(bufferContributions[0]) : NULL, \
+                                 nContributions ? &(bufferContributorMask[0]) : NULL, \
+                                 nDerivatives ? &(bufferDerivatives[0]) : NULL);
         }
-
-        if (muTotalCacheLayer.size() == 0)
+        for (i = 0; i < nValues; i++)
         {
-            // we can create a cache with all the energies we are going to dealing with and
-            // all the mass attenuation coefficients at each layer
-
-            for(iLayer = 0; iLayer < sample.size(); iLayer++)
+            if (!lineMask[i])
             {
-                muTotalCacheEnergies.insert(muTotalCacheEnergies.end(), \
-                                            sampleLayerEnergies[iLayer].begin(), \
-                                            sampleLayerEnergies[iLayer].end());
+                continue;
             }
-            // make the energies unique
-            std::sort(muTotalCacheEnergies.begin(), muTotalCacheEnergies.end());
-            muTotalCacheEnergies.erase(std::unique(muTotalCacheEnergies.begin(), \
-                                                   muTotalCacheEnergies.end()), \
-                                                   muTotalCacheEnergies.end());
-            muTotalCacheLayer.resize(sample.size());
-
-            for(iLayer = 0; iLayer < sample.size(); iLayer++)
+            values[i * nQuantities + MultilayerResult::RATE] += \
+                                bufferValues[i * nQuantities + MultilayerResult::RATE];
+            values[i * nQuantities + MultilayerResult::PRIMARY] += \
+                                bufferValues[i * nQuantities + MultilayerResult::PRIMARY];
+            values[i * nQuantities + MultilayerResult::SECONDARY] += \
+                                bufferValues[i * nQuantities + MultilayerResult::SECONDARY];
+            values[i * nQuantities + MultilayerResult::NEGLECTED] += \
+                                bufferValues[i * nQuantities + MultilayerResult::NEGLECTED];
+            if (nDerivatives)
             {
-                muTotalCacheLayer[iLayer] = this->getLayerMassAttenuationCoefficients(sample[iLayer], \
-                                                                                      muTotalCacheEnergies, \
-                                                                                      elementsLibrary, \
-                                                                                      sampleLayerCompositionList[iLayer])["total"];
+                for (index = i * nParameters; index < (i + 1) * nParameters; index++)
+                {
+                    derivatives[index] += bufferDerivatives[index];
+                }
             }
         }
-        // cross check that ALL energies are present
-        /*
-        for(iLayer = 0; iLayer < sample.size(); iLayer++)
+        for (i = 0; i < nContributions; i++)
         {
-
-            for (int i = 0; i < sampleLayerEnergies[iLayer].size(); ++i)
+            if (bufferContributorMask[i])
             {
-                if(!std::binary_search(muTotalCacheEnergies.begin(),
-                                      muTotalCacheEnergies.end(),
-                                      sampleLayerEnergies[iLayer][i]))
-                {
-                    throw std::runtime_error(" NOT PRESENT 1");
-                }
-                else
-                {
-                    std::cout << " present iRay" << iRay << std::endl;
-                }
+                contributions[i] += bufferContributions[i];
+                contributorMask[i] = 1;
             }
         }
-        */
+    }
 
-        // we start calculation
-        // mu_1_lambda = Mass attenuation coefficient of iLayer at incident energy
-        double mu_1_lambda;
-        // mu_1_i = Mass attenuation coefficient of iLayer at fluorescent energy
-        double mu_1_i;
-        // density and thickness of fluorescent layer
-        double density_1;
-        double thickness_1;
-        // density and thickness of second layer
-        double density_2;
-        double thickness_2;
-        // mu_a_lambda = Mass attenuation coefficient of layers above iLayer at incident energy
-        // mu_a_i = Mass attenuation coefficient of layers above iLayer at fluorescent energy
-        // mu_b_lambda = Mass attenuation coefficient of layers between iLayer and jLayer at incident energy
-        // mu_b_j = Mass attenuation coefficient of layers between iLayer and jLayer at jLayer fluorescent energy j
-        // mu_b_j_d_t sum of product mu * density * thickness of layers between iLayer and jLayer at jLayer fluorescent energy j
-        double mu_b_j_d_t;
-        // mu_2_lambda = Mass attenuation coefficient of jLayer at incident energy
-        double mu_2_lambda;
-        // mu_2_j = Mass attenuation coefficient of jLayer at jLayer fluorescent energy j
-        double mu_2_j;
-        // mu_1_j = Mass attenuation coefficient of iLayer at jLayer fluorescent energy j
-        double mu_1_j;
-        // elementName is the element to be analyzed
-        // lineFamily is the family of  elementName X-ray lines to be considered
-        double energyThreshold;
+    if (this->secondary > 1)
+    {
+        result.applyTertiaryExcitation();
+    }
+}
 
-        // this line can be moved out of the loop
-        std::map<std::string, std::map<std::string, double> > primaryExcitationFactors;
-        std::map<std::string, std::map<std::string, double> > tmpExcitationFactors;
-        std::map<std::string, std::map<std::string, double> >::const_iterator c_it;
-        std::map<std::string, double>::const_iterator mapIt;
-        std::map<std::string, double> muTotalFluo;
-        double detectionEfficiency;
-        double energy;
-        std::string key;
-        std::string tmpString;
-        std::ostringstream tmpStringStream;
-        for (std::vector<std::string>::size_type iElement = 0; iElement < elementList.size(); iElement++)
+void MultilayerPlan::accumulateRays(const std::vector<double>::size_type & firstRay, \
+                                    const std::vector<double>::size_type & lastRay, \
+                                    const std::vector<double>::size_type & firstCalculation, \
+                                    const std::vector<double>::size_type & lastCalculation, \
+                                    double * values, double * contributions, char * contributorMask, \
+                                    double * derivatives) const
+{
+    typedef void (MultilayerPlan::*Kernel)(const std::vector<double>::size_type &, \
+                                           const std::vector<double>::size_type &, \
+                                           const std::vector<double>::size_type &, \
+                                           const std::vector<double>::size_type &, \
+                                           double *, double *, char *, double *) const;
+    // [secondary][interlayer][derivatives]
+    static const Kernel kernels[2][2][2] = {
+        {{&MultilayerPlan::accumulateRayKernel<false, false, false>, \
+          &MultilayerPlan::accumulateRayKernel<false, false, true>}, \
+         {&MultilayerPlan::accumulateRayKernel<false, true, false>, \
+          &MultilayerPlan::accumulateRayKernel<false, true, true>}}, \
+        {{&MultilayerPlan::accumulateRayKernel<true, false, false>, \
+          &MultilayerPlan::accumulateRayKernel<true, false, true>}, \
+         {&MultilayerPlan::accumulateRayKernel<true, true, false>, \
+          &MultilayerPlan::accumulateRayKernel<true, true, true>}}};
+    const int secondaryTerms = (this->secondary > 0) ? 1 : 0;
+    const int interlayerTerms = (this->layerDensity.size() > 1) ? 1 : 0;
+    const int derivativeTerms = ((derivatives != NULL) && (this->parameterNames.size() > 0)) ? 1 : 0;
+
+    (this->*kernels[secondaryTerms][interlayerTerms][derivativeTerms])(firstRay, lastRay, \
+                                                                       firstCalculation, lastCalculation, \
+                                                                       values, contributions, contributorMask, \
+                                                                       derivatives);
+}
+
+template <bool secondaryTerms, bool interlayerTerms, bool derivativeTerms>
+void MultilayerPlan::accumulateRayKernel(const std::vector<double>::size_type & firstRay, \
+                                         const std::vector<double>::size_type & lastRay, \
+                                         const std::vector<double>::size_type & firstCalculation, \
+                                         const std::vector<double>::size_type & lastCalculation, \
+                                         double * values, double * contributions, char * contributorMask, \
+                                         double * derivatives) const
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nLines = this->lineName.size();
+    std::vector<double>::size_type nEnergies = this->sourceEnergies.size();
+    std::vector<double>::size_type nCalculationLines = this->calculationLineMuTotal.size();
+    std::vector<double>::size_type nResultLines = this->resultLineNames.size();
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type jLayer;
+    std::vector<double>::size_type bLayer;
+    std::vector<double>::size_type iCalculation;
+    std::vector<double>::size_type iCalculationLine;
+    std::vector<double>::size_type iLine;
+    std::vector<double>::size_type iLambda;
+    std::vector<double>::size_type iEscape;
+    std::vector<double>::size_type iEnergy;
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::string>::size_type nContributors = this->contributorNames.size();
+    std::vector<double>::size_type iContributor;
+    std::vector<double>::size_type index;
+    std::vector<double>::size_type escapeIndex;
+    const double & sinAlphaIn = this->sinAlphaIn;
+    const double & sinAlphaOut = this->sinAlphaOut;
+    const int nQuantities = MultilayerResult::N_QUANTITIES;
+    double tmpDouble;
+
+    const bool pruning = this->secondaryTolerance > 0.0;
+    double bound;
+    std::vector<double>::size_type nSourceLines;
+    std::vector<double>::size_type iSourceLine;
+    double mu_1_lambda_scatter;
+    std::vector<double>::size_type maxLayerSources = 0;
+    std::vector<double>::size_type nPairSources;
+    std::vector<double>::size_type iPairSource;
+    std::vector<double>::size_type nLineSources;
+    std::vector<double>::size_type iLineSource;
+    std::vector<double>::size_type nBatchSources;
+    std::vector<double>::size_type iBatchSource;
+    for (index = 0; interlayerTerms && (index + 1 < this->sourceOffset.size()); index++)
+    {
+        if ((this->sourceOffset[index + 1] - this->sourceOffset[index]) > maxLayerSources)
         {
-            const std::string & elementName = elementList[iElement];
-            const std::string & lineFamily = familyList[iElement];
-            int calculationLayer;
-            std::string actualLineFamily;
-            if (layerList.size() > 1)
-                calculationLayer = layerList[iElement];
-            else
-                calculationLayer = layerList[0];
-            // a negative calculation layer implies calculation for all layers
-            actualLineFamily = lineFamily;
-            if (lineFamily == "Ka")
-            {
-                actualLineFamily = "KL";
-            }
-            if (lineFamily == "Kb")
+            maxLayerSources = this->sourceOffset[index + 1] - this->sourceOffset[index];
+        }
+    }
+    const std::vector<double>::size_type nSecondaryLines = secondaryTerms ? nLines : 0;
+
+    // derivatives of the primary plus secondary rate of each calculated line for a single ray
+    // with respect to the parameters
+    const std::vector<double>::size_type nParameters = derivativeTerms ? this->parameterNames.size() : 0;
+
+    // the scratch arrays of the kernel are slices of two buffers allocated once per call
+    std::vector<double> workspace(4 * nCalculationLines + 6 * nSecondaryLines + 7 * maxLayerSources + \
+                                  nCalculationLines * nParameters + 1, 0.0);
+    std::vector<std::vector<double>::size_type> indexWorkspace(nSecondaryLines + 2 * maxLayerSources + 1, 0);
+    // quantities of each calculated line for a single ray
+    double * rayRate = workspace.data();
+    double * rayPrimary = rayRate + nCalculationLines;
+    double * raySecondary = rayPrimary + nCalculationLines;
+    // upper bound of the neglected secondary rate of each calculated line for a single ray
+    double * rayNeglected = raySecondary + nCalculationLines;
+    // lines of a family excited by a secondary source, the arguments of their two
+    // de Boer integrals and the values of those integrals evaluated in a single call
+    std::vector<double>::size_type * sourceLines = indexWorkspace.data();
+    double * sourceMu1 = rayNeglected + nCalculationLines;
+    double * sourceMu2 = sourceMu1 + 2 * nSecondaryLines;
+    double * sourceL0 = sourceMu2 + 2 * nSecondaryLines;
+    // sources of the layer originating the secondary excitation, the sources contributing to
+    // a line and the arguments and values of their de Boer integrals evaluated in a single call
+    std::vector<double>::size_type * pairSources = sourceLines + nSecondaryLines;
+    std::vector<double>::size_type * lineSources = pairSources + maxLayerSources;
+    double * pairMu1j = sourceL0 + 2 * nSecondaryLines;
+    double * pairMu2j = pairMu1j + maxLayerSources;
+    double * pairMubjdt = pairMu2j + maxLayerSources;
+    double * batchMu1j = pairMubjdt + maxLayerSources;
+    double * batchMu2j = batchMu1j + maxLayerSources;
+    double * batchMubjdt = batchMu2j + maxLayerSources;
+    double * batchX = batchMubjdt + maxLayerSources;
+    double * rayDerivative = batchX + maxLayerSources;
+    double p;
+    double pShifted;
+    double q;
+    double lineFactor;
+
+    // mu_1_lambda = Mass attenuation coefficient of iLayer at incident energy
+    double mu_1_lambda;
+    // mu_1_i = Mass attenuation coefficient of iLayer at fluorescent energy
+    double mu_1_i;
+    // density and thickness of fluorescent layer
+    double density_1;
+    double thickness_1;
+    // density and thickness of second layer
+    double density_2;
+    double thickness_2;
+    // mu_b_j_d_t sum of product mu * density * thickness of layers between iLayer and jLayer at jLayer fluorescent energy j
+    double mu_b_j_d_t;
+    // mu_2_lambda = Mass attenuation coefficient of jLayer at incident energy
+    double mu_2_lambda;
+    // mu_2_j = Mass attenuation coefficient of jLayer at jLayer fluorescent energy j
+    double mu_2_j;
+    // mu_1_j = Mass attenuation coefficient of iLayer at jLayer fluorescent energy j
+    double mu_1_j;
+    double energyThreshold;
+    double elementMassFractionFactor;
+    double layerFactor;
+    double layerWeight;
+    double exRate;
+    std::vector<double>::size_type lineOffset;
+    std::vector<double>::size_type calculationLineOffset;
+    std::vector<double>::size_type nFamilyLines;
+    std::vector<double>::size_type firstSource;
+    std::vector<double>::size_type lastSource;
+
+    // first mass thickness parameter, nParameters if not requested
+    const std::vector<double>::size_type thicknessOffset = (this->thicknessParameterOffset < nParameters) ? \
+                                                           this->thicknessParameterOffset : nParameters;
+    const bool thicknessTerms = (thicknessOffset < nParameters);
+    std::vector<double>::size_type iParameter;
+    double gradient[8];
+    double *row;
+    const double *effRow;
+    double factor;
+    double scale;
+    double sign;
+
+    // add coefficient times the attenuation coefficients mu of the elements of layer kLayer
+    auto addLayerTerm = [&](double * row, const std::vector<double>::size_type & kLayer, \
+                            const double & coefficient, const double * mu)
+    {
+        std::vector<double>::size_type jParameter;
+        for (jParameter = this->layerParameterOffset[kLayer]; \
+             jParameter < this->layerParameterOffset[kLayer + 1]; jParameter++)
+        {
+            row[jParameter] += coefficient * mu[jParameter];
+        }
+    };
+    // add the derivatives of a term proportional to the ray jRay reaching layer kLayer
+    auto addBeamTerm = [&](double * row, const std::vector<double>::size_type & kLayer, \
+                           const double & term, const std::vector<double>::size_type & jRay)
+    {
+        std::vector<double>::size_type mLayer;
+        for (mLayer = 0; mLayer < kLayer; mLayer++)
+        {
+            addLayerTerm(row, mLayer, \
+                         -term * this->layerDensity[mLayer] * this->layerThickness[mLayer] / this->sinAlphaIn, \
+                         &(this->rayParameterMuTotal[jRay * nParameters]));
+            if (thicknessTerms)
             {
-                // carefull, the actual condition is to start by K and not to be followed by L
-                actualLineFamily = "KM";
+                row[thicknessOffset + mLayer] -= term * this->rayLayerMuTotal[jRay * nLayers + mLayer] / \
+                                                 this->sinAlphaIn;
             }
-            if (actualLineFamily == "")
+        }
+    };
+    // add the derivatives of a term proportional to the rate of source kLambda of layer kLayer
+    auto addSourceTerm = [&](double * row, const std::vector<double>::size_type & kLayer, \
+                             const double & term, const std::vector<double>::size_type & kLambda, \
+                             const std::vector<double>::size_type & jRay)
+    {
+        if (this->sourceScattering[kLambda])
+        {
+            addLayerTerm(row, kLayer, term / this->sourceFactor[kLambda], \
+                         &(this->rayParameterMuCoherent[jRay * nParameters]));
+        }
+        else if (this->sourceParameter[kLambda] < nParameters)
+        {
+            row[this->sourceParameter[kLambda]] += term / \
+                                                   this->parameterMassFraction[this->sourceParameter[kLambda]];
+        }
+        addBeamTerm(row, kLayer, term, jRay);
+    };
+
+    for (iRay = firstRay; iRay < lastRay; iRay++)
+    {
+        for (iCalculation = firstCalculation; iCalculation < lastCalculation; iCalculation++)
+        {
+            iFamily = this->calculationFamily[iCalculation];
+            iLayer = this->calculationLayer[iCalculation];
+            energyThreshold = this->familyEnergyThreshold[iFamily];
+            if (energyThreshold > this->rayEnergy[iRay])
             {
-                throw std::runtime_error("All line families case not implemented yet!!!");
+                continue;
             }
-            if (iElement < energyThresholdList.size())
+            lineOffset = this->familyLineOffset[iFamily];
+            nFamilyLines = this->familyLineOffset[iFamily + 1] - lineOffset;
+            calculationLineOffset = this->calculationLineOffset[iCalculation];
+            // the quantities of the lines of the family are contiguous arrays
+            const char * excited = &(this->lineExcited[iRay * nLines + lineOffset]);
+            const double * primaryRate = &(this->linePrimaryRate[iRay * nLines + lineOffset]);
+            const double * lineMuTotal = &(this->calculationLineMuTotal[calculationLineOffset]);
+            const double * lineEfficiency = &(this->calculationLineEfficiency[calculationLineOffset]);
+            double * ratePrimary = &(rayPrimary[calculationLineOffset]);
+            double * rateTotal = &(rayRate[calculationLineOffset]);
+            double * rateSecondary = &(raySecondary[calculationLineOffset]);
+            double * rateNeglected = &(rayNeglected[calculationLineOffset]);
+            tmpDouble = 0;
+            for (iLine = 0; iLine < nFamilyLines; iLine++)
             {
-                energyThreshold = energyThresholdList[iElement];
+                tmpDouble += excited[iLine];
             }
-            else
+            if (tmpDouble == 0)
             {
-                energyThreshold = this->getEnergyThreshold(elementName, \
-                                                       actualLineFamily.substr(0, 1), \
-                                                       elementsLibrary);
-                energyThresholdList.push_back(energyThreshold);
+                // no need to calculate anything
+                continue;
             }
+            elementMassFractionFactor = this->calculationMassFractionFactor[iCalculation];
 
-            if (energyThreshold > energies[iRay])
+            // primary. The loop has no branches, the lines not excited by the ray having a
+            // zero rate. Their quantities are ignored afterwards.
+            mu_1_lambda = this->rayLayerMuTotal[iRay * nLayers + iLayer];
+            density_1 = this->layerDensity[iLayer];
+            thickness_1 = this->layerThickness[iLayer];
+            layerWeight = this->rayLayerWeight[iRay * nLayers + iLayer];
+            for (iLine = 0; iLine < nFamilyLines; iLine++)
             {
-                continue;
+                tmpDouble = (mu_1_lambda / sinAlphaIn) + (lineMuTotal[iLine] / sinAlphaOut);
+                // keep factor for deciding if secondary excitation is to be considered or not
+                tmpDouble = (1.0 - exp( - tmpDouble * density_1 * thickness_1)) / tmpDouble;
+                tmpDouble *= (elementMassFractionFactor / sinAlphaIn);
+                ratePrimary[iLine] = tmpDouble * primaryRate[iLine] * layerWeight;
+                rateTotal[iLine] = ratePrimary[iLine] * lineEfficiency[iLine];
+                rateSecondary[iLine] = 0.0;
+                rateNeglected[iLine] = 0.0;
             }
-            primaryExcitationFactors = elementsLibrary.getExcitationFactors(elementName, \
-                                                                        energies[iRay], \
-                                                                        weights[iRay]);
-            for (iLayer = 0; iLayer < sample.size(); iLayer++)
+            for (iLine = 0; derivativeTerms && (iLine < nFamilyLines); iLine++)
             {
-                double elementMassFractionFactor;
-                double elementMassFraction;
-                if ((calculationLayer >= 0) && ((iLayer - calculationLayer) != 0))
-                {
-                    // no need to calculate this layer
+                if (!excited[iLine])
                     continue;
-                }
-                elementMassFractionFactor = 1.0;
-                if(true)
+                iCalculationLine = calculationLineOffset + iLine;
+                mu_1_i = lineMuTotal[iLine];
+                // self absorption of the layer and attenuation of the beam by the upper layers
+                row = &(rayDerivative[iCalculationLine * nParameters]);
+                std::fill(row, row + nParameters, 0.0);
+                factor = (mu_1_lambda / sinAlphaIn) + (mu_1_i / sinAlphaOut);
+                tmpDouble = std::exp(-factor * density_1 * thickness_1);
+                if (thicknessTerms)
                 {
-                    std::map<std::string, double> sampleLayerComposition;
-                    layerPtr = &sample[iLayer];
-                    // sampleLayerComposition = (*layerPtr).getComposition(elementsLibrary);
-                    sampleLayerComposition = sampleLayerCompositionList[iLayer];
-                    if (sampleLayerComposition.find(elementName) == sampleLayerComposition.end())
-                    {
-                        elementMassFraction = 0.0;
-                    }
-                    else
-                    {
-                        elementMassFraction = sampleLayerComposition[elementName];
-                    }
+                    row[thicknessOffset + iLayer] += ratePrimary[iLine] * \
+                                                     factor * tmpDouble / (1.0 - tmpDouble);
                 }
-                if (useMassFractions)
-                {
-                    elementMassFractionFactor = elementMassFraction;
-                }
-                // here I should loop for all elements and families
-                key = elementName + " " + lineFamily;
-                // we need to calculate the layer mass attenuation coefficients at the fluorescent energies
-                result.clear();
-                if (elementMassFractionFactor == 0.0)
-                    continue;
-                for (c_it = primaryExcitationFactors.begin(); c_it != primaryExcitationFactors.end(); ++c_it)
+                factor = ratePrimary[iLine] * \
+                         ((density_1 * thickness_1 * tmpDouble / (1.0 - tmpDouble)) - (1.0 / factor));
+                addLayerTerm(row, iLayer, factor / sinAlphaIn, \
+                             &(this->rayParameterMuTotal[iRay * nParameters]));
+                addLayerTerm(row, iLayer, factor / sinAlphaOut, \
+                             &(this->lineParameterMuTotal[(lineOffset + iLine) * nParameters]));
+                addBeamTerm(row, iLayer, ratePrimary[iLine], iRay);
+            }
+
+            for (jLayer = 0; secondaryTerms && (jLayer < nLayers); jLayer++)
+            {
+                firstSource = this->sourceOffset[iRay * nLayers + jLayer];
+                lastSource = this->sourceOffset[iRay * nLayers + jLayer + 1];
+                if ((!interlayerTerms) || (iLayer == jLayer))
                 {
-                    if ((c_it->first.compare(0, actualLineFamily.length(), actualLineFamily) == 0) || \
-                        ((lineFamily == "Kb") && (c_it->first[0] == 'K') && (c_it->first[1] != 'L')))
+                    // intralayer secondary
+                    for (iLambda = firstSource; iLambda < lastSource; iLambda++)
                     {
-                        mapIt = c_it->second.find("factor");
-                        if (mapIt == c_it->second.end())
-                        {
-                            std::cout << "Key <factor> not found in excitation factor" << std::endl;
-                        }
-                        if (mapIt->second <= 0.0)
-                        {
-                            // not excited
+                        iEnergy = this->sourceEnergyIndex[iLambda];
+                        // analogous to incident beam
+                        if (energyThreshold > this->sourceEnergies[iEnergy])
                             continue;
-                        }
-                        mapIt = c_it->second.find("energy");
-                        energy = mapIt->second;
-                        result[c_it->first]["energy"] = energy;
-                        mapIt = c_it->second.find("rate");
-                        result[c_it->first]["rate"] = mapIt->second;
-                        mapIt = c_it->second.find("factor");
-                        result[c_it->first]["factor"] = mapIt->second;
-                        if (actualResult[key][iLayer].find(c_it->first) == actualResult[key][iLayer].end())
+                        mu_2_j = this->sourceLayerMuTotal[jLayer * nEnergies + iEnergy];
+                        const char * sourceExcited = &(this->lineSecondaryExcited[iEnergy * nLines + lineOffset]);
+                        const double * sourceExRate = &(this->lineSecondaryRate[iEnergy * nLines + lineOffset]);
+                        nSourceLines = 0;
+                        for (iLine = 0; iLine < nFamilyLines; iLine++)
                         {
-                            // calculate layer mu total at fluorescent energy
-                            // std::cout << "CALCULATING mu_1_i for " << c_it->first << " ";
-                            // std::cout << "energy " << energy;
-                            result[c_it->first]["mu_1_i"] = \
-                                    this->getLayerMassAttenuationCoefficients(sample[iLayer], energy, \
-                                                                                elementsLibrary,
-                                                                                sampleLayerCompositionList[iLayer])["total"];
-                            // calculate detection efficiency of fluorescent energy
-                            detectionEfficiency = 1.0;
-                            // transmission through upper layers
-                            jLayer = iLayer;
-                            while (jLayer > 0)
-                            {
-                                jLayer--;
-                                layerPtr = &sample[jLayer];
-                                detectionEfficiency *= this->getLayerTransmission( *layerPtr, \
-                                                                                   energy, \
-                                                                                   elementsLibrary, \
-                                                                                   alphaOut,
-                                                                                   sampleLayerCompositionList[jLayer]);
-                            }
-                            // transmission through attenuators
-                            for (jLayer = 0; jLayer < attenuators.size(); jLayer++)
-                            {
-                                layerPtr = &attenuators[jLayer];
-                                detectionEfficiency *= this->getLayerTransmission( *layerPtr, \
-                                                                                   energy, \
-                                                                                   elementsLibrary, \
-                                                                                   90.0);
-                            }
-                            // transmission through user attenuators
-                            for (iTransmissionTable = 0; iTransmissionTable < userAttenuators.size(); iTransmissionTable++)
-                            {
-                                detectionEfficiency *= userAttenuators[iTransmissionTable].getTransmission(energy);
-                            }
-
-
-                            // detection efficiency decomposed in geometric and intrinsic
-                            // TODO: If the detector is defined as a material, one can have the same troubles
-                            // as when using methods from the layers.
-                            detectionEfficiency *= geometricEfficiency[iLayer];
-
-                            if (detector.hasMaterialComposition() || (detector.getMaterialName().size() > 0 ))
+                            if (!excited[iLine])
+                                continue;
+                            if (!sourceExcited[iLine])
+                                continue;
+                            iCalculationLine = calculationLineOffset + iLine;
+                            mu_1_i = lineMuTotal[iLine];
+                            exRate = sourceExRate[iLine];
+                            if (pruning)
                             {
-                                if ((detector.getDensity() > 0.0) && (detector.getThickness() > 0.0))
+                                // the de Boer integrals are bounded by those of a source reabsorbed in
+                                // the layer without escaping from it
+                                tmpDouble = (mu_1_lambda / sinAlphaIn) + (mu_1_i / sinAlphaOut);
+                                bound = 2.0 * (1.0 - std::exp(-tmpDouble * density_1 * thickness_1)) / \
+                                        (tmpDouble * mu_2_j);
+                                bound *= elementMassFractionFactor * (0.5/sinAlphaIn) * \
+                                         exRate * this->sourceRate[iLambda];
+                                if ((rayNeglected[iCalculationLine] + bound) <= \
+                                    (this->secondaryTolerance * rayPrimary[iCalculationLine]))
                                 {
-                                    // calculate intrinsic efficiency
-                                    // assuming normal incidence on detector surface
-                                    detectionEfficiency *= (1.0 - detector.getTransmission(energy, \
-                                                                                elementsLibrary, \
-                                                                                90.0));
+                                    rayNeglected[iCalculationLine] += bound;
+                                    continue;
                                 }
-                                // calculate escape ratio assuming normal incidence on detector surface
-                                escapeRates = detector.getEscape(energy, \
-                                                                 elementsLibrary, \
-                                                                 elementName + c_it->first, \
-                                                                 updateEscape);
-                                updateEscape = 0;
                             }
-
-
-                            result[c_it->first]["energy_threshold"] = energyThreshold;
-                            result[c_it->first]["efficiency"] = detectionEfficiency;
-                            actualResult[key][iLayer][c_it->first]["efficiency"] = detectionEfficiency;
-                            actualResult[key][iLayer][c_it->first]["energy"] = energy;
-                            actualResult[key][iLayer][c_it->first]["energy_threshold"] = energyThreshold;
-                            actualResult[key][iLayer][c_it->first]["mu_1_i"] = result[c_it->first]["mu_1_i"];
-                            actualResult[key][iLayer][c_it->first]["rate"] = 0.0;
-                            actualResult[key][iLayer][c_it->first]["primary"] = 0.0;
-                            actualResult[key][iLayer][c_it->first]["secondary"] = 0.0;
+                            sourceLines[nSourceLines] = iLine;
+                            nSourceLines++;
                         }
+                        if (nSourceLines == 0)
+                            continue;
+                        // Workaround incident angle of 90 degrees and scatter contribution
+                        if ((mu_1_lambda / sinAlphaIn) == mu_2_j)
+                            mu_1_lambda_scatter = mu_1_lambda / (0.99999*sinAlphaIn);
                         else
+                            mu_1_lambda_scatter = mu_1_lambda / sinAlphaIn;
+                        for (iSourceLine = 0; iSourceLine < nSourceLines; iSourceLine++)
                         {
-                            // std::cout << "USING mu_1_i for " << c_it->first << " ";
-                            // std::cout << "energy " << energy;
-                            result[c_it->first]["efficiency"] = \
-                                        actualResult[key][iLayer][c_it->first]["efficiency"];
-                            result[c_it->first]["energy"] = actualResult[key][iLayer][c_it->first]["energy"];
-                            result[c_it->first]["energy_threshold"] = \
-                                                    actualResult[key][iLayer][c_it->first]["energy_threshold"];
-                            result[c_it->first]["mu_1_i"] = actualResult[key][iLayer][c_it->first]["mu_1_i"];
+                            mu_1_i = lineMuTotal[sourceLines[iSourceLine]];
+                            sourceMu1[iSourceLine] = mu_1_lambda / sinAlphaIn;
+                            sourceMu2[iSourceLine] = mu_1_i / sinAlphaOut;
+                            sourceMu1[nSourceLines + iSourceLine] = mu_1_i / sinAlphaOut;
+                            sourceMu2[nSourceLines + iSourceLine] = mu_1_lambda_scatter;
+                        }
+                        Math::deBoerL0(&(sourceMu1[0]), &(sourceMu2[0]), mu_2_j, density_1, thickness_1, \
+                                       &(sourceL0[0]), 2 * nSourceLines);
+                        for (iSourceLine = 0; iSourceLine < nSourceLines; iSourceLine++)
+                        {
+                            iLine = sourceLines[iSourceLine];
+                            iCalculationLine = calculationLineOffset + iLine;
+                            mu_1_i = lineMuTotal[iLine];
+                            exRate = sourceExRate[iLine];
+                            tmpDouble = sourceL0[iSourceLine];
+                            tmpDouble += sourceL0[nSourceLines + iSourceLine];
+                            tmpDouble *= elementMassFractionFactor * (0.5/sinAlphaIn);
+                            tmpDouble *= exRate * this->sourceRate[iLambda];
+                            if (derivativeTerms)
+                            {
+                                // the arguments of the de Boer integrals depend on the layer composition
+                                row = &(rayDerivative[iCalculationLine * nParameters]);
+                                scale = ((mu_1_lambda / sinAlphaIn) == mu_2_j) ? 1.0 / 0.99999 : 1.0;
+                                Math::deBoerL0Derivatives(mu_1_lambda / sinAlphaIn, mu_1_i / sinAlphaOut, \
+                                                          mu_2_j, density_1, thickness_1, gradient);
+                                Math::deBoerL0Derivatives(mu_1_i / sinAlphaOut, scale * mu_1_lambda / sinAlphaIn, \
+                                                          mu_2_j, density_1, thickness_1, gradient + 4);
+                                factor = elementMassFractionFactor * (0.5/sinAlphaIn) * \
+                                         exRate * this->sourceRate[iLambda];
+                                addLayerTerm(row, iLayer, factor * (gradient[0] + scale * gradient[5]) / sinAlphaIn, \
+                                             &(this->rayParameterMuTotal[iRay * nParameters]));
+                                addLayerTerm(row, iLayer, factor * (gradient[1] + gradient[4]) / sinAlphaOut, \
+                                             &(this->lineParameterMuTotal[(lineOffset + iLine) * nParameters]));
+                                addLayerTerm(row, iLayer, factor * (gradient[2] + gradient[6]), \
+                                             &(this->sourceParameterMuTotal[iEnergy * nParameters]));
+                                if (thicknessTerms)
+                                {
+                                    row[thicknessOffset + iLayer] += factor * (gradient[3] + gradient[7]);
+                                }
+                                addSourceTerm(row, jLayer, tmpDouble, iLambda, iRay);
+                            }
+                            if (contributions != NULL)
+                            {
+                                iContributor = this->sourceContributorIndex[this->sourceNameIndex[iLambda] * nLayers + jLayer];
+                                index = this->calculationLineResultIndex[iCalculationLine] * nContributors + iContributor;
+                                contributions[index] += tmpDouble;
+                                contributorMask[index] = 1;
+                            }
+                            raySecondary[iCalculationLine] += tmpDouble;
+                            rayRate[iCalculationLine] += tmpDouble * \
+                                                         this->calculationLineEfficiency[iCalculationLine];
                         }
                     }
+                    continue;
                 }
-                if (result.size() == 0)
+                if ((!pruning) && \
+                    ((this->rayLayerWeight[iRay * nLayers + jLayer] / \
+                      this->rayLayerWeight[iRay * nLayers + iLayer]) < 1.0E-4))
                 {
-                    // no need to calculate anything
+                    // The incident reaching the layer originating the secondary excitation
+                    // is relatively much weaker. In the common energy range of XRF interest,
+                    // one will certainly recover less than of 50 % of the incident photons
+                    // reaching the jLayer originating the secondary excitation "beam".
+                    // An additional factor 100 is accounted for because of the possible ratio
+                    // of attenuation coefficient of the element at incident and secondary excitation
+                    // photon energies
                     continue;
                 }
-                // primary
-                mu_1_lambda = this->getLayerMassAttenuationCoefficients( sample[iLayer], \
-                                                                energies[iRay], \
-                                                                elementsLibrary,
-                                                                sampleLayerCompositionList[iLayer])["total"];
-                density_1 = sample[iLayer].getDensity();
-                thickness_1 = sample[iLayer].getThickness();
-                for (c_it = result.begin(); c_it != result.end(); ++c_it)
+                mu_2_lambda = this->rayLayerMuTotal[iRay * nLayers + jLayer];
+                density_2 = this->layerDensity[jLayer];
+                thickness_2 = this->layerThickness[jLayer];
+                // interlayer case a) iLayer < jLayer or case b) iLayer > jLayer
+                layerFactor = 1.0;
+                if (iLayer > jLayer)
                 {
-                    mapIt = c_it->second.find("mu_1_i");
-                    if (mapIt == c_it->second.end())
-                    {
-                        throw std::runtime_error("Mass attenuation coefficient not calculated!!!");
-                    }
-                    mu_1_i = mapIt->second;
-                    tmpDouble = (mu_1_lambda / sinAlphaIn) + (mu_1_i / sinAlphaOut);
-                    // keep factor for deciding if secondary excitation is to be considered or not
-                    tmpDouble = (1.0 - exp( - tmpDouble * density_1 * thickness_1)) / tmpDouble;
-                    tmpDouble *= (elementMassFractionFactor / sinAlphaIn);
-                    result[c_it->first]["primary"] = tmpDouble * \
-                                                     primaryExcitationFactors[c_it->first]["rate"] * \
-                                                     sampleLayerWeight[iLayer];
-                    result[c_it->first]["rate"] = result[c_it->first]["primary"] * \
-                                                  result[c_it->first]["efficiency"];
-                    result[c_it->first]["secondary"] = 0.0;
-                    //std::cout << c_it->first << "efficiency = " << result[c_it->first]["efficiency"] << std::endl;
-                    //std::cout << c_it->first << "primary = " << result[c_it->first]["primary"] << std::endl;
-                    //std::cout << c_it->first << "energy = " << result[c_it->first]["energy"] << std::endl;
-                    //std::cout << c_it->first << "mu_1_i = " << result[c_it->first]["mu_1_i"] << std::endl;
-                    /*
-                    if ((c_it->first == "KL2") && (iLayer == 0))
+                    layerFactor = std::exp(-mu_2_lambda * density_2 * thickness_2/sinAlphaIn);
+                }
+                // sources of jLayer above the threshold with the attenuation coefficients they need
+                nPairSources = 0;
+                for (iLambda = firstSource; iLambda < lastSource; iLambda++)
+                {
+                    iEnergy = this->sourceEnergyIndex[iLambda];
+                    // analogous to incident beam
+                    if (energyThreshold > this->sourceEnergies[iEnergy])
+                        continue;
+                    mu_b_j_d_t = 0.0;
+                    bLayer = (iLayer < jLayer) ? iLayer + 1 : jLayer + 1;
+                    while (bLayer < ((iLayer < jLayer) ? jLayer : iLayer))
                     {
-                        std::cout << c_it->first << "efficiency = " << result[c_it->first]["efficiency"] << std::endl;
-                        std::cout << c_it->first << "primary = " << result[c_it->first]["primary"] << std::endl;
-                        std::cout << c_it->first << "sampleLayerWeight = " << sampleLayerWeight[iLayer] << std::endl;
-                        std::cout << c_it->first << "Excitation E = " << energies[iRay] << std::endl;
-                        std::cout << c_it->first << "Fluorescence E = " << result[c_it->first]["energy"] << std::endl;
-                        std::cout << c_it->first << "mu_1_i = " << mu_1_i << std::endl;
-                        std::cout << c_it->first << "mu_1_lambda = " << mu_1_lambda<< std::endl;
-                        std::cout << c_it->first << "d * t = " << density_1 * thickness_1 << std::endl;
-                        std::cout << c_it->first << "mu_1_lambda/sinALphain = " << mu_1_lambda / sinAlphaIn<< std::endl;
-                        std::cout << c_it->first << "mu_1_i/sinALphaOut = " << mu_1_i / sinAlphaOut<< std::endl;
+                        mu_b_j_d_t += this->layerDensity[bLayer] * \
+                                      this->layerThickness[bLayer] * \
+                                      this->sourceLayerMuTotal[bLayer * nEnergies + iEnergy];
+                        bLayer++;
                     }
-                    */
+                    pairSources[nPairSources] = iLambda;
+                    pairMu1j[nPairSources] = this->sourceLayerMuTotal[iLayer * nEnergies + iEnergy];
+                    pairMu2j[nPairSources] = this->sourceLayerMuTotal[jLayer * nEnergies + iEnergy];
+                    pairMubjdt[nPairSources] = mu_b_j_d_t;
+                    nPairSources++;
                 }
-
-                if (secondary > 0)
+                if (nPairSources == 0)
+                    continue;
+                // p and q are negative in case b)
+                if (iLayer < jLayer)
                 {
-                    // calculate secondary
-                    for (jLayer = 0; jLayer < sample.size(); jLayer++)
+                    p = mu_2_lambda/sinAlphaIn;
+                    pShifted = mu_2_lambda/(0.99999*sinAlphaIn);
+                }
+                else
+                {
+                    p = -mu_2_lambda/sinAlphaIn;
+                    pShifted = -mu_2_lambda/(0.99999*sinAlphaIn);
+                }
+                for (iLine = 0; iLine < nFamilyLines; iLine++)
+                {
+                    if (!excited[iLine])
+                        continue;
+                    iCalculationLine = calculationLineOffset + iLine;
+                    mu_1_i = lineMuTotal[iLine];
+                    if (iLayer < jLayer)
+                    {
+                        lineFactor = std::exp(-mu_1_i * density_1 * thickness_1/sinAlphaOut);
+                        if ((!pruning) && (lineFactor < 0.001))
+                            continue;
+                        q = mu_1_i/sinAlphaOut;
+                    }
+                    else
                     {
-                        if (iLayer == jLayer)
+                        lineFactor = layerFactor;
+                        q = -mu_1_i/sinAlphaOut;
+                    }
+                    // select the sources contributing to the line, the de Boer integrals of
+                    // all of them but the ones needing the scatter workaround evaluated in one call
+                    nLineSources = 0;
+                    nBatchSources = 0;
+                    for (iPairSource = 0; iPairSource < nPairSources; iPairSource++)
+                    {
+                        iLambda = pairSources[iPairSource];
+                        iEnergy = this->sourceEnergyIndex[iLambda];
+                        if (!this->lineSecondaryExcited[iEnergy * nLines + lineOffset + iLine])
                         {
-                            // intralayer secondary
-                            for(iLambda = 0; iLambda < sampleLayerEnergies[jLayer].size(); iLambda++)
-                            {
-                                // analogous to incident beam
-                                if (energyThreshold > sampleLayerEnergies[jLayer][iLambda])
-                                    continue;
-                                bool calculate;
-                                calculate = true;
-                                if (excitationFactorsCache.find(elementName) != excitationFactorsCache.end())
-                                {
-                                    if (excitationFactorsCache[elementName].find(sampleLayerEnergies[jLayer][iLambda]) \
-                                            != excitationFactorsCache[elementName].end())
-                                    {
-                                        calculate = false;
-                                    }
-                                }
-                                if (calculate)
-                                {
-                                    excitationFactorsCache[elementName] \
-                                                [sampleLayerEnergies[jLayer][iLambda]] = \
-                                                        elementsLibrary.getExcitationFactors(elementName, \
-                                                        sampleLayerEnergies[jLayer][iLambda], \
-                                                        1.0);
-                                }
-                                tmpExcitationFactors = excitationFactorsCache[elementName] \
-                                                        [sampleLayerEnergies[jLayer][iLambda]];
-                                for (c_it = result.begin(); c_it != result.end(); ++c_it)
-                                {
-                                    if (tmpExcitationFactors.find(c_it->first) == tmpExcitationFactors.end())
-                                    {
-                                        // TODO: This needs a comment
-                                        continue;
-                                    }
-                                    mapIt = result[c_it->first].find("mu_1_i");
-                                    if (mapIt == result[c_it->first].end())
-                                        throw std::runtime_error(" mu_1_i key. Mass attenuation not present???");
-                                    mu_1_i = mapIt->second;
-                                    tmpDouble = Math::deBoerL0(mu_1_lambda / sinAlphaIn,
-                                                               mu_1_i / sinAlphaOut,
-                                                               sampleLayerMuTotal[jLayer][iLambda],
-                                                               density_1,
-                                                               thickness_1);
-                                    // Workaround incident angle of 90 degrees and scatter contribution
-                                    if ((mu_1_lambda / sinAlphaIn) == sampleLayerMuTotal[jLayer][iLambda])
-                                        tmpDouble += Math::deBoerL0(mu_1_i / sinAlphaOut,
-                                                               mu_1_lambda / (0.99999*sinAlphaIn),
-                                                               sampleLayerMuTotal[jLayer][iLambda],
-                                                               density_1,
-                                                               thickness_1);
-                                    else
-                                        tmpDouble += Math::deBoerL0(mu_1_i / sinAlphaOut,
-                                                               mu_1_lambda / sinAlphaIn,
-                                                               sampleLayerMuTotal[jLayer][iLambda],
-                                                               density_1,
-                                                               thickness_1);
-                                    tmpDouble *= elementMassFractionFactor * (0.5/sinAlphaIn);
-                                    tmpDouble *= tmpExcitationFactors[c_it->first]["rate"] * \
-                                                    sampleLayerRates[jLayer][iLambda];
-                                    tmpStringStream.str(std::string());
-                                    tmpStringStream.clear();
-                                    tmpStringStream << std::setfill('0') << std::setw(2) << jLayer;
-                                    tmpString = sampleLayerEnergyNames[jLayer][iLambda] + " " + tmpStringStream.str();
-                                    if (actualResult[elementName + " " + lineFamily][iLayer][c_it->first].find(tmpString) == \
-                                        actualResult[elementName + " " + lineFamily][iLayer][c_it->first].end())
-                                    {
-                                        actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] = 0.0;
-                                    }
-                                    actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] += \
-                                                                                                    tmpDouble;
-                                    result[c_it->first]["secondary"] += tmpDouble;
-                                    result[c_it->first]["rate"] += tmpDouble * \
-                                                                   result[c_it->first]["efficiency"];
-                                }
-                            }
+                            // This happens when, for instance, we look for K lines, but obviously
+                            // L lines are present
+                            continue;
                         }
-                        else
+                        exRate = this->lineSecondaryRate[iEnergy * nLines + lineOffset + iLine];
+                        if (exRate < 1.0e-30)
+                        {
+                            continue;
+                        }
+                        if (pruning)
                         {
-                            if ((sampleLayerWeight[jLayer] / sampleLayerWeight[iLayer]) < 1.0E-4)
+                            // bound of the de Boer integrals times the attenuation factors below
+                            // assuming all the photons reaching layer iLayer absorbed there
+                            tmpDouble = mu_2_lambda / sinAlphaIn;
+                            bound = (1.0 - std::exp(-tmpDouble * density_2 * thickness_2)) / \
+                                    (tmpDouble * pairMu1j[iPairSource]);
+                            bound *= elementMassFractionFactor * (0.5/sinAlphaIn) * \
+                                     exRate * this->sourceRate[iLambda];
+                            if ((rayNeglected[iCalculationLine] + bound) <= \
+                                (this->secondaryTolerance * rayPrimary[iCalculationLine]))
                             {
-                                // The incident reaching the layer originating the secondary excitation
-                                // is relatively much weaker. In the common energy range of XRF interest,
-                                // one will certainly recover less than of 50 % of the incident photons
-                                // reaching the jLayer originating the secondary excitation "beam".
-                                // An additional factor 100 is accounted for because of the possible ratio
-                                // of attenuation coefficient of the element at incident and secondary excitation
-                                // photon energies
+                                rayNeglected[iCalculationLine] += bound;
                                 continue;
                             }
-
-                            // continue;
-                            mu_2_lambda = muTotal[jLayer];
-                            density_2 = sampleLayerDensity[jLayer];
-                            thickness_2 = sampleLayerThickness[jLayer];
+                        }
+                        lineSources[nLineSources] = iPairSource;
+                        nLineSources++;
+                        // Workaround incident angle of 90 degrees and scatter contribution
+                        if (-p == pairMu2j[iPairSource])
+                            continue;
+                        batchMu1j[nBatchSources] = pairMu1j[iPairSource];
+                        batchMu2j[nBatchSources] = pairMu2j[iPairSource];
+                        batchMubjdt[nBatchSources] = pairMubjdt[iPairSource];
+                        nBatchSources++;
+                    }
+                    if (nLineSources == 0)
+                        continue;
+                    Math::deBoerX(p, q, density_1 * thickness_1, density_2 * thickness_2, \
+                                  &(batchMu1j[0]), &(batchMu2j[0]), &(batchMubjdt[0]), \
+                                  &(batchX[0]), nBatchSources);
+                    iBatchSource = 0;
+                    for (iLineSource = 0; iLineSource < nLineSources; iLineSource++)
+                    {
+                        iPairSource = lineSources[iLineSource];
+                        iLambda = pairSources[iPairSource];
+                        iEnergy = this->sourceEnergyIndex[iLambda];
+                        mu_1_j = pairMu1j[iPairSource];
+                        mu_2_j = pairMu2j[iPairSource];
+                        mu_b_j_d_t = pairMubjdt[iPairSource];
+                        exRate = this->lineSecondaryRate[iEnergy * nLines + lineOffset + iLine];
+                        tmpDouble = lineFactor;
+                        tmpDouble *= this->sourceRate[iLambda];
+                        if (-p == mu_2_j)
+                        {
+                            tmpDouble *= Math::deBoerX(pShifted, q, \
+                                                       density_1 * thickness_1, \
+                                                       density_2 * thickness_2, \
+                                                       mu_1_j, \
+                                                       mu_2_j, \
+                                                       mu_b_j_d_t);
+                        }
+                        else
+                        {
+                            tmpDouble *= batchX[iBatchSource];
+                            iBatchSource++;
+                        }
+                        tmpDouble *= elementMassFractionFactor * (0.5/sinAlphaIn);
+                        tmpDouble *= exRate;
+                        if (derivativeTerms)
+                        {
+                            // same arguments as above, p and q are negative in case b)
+                            row = &(rayDerivative[iCalculationLine * nParameters]);
                             if (iLayer < jLayer)
                             {
-                                // interlayer case a)
-                                for(iLambda = 0;
-                                    iLambda < sampleLayerEnergies[jLayer].size(); \
-                                    iLambda++)
+                                sign = 1.0;
+                                scale = (-(mu_2_lambda/sinAlphaIn) == mu_2_j) ? 1.0 / 0.99999 : 1.0;
+                                factor = std::exp(-mu_1_i * density_1 * thickness_1/sinAlphaOut);
+                                // attenuation of the line by the layer on its way to the detector
+                                addLayerTerm(row, iLayer, -tmpDouble * density_1 * thickness_1 / sinAlphaOut, \
+                                             &(this->lineParameterMuTotal[(lineOffset + iLine) * nParameters]));
+                                if (thicknessTerms)
                                 {
-                                    // analogous to incident beam
-                                    energy = sampleLayerEnergies[jLayer][iLambda];
-                                    if (energyThreshold > energy)
-                                        continue;
-                                    bool calculate;
-                                    calculate = true;
-                                    if (excitationFactorsCache.find(elementName) != excitationFactorsCache.end())
-                                    {
-                                        if (excitationFactorsCache[elementName].find(sampleLayerEnergies[jLayer][iLambda]) \
-                                                != excitationFactorsCache[elementName].end())
-                                        {
-                                            calculate = false;
-                                        }
-                                    }
-                                    if (calculate)
-                                    {
-                                        excitationFactorsCache[elementName] \
-                                                    [sampleLayerEnergies[jLayer][iLambda]] = \
-                                                            elementsLibrary.getExcitationFactors(elementName, \
-                                                            sampleLayerEnergies[jLayer][iLambda], \
-                                                            1.0);
-                                    }
-                                    tmpExcitationFactors = excitationFactorsCache[elementName] \
-                                                            [sampleLayerEnergies[jLayer][iLambda]];
-                                    for (c_it = result.begin(); c_it != result.end(); ++c_it)
-                                    {
-                                        if (tmpExcitationFactors.find(c_it->first) == tmpExcitationFactors.end())
-                                        {
-                                            // This happens when we look for K lines, but obviously L lines are
-                                            // present
-                                            //std::cout << "Not considered " << c_it->first ;
-                                            //std::cout << " energy = " << sampleLayerEnergies[iLayer][iLambda] << std::endl;
-                                            continue;
-                                        }
-                                        if (tmpExcitationFactors[c_it->first]["rate"] < 1.0e-30)
-                                        {
-                                            // TODO: Is this test necessary or should it be part of optional optimizations?
-                                            continue;
-                                        }
-
-                                        mapIt = result[c_it->first].find("mu_1_i");
-                                        if (mapIt == result[c_it->first].end())
-                                            throw std::runtime_error(" mu_1_i key. Mass attenuation not present???");
-                                        /*
-                                        if(std::lower_bound(muTotalCacheEnergies.begin(), muTotalCacheEnergies.end(), energy) == \
-                                           muTotalCacheEnergies.end())
-                                           {
-                                               std::cout << "c_it->first = " << c_it->first << "elementName " << elementName << std::endl;
-                                               std::cout << "Energy not found ;" << energy << std::endl;
-                                               throw std::runtime_error("STOP");
-                                           }
-                                        */
-                                        mu_1_i = mapIt->second;
-                                        int cacheIndex;
-                                        cacheIndex = -1;
-                                        if (std::binary_search(muTotalCacheEnergies.begin(), muTotalCacheEnergies.end(), energy))
-                                        {
-                                            cacheIndex = std::lower_bound(muTotalCacheEnergies.begin(), \
-                                                                              muTotalCacheEnergies.end(), \
-                                                                              energy) - muTotalCacheEnergies.begin();
-                                            mu_1_j = muTotalCacheLayer[iLayer][cacheIndex];
-                                        }
-                                        else
-                                        {
-                                            mu_1_j = \
-                                                this->getLayerMassAttenuationCoefficients(sample[iLayer], energy, \
-                                                                            elementsLibrary,
-                                                                            sampleLayerCompositionList[iLayer])["total"];
-                                        }
-
-                                        mu_2_j = sampleLayerMuTotal[jLayer][iLambda];
-                                        bLayer = iLayer + 1;
-                                        mu_b_j_d_t = 0.0;
-                                        while (bLayer < jLayer)
-                                        {
-                                            if (cacheIndex >= 0)
-                                            {
-                                                mu_b_j_d_t += sampleLayerDensity[bLayer] * \
-                                                              sampleLayerThickness[bLayer] * \
-                                                              muTotalCacheLayer[bLayer][cacheIndex];
-                                            }
-                                            else
-                                            {
-                                                mu_b_j_d_t += sampleLayerDensity[bLayer] * \
-                                                              sampleLayerThickness[bLayer] * \
-                                                              this->getLayerMassAttenuationCoefficients(sample[bLayer], \
-                                                                                                        energy, \
-                                                                                        elementsLibrary,
-                                                                                        sampleLayerCompositionList[bLayer])["total"];
-                                            }
-                                            bLayer++;
-                                        }
-                                        tmpDouble = std::exp(-mu_1_i * density_1 * thickness_1/sinAlphaOut);
-                                        if (tmpDouble < 0.001)
-                                            continue;
-                                        tmpDouble *= sampleLayerRates[jLayer][iLambda];
-                                        if (-(mu_2_lambda/sinAlphaIn) == mu_2_j)
-                                            tmpDouble *= Math::deBoerX(mu_2_lambda/(0.99999*sinAlphaIn), \
-                                                                  mu_1_i/sinAlphaOut, \
-                                                                  density_1 * thickness_1, \
-                                                                  density_2 * thickness_2, \
-                                                                  mu_1_j, \
-                                                                  mu_2_j, \
-                                                                  mu_b_j_d_t);
-                                        else
-                                            tmpDouble *= Math::deBoerX(mu_2_lambda/sinAlphaIn, \
-                                                                  mu_1_i/sinAlphaOut, \
-                                                                  density_1 * thickness_1, \
-                                                                  density_2 * thickness_2, \
-                                                                  mu_1_j, \
-                                                                  mu_2_j, \
-                                                                  mu_b_j_d_t);
-                                        tmpDouble *= elementMassFractionFactor * (0.5/sinAlphaIn);
-                                        tmpDouble *= tmpExcitationFactors[c_it->first]["rate"];
-                                        tmpStringStream.str(std::string());
-                                        tmpStringStream.clear();
-                                        tmpStringStream << std::setfill('0') << std::setw(2) << jLayer;
-                                        tmpString = sampleLayerEnergyNames[jLayer][iLambda] + " " + tmpStringStream.str();
-                                        if (actualResult[elementName + " " + lineFamily][iLayer][c_it->first].find(tmpString) == \
-                                            actualResult[elementName + " " + lineFamily][iLayer][c_it->first].end())
-                                        {
-                                            actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] = 0.0;
-                                        }
-                                        actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] += \
-                                                                                                        tmpDouble;
-                                        result[c_it->first]["secondary"] += tmpDouble;
-                                        result[c_it->first]["rate"] += tmpDouble * \
-                                                                       result[c_it->first]["efficiency"];
-                                    }
+                                    row[thicknessOffset + iLayer] -= tmpDouble * mu_1_i / sinAlphaOut;
                                 }
                             }
-                            if (iLayer > jLayer)
+                            else
                             {
-                                // interlayer case b)
-                                double layerFactor;
-                                layerFactor = std::exp(-mu_2_lambda * density_2 * thickness_2/sinAlphaIn);
-                                /*
-                                This test has been removed in favour of the one dealing with the relative
-                                weights of each layer. Indeed, the relative amount of secondary excitation
-                                can be huge important. Other point is if we are going to detect something.
-                                if (layerFactor < 0.001)
-                                {
-                                    // No need to calculate anything, the top layer attenuates too much the
-                                    // incoming beam
-                                    continue;
-                                }
-                                */
-                                for(iLambda = 0;
-                                    iLambda < sampleLayerEnergies[jLayer].size(); \
-                                    iLambda++)
+                                sign = -1.0;
+                                scale = ((mu_2_lambda/sinAlphaIn) == mu_2_j) ? 1.0 / 0.99999 : 1.0;
+                                factor = layerFactor;
+                                // attenuation of the beam by the source layer
+                                addLayerTerm(row, jLayer, -tmpDouble * density_2 * thickness_2 / sinAlphaIn, \
+                                             &(this->rayParameterMuTotal[iRay * nParameters]));
+                                if (thicknessTerms)
                                 {
-                                    // analogous to incident beam
-                                    energy = sampleLayerEnergies[jLayer][iLambda];
-                                    if (energyThreshold > energy)
-                                        continue;
-                                    bool calculate;
-                                    calculate = true;
-                                    if (excitationFactorsCache.find(elementName) != excitationFactorsCache.end())
-                                    {
-                                        if (excitationFactorsCache[elementName].find(sampleLayerEnergies[jLayer][iLambda]) \
-                                                != excitationFactorsCache[elementName].end())
-                                        {
-                                            calculate = false;
-                                        }
-                                    }
-                                    if (calculate)
-                                    {
-                                        excitationFactorsCache[elementName] \
-                                                    [sampleLayerEnergies[jLayer][iLambda]] = \
-                                                            elementsLibrary.getExcitationFactors(elementName, \
-                                                            sampleLayerEnergies[jLayer][iLambda], \
-                                                            1.0);
-                                    }
-                                    tmpExcitationFactors = excitationFactorsCache[elementName] \
-                                                            [sampleLayerEnergies[jLayer][iLambda]];
-                                    for (c_it = result.begin(); c_it != result.end(); ++c_it)
-                                    {
-                                        if (tmpExcitationFactors.find(c_it->first) == tmpExcitationFactors.end())
-                                        {
-                                            // This happens when, for instance, we look for K lines, but obviously
-                                            // L lines are present
-                                            //std::cout << "Not considered " << c_it->first ;
-                                            //std::cout << " energy = " << sampleLayerEnergies[iLayer][iLambda] << std::endl;
-                                            continue;
-                                        }
-                                        if (tmpExcitationFactors[c_it->first]["rate"] < 1.0e-30)
-                                        {
-                                            continue;
-                                        }
-                                        mapIt = result[c_it->first].find("mu_1_i");
-                                        if (mapIt == result[c_it->first].end())
-                                            throw std::runtime_error(" mu_1_i key. Mass attenuation not present???");
-                                        mu_1_i = mapIt->second;
-                                        int cacheIndex;
-                                        cacheIndex = -1;
-                                        if (std::binary_search(muTotalCacheEnergies.begin(), muTotalCacheEnergies.end(), energy))
-                                        {
-                                            cacheIndex = std::lower_bound(muTotalCacheEnergies.begin(), \
-                                                                              muTotalCacheEnergies.end(), \
-                                                                              energy) - muTotalCacheEnergies.begin();
-                                            mu_1_j = muTotalCacheLayer[iLayer][cacheIndex];
-                                        }
-                                        else
-                                        {
-                                            mu_1_j = \
-                                                this->getLayerMassAttenuationCoefficients(sample[iLayer], energy, \
-                                                                                    elementsLibrary,
-                                                                                    sampleLayerCompositionList[iLayer])["total"];
-                                        }
-
-                                        mu_2_j = sampleLayerMuTotal[jLayer][iLambda];
-                                        bLayer = jLayer + 1;
-                                        mu_b_j_d_t = 0.0;
-                                        while (bLayer < iLayer)
-                                        {
-                                            if (cacheIndex >= 0)
-                                            {
-                                                mu_1_j = muTotalCacheLayer[iLayer][cacheIndex];
-                                                mu_b_j_d_t += sampleLayerDensity[bLayer] * \
-                                                              sampleLayerThickness[bLayer] * \
-                                                              muTotalCacheLayer[bLayer][cacheIndex];
-                                            }
-                                            else
-                                            {
-                                                mu_b_j_d_t += sampleLayerDensity[bLayer] * \
-                                                              sampleLayerThickness[bLayer] * \
-                                                              this->getLayerMassAttenuationCoefficients(sample[bLayer], energy, \
-                                                                                    elementsLibrary,
-                                                                                    sampleLayerCompositionList[bLayer])["total"];
-                                            }
-
-                                            bLayer++;
-                                        }
-                                        tmpDouble = layerFactor * sampleLayerRates[jLayer][iLambda];
-                                        if ((mu_2_lambda/sinAlphaIn) == mu_2_j)
-                                            tmpDouble *= Math::deBoerX(-mu_2_lambda/(0.99999*sinAlphaIn), \
-                                                                  -mu_1_i/sinAlphaOut, \
-                                                                  density_1 * thickness_1, \
-                                                                  density_2 * thickness_2, \
-                                                                  mu_1_j, \
-                                                                  mu_2_j, \
-                                                                  mu_b_j_d_t);
-                                        else
-                                            tmpDouble *= Math::deBoerX(-mu_2_lambda/sinAlphaIn, \
-                                                                  -mu_1_i/sinAlphaOut, \
-                                                                  density_1 * thickness_1, \
-                                                                  density_2 * thickness_2, \
-                                                                  mu_1_j, \
-                                                                  mu_2_j, \
-                                                                  mu_b_j_d_t);
-                                        tmpDouble *= elementMassFractionFactor * (0.5/sinAlphaIn);
-                                        tmpDouble *= tmpExcitationFactors[c_it->first]["rate"];
-                                        tmpStringStream.str(std::string());
-                                        tmpStringStream.clear();
-                                        tmpStringStream << std::setfill('0') << std::setw(2) << jLayer;
-                                        tmpString = sampleLayerEnergyNames[jLayer][iLambda] + " " + tmpStringStream.str();
-                                        if (actualResult[elementName + " " + lineFamily][iLayer][c_it->first].find(tmpString) == \
-                                            actualResult[elementName + " " + lineFamily][iLayer][c_it->first].end())
-                                        {
-                                            actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] = 0.0;
-                                        }
-                                        actualResult[elementName + " " + lineFamily][iLayer][c_it->first][tmpString] += \
-                                                                                                        tmpDouble;
-                                        result[c_it->first]["secondary"] += tmpDouble;
-                                        result[c_it->first]["rate"] += tmpDouble * \
-                                                                       result[c_it->first]["efficiency"];
-                                    }
+                                    row[thicknessOffset + jLayer] -= tmpDouble * mu_2_lambda / sinAlphaIn;
                                 }
                             }
-                        }
-                    }
-                }
-
-                // here we are done for the element and the layer
-                key = elementName + " " + lineFamily;
-                for (c_it = result.begin(); c_it != result.end(); ++c_it)
-                {
-                    double totalEscape = 0.0;
-                    if (detector.hasMaterialComposition() || (detector.getMaterialName().size() > 0 ))
-                    {
-                        // calculate (if needed) escape ratio
-                        escapeRates = detector.getEscape(result[c_it->first]["energy"], \
-                                                         elementsLibrary, \
-                                                         elementName + c_it->first, \
-                                                         updateEscape);
-                        if (escapeRates.size())
-                        {
-                            updateEscape = 0;
-                            std::map<std::string, std::map<std::string, double> >::const_iterator c_it2;
-     //                       std::map<std::string, double>::const_iterator mapIt;
-                            for( c_it2 = escapeRates.begin(); c_it2!= escapeRates.end(); ++c_it2)
+                            factor *= this->sourceRate[iLambda] * elementMassFractionFactor * \
+                                      (0.5/sinAlphaIn) * exRate;
+                            Math::deBoerXDerivatives(sign * scale * mu_2_lambda/sinAlphaIn, \
+                                                     sign * mu_1_i/sinAlphaOut, \
+                                                     density_1 * thickness_1, \
+                                                     density_2 * thickness_2, \
+                                                     mu_1_j, \
+                                                     mu_2_j, \
+                                                     mu_b_j_d_t, gradient);
+                            addLayerTerm(row, jLayer, factor * gradient[0] * sign * scale / sinAlphaIn, \
+                                         &(this->rayParameterMuTotal[iRay * nParameters]));
+                            addLayerTerm(row, iLayer, factor * gradient[1] * sign / sinAlphaOut, \
+                                         &(this->lineParameterMuTotal[(lineOffset + iLine) * nParameters]));
+                            addLayerTerm(row, iLayer, factor * gradient[4], \
+                                         &(this->sourceParameterMuTotal[iEnergy * nParameters]));
+                            addLayerTerm(row, jLayer, factor * gradient[5], \
+                                         &(this->sourceParameterMuTotal[iEnergy * nParameters]));
+                            if (thicknessTerms)
                             {
-                                tmpString = c_it->first + " "+ c_it2->first;
-                                if (actualResult[key][iLayer].find(tmpString) == actualResult[key][iLayer].end())
-                                {
-                                    mapIt = c_it2->second.find("energy");
-                                    if (mapIt == c_it2->second.end())
-                                    {
-                                        throw std::runtime_error("Missing energy key in escape peak information!");
-                                    }
-                                    actualResult[key][iLayer][tmpString]["energy"] = mapIt->second;
-                                    actualResult[key][iLayer][tmpString]["rate"] = 0.0;
-                                    actualResult[key][iLayer][tmpString]["ratio"] = 0.0;
-                                    actualResult[key][iLayer][tmpString]["primary"] = 0.0;
-                                    actualResult[key][iLayer][tmpString]["secondary"] = 0.0;
-                                }
-                                mapIt = c_it2->second.find("rate");
-                                if (mapIt == c_it2->second.end())
+                                row[thicknessOffset + iLayer] += factor * gradient[2];
+                                row[thicknessOffset + jLayer] += factor * gradient[3];
+                            }
+                            bLayer = (iLayer < jLayer) ? iLayer + 1 : jLayer + 1;
+                            while (bLayer < ((iLayer < jLayer) ? jLayer : iLayer))
+                            {
+                                addLayerTerm(row, bLayer, \
+                                             factor * gradient[6] * this->layerDensity[bLayer] * this->layerThickness[bLayer], \
+                                             &(this->sourceParameterMuTotal[iEnergy * nParameters]));
+                                if (thicknessTerms)
                                 {
-                                    throw std::runtime_error("Missing rate key in escape peak information!");
+                                    row[thicknessOffset + bLayer] += factor * gradient[6] * \
+                                                                     this->sourceLayerMuTotal[bLayer * nEnergies + iEnergy];
                                 }
-                                totalEscape += mapIt->second;
-                                actualResult[key][iLayer][tmpString]["rate"] += mapIt->second * result[c_it->first]["rate"];
-                                actualResult[key][iLayer][tmpString]["ratio"] = mapIt->second;
-                                // The only meaning of filling "primary" and "secondary" for a escape peak is in order to
-                                // be able to evaluate the ratio without having to refer to the actual parent line.
-                                actualResult[key][iLayer][tmpString]["primary"] += mapIt->second * result[c_it->first]["primary"];
-                                actualResult[key][iLayer][tmpString]["secondary"] += mapIt->second * result[c_it->first]["secondary"];
+                                bLayer++;
                             }
+                            addSourceTerm(row, jLayer, tmpDouble, iLambda, iRay);
                         }
+                        if (contributions != NULL)
+                        {
+                            iContributor = this->sourceContributorIndex[this->sourceNameIndex[iLambda] * nLayers + jLayer];
+                            index = this->calculationLineResultIndex[iCalculationLine] * nContributors + iContributor;
+                            contributions[index] += tmpDouble;
+                            contributorMask[index] = 1;
+                        }
+                        raySecondary[iCalculationLine] += tmpDouble;
+                        rayRate[iCalculationLine] += tmpDouble * \
+                                                     this->calculationLineEfficiency[iCalculationLine];
                     }
-                    actualResult[key][iLayer][c_it->first]["rate"] += (1.0 - totalEscape) * result[c_it->first]["rate"];
-                    // primary and secondary are the same independently of having escape or not.
-                    actualResult[key][iLayer][c_it->first]["primary"] += result[c_it->first]["primary"];
-                    actualResult[key][iLayer][c_it->first]["secondary"] += result[c_it->first]["secondary"];
-                    actualResult[key][iLayer][c_it->first]["massFraction"] = elementMassFraction;
                 }
             }
-        }
-    }
-    if (secondary > 1)
-    {
-        // std::cout << "WARNING: Tertiary excitation under development " << std::endl;
-        // approximate tertiary excitation
-        // we ignore the case of excitation after double rayleigh/coherent scattering
-        // Tertiary will not be correct if the peaks of the sample elements are not
-        // included in the list of peaks
-        std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > >::iterator actualResultIt;
-        std::map<std::string, std::map<std::string, double> >::iterator c_it;
-        std::map<std::string, std::map<std::string, double> >::iterator it;
-        std::map<std::string, std::map<std::string, double> >::iterator it2;
-        std::map<std::string, double> contributingKeys;
-        std::map<std::string, double>::iterator contributingKeysIt;
-        std::string key;
-        std::ostringstream tmpStringStream;
-        double factorFirst;
-        double tertiary;
-        std::string ele;
-        for (actualResultIt = actualResult.begin(); actualResultIt != actualResult.end(); ++actualResultIt)
-        {
-            ele = actualResultIt->first.substr(0, actualResultIt->first.find(' '));
-            for (iLayer = 0; iLayer < actualResultIt->second.size(); iLayer++)
+
+            // here we are done for the element and the layer
+            for (iLine = 0; iLine < nFamilyLines; iLine++)
             {
-                for (it = actualResultIt->second[iLayer].begin(); \
-                     it != actualResultIt->second[iLayer].end(); ++it)
+                double totalEscape = 0.0;
+                if (!excited[iLine])
+                    continue;
+                iCalculationLine = calculationLineOffset + iLine;
+                index = this->calculationLineResultIndex[iCalculationLine];
+                row = NULL;
+                if (derivativeTerms)
                 {
-                    //std::cout << it->first << std::endl;
-                    if (it->first.find("esc") != std::string::npos)
-                    {
-                        // this is a escape line -> Ignore it
-                        continue;
-                    }
-                    if (it->second["massFraction"] < 5.0E-3)
+                    // mass fraction of the element and detection efficiency
+                    row = &(rayDerivative[iCalculationLine * nParameters]);
+                    effRow = &(this->calculationLineEfficiencyDerivative[iCalculationLine * nParameters]);
+                    if (this->calculationParameter[iCalculation] < nParameters)
                     {
-                        // one should be able to neglect tertiary excitation from elements
-                        // with less than 1 % concentration
-                        break;
+                        row[this->calculationParameter[iCalculation]] += (rayPrimary[iCalculationLine] + \
+                                                                          raySecondary[iCalculationLine]) / \
+                                                                         elementMassFractionFactor;
                     }
-                    factorFirst = 1.0;
-                    if (it->second["primary"] > 0.0)
+                    for (iParameter = 0; iParameter < nParameters; iParameter++)
                     {
-                        factorFirst = (it->second["primary"] + it->second["secondary"]) / \
-                                     it->second["primary"];
-                    }
-                    if (factorFirst < 1.01)
-                    {
-                        // tertiary contribution should already be less than 1 % -> Ignore it
-                        continue;
-                    }
-                    else
-                    {
-                        tmpStringStream.str(std::string());
-                        tmpStringStream.clear();
-                        tmpStringStream << std::setfill('0') << std::setw(2) << iLayer;
-                        key = ele + " " + it->first + " " + tmpStringStream.str();
-                        contributingKeys[key] = factorFirst;
-                        // the factor will be the same for all lines starting by KL2, being escape or not
+                        row[iParameter] = row[iParameter] * this->calculationLineEfficiency[iCalculationLine] + \
+                                          rayRate[iCalculationLine] * effRow[iParameter];
                     }
                 }
-            }
-        }
-
-        for (actualResultIt = actualResult.begin(); actualResultIt != actualResult.end(); ++actualResultIt)
-        {
-            for (iLayer = 0; iLayer < actualResultIt->second.size(); iLayer++)
-            {
-                for (it = actualResultIt->second[iLayer].begin(); \
-                     it != actualResultIt->second[iLayer].end(); ++it)
+                for (iEscape = this->lineEscapeOffset[lineOffset + iLine]; \
+                     iEscape < this->lineEscapeOffset[lineOffset + iLine + 1]; iEscape++)
                 {
-                    factorFirst = 1.0;
-                    tertiary = 0.0;
-                    if (it->second["primary"] > 0.0)
-                    {
-                        factorFirst = (it->second["primary"] + it->second["secondary"]) / \
-                                     it->second["primary"];
-                    }
-                    if (factorFirst < 1.01)
-                    {
-                        // It had less than 1 % secondary, we assume tertiary will be even less
-                        it->second["tertiary"] = 0.0;
-                        continue;
-                    }
-                    if (it->first.find("esc") != std::string::npos)
-                    {
-                        // this is a escape line -> the contribution to be used is the one of
-                        // the originating line that should already be calculated
-                        key = it->first.substr(0, it->first.find(" "));
-                        tertiary = (it->second["primary"] + it->second["secondary"]) * \
-                                   (actualResultIt->second[iLayer][key]["tertiary"] /  \
-                                   (actualResultIt->second[iLayer][key]["primary"] +   \
-                                    actualResultIt->second[iLayer][key]["secondary"]));
-                    }
-                    else
+                    escapeIndex = (iFamily * nLayers + iLayer) * nResultLines + this->escapeResultIndex[iEscape];
+                    totalEscape += this->escapeRatio[iEscape];
+                    for (iParameter = 0; iParameter < nParameters; iParameter++)
                     {
-                        for (contributingKeysIt = contributingKeys.begin(); \
-                             contributingKeysIt != contributingKeys.end(); ++contributingKeysIt)
-                        {
-                            if (it->second.find(contributingKeysIt->first) != it->second.end())
-                            {
-                                tertiary += it->second[contributingKeysIt->first] * \
-                                            (contributingKeysIt->second - 1.0);
-                            }
-                        }
+                        derivatives[escapeIndex * nParameters + iParameter] += this->escapeRatio[iEscape] * \
+                                                                               row[iParameter];
                     }
-                    it->second["tertiary"] = tertiary;
-                    // update the total rate to account for primary, secondary and tertiary
-                    // rate was equal to (primary + secondary) times a certain efficiency factor
-                    // rate = A * (primary + secondary) therefore  now we must update the rate to
-                    // account for tertiary rate = A * (primary + secondary + tertiary)
-                    it->second["rate"] *= (tertiary + it->second["primary"] + it->second["secondary"]) \
-                                          / (it->second["primary"] + it->second["secondary"]);
+                    values[escapeIndex * nQuantities + MultilayerResult::RATE] += \
+                                            this->escapeRatio[iEscape] * rayRate[iCalculationLine];
+                    // The only meaning of filling "primary" and "secondary" for a escape peak is in order to
+                    // be able to evaluate the ratio without having to refer to the actual parent line.
+                    values[escapeIndex * nQuantities + MultilayerResult::PRIMARY] += \
+                                            this->escapeRatio[iEscape] * rayPrimary[iCalculationLine];
+                    values[escapeIndex * nQuantities + MultilayerResult::SECONDARY] += \
+                                            this->escapeRatio[iEscape] * raySecondary[iCalculationLine];
+                }
+                values[index * nQuantities + MultilayerResult::RATE] += \
+                                            (1.0 - totalEscape) * rayRate[iCalculationLine];
+                // primary and secondary are the same independently of having escape or not.
+                values[index * nQuantities + MultilayerResult::PRIMARY] += rayPrimary[iCalculationLine];
+                values[index * nQuantities + MultilayerResult::SECONDARY] += raySecondary[iCalculationLine];
+                values[index * nQuantities + MultilayerResult::NEGLECTED] += rayNeglected[iCalculationLine];
+                for (iParameter = 0; iParameter < nParameters; iParameter++)
+                {
+                    derivatives[index * nParameters + iParameter] += (1.0 - totalEscape) * row[iParameter];
                 }
             }
         }
     }
-    // this->printConfiguration();
-    // this->lastMultilayerFluorescence = actualResult;
-    return actualResult;
+
 }
 
 } // namespace fisx
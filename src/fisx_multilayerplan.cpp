@@ -0,0 +1,2147 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#include "fisx_multilayerplan.h"
+#include "fisx_xrf.h"
+#include <cmath>
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <exception>
+#include <set>
+#include <iterator>
+
+namespace fisx
+{
+
+MultilayerPlan::MultilayerPlan()
+{
+    this->nThreads = 1;
+    this->outputLevel = MultilayerResult::FULL_BREAKDOWN;
+    this->secondaryTolerance = 0.0;
+    this->beamCompressionTolerance = 0.0;
+    this->massFractionDerivatives = 0;
+    this->massThicknessDerivatives = 0;
+    this->clear();
+}
+
+MultilayerPlan::MultilayerPlan(const XRFConfig & configuration, \
+                               const Elements & elementsLibrary, \
+                               const std::vector<std::string> & elementList, \
+                               const std::vector<int> & layerList, \
+                               const std::vector<std::string> & familyList, \
+                               const int & secondary, \
+                               const int & useGeometricEfficiency, \
+                               const int & useMassFractions, \
+                               const double & secondaryCalculationLimit, \
+                               const Beam & overwritingBeam)
+{
+    this->nThreads = 1;
+    this->outputLevel = MultilayerResult::FULL_BREAKDOWN;
+    this->secondaryTolerance = 0.0;
+    this->beamCompressionTolerance = 0.0;
+    this->massFractionDerivatives = 0;
+    this->massThicknessDerivatives = 0;
+    this->build(configuration, elementsLibrary, elementList, layerList, familyList, \
+                secondary, useGeometricEfficiency, useMassFractions, \
+                secondaryCalculationLimit, overwritingBeam);
+}
+
+void MultilayerPlan::setNumberOfThreads(const int & nThreads)
+{
+    if (nThreads < 1)
+    {
+        throw std::invalid_argument("Number of threads must be at least 1");
+    }
+    this->nThreads = nThreads;
+}
+
+void MultilayerPlan::setOutputLevel(const int & outputLevel)
+{
+    if ((outputLevel < MultilayerResult::RATES_ONLY) || (outputLevel > MultilayerResult::FULL_BREAKDOWN))
+    {
+        throw std::invalid_argument("Invalid output level");
+    }
+    this->outputLevel = outputLevel;
+}
+
+void MultilayerPlan::setSecondaryTolerance(const double & tolerance)
+{
+    if ((tolerance < 0.0) || (tolerance >= 1.0))
+    {
+        throw std::invalid_argument("Secondary tolerance must be in the range [0.0, 1.0)");
+    }
+    this->secondaryTolerance = tolerance;
+}
+
+void MultilayerPlan::setBeamCompressionTolerance(const double & tolerance)
+{
+    if ((tolerance < 0.0) || (tolerance >= 1.0))
+    {
+        throw std::invalid_argument("Beam compression tolerance must be in the range [0.0, 1.0)");
+    }
+    this->beamCompressionTolerance = tolerance;
+}
+
+void MultilayerPlan::setMassFractionDerivatives(const int & flag)
+{
+    this->massFractionDerivatives = (flag != 0) ? 1 : 0;
+}
+
+void MultilayerPlan::setMassThicknessDerivatives(const int & flag)
+{
+    this->massThicknessDerivatives = (flag != 0) ? 1 : 0;
+}
+
+void MultilayerPlan::runTasks(const std::vector<double>::size_type & nTasks, const int & nThreads, \
+                              const std::function<void(const std::vector<double>::size_type &)> & task)
+{
+    std::vector<double>::size_type iTask;
+    std::vector<double>::size_type nWorkers;
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> workerErrors;
+
+    nWorkers = (nThreads > 1) ? (std::vector<double>::size_type) nThreads : 1;
+    if (nWorkers > nTasks)
+    {
+        nWorkers = nTasks;
+    }
+    if (nWorkers < 2)
+    {
+        for (iTask = 0; iTask < nTasks; iTask++)
+        {
+            task(iTask);
+        }
+        return;
+    }
+    workerErrors.resize(nWorkers);
+    for (std::vector<double>::size_type iWorker = 0; iWorker < nWorkers; iWorker++)
+    {
+        workers.push_back(std::thread([&, iWorker]()
+        {
+            try
+            {
+                std::vector<double>::size_type jTask;
+                for (jTask = iWorker; jTask < nTasks; jTask += nWorkers)
+                {
+                    task(jTask);
+                }
+            }
+            catch (...)
+            {
+                workerErrors[iWorker] = std::current_exception();
+            }
+        }));
+    }
+    for (std::vector<double>::size_type iWorker = 0; iWorker < nWorkers; iWorker++)
+    {
+        workers[iWorker].join();
+    }
+    for (std::vector<double>::size_type iWorker = 0; iWorker < nWorkers; iWorker++)
+    {
+        if (workerErrors[iWorker])
+        {
+            std::rethrow_exception(workerErrors[iWorker]);
+        }
+    }
+}
+
+void MultilayerPlan::checkLayerComposition(const int & layerIndex, \
+                                           const std::map<std::string, double> & composition, \
+                                           const Elements & elementsLibrary) const
+{
+    std::map<std::string, double>::const_iterator c_it;
+
+    if ((layerIndex < 0) || (layerIndex >= (int) this->layerDensity.size()))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+    if (composition.size() < 1)
+    {
+        throw std::invalid_argument("Empty composition");
+    }
+    for (c_it = composition.begin(); c_it != composition.end(); ++c_it)
+    {
+        if (!elementsLibrary.isElementNameDefined(c_it->first))
+        {
+            throw std::invalid_argument("Name " + c_it->first + " not among defined elements");
+        }
+        if (c_it->second < 0.0)
+        {
+            throw std::invalid_argument("Name " + c_it->first + " has a negative mass fraction");
+        }
+    }
+}
+
+void MultilayerPlan::setLayerComposition(const int & layerIndex, \
+                                         const std::map<std::string, double> & composition, \
+                                         const Elements & elementsLibrary)
+{
+    this->checkLayerComposition(layerIndex, composition, elementsLibrary);
+    this->layerComposition[layerIndex] = composition;
+    this->buildSampleTerms(elementsLibrary);
+}
+
+const std::map<std::string, double> & MultilayerPlan::getLayerComposition(const int & layerIndex) const
+{
+    if ((layerIndex < 0) || (layerIndex >= (int) this->layerDensity.size()))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+    return this->layerComposition[layerIndex];
+}
+
+void MultilayerPlan::clear()
+{
+    this->secondary = 0;
+    this->useMassFractions = 0;
+    this->secondaryCalculationLimit = 0.0;
+    this->minimumExcitationEnergy = -1.0;
+    this->alphaIn = 90.0;
+    this->sinAlphaIn = 1.0;
+    this->alphaOut = 90.0;
+    this->sinAlphaOut = 1.0;
+    this->layerName.clear();
+    this->layerDensity.clear();
+    this->layerThickness.clear();
+    this->layerFunnyFactor.clear();
+    this->layerComposition.clear();
+    this->layerGeometricEfficiency.clear();
+    this->rayEnergy.clear();
+    this->rayWeight.clear();
+    this->scanEnergy.clear();
+    this->scanRay.clear();
+    this->rayLayerMuTotal.clear();
+    this->rayLayerWeight.clear();
+    this->sourceOffset.clear();
+    this->sourceOffset.push_back(0);
+    this->sourceEnergyIndex.clear();
+    this->sourceNameIndex.clear();
+    this->sourceRate.clear();
+    this->sourceFactor.clear();
+    this->sourceScattering.clear();
+    this->sourceNames.clear();
+    this->sourceEnergies.clear();
+    this->sourceLayerMuTotal.clear();
+    this->tableEnergies.clear();
+    this->tableEnergyIndex.clear();
+    this->tableElements.clear();
+    this->tableLayerMuTotal.clear();
+    this->tableLayerMuCoherent.clear();
+    this->tableElementMuTotal.clear();
+    this->tableElementMuCoherent.clear();
+    this->rayTableIndex.clear();
+    this->lineTableIndex.clear();
+    this->sourceTableIndex.clear();
+    this->familyKey.clear();
+    this->familyElement.clear();
+    this->familyEnergyThreshold.clear();
+    this->familyLineOffset.clear();
+    this->familyLineOffset.push_back(0);
+    this->familyLayerRequested.clear();
+    this->lineName.clear();
+    this->lineEnergy.clear();
+    this->linePrimaryRate.clear();
+    this->lineExcited.clear();
+    this->lineSecondaryRate.clear();
+    this->lineSecondaryExcited.clear();
+    this->lineEscapeOffset.clear();
+    this->lineEscapeOffset.push_back(0);
+    this->escapeName.clear();
+    this->escapeEnergy.clear();
+    this->escapeRatio.clear();
+    this->useGeometricEfficiency = 1;
+    this->referenceLayer = 0;
+    this->detectorDistance = 0.0;
+    this->detectorDiameter = 0.0;
+    this->nAttenuators = 0;
+    this->lineAttenuatorTransmission.clear();
+    this->lineDetectorEfficiency.clear();
+    this->elementMuCache.clear();
+    this->elementExcitationCache.clear();
+    this->peakFamiliesCache.clear();
+    this->familyExcitationCache.clear();
+    this->calculationFamily.clear();
+    this->calculationLayer.clear();
+    this->calculationMassFraction.clear();
+    this->calculationMassFractionFactor.clear();
+    this->calculationLineOffset.clear();
+    this->calculationLineOffset.push_back(0);
+    this->calculationLineMuTotal.clear();
+    this->calculationLineEfficiency.clear();
+    this->calculationLineResultIndex.clear();
+    this->resultLineNames.clear();
+    this->resultLineParents.clear();
+    this->lineResultIndex.clear();
+    this->escapeResultIndex.clear();
+    this->contributorNames.clear();
+    this->sourceContributorIndex.clear();
+    this->parameterNames.clear();
+    this->layerParameterOffset.clear();
+    this->parameterMassFraction.clear();
+    this->rayParameterMuTotal.clear();
+    this->rayParameterMuCoherent.clear();
+    this->lineParameterMuTotal.clear();
+    this->sourceParameterMuTotal.clear();
+    this->sourceParameter.clear();
+    this->calculationParameter.clear();
+    this->calculationLineEfficiencyDerivative.clear();
+    this->thicknessParameterOffset = 0;
+}
+
+void MultilayerPlan::build(const XRFConfig & configuration, \
+                           const Elements & elementsLibrary, \
+                           const std::vector<std::string> & elementList, \
+                           const std::vector<int> & layerList, \
+                           const std::vector<std::string> & familyList, \
+                           const int & secondary, \
+                           const int & useGeometricEfficiency, \
+                           const int & useMassFractions, \
+                           const double & secondaryCalculationLimit, \
+                           const Beam & overwritingBeam)
+{
+    std::vector<std::vector<double> >actualRays = overwritingBeam.getBeamAsDoubleVectors();
+    if (actualRays[0].size() < 1)
+        actualRays = configuration.getBeam().getBeamAsDoubleVectors();
+    this->buildFromRays(configuration, elementsLibrary, elementList, layerList, familyList, \
+                        secondary, useGeometricEfficiency, useMassFractions, secondaryCalculationLimit, \
+                        actualRays, true);
+}
+
+void MultilayerPlan::buildScan(const XRFConfig & configuration, \
+                               const Elements & elementsLibrary, \
+                               const std::vector<std::string> & elementList, \
+                               const std::vector<int> & layerList, \
+                               const std::vector<std::string> & familyList, \
+                               const std::vector<double> & incidentEnergies, \
+                               const int & secondary, \
+                               const int & useGeometricEfficiency, \
+                               const int & useMassFractions, \
+                               const double & secondaryCalculationLimit)
+{
+    std::vector<std::vector<double> > actualRays;
+    std::vector<double>::size_type i;
+    std::vector<double>::size_type nRays;
+
+    for (i = 0; i < incidentEnergies.size(); i++)
+    {
+        if (!(incidentEnergies[i] > 0.0))
+        {
+            std::cout << "Incident energy " << incidentEnergies[i] << " not positive" << std::endl;
+            throw std::invalid_argument("Incident energies of a scan must be positive");
+        }
+    }
+
+    // one ray of unit weight per distinct energy ordered by increasing energy as in a Beam instance
+    actualRays.resize(4);
+    actualRays[0] = incidentEnergies;
+    std::sort(actualRays[0].begin(), actualRays[0].end());
+    actualRays[0].erase(std::unique(actualRays[0].begin(), actualRays[0].end()), actualRays[0].end());
+    actualRays[1].resize(actualRays[0].size(), 1.0);
+    actualRays[2].resize(actualRays[0].size(), 1.0);
+    actualRays[3].resize(actualRays[0].size(), 0.0);
+    this->buildFromRays(configuration, elementsLibrary, elementList, layerList, familyList, \
+                        secondary, useGeometricEfficiency, useMassFractions, secondaryCalculationLimit, \
+                        actualRays, false);
+
+    // the rays are ordered by decreasing energy and those unable to excite any family are not kept
+    nRays = this->rayEnergy.size();
+    this->scanEnergy = incidentEnergies;
+    this->scanRay.resize(incidentEnergies.size());
+    for (i = 0; i < incidentEnergies.size(); i++)
+    {
+        this->scanRay[i] = std::lower_bound(this->rayEnergy.begin(), this->rayEnergy.end(), \
+                                            incidentEnergies[i], std::greater<double>()) - \
+                           this->rayEnergy.begin();
+        if ((this->scanRay[i] < nRays) && (this->rayEnergy[this->scanRay[i]] != incidentEnergies[i]))
+        {
+            this->scanRay[i] = nRays;
+        }
+    }
+}
+
+void MultilayerPlan::buildFromRays(const XRFConfig & configuration, \
+                                   const Elements & elementsLibrary, \
+                                   const std::vector<std::string> & elementList, \
+                                   const std::vector<int> & layerList, \
+                                   const std::vector<std::string> & familyList, \
+                                   const int & secondary, \
+                                   const int & useGeometricEfficiency, \
+                                   const int & useMassFractions, \
+                                   const double & secondaryCalculationLimit, \
+                                   std::vector<std::vector<double> > & actualRays, \
+                                   const bool & mergeRays)
+{
+    // the XRF instance knows how to deal with the materials defined in the configuration
+    XRF xrf;
+    xrf.setConfiguration(configuration);
+    const std::vector<double> & energies = actualRays[0];
+    std::vector<double> & weights = actualRays[1];
+    const std::vector<Layer> & filters = configuration.getBeamFilters();
+    const std::vector<TransmissionTable> & userFilters = configuration.getUserBeamFilters();
+    const std::vector<Layer> & sample = configuration.getSample();
+    const std::vector<Layer> & attenuators = configuration.getAttenuators();
+    const std::vector<TransmissionTable> & userAttenuators = configuration.getUserAttenuators();
+    Detector detector = configuration.getDetector();
+    const double PI = acos(-1.0);
+    std::vector<Layer>::size_type iLayer;
+    std::vector<Layer>::size_type jLayer;
+    std::vector<Layer>::size_type nLayers;
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type nRays;
+    std::vector<double>::size_type i;
+    std::vector<double>::size_type iLine;
+    std::vector<std::string>::size_type iFamily;
+    std::vector<TransmissionTable>::size_type iTransmissionTable;
+    std::vector<double> doubleVector;
+    std::map<std::string, std::vector<std::string>::size_type> familyIndex;
+    std::map<std::string, std::vector<std::string>::size_type>::const_iterator familyIt;
+    std::vector<std::string> familyActualFamily;
+    std::vector<std::string> familyLineFamily;
+    std::map<std::string, double>::const_iterator mapIt;
+    double tmpDouble;
+
+    this->clear();
+    this->secondary = secondary;
+    this->useMassFractions = useMassFractions;
+    this->secondaryCalculationLimit = secondaryCalculationLimit;
+    this->alphaIn = configuration.getAlphaIn();
+    this->sinAlphaIn = sin(this->alphaIn*(PI/180.));
+    this->alphaOut = configuration.getAlphaOut();
+    this->sinAlphaOut = sin(this->alphaOut*(PI/180.));
+    nLayers = sample.size();
+
+    // sample layers and their composition
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        this->layerName.push_back(sample[iLayer].getName());
+        this->layerDensity.push_back(sample[iLayer].getDensity());
+        this->layerThickness.push_back(sample[iLayer].getThickness());
+        this->layerFunnyFactor.push_back(sample[iLayer].getFunnyFactor());
+        this->layerComposition.push_back(xrf.getLayerComposition(sample[iLayer], elementsLibrary));
+        if ((secondary > 0) && (this->layerComposition[iLayer].size() < 1))
+        {
+            std::cout << sample[iLayer].getMaterial().getName() << std::endl;
+            std::cout << "sample composition empty!" << std::endl;
+        }
+    }
+
+    // get the beam after the beam filters
+    for (iLayer = 0; iLayer < filters.size(); iLayer++)
+    {
+        doubleVector = xrf.getLayerTransmission(filters[iLayer], energies, elementsLibrary);
+        for (iRay = 0; iRay < energies.size(); iRay++)
+        {
+            weights[iRay] *= doubleVector[iRay];
+        }
+    }
+    // account for user beam filters
+    for (iTransmissionTable = 0; iTransmissionTable < userFilters.size(); iTransmissionTable++)
+    {
+        doubleVector = userFilters[iTransmissionTable].getTransmission(energies);
+        for (iRay = 0; iRay < energies.size(); iRay++)
+        {
+            weights[iRay] *= doubleVector[iRay];
+        }
+    }
+
+    // geometric efficiency
+    this->useGeometricEfficiency = useGeometricEfficiency;
+    this->referenceLayer = configuration.getReferenceLayer();
+    this->detectorDistance = detector.getDistance();
+    this->detectorDiameter = detector.getDiameter();
+    this->layerGeometricEfficiency.resize(nLayers);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        this->layerGeometricEfficiency[iLayer] = this->getGeometricEfficiency(iLayer);
+    }
+
+    // requested element families. The same family requested twice is calculated once
+    this->minimumExcitationEnergy = -1.0;
+    for (i = 0; i < elementList.size(); i++)
+    {
+        const std::string & elementName = elementList[i];
+        const std::string & lineFamily = familyList[i];
+        std::string actualLineFamily;
+        int calculationLayer;
+        if (layerList.size() > 1)
+            calculationLayer = layerList[i];
+        else
+            calculationLayer = layerList[0];
+        actualLineFamily = lineFamily;
+        if (lineFamily == "Ka")
+        {
+            actualLineFamily = "KL";
+        }
+        if (lineFamily == "Kb")
+        {
+            // carefull, the actual condition is to start by K and not to be followed by L
+            actualLineFamily = "KM";
+        }
+        if (actualLineFamily == "")
+        {
+            throw std::runtime_error("All line families case not implemented yet!!!");
+        }
+        familyIt = familyIndex.find(elementName + " " + lineFamily);
+        if (familyIt == familyIndex.end())
+        {
+            iFamily = this->familyKey.size();
+            familyIndex[elementName + " " + lineFamily] = iFamily;
+            this->familyKey.push_back(elementName + " " + lineFamily);
+            this->familyElement.push_back(elementName);
+            familyLineFamily.push_back(lineFamily);
+            familyActualFamily.push_back(actualLineFamily);
+            tmpDouble = xrf.getEnergyThreshold(elementName, actualLineFamily.substr(0, 1), elementsLibrary);
+            this->familyEnergyThreshold.push_back(tmpDouble);
+            this->familyLayerRequested.resize(this->familyLayerRequested.size() + nLayers, 0);
+            if ((tmpDouble < this->minimumExcitationEnergy) || (this->minimumExcitationEnergy < 0.0))
+            {
+                this->minimumExcitationEnergy = tmpDouble;
+            }
+        }
+        else
+        {
+            iFamily = familyIt->second;
+        }
+        // a negative calculation layer implies calculation for all layers
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if ((calculationLayer < 0) || (iLayer == (std::vector<Layer>::size_type) calculationLayer))
+            {
+                this->familyLayerRequested[iFamily * nLayers + iLayer] = 1;
+            }
+        }
+    }
+
+    // merge the rays that do not need to be evaluated separately
+    if (mergeRays && (this->beamCompressionTolerance > 0.0))
+    {
+        this->compressBeam(actualRays, familyLineFamily, familyActualFamily, elementsLibrary);
+    }
+
+    // rays able to excite at least one family starting by the highest energy
+    iRay = energies.size();
+    while ((iRay > 0) && (this->familyKey.size() > 0))
+    {
+        --iRay;
+        if (energies[iRay] < this->minimumExcitationEnergy)
+        {
+            continue;
+        }
+        this->rayEnergy.push_back(energies[iRay]);
+        this->rayWeight.push_back(weights[iRay]);
+    }
+    nRays = this->rayEnergy.size();
+
+    // emission lines of each family excited by the beam. The families are independent of each other
+    // and they are evaluated as separate tasks, each one writing its own entries
+    std::vector<std::map<std::string, double> >::size_type nTotalLines;
+    std::map<std::string, double>::const_iterator lineIt;
+    std::vector<std::vector<std::map<std::string, double> > > allFamilyRayRates;
+    std::vector<std::map<std::string, double> > allFamilyLineEnergy;
+    allFamilyRayRates.resize(this->familyKey.size());
+    allFamilyLineEnergy.resize(this->familyKey.size());
+    MultilayerPlan::runTasks(this->familyKey.size(), this->nThreads, \
+                             [&](const std::vector<double>::size_type & jFamily)
+    {
+        const std::string & elementName = this->familyElement[jFamily];
+        const std::string & lineFamily = familyLineFamily[jFamily];
+        const std::string & actualLineFamily = familyActualFamily[jFamily];
+        std::vector<std::map<std::string, double> > & familyRayRates = allFamilyRayRates[jFamily];
+        std::map<std::string, double> & familyLineEnergy = allFamilyLineEnergy[jFamily];
+        std::map<std::string, std::map<std::string, double> > excitationFactors;
+        std::map<std::string, std::map<std::string, double> >::const_iterator factorIt;
+        std::map<std::string, double>::const_iterator valueIt;
+        std::vector<double>::size_type jRay;
+        familyRayRates.resize(nRays);
+        for (jRay = 0; jRay < nRays; jRay++)
+        {
+            if (this->familyEnergyThreshold[jFamily] > this->rayEnergy[jRay])
+            {
+                continue;
+            }
+            excitationFactors = elementsLibrary.getExcitationFactors(elementName, \
+                                                                     this->rayEnergy[jRay], \
+                                                                     this->rayWeight[jRay]);
+            for (factorIt = excitationFactors.begin(); factorIt != excitationFactors.end(); ++factorIt)
+            {
+                if ((factorIt->first.compare(0, actualLineFamily.length(), actualLineFamily) == 0) || \
+                    ((lineFamily == "Kb") && (factorIt->first[0] == 'K') && (factorIt->first[1] != 'L')))
+                {
+                    valueIt = factorIt->second.find("factor");
+                    if (valueIt == factorIt->second.end())
+                    {
+                        std::cout << "Key <factor> not found in excitation factor" << std::endl;
+                    }
+                    if (valueIt->second <= 0.0)
+                    {
+                        // not excited
+                        continue;
+                    }
+                    familyRayRates[jRay][factorIt->first] = factorIt->second.find("rate")->second;
+                    familyLineEnergy[factorIt->first] = factorIt->second.find("energy")->second;
+                }
+            }
+        }
+    });
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        for (lineIt = allFamilyLineEnergy[iFamily].begin(); lineIt != allFamilyLineEnergy[iFamily].end(); ++lineIt)
+        {
+            this->lineName.push_back(lineIt->first);
+            this->lineEnergy.push_back(lineIt->second);
+        }
+        this->familyLineOffset.push_back(this->lineName.size());
+    }
+    nTotalLines = this->lineName.size();
+
+    // primary excitation rates of each line at each ray
+    this->linePrimaryRate.resize(nRays * nTotalLines, 0.0);
+    this->lineExcited.resize(nRays * nTotalLines, 0);
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        for (iRay = 0; iRay < nRays; iRay++)
+        {
+            const std::map<std::string, double> & rates = allFamilyRayRates[iFamily][iRay];
+            for (iLine = this->familyLineOffset[iFamily]; iLine < this->familyLineOffset[iFamily + 1]; iLine++)
+            {
+                mapIt = rates.find(this->lineName[iLine]);
+                if (mapIt != rates.end())
+                {
+                    this->linePrimaryRate[iRay * nTotalLines + iLine] = mapIt->second;
+                    this->lineExcited[iRay * nTotalLines + iLine] = 1;
+                }
+            }
+        }
+    }
+
+    // escape peaks
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        for (iLine = this->familyLineOffset[iFamily]; iLine < this->familyLineOffset[iFamily + 1]; iLine++)
+        {
+            if (detector.hasMaterialComposition() || (detector.getMaterialName().size() > 0 ))
+            {
+                std::map<std::string, std::map<std::string, double> > escapeRates;
+                std::map<std::string, std::map<std::string, double> >::const_iterator c_it2;
+                // calculate escape ratio assuming normal incidence on detector surface
+                escapeRates = detector.getEscape(this->lineEnergy[iLine], \
+                                                 elementsLibrary, \
+                                                 this->familyElement[iFamily] + this->lineName[iLine], \
+                                                 (iLine == 0) ? 1 : 0);
+                for (c_it2 = escapeRates.begin(); c_it2 != escapeRates.end(); ++c_it2)
+                {
+                    mapIt = c_it2->second.find("energy");
+                    if (mapIt == c_it2->second.end())
+                    {
+                        throw std::runtime_error("Missing energy key in escape peak information!");
+                    }
+                    this->escapeEnergy.push_back(mapIt->second);
+                    mapIt = c_it2->second.find("rate");
+                    if (mapIt == c_it2->second.end())
+                    {
+                        throw std::runtime_error("Missing rate key in escape peak information!");
+                    }
+                    this->escapeRatio.push_back(mapIt->second);
+                    this->escapeName.push_back(c_it2->first);
+                }
+            }
+            this->lineEscapeOffset.push_back(this->escapeName.size());
+        }
+    }
+
+    // transmission through the attenuators and intrinsic detection efficiency of each line.
+    // They do not depend on the sample and each attenuator is evaluated at all the line energies at once
+    this->nAttenuators = attenuators.size() + userAttenuators.size();
+    this->lineAttenuatorTransmission.resize(nTotalLines * this->nAttenuators);
+    if (nTotalLines > 0)
+    {
+        for (jLayer = 0; jLayer < this->nAttenuators; jLayer++)
+        {
+            if (jLayer < attenuators.size())
+            {
+                doubleVector = xrf.getLayerTransmission(attenuators[jLayer], this->lineEnergy, elementsLibrary, 90.0);
+            }
+            else
+            {
+                doubleVector = userAttenuators[jLayer - attenuators.size()].getTransmission(this->lineEnergy);
+            }
+            for (iLine = 0; iLine < nTotalLines; iLine++)
+            {
+                this->lineAttenuatorTransmission[iLine * this->nAttenuators + jLayer] = doubleVector[iLine];
+            }
+        }
+        // TODO: If the detector is defined as a material, one can have the same troubles
+        // as when using methods from the layers.
+        if (detector.hasMaterialComposition() || (detector.getMaterialName().size() > 0 ))
+        {
+            if ((detector.getDensity() > 0.0) && (detector.getThickness() > 0.0))
+            {
+                // calculate intrinsic efficiency
+                // assuming normal incidence on detector surface
+                doubleVector = detector.getTransmission(this->lineEnergy, elementsLibrary, 90.0);
+                for (iLine = 0; iLine < nTotalLines; iLine++)
+                {
+                    this->lineDetectorEfficiency.push_back(1.0 - doubleVector[iLine]);
+                }
+            }
+        }
+    }
+
+    // lookup tables of the result following the order of the map output
+    std::vector<std::string>::size_type iEscape;
+    std::string::size_type iString;
+    std::ostringstream tmpStringStream;
+    for (iLine = 0; iLine < nTotalLines; iLine++)
+    {
+        this->resultLineNames.push_back(this->lineName[iLine]);
+        for (iEscape = this->lineEscapeOffset[iLine]; iEscape < this->lineEscapeOffset[iLine + 1]; iEscape++)
+        {
+            this->resultLineNames.push_back(this->lineName[iLine] + " " + this->escapeName[iEscape]);
+        }
+    }
+    std::sort(this->resultLineNames.begin(), this->resultLineNames.end());
+    this->resultLineNames.erase(std::unique(this->resultLineNames.begin(), \
+                                            this->resultLineNames.end()), \
+                                this->resultLineNames.end());
+    for (i = 0; i < this->resultLineNames.size(); i++)
+    {
+        iString = this->resultLineNames[i].find(' ');
+        if (iString == std::string::npos)
+        {
+            this->resultLineParents.push_back(-1);
+        }
+        else
+        {
+            this->resultLineParents.push_back((int) (std::lower_bound(this->resultLineNames.begin(), \
+                                                     this->resultLineNames.end(), \
+                                                     this->resultLineNames[i].substr(0, iString)) - \
+                                                     this->resultLineNames.begin()));
+        }
+    }
+    this->escapeResultIndex.resize(this->escapeName.size());
+    for (iLine = 0; iLine < nTotalLines; iLine++)
+    {
+        this->lineResultIndex.push_back(std::lower_bound(this->resultLineNames.begin(), \
+                                                         this->resultLineNames.end(), \
+                                                         this->lineName[iLine]) - \
+                                        this->resultLineNames.begin());
+        for (iEscape = this->lineEscapeOffset[iLine]; iEscape < this->lineEscapeOffset[iLine + 1]; iEscape++)
+        {
+            this->escapeResultIndex[iEscape] = std::lower_bound(this->resultLineNames.begin(), \
+                                                    this->resultLineNames.end(), \
+                                                    this->lineName[iLine] + " " + this->escapeName[iEscape]) - \
+                                               this->resultLineNames.begin();
+        }
+    }
+
+    // everything depending on the composition of the sample layers
+    this->buildSampleTerms(elementsLibrary);
+}
+
+void MultilayerPlan::compressBeam(std::vector<std::vector<double> > & rays, \
+                                  const std::vector<std::string> & familyLineFamily, \
+                                  const std::vector<std::string> & familyActualFamily, \
+                                  const Elements & elementsLibrary) const
+{
+    const std::vector<double> & energies = rays[0];
+    const std::vector<double> & weights = rays[1];
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nRays = energies.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type iFirst;
+    std::vector<double>::size_type iLast;
+    std::vector<double>::size_type iResponse;
+    std::vector<double>::size_type nResponses;
+    std::vector<double>::size_type i;
+    std::vector<std::string>::size_type iFamily;
+    std::map<std::string, double>::const_iterator mapIt;
+    std::map<std::string, std::map<std::string, double> >::const_iterator factorIt;
+    std::vector<std::map<std::string, std::map<std::string, double> > > excitationFactors;
+    std::set<std::string> elementNames;
+    std::set<std::string>::const_iterator nameIt;
+    std::set<double> edges;
+    std::vector<std::map<std::string, double> > familyLines;
+    std::vector<double> lineEnergies;
+    std::vector<double> lineMuTotal;
+    std::vector<double> muTotal;
+    // requested (family, layer, line) triplets and attenuation of the line on its way out of the layer
+    std::vector<std::vector<std::string>::size_type> responseFamily;
+    std::vector<std::vector<double>::size_type> responseLayer;
+    std::vector<std::string> responseLine;
+    std::vector<double> responseLineMuTotal;
+    std::vector<double> responses;
+    std::vector<double> groupSum;
+    std::vector<double> candidateEnergy(1);
+    std::vector<double> candidateResponses;
+    std::vector<std::vector<double> > compressedRays;
+    double groupWeight;
+    double groupEnergy;
+    double representativeEnergy;
+    double representativeWeight;
+    bool accepted;
+
+    if ((nRays < 2) || (this->familyKey.size() < 1))
+    {
+        return;
+    }
+
+    // absorption edges of the sample elements and of the requested elements
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        for (mapIt = this->layerComposition[iLayer].begin(); mapIt != this->layerComposition[iLayer].end(); ++mapIt)
+        {
+            elementNames.insert(mapIt->first);
+        }
+    }
+    elementNames.insert(this->familyElement.begin(), this->familyElement.end());
+    for (nameIt = elementNames.begin(); nameIt != elementNames.end(); ++nameIt)
+    {
+        const std::map<std::string, double> & bindingEnergies = elementsLibrary.getBindingEnergies(*nameIt);
+        for (mapIt = bindingEnergies.begin(); mapIt != bindingEnergies.end(); ++mapIt)
+        {
+            if (mapIt->second > 0.0)
+            {
+                edges.insert(mapIt->second);
+            }
+        }
+    }
+
+    // lines of each family excited by the beam
+    familyLines.resize(this->familyKey.size());
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        const std::string & lineFamily = familyLineFamily[iFamily];
+        const std::string & actualLineFamily = familyActualFamily[iFamily];
+        excitationFactors = elementsLibrary.getExcitationFactors(this->familyElement[iFamily], energies, \
+                                                                 std::vector<double>(nRays, 1.0));
+        for (iRay = 0; iRay < nRays; iRay++)
+        {
+            if (this->familyEnergyThreshold[iFamily] > energies[iRay])
+            {
+                continue;
+            }
+            for (factorIt = excitationFactors[iRay].begin(); factorIt != excitationFactors[iRay].end(); ++factorIt)
+            {
+                if ((factorIt->first.compare(0, actualLineFamily.length(), actualLineFamily) == 0) || \
+                    ((lineFamily == "Kb") && (factorIt->first[0] == 'K') && (factorIt->first[1] != 'L')))
+                {
+                    if (factorIt->second.find("factor")->second > 0.0)
+                    {
+                        familyLines[iFamily][factorIt->first] = factorIt->second.find("energy")->second;
+                    }
+                }
+            }
+        }
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if ((!this->familyLayerRequested[iFamily * nLayers + iLayer]) || \
+                (this->layerComposition[iLayer].size() < 1) || (familyLines[iFamily].size() < 1))
+            {
+                continue;
+            }
+            lineEnergies.clear();
+            for (mapIt = familyLines[iFamily].begin(); mapIt != familyLines[iFamily].end(); ++mapIt)
+            {
+                lineEnergies.push_back(mapIt->second);
+            }
+            // same mixture rule as the one of getLayerMassAttenuationCoefficients
+            lineMuTotal.clear();
+            lineMuTotal.resize(lineEnergies.size(), 0.0);
+            for (mapIt = this->layerComposition[iLayer].begin(); \
+                 mapIt != this->layerComposition[iLayer].end(); ++mapIt)
+            {
+                muTotal = elementsLibrary.getMassAttenuationCoefficients(mapIt->first, lineEnergies)["total"];
+                for (i = 0; i < lineMuTotal.size(); i++)
+                {
+                    lineMuTotal[i] += mapIt->second * muTotal[i];
+                }
+            }
+            for (mapIt = familyLines[iFamily].begin(), i = 0; mapIt != familyLines[iFamily].end(); ++mapIt, i++)
+            {
+                responseFamily.push_back(iFamily);
+                responseLayer.push_back(iLayer);
+                responseLine.push_back(mapIt->first);
+                responseLineMuTotal.push_back(lineMuTotal[i] / this->sinAlphaOut);
+            }
+        }
+    }
+    nResponses = responseFamily.size();
+    if (nResponses < 1)
+    {
+        return;
+    }
+
+    // Primary rate of every response at unit weight for the given energies [iResponse * nEnergies + iEnergy]:
+    // excitation factor, attenuation of the beam by the upper layers and self absorption of the layer
+    auto evaluateResponses = [&](const std::vector<double> & energy, std::vector<double> & result)
+    {
+        std::vector<double>::size_type nEnergies = energy.size();
+        std::vector<double>::size_type jLayer;
+        std::vector<double>::size_type jEnergy;
+        std::vector<double>::size_type jResponse;
+        std::vector<std::string>::size_type jFamily;
+        std::vector<double> layerMuTotal(nLayers * nEnergies, 0.0);
+        std::vector<double> layerTransmission(nLayers * nEnergies, 1.0);
+        std::vector<double> elementMuTotal;
+        std::vector<std::vector<std::map<std::string, std::map<std::string, double> > > > factors;
+        std::map<std::string, std::map<std::string, double> >::const_iterator lineIt;
+        std::map<std::string, double>::const_iterator c_it;
+        double massThickness;
+        double chi;
+        double rate;
+
+        for (jLayer = 0; jLayer < nLayers; jLayer++)
+        {
+            for (c_it = this->layerComposition[jLayer].begin(); c_it != this->layerComposition[jLayer].end(); ++c_it)
+            {
+                elementMuTotal = elementsLibrary.getMassAttenuationCoefficients(c_it->first, energy)["total"];
+                for (jEnergy = 0; jEnergy < nEnergies; jEnergy++)
+                {
+                    layerMuTotal[jLayer * nEnergies + jEnergy] += c_it->second * elementMuTotal[jEnergy];
+                }
+            }
+            if (jLayer > 0)
+            {
+                massThickness = this->layerDensity[jLayer - 1] * this->layerThickness[jLayer - 1] / this->sinAlphaIn;
+                for (jEnergy = 0; jEnergy < nEnergies; jEnergy++)
+                {
+                    layerTransmission[jLayer * nEnergies + jEnergy] = \
+                                layerTransmission[(jLayer - 1) * nEnergies + jEnergy] * \
+                                std::exp(-massThickness * layerMuTotal[(jLayer - 1) * nEnergies + jEnergy]);
+                }
+            }
+        }
+        factors.resize(this->familyKey.size());
+        for (jFamily = 0; jFamily < this->familyKey.size(); jFamily++)
+        {
+            factors[jFamily] = elementsLibrary.getExcitationFactors(this->familyElement[jFamily], energy, \
+                                                                    std::vector<double>(nEnergies, 1.0));
+        }
+        result.clear();
+        result.resize(nResponses * nEnergies, 0.0);
+        for (jResponse = 0; jResponse < nResponses; jResponse++)
+        {
+            jFamily = responseFamily[jResponse];
+            jLayer = responseLayer[jResponse];
+            massThickness = this->layerDensity[jLayer] * this->layerThickness[jLayer];
+            for (jEnergy = 0; jEnergy < nEnergies; jEnergy++)
+            {
+                if (this->familyEnergyThreshold[jFamily] > energy[jEnergy])
+                {
+                    continue;
+                }
+                lineIt = factors[jFamily][jEnergy].find(responseLine[jResponse]);
+                if (lineIt == factors[jFamily][jEnergy].end())
+                {
+                    continue;
+                }
+                if (lineIt->second.find("factor")->second <= 0.0)
+                {
+                    continue;
+                }
+                rate = lineIt->second.find("rate")->second;
+                chi = layerMuTotal[jLayer * nEnergies + jEnergy] / this->sinAlphaIn + \
+                      responseLineMuTotal[jResponse];
+                if (chi * massThickness > 1.0e-10)
+                {
+                    chi = (1.0 - std::exp(-chi * massThickness)) / chi;
+                }
+                else
+                {
+                    chi = massThickness;
+                }
+                result[jResponse * nEnergies + jEnergy] = rate * layerTransmission[jLayer * nEnergies + jEnergy] * chi;
+            }
+        }
+    };
+    evaluateResponses(energies, responses);
+
+    // Greedy grouping of adjacent rays not separated by an absorption edge. A group is replaced by a ray
+    // at its weighted mean energy carrying the weight of the group. The group is accepted if the response
+    // of every line to that ray differs from the response to the group by less than the tolerance times
+    // the latter. Since the responses are positive, the relative error of the total primary rate of
+    // every line is bounded by the tolerance.
+    compressedRays.resize(rays.size());
+    groupSum.resize(nResponses);
+    iFirst = 0;
+    while (iFirst < nRays)
+    {
+        groupWeight = weights[iFirst];
+        groupEnergy = weights[iFirst] * energies[iFirst];
+        for (iResponse = 0; iResponse < nResponses; iResponse++)
+        {
+            groupSum[iResponse] = weights[iFirst] * responses[iResponse * nRays + iFirst];
+        }
+        representativeEnergy = energies[iFirst];
+        representativeWeight = weights[iFirst];
+        iLast = iFirst + 1;
+        // rays below the lowest excitation energy are discarded later on and they are kept as they are
+        while ((iLast < nRays) && (energies[iFirst] >= this->minimumExcitationEnergy) && \
+               (edges.upper_bound(energies[iFirst]) == edges.upper_bound(energies[iLast])))
+        {
+            groupWeight += weights[iLast];
+            groupEnergy += weights[iLast] * energies[iLast];
+            for (iResponse = 0; iResponse < nResponses; iResponse++)
+            {
+                groupSum[iResponse] += weights[iLast] * responses[iResponse * nRays + iLast];
+            }
+            if (groupWeight > 0.0)
+            {
+                candidateEnergy[0] = groupEnergy / groupWeight;
+                evaluateResponses(candidateEnergy, candidateResponses);
+                accepted = true;
+                for (iResponse = 0; iResponse < nResponses; iResponse++)
+                {
+                    if (std::fabs(groupWeight * candidateResponses[iResponse] - groupSum[iResponse]) > \
+                        this->beamCompressionTolerance * groupSum[iResponse])
+                    {
+                        accepted = false;
+                        break;
+                    }
+                }
+                if (!accepted)
+                {
+                    break;
+                }
+                representativeEnergy = candidateEnergy[0];
+            }
+            representativeWeight = groupWeight;
+            iLast++;
+        }
+        compressedRays[0].push_back(representativeEnergy);
+        compressedRays[1].push_back(representativeWeight);
+        compressedRays[2].push_back(rays[2][iFirst]);
+        compressedRays[3].push_back(rays[3][iFirst]);
+        iFirst = iLast;
+    }
+    for (i = 0; i < rays.size(); i++)
+    {
+        rays[i].swap(compressedRays[i]);
+    }
+}
+
+void MultilayerPlan::buildSampleTerms(const Elements & elementsLibrary)
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nRays = this->rayEnergy.size();
+    std::vector<double>::size_type nTotalLines = this->lineName.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type jLayer;
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type i;
+    std::vector<double>::size_type iLine;
+    std::vector<double>::size_type nEnergies;
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::vector<std::string> > layerElements;
+    const std::map<std::string, std::map<std::string, double> > * tmpExcitationFactors = NULL;
+    std::map<std::string, std::map<std::string, double> >::const_iterator c_it;
+    std::map<std::string, double>::const_iterator mapIt;
+    std::ostringstream tmpStringStream;
+    double tmpDouble;
+
+    this->rayLayerMuTotal.clear();
+    this->rayLayerWeight.clear();
+    this->sourceOffset.clear();
+    this->sourceOffset.push_back(0);
+    this->sourceEnergyIndex.clear();
+    this->sourceNameIndex.clear();
+    this->sourceRate.clear();
+    this->sourceFactor.clear();
+    this->sourceScattering.clear();
+    this->sourceNames.clear();
+    this->sourceEnergies.clear();
+    this->sourceLayerMuTotal.clear();
+    this->lineSecondaryRate.clear();
+    this->lineSecondaryExcited.clear();
+    this->calculationFamily.clear();
+    this->calculationLayer.clear();
+    this->calculationMassFraction.clear();
+    this->calculationMassFractionFactor.clear();
+    this->calculationLineOffset.clear();
+    this->calculationLineOffset.push_back(0);
+    this->calculationLineMuTotal.clear();
+    this->calculationLineEfficiency.clear();
+    this->calculationLineResultIndex.clear();
+    this->contributorNames.clear();
+    this->sourceContributorIndex.clear();
+
+    // attenuation table of the sample at the incident and at the line energies
+    layerElements.resize(nLayers);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        for (mapIt = this->layerComposition[iLayer].begin(); \
+             mapIt != this->layerComposition[iLayer].end(); ++mapIt)
+        {
+            layerElements[iLayer].push_back(mapIt->first);
+            this->tableElements.push_back(mapIt->first);
+        }
+    }
+    std::sort(this->tableElements.begin(), this->tableElements.end());
+    this->tableElements.erase(std::unique(this->tableElements.begin(), this->tableElements.end()), \
+                              this->tableElements.end());
+    this->tableEnergies.clear();
+    this->tableEnergyIndex.clear();
+    this->tableLayerMuTotal.clear();
+    this->tableLayerMuCoherent.clear();
+    this->tableElementMuTotal.clear();
+    this->tableElementMuCoherent.clear();
+    this->rayTableIndex = this->addTableEnergies(this->rayEnergy, elementsLibrary);
+    this->lineTableIndex = this->addTableEnergies(this->lineEnergy, elementsLibrary);
+
+    if ((this->secondary > 0) && (this->nThreads > 1))
+    {
+        this->fetchRayElementData(layerElements, elementsLibrary);
+    }
+
+    // incident beam reaching each layer and secondary excitation sources of each layer
+    std::vector<double> rawSourceEnergy;
+    std::map<std::string, std::vector<std::string>::size_type> sourceNameIndexMap;
+    this->rayLayerMuTotal.resize(nRays * nLayers);
+    this->rayLayerWeight.resize(nRays * nLayers);
+    for (iRay = 0; iRay < nRays; iRay++)
+    {
+        tmpDouble = 0.0;
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if (iLayer == 0)
+                this->rayLayerWeight[iRay * nLayers + iLayer] = 1.0;
+            else
+                this->rayLayerWeight[iRay * nLayers + iLayer] = exp(-tmpDouble);
+            this->rayLayerMuTotal[iRay * nLayers + iLayer] = \
+                        this->tableLayerMuTotal[this->rayTableIndex[iRay] * nLayers + iLayer];
+            tmpDouble += this->layerDensity[iLayer] * this->layerThickness[iLayer] *\
+                         this->rayLayerMuTotal[iRay * nLayers + iLayer] / this->sinAlphaIn;
+        }
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if (this->secondary > 0)
+            {
+                std::vector<std::pair<std::string, double> >::size_type iPeakFamily;
+                std::string::size_type iString;
+                std::string ele;
+                std::string lastEle = "dummytext";
+                std::string family;
+                std::string name;
+                const std::map<std::string, double> & composition = this->layerComposition[iLayer];
+                double layerWeight;
+                double massFraction;
+
+                layerWeight = this->rayLayerWeight[iRay * nLayers + iLayer];
+                // They are ordered by increasing binding energy
+                const std::vector<std::pair<std::string, double> > & peakFamilies = \
+                        this->getLayerPeakFamilies(layerElements[iLayer], this->rayEnergy[iRay], elementsLibrary);
+                for (iPeakFamily = 0 ; iPeakFamily < peakFamilies.size(); iPeakFamily++)
+                {
+                    iString = peakFamilies[iPeakFamily].first.find(' ');
+                    family = peakFamilies[iPeakFamily].first.substr(iString + 1, \
+                                    peakFamilies[iPeakFamily].first.size() - iString - 1);
+                    ele = peakFamilies[iPeakFamily].first.substr(0, iString);
+                    if (ele != lastEle)
+                    {
+                        // The secondary rates NOT corrected for the beam intensity reaching the layer
+                        // The secondary rates NOT corrected for mass of element fraction in layer
+                        tmpExcitationFactors = &(this->getElementExcitationFactors(ele, \
+                                                                                   this->rayEnergy[iRay], \
+                                                                                   elementsLibrary));
+                        lastEle = ele;
+                    }
+                    massFraction = composition.find(ele)->second;
+                    for (c_it = tmpExcitationFactors->begin(); c_it != tmpExcitationFactors->end(); ++c_it)
+                    {
+                        if (c_it->first.compare(0, family.length(), family) != 0)
+                        {
+                            continue;
+                        }
+                        mapIt = c_it->second.find("rate");
+                        if ((mapIt->second * massFraction) <= 0.0)
+                        {
+                            continue;
+                        }
+                        if (this->secondaryCalculationLimit > 0.0)
+                        {
+                            // unfortunately the mass fraction of the element is not a good criterium
+                            // for instance, we can have 20 elements with a mass fraction of 1 % but all
+                            // together make 20 % of the sample.
+                            if (mapIt->second < this->secondaryCalculationLimit)
+                            {
+                                continue;
+                            }
+                        }
+                        // lines below all the thresholds cannot excite anything
+                        if (c_it->second.find("energy")->second < this->minimumExcitationEnergy)
+                        {
+                            continue;
+                        }
+                        // Store rates already corrected for the beam intensity reaching the layer
+                        // Store rates already corrected for the element mass fraction
+                        name = ele + " " + c_it->first;
+                        if (sourceNameIndexMap.find(name) == sourceNameIndexMap.end())
+                        {
+                            sourceNameIndexMap[name] = this->sourceNames.size();
+                            this->sourceNames.push_back(name);
+                        }
+                        this->sourceNameIndex.push_back(sourceNameIndexMap[name]);
+                        rawSourceEnergy.push_back(c_it->second.find("energy")->second);
+                        this->sourceFactor.push_back(mapIt->second * massFraction);
+                        this->sourceScattering.push_back(0);
+                        this->sourceRate.push_back(this->sourceFactor.back() * \
+                                                   this->rayWeight[iRay] * layerWeight);
+                    }
+                }
+                // We have to add the contribution of coherent scattering
+                // We do so by assuming an isotropic emission of the same energy as the
+                // incident beam
+                name = "coherent scattering";
+                if (sourceNameIndexMap.find(name) == sourceNameIndexMap.end())
+                {
+                    sourceNameIndexMap[name] = this->sourceNames.size();
+                    this->sourceNames.push_back(name);
+                }
+                this->sourceNameIndex.push_back(sourceNameIndexMap[name]);
+                rawSourceEnergy.push_back(this->rayEnergy[iRay]);
+                this->sourceFactor.push_back(this->tableLayerMuCoherent[this->rayTableIndex[iRay] * nLayers + iLayer]);
+                this->sourceScattering.push_back(1);
+                this->sourceRate.push_back((this->rayWeight[iRay] * layerWeight) * \
+                                           this->sourceFactor.back());
+            }
+            this->sourceOffset.push_back(this->sourceRate.size());
+        }
+    }
+
+    // the unique set of secondary excitation energies and the sample attenuation at them
+    this->sourceEnergies = rawSourceEnergy;
+    std::sort(this->sourceEnergies.begin(), this->sourceEnergies.end());
+    this->sourceEnergies.erase(std::unique(this->sourceEnergies.begin(), \
+                                           this->sourceEnergies.end()), \
+                               this->sourceEnergies.end());
+    nEnergies = this->sourceEnergies.size();
+    this->sourceEnergyIndex.resize(rawSourceEnergy.size());
+    for (i = 0; i < rawSourceEnergy.size(); i++)
+    {
+        this->sourceEnergyIndex[i] = std::lower_bound(this->sourceEnergies.begin(), \
+                                                      this->sourceEnergies.end(), \
+                                                      rawSourceEnergy[i]) - this->sourceEnergies.begin();
+    }
+    this->sourceTableIndex = this->addTableEnergies(this->sourceEnergies, elementsLibrary);
+    this->sourceLayerMuTotal.resize(nLayers * nEnergies);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        for (i = 0; i < nEnergies; i++)
+        {
+            this->sourceLayerMuTotal[iLayer * nEnergies + i] = \
+                        this->tableLayerMuTotal[this->sourceTableIndex[i] * nLayers + iLayer];
+        }
+    }
+
+    // secondary excitation rates of each line at the energies emitted by the sources.
+    // Each family task uses its own cache of excitation factors because the same element
+    // can be requested with different families (ex. "Pb L" and "Pb M")
+    this->lineSecondaryRate.resize(nTotalLines * nEnergies, 0.0);
+    this->lineSecondaryExcited.resize(nTotalLines * nEnergies, 0);
+    this->familyExcitationCache.resize(this->familyKey.size());
+    MultilayerPlan::runTasks((this->secondary > 0) ? this->familyKey.size() : 0, this->nThreads, \
+                             [&](const std::vector<double>::size_type & jFamily)
+    {
+        const std::string & elementName = this->familyElement[jFamily];
+        std::map<double, std::map<std::string, std::map<std::string, double> > > & excitationFactorsCache = \
+                                                                this->familyExcitationCache[jFamily];
+        std::map<std::string, std::map<std::string, double> >::const_iterator factorIt;
+        std::vector<double>::size_type jEnergy;
+        std::vector<double>::size_type jLine;
+        if (this->familyLineOffset[jFamily] == this->familyLineOffset[jFamily + 1])
+        {
+            return;
+        }
+        for (jEnergy = 0; jEnergy < nEnergies; jEnergy++)
+        {
+            // analogous to incident beam
+            if (this->familyEnergyThreshold[jFamily] > this->sourceEnergies[jEnergy])
+                continue;
+            if (excitationFactorsCache.find(this->sourceEnergies[jEnergy]) == excitationFactorsCache.end())
+            {
+                excitationFactorsCache[this->sourceEnergies[jEnergy]] = \
+                        elementsLibrary.getExcitationFactors(elementName, \
+                                                             this->sourceEnergies[jEnergy], \
+                                                             1.0);
+            }
+            const std::map<std::string, std::map<std::string, double> > & factors = \
+                        excitationFactorsCache[this->sourceEnergies[jEnergy]];
+            for (jLine = this->familyLineOffset[jFamily]; jLine < this->familyLineOffset[jFamily + 1]; jLine++)
+            {
+                factorIt = factors.find(this->lineName[jLine]);
+                if (factorIt == factors.end())
+                {
+                    // This happens when, for instance, we look for K lines, but obviously
+                    // L lines are present
+                    continue;
+                }
+                this->lineSecondaryRate[jEnergy * nTotalLines + jLine] = factorIt->second.find("rate")->second;
+                this->lineSecondaryExcited[jEnergy * nTotalLines + jLine] = 1;
+            }
+        }
+    });
+
+    // (element family, layer) calculations
+    for (iFamily = 0; iFamily < this->familyKey.size(); iFamily++)
+    {
+        if (this->familyLineOffset[iFamily] == this->familyLineOffset[iFamily + 1])
+        {
+            // nothing excited
+            continue;
+        }
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            double elementMassFraction;
+            double elementMassFractionFactor;
+            if (this->familyLayerRequested[iFamily * nLayers + iLayer] == 0)
+            {
+                // no need to calculate this layer
+                continue;
+            }
+            mapIt = this->layerComposition[iLayer].find(this->familyElement[iFamily]);
+            if (mapIt == this->layerComposition[iLayer].end())
+            {
+                elementMassFraction = 0.0;
+            }
+            else
+            {
+                elementMassFraction = mapIt->second;
+            }
+            elementMassFractionFactor = 1.0;
+            if (this->useMassFractions)
+            {
+                elementMassFractionFactor = elementMassFraction;
+            }
+            if (elementMassFractionFactor == 0.0)
+                continue;
+            this->calculationFamily.push_back(iFamily);
+            this->calculationLayer.push_back(iLayer);
+            this->calculationMassFraction.push_back(elementMassFraction);
+            this->calculationMassFractionFactor.push_back(elementMassFractionFactor);
+            for (iLine = this->familyLineOffset[iFamily]; iLine < this->familyLineOffset[iFamily + 1]; iLine++)
+            {
+                // layer mu total at fluorescent energy
+                this->calculationLineMuTotal.push_back( \
+                        this->tableLayerMuTotal[this->lineTableIndex[iLine] * nLayers + iLayer]);
+                // calculate detection efficiency of fluorescent energy
+                this->calculationLineEfficiency.push_back(this->getLineEfficiency(iLayer, iLine));
+            }
+            this->calculationLineOffset.push_back(this->calculationLineMuTotal.size());
+        }
+    }
+
+    // lookup tables of the result depending on the calculations and on the secondary sources
+    for (i = 0; i < this->calculationFamily.size(); i++)
+    {
+        for (iLine = this->familyLineOffset[this->calculationFamily[i]]; \
+             iLine < this->familyLineOffset[this->calculationFamily[i] + 1]; iLine++)
+        {
+            this->calculationLineResultIndex.push_back((this->calculationFamily[i] * nLayers + \
+                                                        this->calculationLayer[i]) * \
+                                                       this->resultLineNames.size() + \
+                                                       this->lineResultIndex[iLine]);
+        }
+    }
+
+    // secondary excitation contributors are identified by source name and source layer
+    std::vector<char> sourceInLayer(this->sourceNames.size() * nLayers, 0);
+    for (iRay = 0; iRay < nRays; iRay++)
+    {
+        for (jLayer = 0; jLayer < nLayers; jLayer++)
+        {
+            for (i = this->sourceOffset[iRay * nLayers + jLayer]; i < this->sourceOffset[iRay * nLayers + jLayer + 1]; i++)
+            {
+                sourceInLayer[this->sourceNameIndex[i] * nLayers + jLayer] = 1;
+            }
+        }
+    }
+    // the names are built once and sorted together with the (source name, layer) pair they identify
+    std::vector<std::pair<std::string, std::vector<std::string>::size_type> > sortedContributors;
+    for (i = 0; i < this->sourceNames.size(); i++)
+    {
+        for (jLayer = 0; jLayer < nLayers; jLayer++)
+        {
+            if (sourceInLayer[i * nLayers + jLayer])
+            {
+                tmpStringStream.str(std::string());
+                tmpStringStream.clear();
+                tmpStringStream << std::setfill('0') << std::setw(2) << jLayer;
+                sortedContributors.push_back(std::make_pair(this->sourceNames[i] + " " + tmpStringStream.str(), \
+                                                            i * nLayers + jLayer));
+            }
+        }
+    }
+    std::sort(sortedContributors.begin(), sortedContributors.end());
+    this->contributorNames.resize(sortedContributors.size());
+    this->sourceContributorIndex.resize(this->sourceNames.size() * nLayers, 0);
+    for (i = 0; i < sortedContributors.size(); i++)
+    {
+        this->contributorNames[i].swap(sortedContributors[i].first);
+        this->sourceContributorIndex[sortedContributors[i].second] = i;
+    }
+
+    // terms needed by the derivatives with respect to the mass fractions
+    this->buildDerivativeTerms();
+}
+
+void MultilayerPlan::buildDerivativeTerms()
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nRays = this->rayEnergy.size();
+    std::vector<double>::size_type nTotalLines = this->lineName.size();
+    std::vector<double>::size_type nEnergies = this->sourceEnergies.size();
+    std::vector<double>::size_type nTableElements = this->tableElements.size();
+    std::vector<double>::size_type nParameters;
+    std::vector<double>::size_type iParameter;
+    std::vector<double>::size_type iElement;
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type jLayer;
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type iLine;
+    std::vector<double>::size_type iEnergy;
+    std::vector<double>::size_type iCalculation;
+    std::vector<double>::size_type iCalculationLine;
+    std::vector<double>::size_type i;
+    std::map<std::string, double>::const_iterator mapIt;
+    std::ostringstream tmpStringStream;
+    std::string name;
+    const double PI = std::acos(-1.0);
+    double path;
+    double muTotal;
+    double distance;
+    double geometricDerivative;
+    double tmpDouble;
+
+    this->parameterNames.clear();
+    this->layerParameterOffset.clear();
+    this->parameterMassFraction.clear();
+    this->rayParameterMuTotal.clear();
+    this->rayParameterMuCoherent.clear();
+    this->lineParameterMuTotal.clear();
+    this->sourceParameterMuTotal.clear();
+    this->sourceParameter.clear();
+    this->calculationParameter.clear();
+    this->calculationLineEfficiencyDerivative.clear();
+    this->thicknessParameterOffset = 0;
+    if ((!this->massFractionDerivatives) && (!this->massThicknessDerivatives))
+    {
+        return;
+    }
+
+    // one parameter per element of each layer following the order of the compositions
+    // followed by one parameter per layer for the mass thicknesses
+    this->layerParameterOffset.push_back(0);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        tmpStringStream.str(std::string());
+        tmpStringStream.clear();
+        tmpStringStream << std::setfill('0') << std::setw(2) << iLayer;
+        for (mapIt = this->layerComposition[iLayer].begin(); \
+             (mapIt != this->layerComposition[iLayer].end()) && this->massFractionDerivatives; ++mapIt)
+        {
+            this->parameterNames.push_back(mapIt->first + " " + tmpStringStream.str());
+            this->parameterMassFraction.push_back(mapIt->second);
+        }
+        this->layerParameterOffset.push_back(this->parameterNames.size());
+    }
+    this->thicknessParameterOffset = this->parameterNames.size();
+    for (iLayer = 0; (iLayer < nLayers) && this->massThicknessDerivatives; iLayer++)
+    {
+        tmpStringStream.str(std::string());
+        tmpStringStream.clear();
+        tmpStringStream << std::setfill('0') << std::setw(2) << iLayer;
+        this->parameterNames.push_back("massThickness " + tmpStringStream.str());
+    }
+    nParameters = this->parameterNames.size();
+
+    // element mass attenuation coefficients at the ray, line and secondary source energies
+    this->rayParameterMuTotal.resize(nRays * nParameters);
+    this->rayParameterMuCoherent.resize(nRays * nParameters);
+    this->lineParameterMuTotal.resize(nTotalLines * nParameters);
+    this->sourceParameterMuTotal.resize(nEnergies * nParameters);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        iParameter = this->layerParameterOffset[iLayer];
+        for (mapIt = this->layerComposition[iLayer].begin(); \
+             (mapIt != this->layerComposition[iLayer].end()) && this->massFractionDerivatives; ++mapIt)
+        {
+            iElement = std::lower_bound(this->tableElements.begin(), this->tableElements.end(), mapIt->first) - \
+                       this->tableElements.begin();
+            for (iRay = 0; iRay < nRays; iRay++)
+            {
+                i = this->rayTableIndex[iRay] * nTableElements + iElement;
+                this->rayParameterMuTotal[iRay * nParameters + iParameter] = this->tableElementMuTotal[i];
+                this->rayParameterMuCoherent[iRay * nParameters + iParameter] = this->tableElementMuCoherent[i];
+            }
+            for (iLine = 0; iLine < nTotalLines; iLine++)
+            {
+                this->lineParameterMuTotal[iLine * nParameters + iParameter] = \
+                    this->tableElementMuTotal[this->lineTableIndex[iLine] * nTableElements + iElement];
+            }
+            for (iEnergy = 0; iEnergy < nEnergies; iEnergy++)
+            {
+                this->sourceParameterMuTotal[iEnergy * nParameters + iParameter] = \
+                    this->tableElementMuTotal[this->sourceTableIndex[iEnergy] * nTableElements + iElement];
+            }
+            iParameter++;
+        }
+    }
+
+    // the fluorescence sources are proportional to the mass fraction of the emitting element
+    this->sourceParameter.resize(this->sourceRate.size(), nParameters);
+    for (iRay = 0; (iRay < nRays) && this->massFractionDerivatives; iRay++)
+    {
+        for (jLayer = 0; jLayer < nLayers; jLayer++)
+        {
+            for (i = this->sourceOffset[iRay * nLayers + jLayer]; i < this->sourceOffset[iRay * nLayers + jLayer + 1]; i++)
+            {
+                if (this->sourceScattering[i])
+                {
+                    continue;
+                }
+                const std::map<std::string, double> & composition = this->layerComposition[jLayer];
+                name = this->sourceNames[this->sourceNameIndex[i]];
+                name = name.substr(0, name.find(' '));
+                this->sourceParameter[i] = this->layerParameterOffset[jLayer] + \
+                                           std::distance(composition.begin(), composition.find(name));
+            }
+        }
+    }
+
+    // the calculations are proportional to the mass fraction of their element if requested
+    this->calculationParameter.resize(this->calculationFamily.size(), nParameters);
+    for (iCalculation = 0; (iCalculation < this->calculationFamily.size()) && \
+                           this->useMassFractions && this->massFractionDerivatives; iCalculation++)
+    {
+        const std::map<std::string, double> & composition = this->layerComposition[this->calculationLayer[iCalculation]];
+        mapIt = composition.find(this->familyElement[this->calculationFamily[iCalculation]]);
+        if (mapIt != composition.end())
+        {
+            this->calculationParameter[iCalculation] = \
+                        this->layerParameterOffset[this->calculationLayer[iCalculation]] + \
+                        std::distance(composition.begin(), mapIt);
+        }
+    }
+
+    // the detection efficiency depends on the transmission through the upper layers
+    // T = (1 - f) + f * exp(-path * mu) therefore d(log(T))/dC = - f * exp(-path * mu) * path * mu_element / T
+    // and, the path being proportional to the mass thickness x, d(log(T))/dx = - f * exp(-path * mu) * path * mu / (x * T)
+    this->calculationLineEfficiencyDerivative.resize(this->calculationLineMuTotal.size() * nParameters, 0.0);
+    for (iCalculation = 0; iCalculation < this->calculationFamily.size(); iCalculation++)
+    {
+        iLayer = this->calculationLayer[iCalculation];
+        iLine = this->familyLineOffset[this->calculationFamily[iCalculation]];
+        // same distance as getGeometricEfficiency, G = 0.5 * (1 - D / sqrt(D^2 + R^2)) therefore
+        // d(log(G))/dD = - 0.5 * R^2 / ((D^2 + R^2)^1.5 * G) and dD/dx = +/- 1 / (density * sinAlphaOut)
+        geometricDerivative = 0.0;
+        distance = this->detectorDistance;
+        if (this->massThicknessDerivatives && (this->useGeometricEfficiency != 0) && \
+            (this->detectorDiameter != 0.0) && ((distance != 0.0) || (iLayer != 0)))
+        {
+            for (jLayer = (std::vector<double>::size_type) this->referenceLayer; jLayer < iLayer; jLayer++)
+            {
+                distance += this->layerThickness[jLayer] / this->sinAlphaOut;
+            }
+            for (jLayer = iLayer; jLayer < (std::vector<double>::size_type) this->referenceLayer; jLayer++)
+            {
+                distance -= this->layerThickness[jLayer] / this->sinAlphaOut;
+            }
+            tmpDouble = distance * distance + 0.25 * this->detectorDiameter * this->detectorDiameter;
+            geometricDerivative = - 0.125 * this->detectorDiameter * this->detectorDiameter / \
+                                  (tmpDouble * std::sqrt(tmpDouble) * this->layerGeometricEfficiency[iLayer]);
+        }
+        for (iCalculationLine = this->calculationLineOffset[iCalculation]; \
+             iCalculationLine < this->calculationLineOffset[iCalculation + 1]; iCalculationLine++)
+        {
+            for (jLayer = 0; jLayer < iLayer; jLayer++)
+            {
+                // same path as getLayerTransmission
+                path = this->layerDensity[jLayer] * this->layerThickness[jLayer];
+                if (this->alphaOut != 90.0)
+                {
+                    path /= std::sin(((this->alphaOut < 0) ? -this->alphaOut : this->alphaOut) * PI / 180.);
+                }
+                muTotal = this->tableLayerMuTotal[this->lineTableIndex[iLine] * nLayers + jLayer];
+                tmpDouble = this->layerFunnyFactor[jLayer] * std::exp(-path * muTotal);
+                tmpDouble = - tmpDouble * path / ((1.0 - this->layerFunnyFactor[jLayer]) + tmpDouble);
+                if (this->massThicknessDerivatives)
+                {
+                    this->calculationLineEfficiencyDerivative[iCalculationLine * nParameters + \
+                                                              this->thicknessParameterOffset + jLayer] = \
+                            tmpDouble * muTotal / (this->layerDensity[jLayer] * this->layerThickness[jLayer]);
+                }
+                for (iParameter = this->layerParameterOffset[jLayer]; \
+                     iParameter < this->layerParameterOffset[jLayer + 1]; iParameter++)
+                {
+                    this->calculationLineEfficiencyDerivative[iCalculationLine * nParameters + iParameter] = \
+                                    tmpDouble * this->lineParameterMuTotal[iLine * nParameters + iParameter];
+                }
+            }
+            if (geometricDerivative != 0.0)
+            {
+                for (jLayer = (std::vector<double>::size_type) this->referenceLayer; jLayer < iLayer; jLayer++)
+                {
+                    this->calculationLineEfficiencyDerivative[iCalculationLine * nParameters + \
+                                                              this->thicknessParameterOffset + jLayer] += \
+                            geometricDerivative / (this->layerDensity[jLayer] * this->sinAlphaOut);
+                }
+                for (jLayer = iLayer; jLayer < (std::vector<double>::size_type) this->referenceLayer; jLayer++)
+                {
+                    this->calculationLineEfficiencyDerivative[iCalculationLine * nParameters + \
+                                                              this->thicknessParameterOffset + jLayer] -= \
+                            geometricDerivative / (this->layerDensity[jLayer] * this->sinAlphaOut);
+                }
+            }
+            iLine++;
+        }
+    }
+}
+
+void MultilayerPlan::setLayerDensityAndThickness(const int & layerIndex, \
+                                                 const double & density, \
+                                                 const double & thickness)
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<char> layerModified;
+    double tmpDouble;
+
+    if ((layerIndex < 0) || (layerIndex >= (int) nLayers))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+    if ((density * thickness) <= 0.0)
+    {
+        throw std::invalid_argument("Layer " + this->layerName[layerIndex] + \
+                                    " density and thickness must be positive");
+    }
+    this->layerDensity[layerIndex] = density;
+    this->layerThickness[layerIndex] = thickness;
+
+    // the layers below the modified one see a different incident beam and their emission
+    // is attenuated differently. The ones above are only affected if the geometric efficiency
+    // changes because of a different distance to the detector.
+    layerModified.resize(nLayers, 0);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        tmpDouble = this->getGeometricEfficiency(iLayer);
+        if ((iLayer > (std::vector<double>::size_type) layerIndex) || \
+            (tmpDouble != this->layerGeometricEfficiency[iLayer]))
+        {
+            layerModified[iLayer] = 1;
+        }
+        this->layerGeometricEfficiency[iLayer] = tmpDouble;
+    }
+
+    // incident beam reaching the layers below and their secondary sources
+    this->updateIncidentBeamTerms((std::vector<double>::size_type) layerIndex);
+
+    // detection efficiency of the lines emitted by the affected layers
+    this->updateLineEfficiencies(layerModified);
+
+    // the derivatives of the detection efficiencies depend on the mass thickness of the upper layers
+    this->buildDerivativeTerms();
+}
+
+void MultilayerPlan::setGeometry(const double & alphaIn, const double & alphaOut)
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type iLayer;
+    const double PI = acos(-1.0);
+
+    // same angles as the ones obtained from the configuration when building the plan
+    this->alphaIn = alphaIn;
+    this->sinAlphaIn = sin(this->alphaIn*(PI/180.));
+    this->alphaOut = alphaOut;
+    this->sinAlphaOut = sin(this->alphaOut*(PI/180.));
+
+    // the distance to the detector depends on the exit angle
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        this->layerGeometricEfficiency[iLayer] = this->getGeometricEfficiency(iLayer);
+    }
+
+    // incident beam reaching all the layers but the first one and detection efficiency of all the lines
+    this->updateIncidentBeamTerms(0);
+    this->updateLineEfficiencies(std::vector<char>(nLayers, 1));
+
+    // the derivatives of the detection efficiencies depend on the exit angle
+    this->buildDerivativeTerms();
+}
+
+void MultilayerPlan::updateIncidentBeamTerms(const std::vector<double>::size_type & layerIndex)
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nRays = this->rayEnergy.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type i;
+    double tmpDouble;
+
+    for (iRay = 0; iRay < nRays; iRay++)
+    {
+        tmpDouble = 0.0;
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if (iLayer > layerIndex)
+            {
+                this->rayLayerWeight[iRay * nLayers + iLayer] = exp(-tmpDouble);
+                for (i = this->sourceOffset[iRay * nLayers + iLayer]; \
+                     i < this->sourceOffset[iRay * nLayers + iLayer + 1]; i++)
+                {
+                    if (this->sourceScattering[i])
+                        this->sourceRate[i] = (this->rayWeight[iRay] * \
+                                               this->rayLayerWeight[iRay * nLayers + iLayer]) * \
+                                              this->sourceFactor[i];
+                    else
+                        this->sourceRate[i] = this->sourceFactor[i] * this->rayWeight[iRay] * \
+                                              this->rayLayerWeight[iRay * nLayers + iLayer];
+                }
+            }
+            tmpDouble += this->layerDensity[iLayer] * this->layerThickness[iLayer] *\
+                         this->rayLayerMuTotal[iRay * nLayers + iLayer] / this->sinAlphaIn;
+        }
+    }
+}
+
+void MultilayerPlan::updateLineEfficiencies(const std::vector<char> & layerModified)
+{
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type iCalculation;
+    std::vector<double>::size_type iCalculationLine;
+    std::vector<double>::size_type iLine;
+
+    for (iCalculation = 0; iCalculation < this->calculationFamily.size(); iCalculation++)
+    {
+        iLayer = this->calculationLayer[iCalculation];
+        if (!layerModified[iLayer])
+            continue;
+        iLine = this->familyLineOffset[this->calculationFamily[iCalculation]];
+        for (iCalculationLine = this->calculationLineOffset[iCalculation]; \
+             iCalculationLine < this->calculationLineOffset[iCalculation + 1]; iCalculationLine++)
+        {
+            this->calculationLineEfficiency[iCalculationLine] = this->getLineEfficiency(iLayer, iLine);
+            iLine++;
+        }
+    }
+}
+
+const double & MultilayerPlan::getLayerDensity(const int & layerIndex) const
+{
+    if ((layerIndex < 0) || (layerIndex >= (int) this->layerDensity.size()))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+    return this->layerDensity[layerIndex];
+}
+
+const double & MultilayerPlan::getLayerThickness(const int & layerIndex) const
+{
+    if ((layerIndex < 0) || (layerIndex >= (int) this->layerThickness.size()))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+    return this->layerThickness[layerIndex];
+}
+
+double MultilayerPlan::getGeometricEfficiency(const std::vector<double>::size_type & iLayer) const
+{
+    // same as XRF::getGeometricEfficiency using the stored layers
+    std::vector<double>::size_type jLayer;
+    std::vector<double>::size_type referenceLayerIndex;
+    double distance;
+
+    if (this->useGeometricEfficiency == 0)
+    {
+        return 1.0;
+    }
+    // if the detector diameter is zero, return 1
+    if (this->detectorDiameter == 0.0)
+    {
+        return 1.0;
+    }
+    distance = this->detectorDistance;
+    if ((distance == 0.0) && (iLayer == 0))
+    {
+        return 0.5;
+    }
+    if (this->referenceLayer < 0)
+    {
+        throw std::invalid_argument("Negative reference layer index in getGeometricEfficiency");
+    }
+    referenceLayerIndex = (std::vector<double>::size_type) this->referenceLayer;
+    if (iLayer > referenceLayerIndex)
+    {
+        for (jLayer = referenceLayerIndex; jLayer < iLayer; jLayer++)
+        {
+            distance += this->layerThickness[jLayer] / this->sinAlphaOut;
+        }
+    }
+    else
+    {
+        for (jLayer = iLayer; jLayer < referenceLayerIndex; jLayer++)
+        {
+            distance -= this->layerThickness[jLayer] / this->sinAlphaOut;
+        }
+    }
+
+    // calculate geometric efficiency 0.5 * (1 - cos theta)
+    return (0.5 * (1.0 - (distance / sqrt(pow(distance, 2) + pow(0.5 * this->detectorDiameter, 2)))));
+}
+
+double MultilayerPlan::getLineEfficiency(const std::vector<double>::size_type & iLayer, \
+                                         const std::vector<double>::size_type & iLine) const
+{
+    std::vector<double>::size_type jLayer;
+    std::vector<double>::size_type i;
+    double detectionEfficiency;
+
+    detectionEfficiency = 1.0;
+    // transmission through upper layers
+    jLayer = iLayer;
+    while (jLayer > 0)
+    {
+        jLayer--;
+        detectionEfficiency *= this->getLayerTransmission(jLayer, this->lineTableIndex[iLine]);
+    }
+    // transmission through attenuators and user attenuators
+    for (i = iLine * this->nAttenuators; i < (iLine + 1) * this->nAttenuators; i++)
+    {
+        detectionEfficiency *= this->lineAttenuatorTransmission[i];
+    }
+    // detection efficiency decomposed in geometric and intrinsic
+    detectionEfficiency *= this->layerGeometricEfficiency[iLayer];
+    if (this->lineDetectorEfficiency.size() > 0)
+    {
+        detectionEfficiency *= this->lineDetectorEfficiency[iLine];
+    }
+    return detectionEfficiency;
+}
+
+std::map<std::string, std::vector<double> > MultilayerPlan::getLayerMassAttenuationCoefficients( \
+                                                    const std::vector<double>::size_type & iLayer, \
+                                                    const std::vector<double> & energy, \
+                                                    const Elements & elementsLibrary)
+{
+    // this is the Elements::getMassAttenuationCoefficients calculation for a composition already
+    // given in terms of elements but using the element coefficients kept by the plan
+    const std::map<std::string, double> & composition = this->layerComposition[iLayer];
+    std::map<std::string, std::vector<double> > result;
+    std::map<std::string, double>::const_iterator c_it;
+    std::vector<double>::size_type n;
+    std::vector<double> & coherent = result["coherent"];
+    std::vector<double> & compton = result["compton"];
+    std::vector<double> & pair = result["pair"];
+    std::vector<double> & photoelectric = result["photoelectric"];
+    std::vector<double> & total = result["total"];
+    double massFraction;
+
+    if (composition.size() < 1)
+    {
+        // let the library deal with (complain about) it
+        return elementsLibrary.getMassAttenuationCoefficients(composition, energy);
+    }
+    result["energy"] = energy;
+    coherent.resize(energy.size());
+    compton.resize(energy.size());
+    pair.resize(energy.size());
+    photoelectric.resize(energy.size());
+    total.resize(energy.size());
+    for (n = 0; n < energy.size(); n++)
+    {
+        coherent[n] = 0.0;
+        compton[n] = 0.0;
+        pair[n] = 0.0;
+        photoelectric[n] = 0.0;
+        for (c_it = composition.begin(); c_it != composition.end(); ++c_it)
+        {
+            const std::map<std::string, double> & mu = \
+                        this->getElementMassAttenuationCoefficients(c_it->first, energy[n], elementsLibrary);
+            massFraction = c_it->second / 1.0;
+            coherent[n] += mu.find("coherent")->second * massFraction;
+            compton[n] += mu.find("compton")->second * massFraction;
+            pair[n] += mu.find("pair")->second * massFraction;
+            photoelectric[n] += mu.find("photoelectric")->second * massFraction;
+        }
+        total[n] = (coherent[n] + compton[n]) + pair[n] + photoelectric[n];
+    }
+    return result;
+}
+
+std::vector<std::vector<double>::size_type> MultilayerPlan::addTableEnergies(const std::vector<double> & energy, \
+                                                                             const Elements & elementsLibrary)
+{
+    std::vector<double>::size_type nLayers = this->layerDensity.size();
+    std::vector<double>::size_type nElements = this->tableElements.size();
+    std::vector<double>::size_type firstEnergy = this->tableEnergies.size();
+    std::vector<double>::size_type iLayer;
+    std::vector<double>::size_type iElement;
+    std::vector<double>::size_type i;
+    std::vector<std::vector<double>::size_type> result(energy.size());
+    std::map<double, std::vector<double>::size_type>::const_iterator it;
+    std::vector<double> newEnergies;
+
+    for (i = 0; i < energy.size(); i++)
+    {
+        it = this->tableEnergyIndex.find(energy[i]);
+        if (it == this->tableEnergyIndex.end())
+        {
+            it = this->tableEnergyIndex.insert(std::make_pair(energy[i], this->tableEnergies.size())).first;
+            this->tableEnergies.push_back(energy[i]);
+            newEnergies.push_back(energy[i]);
+        }
+        result[i] = it->second;
+    }
+    if (newEnergies.size() < 1)
+    {
+        return result;
+    }
+
+    this->tableLayerMuTotal.resize(this->tableEnergies.size() * nLayers);
+    this->tableLayerMuCoherent.resize(this->tableEnergies.size() * nLayers);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        std::map<std::string, std::vector<double> > mu;
+        mu = this->getLayerMassAttenuationCoefficients(iLayer, newEnergies, elementsLibrary);
+        const std::vector<double> & total = mu["total"];
+        const std::vector<double> & coherent = mu["coherent"];
+        for (i = 0; i < newEnergies.size(); i++)
+        {
+            this->tableLayerMuTotal[(firstEnergy + i) * nLayers + iLayer] = total[i];
+            this->tableLayerMuCoherent[(firstEnergy + i) * nLayers + iLayer] = coherent[i];
+        }
+    }
+    this->tableElementMuTotal.resize(this->tableEnergies.size() * nElements);
+    this->tableElementMuCoherent.resize(this->tableEnergies.size() * nElements);
+    for (iElement = 0; iElement < nElements; iElement++)
+    {
+        for (i = 0; i < newEnergies.size(); i++)
+        {
+            const std::map<std::string, double> & mu = \
+                this->getElementMassAttenuationCoefficients(this->tableElements[iElement], newEnergies[i], \
+                                                            elementsLibrary);
+            this->tableElementMuTotal[(firstEnergy + i) * nElements + iElement] = \
+                (mu.find("coherent")->second + mu.find("compton")->second) + \
+                mu.find("pair")->second + mu.find("photoelectric")->second;
+            this->tableElementMuCoherent[(firstEnergy + i) * nElements + iElement] = mu.find("coherent")->second;
+        }
+    }
+    return result;
+}
+
+const std::map<std::string, double> & MultilayerPlan::getElementMassAttenuationCoefficients( \
+                                                    const std::string & elementName, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary)
+{
+    std::map<double, std::map<std::string, double> > & cache = this->elementMuCache[elementName];
+    std::map<double, std::map<std::string, double> >::iterator it;
+
+    it = cache.find(energy);
+    if (it == cache.end())
+    {
+        it = cache.insert(std::make_pair(energy, \
+                    elementsLibrary.getElement(elementName).getMassAttenuationCoefficients(energy))).first;
+    }
+    return it->second;
+}
+
+const std::map<std::string, std::map<std::string, double> > & MultilayerPlan::getElementExcitationFactors( \
+                                                    const std::string & elementName, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary)
+{
+    std::map<double, std::map<std::string, std::map<std::string, double> > > & cache = \
+                                                    this->elementExcitationCache[elementName];
+    std::map<double, std::map<std::string, std::map<std::string, double> > >::iterator it;
+
+    it = cache.find(energy);
+    if (it == cache.end())
+    {
+        it = cache.insert(std::make_pair(energy, \
+                    elementsLibrary.getExcitationFactors(elementName, energy, 1.0))).first;
+    }
+    return it->second;
+}
+
+const std::vector<std::pair<std::string, double> > & MultilayerPlan::getLayerPeakFamilies( \
+                                                    const std::vector<std::string> & elementList, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary)
+{
+    std::string key;
+    std::vector<std::string>::size_type i;
+    std::map<double, std::vector<std::pair<std::string, double> > >::iterator it;
+
+    for (i = 0; i < elementList.size(); i++)
+    {
+        key += elementList[i] + " ";
+    }
+    std::map<double, std::vector<std::pair<std::string, double> > > & cache = this->peakFamiliesCache[key];
+    it = cache.find(energy);
+    if (it == cache.end())
+    {
+        it = cache.insert(std::make_pair(energy, elementsLibrary.getPeakFamilies(elementList, energy))).first;
+    }
+    return it->second;
+}
+
+void MultilayerPlan::fetchRayElementData(const std::vector<std::vector<std::string> > & layerElements, \
+                                         const Elements & elementsLibrary)
+{
+    std::vector<double>::size_type nLayers = layerElements.size();
+    std::vector<double>::size_type nRays = this->rayEnergy.size();
+    std::vector<double>::size_type iRay;
+    std::vector<double>::size_type iLayer;
+    std::vector<std::string> layerKey;
+    std::vector<std::vector<std::pair<std::string, double> > > rayPeakFamilies;
+    std::vector<std::vector<char> > rayPeakFamiliesFetched;
+    std::vector<std::map<std::string, std::map<std::string, std::map<std::string, double> > > > rayFactors;
+    std::map<std::string, std::map<std::string, std::map<std::string, double> > >::const_iterator factorIt;
+
+    // same keys as getLayerPeakFamilies
+    layerKey.resize(nLayers);
+    for (iLayer = 0; iLayer < nLayers; iLayer++)
+    {
+        for (std::vector<std::string>::size_type i = 0; i < layerElements[iLayer].size(); i++)
+        {
+            layerKey[iLayer] += layerElements[iLayer][i] + " ";
+        }
+    }
+
+    // the caches are only read by the tasks, each ray filling its own entries
+    rayPeakFamilies.resize(nRays * nLayers);
+    rayPeakFamiliesFetched.resize(nRays, std::vector<char>(nLayers, 0));
+    rayFactors.resize(nRays);
+    MultilayerPlan::runTasks(nRays, this->nThreads, [&](const std::vector<double>::size_type & jRay)
+    {
+        const double & energy = this->rayEnergy[jRay];
+        std::vector<double>::size_type jLayer;
+        std::vector<std::pair<std::string, double> >::size_type iPeakFamily;
+        std::string ele;
+        for (jLayer = 0; jLayer < nLayers; jLayer++)
+        {
+            const std::vector<std::pair<std::string, double> > * peakFamilies = NULL;
+            std::map<std::string, std::map<double, std::vector<std::pair<std::string, double> > > >::const_iterator \
+                        keyIt = this->peakFamiliesCache.find(layerKey[jLayer]);
+            if (keyIt != this->peakFamiliesCache.end())
+            {
+                std::map<double, std::vector<std::pair<std::string, double> > >::const_iterator \
+                        energyIt = keyIt->second.find(energy);
+                if (energyIt != keyIt->second.end())
+                {
+                    peakFamilies = &(energyIt->second);
+                }
+            }
+            if (peakFamilies == NULL)
+            {
+                rayPeakFamilies[jRay * nLayers + jLayer] = elementsLibrary.getPeakFamilies(layerElements[jLayer], \
+                                                                                           energy);
+                rayPeakFamiliesFetched[jRay][jLayer] = 1;
+                peakFamilies = &(rayPeakFamilies[jRay * nLayers + jLayer]);
+            }
+            for (iPeakFamily = 0; iPeakFamily < peakFamilies->size(); iPeakFamily++)
+            {
+                ele = (*peakFamilies)[iPeakFamily].first.substr(0, (*peakFamilies)[iPeakFamily].first.find(' '));
+                if (rayFactors[jRay].find(ele) != rayFactors[jRay].end())
+                {
+                    continue;
+                }
+                std::map<std::string, std::map<double, std::map<std::string, std::map<std::string, double> > > >::\
+                        const_iterator elementIt = this->elementExcitationCache.find(ele);
+                if ((elementIt != this->elementExcitationCache.end()) && \
+                    (elementIt->second.find(energy) != elementIt->second.end()))
+                {
+                    continue;
+                }
+                rayFactors[jRay][ele] = elementsLibrary.getExcitationFactors(ele, energy, 1.0);
+            }
+        }
+    });
+
+    // keep them in the same caches as getLayerPeakFamilies and getElementExcitationFactors
+    for (iRay = 0; iRay < nRays; iRay++)
+    {
+        for (iLayer = 0; iLayer < nLayers; iLayer++)
+        {
+            if (rayPeakFamiliesFetched[iRay][iLayer])
+            {
+                this->peakFamiliesCache[layerKey[iLayer]][this->rayEnergy[iRay]].swap( \
+                                                                rayPeakFamilies[iRay * nLayers + iLayer]);
+            }
+        }
+        for (factorIt = rayFactors[iRay].begin(); factorIt != rayFactors[iRay].end(); ++factorIt)
+        {
+            this->elementExcitationCache[factorIt->first][this->rayEnergy[iRay]] = factorIt->second;
+        }
+    }
+}
+
+double MultilayerPlan::getLayerTransmission(const std::vector<double>::size_type & iLayer, \
+                                            const std::vector<double>::size_type & iEnergy) const
+{
+    // same as XRF::getLayerTransmission at the exit angle
+    const double PI = std::acos(-1.0);
+    double tmpDouble;
+    double muTotal;
+
+    if (this->alphaOut == 90.0)
+    {
+        tmpDouble = this->layerDensity[iLayer] * this->layerThickness[iLayer];
+    }
+    else
+    {
+        if (this->alphaOut < 0)
+            tmpDouble = std::sin(-this->alphaOut * PI / 180.);
+        else
+            tmpDouble = std::sin(this->alphaOut * PI / 180.);
+        tmpDouble = this->layerDensity[iLayer] * this->layerThickness[iLayer] / tmpDouble;
+    }
+
+    if(tmpDouble <= 0.0)
+    {
+        std::string msg;
+        msg = "Layer " + this->layerName[iLayer] + " thickness is " + Elements::toString(tmpDouble) + " g/cm2";
+        throw std::runtime_error( msg );
+    }
+
+    muTotal = this->tableLayerMuTotal[iEnergy * this->layerDensity.size() + iLayer];
+    return (1.0 - this->layerFunnyFactor[iLayer]) + \
+           (this->layerFunnyFactor[iLayer] * exp(-(tmpDouble * muTotal)));
+}
+
+} // namespace fisx
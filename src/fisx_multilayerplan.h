@@ -0,0 +1,645 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#ifndef FISX_MULTILAYERPLAN_H
+#define FISX_MULTILAYERPLAN_H
+#include "fisx_xrfconfig.h"
+#include "fisx_elements.h"
+#include "fisx_multilayerresult.h"
+#include <functional>
+
+namespace fisx
+{
+
+/*!
+  \class MultilayerPlan
+  \brief Precalculated description of a multilayer fluorescence calculation
+
+   All the quantities that only depend on the configuration (beam, beam filters, geometry, sample,
+   attenuators and detector) and on the requested element families are calculated once when the
+   plan is built and stored in flat arrays: layer compositions, beam weights after the filters,
+   mass attenuation coefficients, excitation factors, secondary excitation sources, detection
+   efficiencies and escape ratios.
+
+   The evaluation of the plan does not need to access the elements library and it can be repeated
+   as many times as needed.
+*/
+class MultilayerPlan
+{
+public:
+    /*!
+    Empty plan. Its evaluation returns an empty output.
+    */
+    MultilayerPlan();
+
+    /*!
+    Build the plan. The arguments are the same as those of the XRF::getMultilayerFluorescence
+    method taking lists of elements, layers and families.
+    */
+    MultilayerPlan(const XRFConfig & configuration, \
+                   const Elements & elementsLibrary, \
+                   const std::vector<std::string> & elementList, \
+                   const std::vector<int> & layerList, \
+                   const std::vector<std::string> & familyList, \
+                   const int & secondary = 0, \
+                   const int & useGeometricEfficiency = 1, \
+                   const int & useMassFractions = 0, \
+                   const double & secondaryCalculationLimit = 0.0, \
+                   const Beam & overwritingBeam = Beam());
+
+    /*!
+    (Re)build the plan. See the constructor.
+    */
+    void build(const XRFConfig & configuration, \
+               const Elements & elementsLibrary, \
+               const std::vector<std::string> & elementList, \
+               const std::vector<int> & layerList, \
+               const std::vector<std::string> & familyList, \
+               const int & secondary = 0, \
+               const int & useGeometricEfficiency = 1, \
+               const int & useMassFractions = 0, \
+               const double & secondaryCalculationLimit = 0.0, \
+               const Beam & overwritingBeam = Beam());
+
+    /*!
+    Build the plan of an incident energy scan. Each of the incidentEnergies is an independent
+    monochromatic beam of unit weight before the beam filters, as given by Beam::setSingleEnergyBeam.
+    The other arguments are the same as those of build. The quantities at the energies of the emitted
+    lines (detection efficiencies, attenuator transmissions, attenuation coefficients and escape ratios)
+    are calculated once for the whole scan. The beam is never compressed.
+    */
+    void buildScan(const XRFConfig & configuration, \
+                   const Elements & elementsLibrary, \
+                   const std::vector<std::string> & elementList, \
+                   const std::vector<int> & layerList, \
+                   const std::vector<std::string> & familyList, \
+                   const std::vector<double> & incidentEnergies, \
+                   const int & secondary = 0, \
+                   const int & useGeometricEfficiency = 1, \
+                   const int & useMassFractions = 0, \
+                   const double & secondaryCalculationLimit = 0.0);
+
+    /*!
+    Evaluate the plan. The output is the same as the one of XRF::getMultilayerFluorescence
+    */
+    std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > \
+                getMultilayerFluorescence() const;
+
+    /*!
+    Evaluate the plan filling a dense result. The storage of the result is reused if it already
+    corresponds to this plan.
+    */
+    void getMultilayerFluorescence(MultilayerResult & result) const;
+
+    /*!
+    True if evaluating the plan into result keeps the storage of its arrays, that is, if the result
+    already has the layout of the output of this plan.
+    */
+    bool keepsResultLayout(const MultilayerResult & result) const;
+
+    /*!
+    Evaluate the plan for a set of compositions of the sample layer layerIndex (mapping mode).
+    Each composition is given as element mass fractions, as returned by Elements::getComposition,
+    and replaces the composition of that layer. The beam, the filters, the attenuators, the detector
+    and the geometry are shared by all the compositions. The compositions are distributed among the
+    threads of the plan. The plan itself is not modified.
+    */
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                getMultilayerFluorescence(const std::vector<std::map<std::string, double> > & compositions, \
+                                          const int & layerIndex, \
+                                          const Elements & elementsLibrary) const;
+
+    /*!
+    Evaluate the plan for a set of compositions of the sample layer layerIndex filling one dense
+    result per composition. See the previous method.
+    */
+    void getMultilayerFluorescence(const std::vector<std::map<std::string, double> > & compositions, \
+                                   const int & layerIndex, \
+                                   const Elements & elementsLibrary, \
+                                   std::vector<MultilayerResult> & results) const;
+
+    /*!
+    Evaluate an incident energy scan (see buildScan) filling one dense result per incident energy,
+    following the order of the energies supplied to buildScan. Only the terms depending on the incident
+    energy are evaluated at each point and the points are distributed among the threads of the plan.
+    The emission lines are those excited by at least one of the energies, their rates being zero at the
+    energies not able to excite them. The output is empty if the plan was not built by buildScan.
+    */
+    void getMultilayerFluorescenceScan(std::vector<MultilayerResult> & results) const;
+
+    /*!
+    Same as the previous method returning one output per incident energy, as returned by
+    XRF::getMultilayerFluorescence.
+    */
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                getMultilayerFluorescenceScan() const;
+
+    /*!
+    Incident energies of the scan (see buildScan). Empty if the plan was not built by buildScan.
+    */
+    const std::vector<double> & getScanEnergies() const {return this->scanEnergy;};
+
+    /*!
+    Replace the composition of the sample layer layerIndex by the given element mass fractions and
+    update the terms depending on the sample composition. The data of the elements (attenuation
+    coefficients, excitation factors and excited shells) are kept by the plan, so only elements or
+    energies not seen before require the library. Otherwise the update reduces to the mixture sums,
+    the de Boer terms being calculated when the plan is evaluated.
+    */
+    void setLayerComposition(const int & layerIndex, \
+                             const std::map<std::string, double> & composition, \
+                             const Elements & elementsLibrary);
+
+    /*!
+    Composition of the sample layer layerIndex in terms of element mass fractions
+    */
+    const std::map<std::string, double> & getLayerComposition(const int & layerIndex) const;
+
+    /*!
+    Change the density and the thickness of the sample layer layerIndex. Only the terms depending on
+    the mass thickness of that layer are updated: the incident beam reaching the layers below it,
+    their secondary sources and the detection efficiency of the lines they emit. The lines emitted
+    by the layers above are only updated if their geometric efficiency changes.
+    */
+    void setLayerDensityAndThickness(const int & layerIndex, \
+                                     const double & density, \
+                                     const double & thickness);
+    const double & getLayerDensity(const int & layerIndex) const;
+    const double & getLayerThickness(const int & layerIndex) const;
+
+    /*!
+    Change the incident and exit angles (in degrees) with respect to the sample surface. The mass
+    attenuation coefficients, excitation factors and secondary sources do not depend on them, so only
+    the attenuation of the incident beam reaching each layer, the secondary sources scaled by it and the
+    detection efficiency of the lines (transmission through the upper layers and geometric efficiency)
+    are calculated again, the de Boer terms being evaluated with the new angles. The beam rays merged
+    according to the beam compression tolerance are kept.
+    */
+    void setGeometry(const double & alphaIn, const double & alphaOut);
+    const double & getAlphaIn() const {return this->alphaIn;};
+    const double & getAlphaOut() const {return this->alphaOut;};
+
+    /*!
+    Evaluate the plan for a set of (alphaIn[i], alphaOut[i]) geometries (angle sweep), filling one dense
+    result per geometry. Each geometry is set as with setGeometry on a copy of the plan, the terms
+    depending on the energies being shared by all of them. The geometries are distributed among the
+    threads of the plan. The plan itself is not modified.
+    */
+    void getMultilayerFluorescenceGeometries(const std::vector<double> & alphaIn, \
+                                             const std::vector<double> & alphaOut, \
+                                             std::vector<MultilayerResult> & results) const;
+
+    /*!
+    Same as the previous method returning one output per geometry, as returned by
+    XRF::getMultilayerFluorescence.
+    */
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                getMultilayerFluorescenceGeometries(const std::vector<double> & alphaIn, \
+                                                    const std::vector<double> & alphaOut) const;
+
+    /*!
+    Number of threads used to build and to evaluate the plan. The element families and the beam
+    rays are distributed among them. The result does not depend on the number of threads.
+    */
+    void setNumberOfThreads(const int & nThreads);
+    const int & getNumberOfThreads() const {return this->nThreads;};
+
+    /*!
+    Amount of information produced by the evaluation of the plan, one of the
+    MultilayerResult::OutputLevel values. Default is MultilayerResult::FULL_BREAKDOWN.
+    */
+    void setOutputLevel(const int & outputLevel);
+    const int & getOutputLevel() const {return this->outputLevel;};
+
+    /*!
+    Relative tolerance used to neglect secondary excitation sources. Zero (default) keeps the fixed
+    cutoffs of the original calculation. Otherwise, an upper bound of the contribution of each secondary
+    source to each line is evaluated prior to the de Boer integrals and the source is neglected if the
+    sum of the bounds neglected so far does not exceed the tolerance times the primary rate of the line.
+    The sum of the neglected bounds is given by the MultilayerResult::NEGLECTED quantity.
+    */
+    void setSecondaryTolerance(const double & tolerance);
+    const double & getSecondaryTolerance() const {return this->secondaryTolerance;};
+
+    /*!
+    Relative tolerance used to reduce the number of beam rays when the plan is built. Zero (default)
+    keeps all the rays. Otherwise, adjacent rays not separated by an absorption edge of the sample
+    or of the requested elements are merged into one of them carrying their total weight, as long as
+    the primary rate of every requested line in every requested layer changes by less than the
+    tolerance. The error is bounded for the sample the plan is built with, the reduced beam being
+    kept by subsequent changes of the sample layers.
+    */
+    void setBeamCompressionTolerance(const double & tolerance);
+    const double & getBeamCompressionTolerance() const {return this->beamCompressionTolerance;};
+
+    /*!
+    If non-zero, the evaluation also calculates the derivatives of the rates with respect to the mass
+    fraction of every element of every sample layer (see MultilayerResult::getDerivatives). They are
+    obtained analytically in the same pass as the rates, considering the element mass fractions as
+    independent variables: the primary and secondary excitation, the attenuation of the incident beam
+    and of the emitted lines by the sample layers and the secondary sources depend on them. Neglected
+    secondary sources do not contribute to the derivatives. The terms needed by the derivatives are
+    calculated with the sample terms, so the flag has to be set before building the plan, otherwise
+    it only applies after the next change of the sample layers. Default is 0.
+    */
+    void setMassFractionDerivatives(const int & flag);
+    const int & getMassFractionDerivatives() const {return this->massFractionDerivatives;};
+
+    /*!
+    If non-zero, the evaluation also calculates the derivatives of the rates with respect to the mass
+    thickness (density times thickness) of every sample layer, as needed to refine the thicknesses
+    of the layers. They are obtained analytically in the same pass as the rates: self absorption,
+    attenuation of the incident beam and of the emitted lines and the de Boer integrals depend on the
+    mass thicknesses. The geometric efficiency depends on the distance to the detector, hence on the
+    thickness of the layers between the reference layer and the emitting layer, and it is derived at
+    constant density. With secondary 2 the tertiary excitation is only scaled with the rates (see
+    MultilayerResult::applyTertiaryExcitation) and the derivatives are then accurate within about 10 %
+    of rate / mass thickness instead of 1.0e-5, the error being larger close to the absorption edges
+    of the exciting elements. As for the mass fraction derivatives, the flag has to
+    be set before building the plan. Default is 0.
+    */
+    void setMassThicknessDerivatives(const int & flag);
+    const int & getMassThicknessDerivatives() const {return this->massThicknessDerivatives;};
+
+    /*!
+    Names of the parameters of the derivatives: the mass fractions ("Fe 01" for the mass fraction of
+    iron in layer 1) ordered by layer and by element within each layer, followed by the mass thicknesses
+    ("massThickness 01" for layer 1). Empty if no derivatives are calculated.
+    */
+    const std::vector<std::string> & getParameterNames() const {return this->parameterNames;};
+
+    /*!
+    Element families (ex. "Cr K") considered by the plan
+    */
+    const std::vector<std::string> & getElementFamilies() const {return this->familyKey;};
+
+    /*!
+    Number of sample layers
+    */
+    std::vector<double>::size_type getNumberOfLayers() const {return this->layerDensity.size();};
+
+    /*!
+    Number of beam rays able to excite at least one of the requested element families
+    */
+    std::vector<double>::size_type getNumberOfRays() const {return this->rayEnergy.size();};
+
+    /*!
+    Secondary excitation level the plan was built for
+    */
+    const int & getSecondary() const {return this->secondary;};
+
+private:
+    void clear();
+
+    /*!
+    Common part of build and buildScan. The rays are given as energy, weight, characteristic flag and
+    divergency vectors (see Beam::getBeamAsDoubleVectors) and they are merged according to the beam
+    compression tolerance if mergeRays is true.
+    */
+    void buildFromRays(const XRFConfig & configuration, \
+                       const Elements & elementsLibrary, \
+                       const std::vector<std::string> & elementList, \
+                       const std::vector<int> & layerList, \
+                       const std::vector<std::string> & familyList, \
+                       const int & secondary, \
+                       const int & useGeometricEfficiency, \
+                       const int & useMassFractions, \
+                       const double & secondaryCalculationLimit, \
+                       std::vector<std::vector<double> > & actualRays, \
+                       const bool & mergeRays);
+
+    /*!
+    Evaluate the rays firstRay to lastRay - 1 filling the result using at most nThreads threads
+    */
+    void evaluateRays(MultilayerResult & result, \
+                      const std::vector<double>::size_type & firstRay, \
+                      const std::vector<double>::size_type & lastRay, \
+                      const int & nThreads) const;
+
+    /*!
+    Calculate all the quantities depending on the composition of the sample layers: attenuation of the
+    incident beam, secondary excitation sources, mass fractions, sample attenuation and transmission
+    of the emitted lines through the upper layers.
+    */
+    void buildSampleTerms(const Elements & elementsLibrary);
+
+    /*!
+    Calculate the quantities needed by the derivatives with respect to the layer mass fractions and
+    mass thicknesses: the parameters, the element mass attenuation coefficients at the ray, line and
+    secondary source energies and the derivatives of the detection efficiencies. The sample terms have
+    to be up to date.
+    */
+    void buildDerivativeTerms();
+
+    /*!
+    Update the incident beam reaching the layers below layerIndex and their secondary sources
+    */
+    void updateIncidentBeamTerms(const std::vector<double>::size_type & layerIndex);
+
+    /*!
+    Update the detection efficiency of the lines emitted by the layers flagged in layerModified
+    */
+    void updateLineEfficiencies(const std::vector<char> & layerModified);
+
+    /*!
+    Merge the beam rays (energy, weight, characteristic flag and divergency vectors as returned by
+    Beam::getBeamAsDoubleVectors) according to the beam compression tolerance. The requested families
+    and the sample layers have to be already set. The response of each line to a ray is its primary
+    rate at unit weight: excitation factor, attenuation of the beam by the upper layers and self
+    absorption of the layer. The detection efficiency does not depend on the ray and is ignored.
+    */
+    void compressBeam(std::vector<std::vector<double> > & rays, \
+                      const std::vector<std::string> & familyLineFamily, \
+                      const std::vector<std::string> & familyActualFamily, \
+                      const Elements & elementsLibrary) const;
+
+    /*!
+    Check the layer index and the element mass fractions supplied to setLayerComposition
+    */
+    void checkLayerComposition(const int & layerIndex, \
+                               const std::map<std::string, double> & composition, \
+                               const Elements & elementsLibrary) const;
+
+    /*!
+    Same as the XRF methods of the same name but using the stored sample layers.
+    */
+    std::map<std::string, std::vector<double> > getLayerMassAttenuationCoefficients( \
+                                                    const std::vector<double>::size_type & iLayer, \
+                                                    const std::vector<double> & energy, \
+                                                    const Elements & elementsLibrary);
+
+    /*!
+    Transmission of the sample layer iLayer at the exit angle for the energy of index iEnergy
+    of the attenuation table (see addTableEnergies)
+    */
+    double getLayerTransmission(const std::vector<double>::size_type & iLayer, \
+                                const std::vector<double>::size_type & iEnergy) const;
+    double getGeometricEfficiency(const std::vector<double>::size_type & iLayer) const;
+
+    /*!
+    Detection efficiency of line iLine emitted by layer iLayer: transmission through the upper layers
+    and the attenuators, geometric and intrinsic detector efficiencies
+    */
+    double getLineEfficiency(const std::vector<double>::size_type & iLayer, \
+                             const std::vector<double>::size_type & iLine) const;
+
+    /*!
+    Add to the attenuation table the given energies not already in it and return their indices.
+    The mass attenuation coefficients of the sample layers and of their elements are calculated
+    once per energy.
+    */
+    std::vector<std::vector<double>::size_type> addTableEnergies(const std::vector<double> & energy, \
+                                                                 const Elements & elementsLibrary);
+
+    const std::vector<std::pair<std::string, double> > & getLayerPeakFamilies( \
+                                                    const std::vector<std::string> & elementList, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary);
+
+    /*!
+    Obtain from the library the peak families of the layers and the excitation factors of their
+    elements at the ray energies not seen before. The rays are distributed among the threads and
+    the data are kept by the plan afterwards, the secondary sources being built from them.
+    */
+    void fetchRayElementData(const std::vector<std::vector<std::string> > & layerElements, \
+                             const Elements & elementsLibrary);
+
+    /*!
+    Element data obtained from the library the first time they are needed
+    */
+    const std::map<std::string, double> & getElementMassAttenuationCoefficients( \
+                                                    const std::string & elementName, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary);
+    const std::map<std::string, std::map<std::string, double> > & getElementExcitationFactors( \
+                                                    const std::string & elementName, \
+                                                    const double & energy, \
+                                                    const Elements & elementsLibrary);
+
+    /*!
+    Accumulate the rates, primary, secondary and contributions due to rays firstRay to lastRay - 1
+    for the calculations firstCalculation to lastCalculation - 1 into the supplied buffers.
+    The buffers follow the layout of the result arrays. The work is done by the accumulateRayKernel
+    instance matching the plan, selected once per call.
+    */
+    void accumulateRays(const std::vector<double>::size_type & firstRay, \
+                        const std::vector<double>::size_type & lastRay, \
+                        const std::vector<double>::size_type & firstCalculation, \
+                        const std::vector<double>::size_type & lastCalculation, \
+                        double * values, double * contributions, char * contributorMask, \
+                        double * derivatives) const;
+
+    /*!
+    Implementation of accumulateRays. The terms not needed by the plan are removed at compile time:
+    the secondary excitation if secondaryTerms is false (the tertiary excitation being applied to
+    the result afterwards, the kernel is the same for secondary 1 and 2), the excitation of a layer
+    by the other layers if interlayerTerms is false (single layer samples) and the derivatives if
+    derivativeTerms is false.
+    */
+    template <bool secondaryTerms, bool interlayerTerms, bool derivativeTerms>
+    void accumulateRayKernel(const std::vector<double>::size_type & firstRay, \
+                             const std::vector<double>::size_type & lastRay, \
+                             const std::vector<double>::size_type & firstCalculation, \
+                             const std::vector<double>::size_type & lastCalculation, \
+                             double * values, double * contributions, char * contributorMask, \
+                             double * derivatives) const;
+
+    /*!
+    Execute task(0) to task(nTasks - 1) using at most nThreads threads. The tasks are statically
+    distributed among the threads. An exception thrown by a task is rethrown once all the threads
+    are finished.
+    */
+    static void runTasks(const std::vector<double>::size_type & nTasks, const int & nThreads, \
+                         const std::function<void(const std::vector<double>::size_type &)> & task);
+
+    /*!
+    The rays are evaluated in at most this number of blocks, each one with its own buffers.
+    The blocks only depend on the number of rays and they are always added in the same order.
+    */
+    static const unsigned int maximumNumberOfRayBlocks = 32;
+    int nThreads;
+    int outputLevel;
+    double secondaryTolerance;
+    double beamCompressionTolerance;
+    int massFractionDerivatives;
+    int massThicknessDerivatives;
+
+    // calculation flags
+    int secondary;
+    int useMassFractions;
+    double secondaryCalculationLimit;
+    double minimumExcitationEnergy;
+    double alphaIn;
+    double sinAlphaIn;
+    double alphaOut;
+    double sinAlphaOut;
+
+    // sample layers
+    std::vector<std::string> layerName;
+    std::vector<double> layerDensity;
+    std::vector<double> layerThickness;
+    std::vector<double> layerFunnyFactor;
+    std::vector<std::map<std::string, double> > layerComposition;
+    std::vector<double> layerGeometricEfficiency;
+    // geometric efficiency parameters
+    int useGeometricEfficiency;
+    int referenceLayer;
+    double detectorDistance;
+    double detectorDiameter;
+
+    // rays able to excite something ordered by decreasing energy
+    std::vector<double> rayEnergy;
+    std::vector<double> rayWeight;
+    // incident energies of a scan and the ray evaluated at each of them, nRays if none
+    std::vector<double> scanEnergy;
+    std::vector<std::vector<double>::size_type> scanRay;
+    // [iRay * nLayers + iLayer] mass attenuation at the ray energy and ray fraction reaching the layer
+    std::vector<double> rayLayerMuTotal;
+    std::vector<double> rayLayerWeight;
+
+    // secondary excitation sources. The sources of layer iLayer at ray iRay are stored between
+    // sourceOffset[iRay * nLayers + iLayer] and sourceOffset[iRay * nLayers + iLayer + 1]
+    std::vector<std::vector<double>::size_type> sourceOffset;
+    std::vector<std::vector<double>::size_type> sourceEnergyIndex;
+    std::vector<std::vector<std::string>::size_type> sourceNameIndex;
+    std::vector<double> sourceRate;
+    // source rate prior to the correction for the incident beam reaching the layer and type of source
+    std::vector<double> sourceFactor;
+    std::vector<char> sourceScattering;
+    // source names ("Fe KL3", "coherent scattering")
+    std::vector<std::string> sourceNames;
+
+    // energies emitted by the secondary sources (sorted and unique) and the mass attenuation
+    // coefficients of each layer at them [iLayer * nSourceEnergies + iEnergy]
+    std::vector<double> sourceEnergies;
+    std::vector<double> sourceLayerMuTotal;
+
+    // attenuation table. Every energy needed by the sample terms (ray, line and secondary source
+    // energies) is identified by its index in tableEnergies, the table holding the total and coherent
+    // mass attenuation coefficients of the sample layers [iEnergy * nLayers + iLayer] and the total
+    // ones of the sample elements [iEnergy * nTableElements + iElement] at it. The table is filled
+    // when the sample terms are built, tableEnergyIndex only being used to find the known energies.
+    std::vector<double> tableEnergies;
+    std::map<double, std::vector<double>::size_type> tableEnergyIndex;
+    std::vector<std::string> tableElements;
+    std::vector<double> tableLayerMuTotal;
+    std::vector<double> tableLayerMuCoherent;
+    std::vector<double> tableElementMuTotal;
+    std::vector<double> tableElementMuCoherent;
+    // index in the attenuation table of the energy of each ray, line and secondary source energy
+    std::vector<std::vector<double>::size_type> rayTableIndex;
+    std::vector<std::vector<double>::size_type> lineTableIndex;
+    std::vector<std::vector<double>::size_type> sourceTableIndex;
+
+    // requested element families. Lines of family iFamily go from familyLineOffset[iFamily] to
+    // familyLineOffset[iFamily + 1]
+    std::vector<std::string> familyKey;
+    std::vector<std::string> familyElement;
+    std::vector<double> familyEnergyThreshold;
+    std::vector<std::vector<double>::size_type> familyLineOffset;
+    // [iFamily * nLayers + iLayer] non-zero if the family has been requested in the layer
+    std::vector<char> familyLayerRequested;
+
+    // emission lines of the requested families
+    std::vector<std::string> lineName;
+    std::vector<double> lineEnergy;
+    // primary excitation rates [iRay * nLines + iLine], zero for the lines not excited by the ray
+    std::vector<double> linePrimaryRate;
+    std::vector<char> lineExcited;
+    // secondary excitation rates at the secondary source energies [iEnergy * nLines + iLine], the lines
+    // of a family being contiguous at each energy
+    std::vector<double> lineSecondaryRate;
+    std::vector<char> lineSecondaryExcited;
+    // escape peaks of each line, from lineEscapeOffset[iLine] to lineEscapeOffset[iLine + 1]
+    std::vector<std::vector<double>::size_type> lineEscapeOffset;
+    std::vector<std::string> escapeName;
+    std::vector<double> escapeEnergy;
+    std::vector<double> escapeRatio;
+    // transmission through the attenuators and user attenuators [iLine * nAttenuators + iAttenuator]
+    // and intrinsic detector efficiency (empty if not used) of each line
+    std::vector<double>::size_type nAttenuators;
+    std::vector<double> lineAttenuatorTransmission;
+    std::vector<double> lineDetectorEfficiency;
+
+    // (element family, layer) pairs to be calculated
+    std::vector<std::vector<std::string>::size_type> calculationFamily;
+    std::vector<std::vector<double>::size_type> calculationLayer;
+    std::vector<double> calculationMassFraction;
+    std::vector<double> calculationMassFractionFactor;
+    // per line quantities of each calculation starting at calculationLineOffset[iCalculation]
+    // and following the order of the family lines
+    std::vector<std::vector<double>::size_type> calculationLineOffset;
+    std::vector<double> calculationLineMuTotal;
+    std::vector<double> calculationLineEfficiency;
+    // index of each calculated line in the line mask of the result
+    std::vector<std::vector<double>::size_type> calculationLineResultIndex;
+
+    // parameters of the derivatives, the mass fractions of layer iLayer from layerParameterOffset[iLayer]
+    // to layerParameterOffset[iLayer + 1], and their mass fractions. The mass thickness of layer iLayer
+    // is parameter thicknessParameterOffset + iLayer, if calculated.
+    std::vector<std::string> parameterNames;
+    std::vector<std::vector<double>::size_type> layerParameterOffset;
+    std::vector<double>::size_type thicknessParameterOffset;
+    std::vector<double> parameterMassFraction;
+    // mass attenuation coefficients of the parameter elements [iRay * nParameters + iParameter] at the
+    // ray energies, [iLine * nParameters + iParameter] at the line energies and
+    // [iEnergy * nParameters + iParameter] at the secondary source energies
+    std::vector<double> rayParameterMuTotal;
+    std::vector<double> rayParameterMuCoherent;
+    std::vector<double> lineParameterMuTotal;
+    std::vector<double> sourceParameterMuTotal;
+    // parameter of the element emitting each fluorescence source and parameter of the element of each
+    // calculation if the mass fractions are used (nParameters if there is none)
+    std::vector<std::vector<double>::size_type> sourceParameter;
+    std::vector<std::vector<double>::size_type> calculationParameter;
+    // derivatives of the logarithm of the detection efficiency [iCalculationLine * nParameters + iParameter]
+    std::vector<double> calculationLineEfficiencyDerivative;
+
+    // lookup tables of the result. Lines and escape peaks of the lines are mapped to the result line
+    // names via lineResultIndex and escapeResultIndex. Secondary sources of name iName in layer
+    // jLayer are mapped to the contributor names via sourceContributorIndex[iName * nLayers + jLayer]
+    std::vector<std::string> resultLineNames;
+    std::vector<int> resultLineParents;
+    std::vector<std::vector<std::string>::size_type> lineResultIndex;
+    std::vector<std::vector<std::string>::size_type> escapeResultIndex;
+    std::vector<std::string> contributorNames;
+    std::vector<std::vector<std::string>::size_type> sourceContributorIndex;
+
+    // library data not depending on the sample composition, kept for the sample updates.
+    // [element][energy] attenuation coefficients and excitation factors with unit weight,
+    // [element names of a layer][energy] excited shells, [family][energy] excitation factors
+    // of the family element at the secondary source energies (one map per family task)
+    std::map<std::string, std::map<double, std::map<std::string, double> > > elementMuCache;
+    std::map<std::string, std::map<double, std::map<std::string, std::map<std::string, double> > > > \
+                                                                            elementExcitationCache;
+    std::map<std::string, std::map<double, std::vector<std::pair<std::string, double> > > > peakFamiliesCache;
+    std::vector<std::map<double, std::map<std::string, std::map<std::string, double> > > > familyExcitationCache;
+};
+
+} // namespace fisx
+
+#endif // FISX_MULTILAYERPLAN_H
@@ -0,0 +1,413 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#include "fisx_multilayerresult.h"
+#include <sstream>
+#include <stdexcept>
+#include <iomanip>
+#include <algorithm>
+
+namespace fisx
+{
+
+MultilayerResult::MultilayerResult()
+{
+    this->nLayers = 0;
+    this->secondary = 0;
+    this->outputLevel = FULL_BREAKDOWN;
+    this->secondaryTolerance = 0.0;
+}
+
+std::vector<std::string> MultilayerResult::getQuantityNames()
+{
+    std::vector<std::string> names;
+    names.resize(N_QUANTITIES);
+    names[RATE] = "rate";
+    names[PRIMARY] = "primary";
+    names[SECONDARY] = "secondary";
+    names[TERTIARY] = "tertiary";
+    names[EFFICIENCY] = "efficiency";
+    names[ENERGY] = "energy";
+    names[ENERGY_THRESHOLD] = "energy_threshold";
+    names[MU_1_I] = "mu_1_i";
+    names[MASS_FRACTION] = "massFraction";
+    names[RATIO] = "ratio";
+    names[NEGLECTED] = "secondary_neglected";
+    return names;
+}
+
+void MultilayerResult::initialize(const std::vector<std::string> & elementFamilies, \
+                                  const std::vector<std::string>::size_type & nLayers, \
+                                  const std::vector<std::string> & lineNames, \
+                                  const std::vector<int> & lineParents, \
+                                  const std::vector<std::string> & contributorNames, \
+                                  const int & secondary, \
+                                  const int & outputLevel, \
+                                  const double & secondaryTolerance, \
+                                  const std::vector<std::string> & parameterNames)
+{
+    std::vector<double>::size_type nLines;
+    std::vector<double>::size_type nContributions;
+
+    if ((outputLevel < RATES_ONLY) || (outputLevel > FULL_BREAKDOWN))
+    {
+        throw std::invalid_argument("Invalid output level");
+    }
+    // the contributions are needed by the tertiary excitation
+    nLines = elementFamilies.size() * nLayers * lineNames.size();
+    nContributions = 0;
+    if ((outputLevel == FULL_BREAKDOWN) || (secondary > 1))
+    {
+        nContributions = nLines * contributorNames.size();
+    }
+    if (!this->hasLayout(elementFamilies, nLayers, lineNames, lineParents, contributorNames, \
+                         secondary, outputLevel, parameterNames))
+    {
+        this->elementFamilies = elementFamilies;
+        this->nLayers = nLayers;
+        this->lineNames = lineNames;
+        this->lineParents = lineParents;
+        this->contributorNames = contributorNames;
+        this->parameterNames = parameterNames;
+        this->values.resize(nLines * N_QUANTITIES);
+        this->derivatives.resize(nLines * parameterNames.size());
+        this->contributions.resize(nContributions);
+        this->lineMask.resize(nLines);
+        this->contributorMask.resize(nContributions);
+        this->familyOrder.clear();
+        this->lineContributorIndex.clear();
+    }
+    this->secondary = secondary;
+    this->outputLevel = outputLevel;
+    this->secondaryTolerance = secondaryTolerance;
+    std::fill(this->values.begin(), this->values.end(), 0.0);
+    std::fill(this->derivatives.begin(), this->derivatives.end(), 0.0);
+    std::fill(this->contributions.begin(), this->contributions.end(), 0.0);
+    std::fill(this->lineMask.begin(), this->lineMask.end(), 0);
+    std::fill(this->contributorMask.begin(), this->contributorMask.end(), 0);
+}
+
+bool MultilayerResult::hasLayout(const std::vector<std::string> & elementFamilies, \
+                                 const std::vector<std::string>::size_type & nLayers, \
+                                 const std::vector<std::string> & lineNames, \
+                                 const std::vector<int> & lineParents, \
+                                 const std::vector<std::string> & contributorNames, \
+                                 const int & secondary, \
+                                 const int & outputLevel, \
+                                 const std::vector<std::string> & parameterNames) const
+{
+    std::vector<double>::size_type nContributions;
+
+    nContributions = 0;
+    if ((outputLevel == FULL_BREAKDOWN) || (secondary > 1))
+    {
+        nContributions = elementFamilies.size() * nLayers * lineNames.size() * contributorNames.size();
+    }
+    return ((this->nLayers == nLayers) && \
+            (this->contributions.size() == nContributions) && \
+            (this->elementFamilies == elementFamilies) && \
+            (this->lineNames == lineNames) && \
+            (this->lineParents == lineParents) && \
+            (this->contributorNames == contributorNames) && \
+            (this->parameterNames == parameterNames));
+}
+
+void MultilayerResult::applyTertiaryExcitation()
+{
+    // approximate tertiary excitation
+    // we ignore the case of excitation after double rayleigh/coherent scattering
+    // Tertiary will not be correct if the peaks of the sample elements are not
+    // included in the list of peaks
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::string>::size_type iLayer;
+    std::vector<std::string>::size_type iLine;
+    std::vector<std::string>::size_type iContributor;
+    std::vector<std::string>::size_type nLines = this->lineNames.size();
+    std::vector<std::string>::size_type nContributors = this->contributorNames.size();
+    std::vector<std::string>::size_type nParameters = this->parameterNames.size();
+    std::vector<std::string>::size_type iParameter;
+    std::vector<double>::size_type index;
+    std::vector<double>::size_type parentIndex;
+    std::vector<double> contributorFactor;
+    std::vector<char> contributorSelected;
+    double factorFirst;
+    double tertiary;
+    double *value;
+    const double *parentValue;
+
+    if (this->contributions.size() != this->lineMask.size() * nContributors)
+    {
+        throw std::runtime_error("Secondary excitation contributions not available");
+    }
+    if (this->familyOrder.size() != this->elementFamilies.size())
+    {
+        this->buildContributorLookup();
+    }
+    contributorFactor.resize(nContributors, 1.0);
+    contributorSelected.resize(nContributors, 0);
+
+    // follow the order of the map output, the last family of the same element prevails
+    for (std::vector<std::string>::size_type i = 0; i < this->familyOrder.size(); i++)
+    {
+        iFamily = this->familyOrder[i];
+        for (iLayer = 0; iLayer < this->nLayers; iLayer++)
+        {
+            for (iLine = 0; iLine < nLines; iLine++)
+            {
+                index = this->getLineIndex(iFamily, iLayer, iLine);
+                if (!this->lineMask[index])
+                {
+                    continue;
+                }
+                if (this->lineNames[iLine].find("esc") != std::string::npos)
+                {
+                    // this is a escape line -> Ignore it
+                    continue;
+                }
+                value = &(this->values[index * N_QUANTITIES]);
+                if (value[MASS_FRACTION] < 5.0E-3)
+                {
+                    // one should be able to neglect tertiary excitation from elements
+                    // with less than 1 % concentration
+                    break;
+                }
+                factorFirst = 1.0;
+                if (value[PRIMARY] > 0.0)
+                {
+                    factorFirst = (value[PRIMARY] + value[SECONDARY]) / value[PRIMARY];
+                }
+                if (factorFirst < 1.01)
+                {
+                    // tertiary contribution should already be less than 1 % -> Ignore it
+                    continue;
+                }
+                if (this->lineContributorIndex[index] >= 0)
+                {
+                    // the factor will be the same for all lines starting by KL2, being escape or not
+                    contributorFactor[this->lineContributorIndex[index]] = factorFirst;
+                    contributorSelected[this->lineContributorIndex[index]] = 1;
+                }
+            }
+        }
+    }
+
+    for (iFamily = 0; iFamily < this->elementFamilies.size(); iFamily++)
+    {
+        for (iLayer = 0; iLayer < this->nLayers; iLayer++)
+        {
+            // parent lines are sorted before their escape peaks
+            for (iLine = 0; iLine < nLines; iLine++)
+            {
+                index = this->getLineIndex(iFamily, iLayer, iLine);
+                if (!this->lineMask[index])
+                {
+                    continue;
+                }
+                value = &(this->values[index * N_QUANTITIES]);
+                factorFirst = 1.0;
+                tertiary = 0.0;
+                if (value[PRIMARY] > 0.0)
+                {
+                    factorFirst = (value[PRIMARY] + value[SECONDARY]) / value[PRIMARY];
+                }
+                if (factorFirst < 1.01)
+                {
+                    // It had less than 1 % secondary, we assume tertiary will be even less
+                    value[TERTIARY] = 0.0;
+                    continue;
+                }
+                if (this->lineParents[iLine] >= 0)
+                {
+                    // this is a escape line -> the contribution to be used is the one of
+                    // the originating line that should already be calculated
+                    parentIndex = this->getLineIndex(iFamily, iLayer, this->lineParents[iLine]);
+                    parentValue = &(this->values[parentIndex * N_QUANTITIES]);
+                    tertiary = (value[PRIMARY] + value[SECONDARY]) * \
+                               (parentValue[TERTIARY] / (parentValue[PRIMARY] + parentValue[SECONDARY]));
+                }
+                else
+                {
+                    for (iContributor = 0; iContributor < nContributors; iContributor++)
+                    {
+                        if (contributorSelected[iContributor] && \
+                            this->contributorMask[index * nContributors + iContributor])
+                        {
+                            tertiary += this->contributions[index * nContributors + iContributor] * \
+                                        (contributorFactor[iContributor] - 1.0);
+                        }
+                    }
+                }
+                value[TERTIARY] = tertiary;
+                // update the total rate to account for primary, secondary and tertiary
+                // rate was equal to (primary + secondary) times a certain efficiency factor
+                // rate = A * (primary + secondary) therefore  now we must update the rate to
+                // account for tertiary rate = A * (primary + secondary + tertiary)
+                factorFirst = (tertiary + value[PRIMARY] + value[SECONDARY]) \
+                              / (value[PRIMARY] + value[SECONDARY]);
+                value[RATE] *= factorFirst;
+                for (iParameter = 0; iParameter < nParameters; iParameter++)
+                {
+                    this->derivatives[index * nParameters + iParameter] *= factorFirst;
+                }
+            }
+        }
+    }
+}
+
+void MultilayerResult::buildContributorLookup()
+{
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::string>::size_type iLayer;
+    std::vector<std::string>::size_type iLine;
+    std::vector<std::string>::size_type nLines = this->lineNames.size();
+    std::vector<std::pair<std::string, std::vector<std::string>::size_type> > sortedFamilies;
+    std::vector<std::string>::const_iterator c_it;
+    std::ostringstream tmpStringStream;
+    std::string key;
+    std::string ele;
+
+    for (iFamily = 0; iFamily < this->elementFamilies.size(); iFamily++)
+    {
+        sortedFamilies.push_back(std::make_pair(this->elementFamilies[iFamily], iFamily));
+    }
+    std::sort(sortedFamilies.begin(), sortedFamilies.end());
+    this->familyOrder.resize(sortedFamilies.size());
+    for (iFamily = 0; iFamily < sortedFamilies.size(); iFamily++)
+    {
+        this->familyOrder[iFamily] = sortedFamilies[iFamily].second;
+    }
+
+    // contributor names are sorted
+    this->lineContributorIndex.resize(this->lineMask.size());
+    for (iFamily = 0; iFamily < this->elementFamilies.size(); iFamily++)
+    {
+        ele = this->elementFamilies[iFamily].substr(0, this->elementFamilies[iFamily].find(' '));
+        for (iLayer = 0; iLayer < this->nLayers; iLayer++)
+        {
+            tmpStringStream.str(std::string());
+            tmpStringStream.clear();
+            tmpStringStream << std::setfill('0') << std::setw(2) << iLayer;
+            for (iLine = 0; iLine < nLines; iLine++)
+            {
+                key = ele + " " + this->lineNames[iLine] + " " + tmpStringStream.str();
+                c_it = std::lower_bound(this->contributorNames.begin(), this->contributorNames.end(), key);
+                if ((c_it != this->contributorNames.end()) && (*c_it == key))
+                {
+                    this->lineContributorIndex[this->getLineIndex(iFamily, iLayer, iLine)] = \
+                                                        (int) (c_it - this->contributorNames.begin());
+                }
+                else
+                {
+                    this->lineContributorIndex[this->getLineIndex(iFamily, iLayer, iLine)] = -1;
+                }
+            }
+        }
+    }
+}
+
+std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > \
+                MultilayerResult::getAsMap() const
+{
+    std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > result;
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::string>::size_type iLayer;
+    std::vector<std::string>::size_type iLine;
+    std::vector<std::string>::size_type iContributor;
+    std::vector<std::string>::size_type nLines = this->lineNames.size();
+    std::vector<std::string>::size_type nContributors = this->contributorNames.size();
+    std::vector<double>::size_type index;
+    const double *value;
+    int lastLayer;
+
+    for (iFamily = 0; iFamily < this->elementFamilies.size(); iFamily++)
+    {
+        lastLayer = -1;
+        for (iLayer = 0; iLayer < this->nLayers; iLayer++)
+        {
+            for (iLine = 0; iLine < nLines; iLine++)
+            {
+                index = this->getLineIndex(iFamily, iLayer, iLine);
+                if (!this->lineMask[index])
+                {
+                    continue;
+                }
+                lastLayer = (int) iLayer;
+                value = &(this->values[index * N_QUANTITIES]);
+                std::map<std::string, double> & output = \
+                                result[this->elementFamilies[iFamily]][(int) iLayer][this->lineNames[iLine]];
+                output["rate"] = value[RATE];
+                if (this->outputLevel == RATES_ONLY)
+                {
+                    continue;
+                }
+                output["energy"] = value[ENERGY];
+                output["primary"] = value[PRIMARY];
+                output["secondary"] = value[SECONDARY];
+                if (this->secondary > 1)
+                {
+                    output["tertiary"] = value[TERTIARY];
+                }
+                if (this->lineParents[iLine] >= 0)
+                {
+                    output["ratio"] = value[RATIO];
+                    continue;
+                }
+                output["efficiency"] = value[EFFICIENCY];
+                output["energy_threshold"] = value[ENERGY_THRESHOLD];
+                output["mu_1_i"] = value[MU_1_I];
+                output["massFraction"] = value[MASS_FRACTION];
+                if (this->secondaryTolerance > 0.0)
+                {
+                    output["secondary_neglected"] = value[NEGLECTED];
+                }
+                if (this->outputLevel != FULL_BREAKDOWN)
+                {
+                    continue;
+                }
+                for (iContributor = 0; iContributor < nContributors; iContributor++)
+                {
+                    if (this->contributorMask[index * nContributors + iContributor])
+                    {
+                        output[this->contributorNames[iContributor]] = \
+                                        this->contributions[index * nContributors + iContributor];
+                    }
+                }
+            }
+        }
+        if (this->secondary > 1)
+        {
+            // the tertiary excitation calculation always provided all the layers up to the last one
+            for (iLayer = 0; ((int) iLayer) < lastLayer; iLayer++)
+            {
+                result[this->elementFamilies[iFamily]][(int) iLayer];
+            }
+        }
+    }
+    return result;
+}
+
+} // namespace fisx
@@ -0,0 +1,230 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#ifndef FISX_MULTILAYERRESULT_H
+#define FISX_MULTILAYERRESULT_H
+#include <string>
+#include <vector>
+#include <map>
+
+namespace fisx
+{
+
+/*!
+  \class MultilayerResult
+  \brief Dense storage of the output of a multilayer fluorescence calculation
+
+   The values are stored in a contiguous array indexed as (element family, layer, line, quantity) and
+   the secondary excitation contributions in a contiguous array indexed as (element family, layer,
+   line, contributor). The names associated to each index are available in separate lookup tables.
+
+   The line names include the escape peaks of each line ("KL3 Si_KL3esc"). The line names and the
+   contributor names are sorted, therefore they follow the same order as the keys of the map returned
+   by XRF::getMultilayerFluorescence.
+
+   Not all the (element family, layer, line) combinations are calculated. A mask tells which ones are
+   present and a second mask tells which contributions are present.
+*/
+class MultilayerResult
+{
+public:
+    /*!
+    Quantities stored for each (element family, layer, line). Their names are the keys used in the
+    map output.
+    */
+    enum Quantity
+    {
+        RATE = 0,
+        PRIMARY,
+        SECONDARY,
+        TERTIARY,
+        EFFICIENCY,
+        ENERGY,
+        ENERGY_THRESHOLD,
+        MU_1_I,
+        MASS_FRACTION,
+        RATIO,
+        NEGLECTED,
+        N_QUANTITIES
+    };
+
+    /*!
+    Amount of information produced by a calculation.
+    RATES_ONLY - Only the rates are given in the map output
+    PRIMARY_SECONDARY - All the quantities except the secondary excitation contributions
+    FULL_BREAKDOWN - All the quantities and the contribution of each secondary excitation source
+    The contributions are neither calculated nor stored unless FULL_BREAKDOWN is requested or they are
+    needed to approximate the tertiary excitation.
+    */
+    enum OutputLevel
+    {
+        RATES_ONLY = 0,
+        PRIMARY_SECONDARY,
+        FULL_BREAKDOWN
+    };
+
+    MultilayerResult();
+
+    /*!
+    Set the lookup tables and reset all the values to zero. The storage is only reallocated if the
+    tables are not the same as the current ones.
+    \param elementFamilies - Element families (ex. "Cr K")
+    \param nLayers - Number of sample layers
+    \param lineNames - Sorted line names, escape peaks included
+    \param lineParents - Index of the parent line of escape peaks, -1 for fluorescence lines
+    \param contributorNames - Sorted secondary excitation contributor names (ex. "Fe KL3 01")
+    \param secondary - Secondary excitation level of the calculation
+    \param outputLevel - One of the OutputLevel values
+    \param secondaryTolerance - Relative tolerance used to neglect secondary excitation sources. If
+    positive, the NEGLECTED quantity is part of the map output.
+    \param parameterNames - Names of the parameters the rates are derived with respect to (ex. "Fe 01"
+    for the mass fraction of iron in layer 1). No derivatives are stored if empty.
+    */
+    void initialize(const std::vector<std::string> & elementFamilies, \
+                    const std::vector<std::string>::size_type & nLayers, \
+                    const std::vector<std::string> & lineNames, \
+                    const std::vector<int> & lineParents, \
+                    const std::vector<std::string> & contributorNames, \
+                    const int & secondary, \
+                    const int & outputLevel = FULL_BREAKDOWN, \
+                    const double & secondaryTolerance = 0.0, \
+                    const std::vector<std::string> & parameterNames = std::vector<std::string>());
+
+    /*!
+    True if initialize called with the same arguments keeps the storage of the arrays, and therefore
+    the pointers returned by getValues, getContributions, getDerivatives and the mask methods.
+    */
+    bool hasLayout(const std::vector<std::string> & elementFamilies, \
+                   const std::vector<std::string>::size_type & nLayers, \
+                   const std::vector<std::string> & lineNames, \
+                   const std::vector<int> & lineParents, \
+                   const std::vector<std::string> & contributorNames, \
+                   const int & secondary, \
+                   const int & outputLevel, \
+                   const std::vector<std::string> & parameterNames) const;
+
+    const std::vector<std::string> & getElementFamilies() const {return this->elementFamilies;};
+    const std::vector<std::string>::size_type & getNumberOfLayers() const {return this->nLayers;};
+    const std::vector<std::string> & getLineNames() const {return this->lineNames;};
+    const std::vector<int> & getLineParents() const {return this->lineParents;};
+    const std::vector<std::string> & getContributorNames() const {return this->contributorNames;};
+    const int & getSecondary() const {return this->secondary;};
+    const int & getOutputLevel() const {return this->outputLevel;};
+    const double & getSecondaryTolerance() const {return this->secondaryTolerance;};
+    const std::vector<std::string> & getParameterNames() const {return this->parameterNames;};
+
+    /*!
+    Names of the quantities in the order given by the Quantity enumeration
+    */
+    static std::vector<std::string> getQuantityNames();
+
+    /*!
+    Values as a contiguous array of shape (element families, layers, lines, quantities)
+    */
+    double * getValues() {return this->values.size() ? &(this->values[0]) : NULL;};
+    const double * getValues() const {return this->values.size() ? &(this->values[0]) : NULL;};
+
+    /*!
+    Secondary excitation contributions as a contiguous array of shape
+    (element families, layers, lines, contributors). NULL if they have not been calculated.
+    */
+    double * getContributions() {return this->contributions.size() ? &(this->contributions[0]) : NULL;};
+    const double * getContributions() const {return this->contributions.size() ? &(this->contributions[0]) : NULL;};
+
+    /*!
+    Derivatives of the rates with respect to the parameters as a contiguous array of shape
+    (element families, layers, lines, parameters). NULL if they have not been calculated.
+    */
+    double * getDerivatives() {return this->derivatives.size() ? &(this->derivatives[0]) : NULL;};
+    const double * getDerivatives() const {return this->derivatives.size() ? &(this->derivatives[0]) : NULL;};
+
+    /*!
+    Non-zero for the calculated (element family, layer, line) combinations
+    */
+    char * getLineMask() {return this->lineMask.size() ? &(this->lineMask[0]) : NULL;};
+    const char * getLineMask() const {return this->lineMask.size() ? &(this->lineMask[0]) : NULL;};
+
+    /*!
+    Non-zero for the (element family, layer, line, contributor) combinations present in the output
+    */
+    char * getContributorMask() {return this->contributorMask.size() ? &(this->contributorMask[0]) : NULL;};
+    const char * getContributorMask() const {return this->contributorMask.size() ? &(this->contributorMask[0]) : NULL;};
+
+    /*!
+    Index of an (element family, layer, line) combination in the line mask. Multiply by the number of
+    quantities or by the number of contributors to get the offset in the other arrays.
+    */
+    std::vector<double>::size_type getLineIndex(const std::vector<std::string>::size_type & family, \
+                                                const std::vector<std::string>::size_type & layer, \
+                                                const std::vector<std::string>::size_type & line) const
+    {
+        return (family * this->nLayers + layer) * this->lineNames.size() + line;
+    };
+
+    /*!
+    Approximate tertiary excitation. It fills the TERTIARY quantity and updates the rates.
+    The derivatives of the rates are scaled by the same factor as the rates, that is, the relative
+    tertiary contribution is taken as constant. Where the tertiary excitation is significant, as for
+    Cr excited by Fe excited by Ni, the mass thickness derivatives can then be off by some percent.
+    */
+    void applyTertiaryExcitation();
+
+    /*!
+    Output in the form returned by XRF::getMultilayerFluorescence
+    */
+    std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > \
+                getAsMap() const;
+
+private:
+    /*!
+    Lookup tables of the tertiary excitation built once for the current names: order of the families
+    in the map output and index of the secondary contributor corresponding to each (element family,
+    layer, line) combination, -1 if there is none.
+    */
+    void buildContributorLookup();
+
+    std::vector<std::string> elementFamilies;
+    std::vector<std::string>::size_type nLayers;
+    std::vector<std::string> lineNames;
+    std::vector<int> lineParents;
+    std::vector<std::string> contributorNames;
+    int secondary;
+    int outputLevel;
+    double secondaryTolerance;
+    std::vector<std::string> parameterNames;
+    std::vector<double> values;
+    std::vector<double> derivatives;
+    std::vector<double> contributions;
+    std::vector<char> lineMask;
+    std::vector<char> contributorMask;
+    std::vector<std::vector<std::string>::size_type> familyOrder;
+    std::vector<int> lineContributorIndex;
+};
+
+} // namespace fisx
+
+#endif // FISX_MULTILAYERRESULT_H
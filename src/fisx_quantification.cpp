@@ -0,0 +1,354 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#include "fisx_quantification.h"
+#include "fisx_simpleini.h"
+#include <cmath>
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+
+namespace fisx
+{
+
+Quantification::Quantification()
+{
+    this->layerIndex = 0;
+    this->maximumNumberOfIterations = 20;
+    this->tolerance = 1.0e-4;
+    this->nIterations = 0;
+    this->converged = 0;
+}
+
+void Quantification::setConfiguration(const XRF & xrf, \
+                                      const Elements & elementsLibrary, \
+                                      const std::vector<std::string> & elementFamilies, \
+                                      const int & layerIndex, \
+                                      const int & secondary)
+{
+    std::vector<std::string>::size_type i;
+    std::vector<std::string> elementFamilyLayer;
+    std::vector<std::string> tmpStringVector;
+    std::string tmpString;
+    std::string msg;
+    std::ostringstream layerString;
+
+    if (elementFamilies.size() < 1)
+    {
+        throw std::invalid_argument("No element family to be quantified");
+    }
+    if ((layerIndex < 0) || (layerIndex >= (int) xrf.getSample().size()))
+    {
+        std::cout << "Layer index " << layerIndex << " out of range" << std::endl;
+        throw std::invalid_argument("Layer index out of range");
+    }
+
+    layerString << layerIndex;
+    this->familyKey.clear();
+    this->familyElement.clear();
+    for (i = 0; i < elementFamilies.size(); i++)
+    {
+        tmpString = "";
+        SimpleIni::parseStringAsMultipleValues(elementFamilies[i], tmpStringVector, tmpString, ' ');
+        // We should have a key of the form "Cr K"
+        if (tmpStringVector.size() != 2)
+        {
+            msg = "Element family not of the form \"Cr K\": " + elementFamilies[i];
+            std::cout << msg << std::endl;
+            throw std::invalid_argument(msg);
+        }
+        this->familyKey.push_back(tmpStringVector[0] + " " + tmpStringVector[1]);
+        this->familyElement.push_back(tmpStringVector[0]);
+        elementFamilyLayer.push_back(this->familyKey[i] + " " + layerString.str());
+    }
+
+    // rates per unit mass fraction
+    this->plan = xrf.getMultilayerPlan(elementFamilyLayer, elementsLibrary, secondary, 1, 0);
+    this->plan.setOutputLevel(MultilayerResult::RATES_ONLY);
+    this->layerIndex = layerIndex;
+    this->initialComposition = this->plan.getLayerComposition(layerIndex);
+    this->layerComposition = this->initialComposition;
+    this->massFractions.clear();
+    this->matrixFactors.clear();
+    this->nIterations = 0;
+    this->converged = 0;
+}
+
+void Quantification::setMaximumNumberOfIterations(const int & nIterations)
+{
+    if (nIterations < 1)
+    {
+        throw std::invalid_argument("The maximum number of iterations has to be at least one");
+    }
+    this->maximumNumberOfIterations = nIterations;
+}
+
+void Quantification::setTolerance(const double & tolerance)
+{
+    if (tolerance < 0.0)
+    {
+        throw std::invalid_argument("Negative tolerance");
+    }
+    this->tolerance = tolerance;
+}
+
+std::map<std::string, double> Quantification::quantify(const std::map<std::string, double> & peakAreas, \
+                                                       const double & fluxTime, \
+                                                       const Elements & elementsLibrary)
+{
+    std::vector<std::string>::size_type i;
+    std::vector<std::string>::size_type j;
+    std::vector<std::string>::size_type k;
+    std::vector<std::string>::size_type nElements;
+    std::map<std::string, double>::const_iterator c_it;
+    std::map<std::string, double> composition;
+    std::map<std::string, double> quantified;
+    std::vector<std::string> elementName;
+    std::vector<std::string> elementFamily;
+    std::vector<double> elementArea;
+    // logarithms of the mass fractions, residuals (logarithms of the calculated over the measured areas)
+    // and approximated inverse jacobian of the residuals
+    std::vector<double> x;
+    std::vector<double> f;
+    std::vector<double> lastX;
+    std::vector<double> lastF;
+    std::vector<double> h;
+    std::vector<double> dx;
+    std::vector<double> hdf;
+    std::vector<double> dxh;
+    std::vector<double> step;
+    double rate;
+    double value;
+    double previous;
+    double denominator;
+    int haveLast;
+    int valid;
+    int done;
+
+    if (this->familyKey.size() < 1)
+    {
+        throw std::runtime_error("Quantification not configured");
+    }
+    if (fluxTime <= 0.0)
+    {
+        throw std::invalid_argument("Flux time has to be positive");
+    }
+    for (i = 0; i < this->familyKey.size(); i++)
+    {
+        if (peakAreas.find(this->familyKey[i]) == peakAreas.end())
+        {
+            std::cout << "Missing area of " << this->familyKey[i] << std::endl;
+            throw std::invalid_argument("Missing area of " + this->familyKey[i]);
+        }
+        // the first family of each element gives its mass fraction
+        if (std::find(elementName.begin(), elementName.end(), this->familyElement[i]) == elementName.end())
+        {
+            elementName.push_back(this->familyElement[i]);
+            elementFamily.push_back(this->familyKey[i]);
+            elementArea.push_back(peakAreas.find(this->familyKey[i])->second);
+        }
+    }
+    nElements = elementName.size();
+    x.resize(nElements);
+    f.resize(nElements);
+    dx.resize(nElements);
+    hdf.resize(nElements);
+    dxh.resize(nElements);
+    step.resize(nElements);
+    h.resize(nElements * nElements);
+    for (i = 0; i < nElements; i++)
+    {
+        for (j = 0; j < nElements; j++)
+        {
+            h[i * nElements + j] = (i == j) ? 1.0 : 0.0;
+        }
+    }
+
+    // The plain iteration C = area / (fluxTime * R(C)) is a fixed jacobian step assuming the
+    // calculated areas to be proportional to the mass fractions. It converges slowly when the
+    // quantified elements dominate the attenuation of the sample because a common scaling of them
+    // is then almost compensated. Starting from that step, the inverse jacobian of the logarithms
+    // of the calculated areas with respect to the logarithms of the mass fractions is improved at
+    // each iteration by a Broyden update.
+    composition = this->initialComposition;
+    haveLast = 0;
+    this->nIterations = 0;
+    this->converged = 0;
+    while (this->nIterations < this->maximumNumberOfIterations)
+    {
+        this->plan.setLayerComposition(this->layerIndex, composition, elementsLibrary);
+        this->updateMatrixFactors();
+        this->nIterations++;
+
+        quantified.clear();
+        valid = 1;
+        for (i = 0; i < nElements; i++)
+        {
+            rate = this->matrixFactors[elementFamily[i]];
+            c_it = composition.find(elementName[i]);
+            previous = (c_it == composition.end()) ? 0.0 : c_it->second;
+            if ((rate > 0.0) && (elementArea[i] > 0.0) && (previous > 0.0))
+            {
+                x[i] = std::log(previous);
+                f[i] = std::log(fluxTime * rate * previous / elementArea[i]);
+            }
+            else
+            {
+                x[i] = 0.0;
+                f[i] = 0.0;
+                if ((rate > 0.0) && (elementArea[i] > 0.0))
+                {
+                    // first estimate of the element, the previous iteration cannot be used
+                    valid = 0;
+                }
+            }
+        }
+
+        if (haveLast && valid)
+        {
+            for (i = 0; i < nElements; i++)
+            {
+                dx[i] = x[i] - lastX[i];
+                hdf[i] = 0.0;
+                for (j = 0; j < nElements; j++)
+                {
+                    hdf[i] += h[i * nElements + j] * (f[j] - lastF[j]);
+                }
+            }
+            for (j = 0; j < nElements; j++)
+            {
+                dxh[j] = 0.0;
+                for (k = 0; k < nElements; k++)
+                {
+                    dxh[j] += dx[k] * h[k * nElements + j];
+                }
+            }
+            denominator = 0.0;
+            for (i = 0; i < nElements; i++)
+            {
+                denominator += dx[i] * hdf[i];
+            }
+            if (std::fabs(denominator) > 1.0e-12)
+            {
+                for (i = 0; i < nElements; i++)
+                {
+                    for (j = 0; j < nElements; j++)
+                    {
+                        h[i * nElements + j] += (dx[i] - hdf[i]) * dxh[j] / denominator;
+                    }
+                }
+            }
+        }
+
+        for (i = 0; i < nElements; i++)
+        {
+            step[i] = 0.0;
+            for (j = 0; j < nElements; j++)
+            {
+                step[i] -= h[i * nElements + j] * f[j];
+            }
+        }
+
+        done = 1;
+        for (i = 0; i < nElements; i++)
+        {
+            rate = this->matrixFactors[elementFamily[i]];
+            c_it = composition.find(elementName[i]);
+            previous = (c_it == composition.end()) ? 0.0 : c_it->second;
+            value = 0.0;
+            if ((rate > 0.0) && (elementArea[i] > 0.0))
+            {
+                if (previous > 0.0)
+                {
+                    // do not change a mass fraction by more than a factor e in one iteration
+                    if (step[i] > 1.0)
+                        step[i] = 1.0;
+                    if (step[i] < -1.0)
+                        step[i] = -1.0;
+                    value = previous * std::exp(step[i]);
+                }
+                else
+                {
+                    value = elementArea[i] / (fluxTime * rate);
+                }
+            }
+            if (std::fabs(value - previous) > this->tolerance * value)
+            {
+                done = 0;
+            }
+            quantified[elementName[i]] = value;
+        }
+        for (c_it = quantified.begin(); c_it != quantified.end(); ++c_it)
+        {
+            composition[c_it->first] = c_it->second;
+        }
+        lastX = x;
+        lastF = f;
+        haveLast = valid;
+        if (done)
+        {
+            this->converged = 1;
+            break;
+        }
+    }
+    this->massFractions = quantified;
+    this->layerComposition = composition;
+    return this->massFractions;
+}
+
+void Quantification::updateMatrixFactors()
+{
+    std::vector<std::string>::size_type iFamily;
+    std::vector<std::string>::size_type iLine;
+    std::vector<double>::size_type index;
+    double rate;
+
+    this->plan.getMultilayerFluorescence(this->result);
+    const std::vector<std::string> & families = this->result.getElementFamilies();
+    const std::vector<int> & lineParents = this->result.getLineParents();
+    const double * values = this->result.getValues();
+    const char * lineMask = this->result.getLineMask();
+
+    this->matrixFactors.clear();
+    for (iFamily = 0; iFamily < families.size(); iFamily++)
+    {
+        rate = 0.0;
+        for (iLine = 0; iLine < lineParents.size(); iLine++)
+        {
+            // escape peaks are not part of the measured area of the family
+            index = this->result.getLineIndex(iFamily, this->layerIndex, iLine);
+            if (lineMask[index] && (lineParents[iLine] < 0))
+            {
+                rate += values[index * MultilayerResult::N_QUANTITIES + MultilayerResult::RATE];
+            }
+        }
+        this->matrixFactors[families[iFamily]] = rate;
+    }
+}
+
+} // namespace fisx
@@ -0,0 +1,132 @@
+#/*##########################################################################
+#
+# The fisx library for X-Ray Fluorescence
+#
+# Copyright (c) 2014-2023 European Synchrotron Radiation Facility
+#
+# This file is part of the fisx X-ray developed by V.A. Sole
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#############################################################################*/
+#ifndef FISX_QUANTIFICATION_H
+#define FISX_QUANTIFICATION_H
+#include "fisx_xrf.h"
+#include "fisx_multilayerplan.h"
+#include "fisx_multilayerresult.h"
+
+namespace fisx
+{
+
+/*!
+  \class Quantification
+  \brief Fundamental parameters quantification of the elements of one sample layer
+
+   The measured peak areas of a set of element families are converted into mass fractions by
+   iterating the fundamental parameters calculation:
+
+   C(i + 1) = area / (fluxTime * R(C(i)))
+
+   where R is the detected rate of the element family per unit mass fraction calculated with the
+   composition of the previous iteration. The mass fractions of the elements not being quantified
+   are kept fixed.
+
+   The configuration (beam, filters, geometry, sample, attenuators and detector) is taken once from
+   an XRF instance and kept as a MultilayerPlan, so each iteration only updates the terms depending
+   on the composition of the quantified layer.
+*/
+class Quantification
+{
+public:
+    Quantification();
+
+    /*!
+    Take the configuration of the XRF instance.
+    \param elementFamilies - Element families to be quantified (ex. "Fe K"). When several families of
+    the same element are given, the first one is used to obtain its mass fraction.
+    \param layerIndex - Sample layer containing the quantified elements
+    \param secondary - Secondary excitation level (0, 1 or 2)
+    */
+    void setConfiguration(const XRF & xrf, \
+                          const Elements & elementsLibrary, \
+                          const std::vector<std::string> & elementFamilies, \
+                          const int & layerIndex = 0, \
+                          const int & secondary = 0);
+
+    /*!
+    Iteration control. The iterations stop when the relative change of all the mass fractions is
+    below the tolerance or when the maximum number of iterations is reached.
+    */
+    void setMaximumNumberOfIterations(const int & nIterations);
+    const int & getMaximumNumberOfIterations() const {return this->maximumNumberOfIterations;};
+    void setTolerance(const double & tolerance);
+    const double & getTolerance() const {return this->tolerance;};
+
+    /*!
+    Obtain the mass fractions of the quantified elements.
+    \param peakAreas - Measured areas keyed by element family (ex. "Fe K"). Every family given to
+    setConfiguration has to be present.
+    \param fluxTime - Product of the incident flux and the acquisition time
+    The iterations start from the composition of the layer in the XRF configuration.
+    Returns the mass fractions keyed by element name.
+    */
+    std::map<std::string, double> quantify(const std::map<std::string, double> & peakAreas, \
+                                           const double & fluxTime, \
+                                           const Elements & elementsLibrary);
+
+    /*!
+    Results of the last quantification. The matrix factors are the detected rates of each element
+    family per unit mass fraction and unit flux obtained in the last iteration.
+    */
+    const std::map<std::string, double> & getMassFractions() const {return this->massFractions;};
+    const std::map<std::string, double> & getMatrixFactors() const {return this->matrixFactors;};
+    const int & getNumberOfIterations() const {return this->nIterations;};
+    const int & hasConverged() const {return this->converged;};
+
+    /*!
+    Composition of the quantified layer used in the last iteration
+    */
+    const std::map<std::string, double> & getLayerComposition() const {return this->layerComposition;};
+
+private:
+    /*!
+    Evaluate the plan and sum the rates of the fluorescence lines of each family in the layer
+    */
+    void updateMatrixFactors();
+
+    MultilayerPlan plan;
+    MultilayerResult result;
+    int layerIndex;
+    std::vector<std::string> familyKey;
+    std::vector<std::string> familyElement;
+    std::map<std::string, double> initialComposition;
+
+    int maximumNumberOfIterations;
+    double tolerance;
+
+    std::map<std::string, double> massFractions;
+    std::map<std::string, double> layerComposition;
+    std::map<std::string, double> matrixFactors;
+    int nIterations;
+    int converged;
+};
+
+} // namespace fisx
+
+#endif // FISX_QUANTIFICATION_H
@@ -43,23 +43,45 @@ XRF::XRF()
     // initialize geometry with default parameters
     this->configuration = XRFConfig();
     this->setGeometry(45., 45.);
+    this->nThreads = 1;
+    this->outputLevel = MultilayerResult::FULL_BREAKDOWN;
+    this->secondaryTolerance = 0.0;
+    this->beamCompressionTolerance = 0.0;
+    this->massFractionDerivatives = 0;
+    this->massThicknessDerivatives = 0;
+    this->multilayerCacheEnabled = 0;
+    this->clearMultilayerCache();
+    this->resultCacheSize = 0;
+    this->clearResultCache();
     //this->elements = NULL;
 };
 
 XRF::XRF(const std::string & fileName)
 {
     this->readConfigurationFromFile(fileName);
+    this->nThreads = 1;
+    this->outputLevel = MultilayerResult::FULL_BREAKDOWN;
+    this->secondaryTolerance = 0.0;
+    this->beamCompressionTolerance = 0.0;
+    this->massFractionDerivatives = 0;
+    this->massThicknessDerivatives = 0;
+    this->multilayerCacheEnabled = 0;
+    this->clearMultilayerCache();
+    this->resultCacheSize = 0;
+    this->clearResultCache();
     //this->elements = NULL;
 }
 
 void XRF::readConfigurationFromFile(const std::string & fileName)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     this->configuration.readConfigurationFromFile(fileName);
 }
 
 void XRF::setGeometry(const double & alphaIn, const double & alphaOut, const double & scatteringAngle)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     if (scatteringAngle < 0.0)
     {
@@ -73,12 +95,14 @@ void XRF::setGeometry(const double & alphaIn, const double & alphaOut, const dou
 
 void XRF::setBeam(const Beam & beam)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     this->configuration.setBeam(beam);
 }
 
 void XRF::setSingleEnergyBeam(const double & energy, const double & divergency)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     this->configuration.setSingleEnergyBeam(energy, divergency);
 }
@@ -88,23 +112,27 @@ void XRF::setBeam(const std::vector<double> & energies, \
                  const std::vector<int> & characteristic, \
                  const std::vector<double> & divergency)
 {
+    this->multilayerPlanValid = false;
     this->configuration.setBeam(energies, weight, characteristic, divergency);
 }
 
 void XRF::setBeamFilters(const std::vector<Layer> &layers)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     this->configuration.setBeamFilters(layers);
 }
 
 void XRF::setUserBeamFilters(const std::vector<TransmissionTable> & userFilters)
 {
+    this->multilayerPlanValid = false;
     this->recentBeam = true;
     this->configuration.setUserBeamFilters(userFilters);
 }
 
 void XRF::setSample(const std::vector<Layer> & layers, const int & referenceLayer)
 {
+    this->checkMultilayerPlanSample(layers, referenceLayer);
     this->configuration.setSample(layers, referenceLayer);
 }
 
@@ -114,6 +142,7 @@ void XRF::setSample(const std::string & name, \
 {
     std::vector<Layer> vLayer;
     vLayer.push_back(Layer(name, density, thickness, 1.0));
+    this->checkMultilayerPlanSample(vLayer, 0);
     this->configuration.setSample(vLayer, 0);
 }
 
@@ -121,21 +150,25 @@ void XRF::setSample(const Layer & layer)
 {
     std::vector<Layer> vLayer;
     vLayer.push_back(layer);
+    this->checkMultilayerPlanSample(vLayer, 0);
     this->configuration.setSample(vLayer, 0);
 }
 
 void XRF::setAttenuators(const std::vector<Layer> & attenuators)
 {
+    this->multilayerPlanValid = false;
     this->configuration.setAttenuators(attenuators);
 }
 
 void XRF::setUserAttenuators(const std::vector<TransmissionTable> & userAttenuators)
 {
+    this->multilayerPlanValid = false;
     this->configuration.setUserAttenuators(userAttenuators);
 }
 
 void XRF::setDetector(const Detector & detector)
 {
+    this->multilayerPlanValid = false;
     this->configuration.setDetector(detector);
 }
 
@@ -262,6 +295,146 @@ const XRFConfig & XRF::getConfiguration() const
 
 }
 
+void XRF::setNumberOfThreads(const int & nThreads)
+{
+    if (nThreads < 1)
+    {
+        throw std::invalid_argument("Number of threads must be at least 1");
+    }
+    this->nThreads = nThreads;
+}
+
+void XRF::setOutputLevel(const int & outputLevel)
+{
+    if ((outputLevel < MultilayerResult::RATES_ONLY) || (outputLevel > MultilayerResult::FULL_BREAKDOWN))
+    {
+        throw std::invalid_argument("Invalid output level");
+    }
+    this->outputLevel = outputLevel;
+}
+
+void XRF::setSecondaryTolerance(const double & tolerance)
+{
+    if ((tolerance < 0.0) || (tolerance >= 1.0))
+    {
+        throw std::invalid_argument("Secondary tolerance must be in the range [0.0, 1.0)");
+    }
+    this->secondaryTolerance = tolerance;
+}
+
+void XRF::setBeamCompressionTolerance(const double & tolerance)
+{
+    if ((tolerance < 0.0) || (tolerance >= 1.0))
+    {
+        throw std::invalid_argument("Beam compression tolerance must be in the range [0.0, 1.0)");
+    }
+    if (tolerance != this->beamCompressionTolerance)
+    {
+        // the rays of a kept plan are already set
+        this->multilayerPlanValid = false;
+    }
+    this->beamCompressionTolerance = tolerance;
+}
+
+void XRF::setMassFractionDerivatives(const int & flag)
+{
+    this->massFractionDerivatives = (flag != 0) ? 1 : 0;
+}
+
+void XRF::setMassThicknessDerivatives(const int & flag)
+{
+    this->massThicknessDerivatives = (flag != 0) ? 1 : 0;
+}
+
+void XRF::setMultilayerCacheEnabled(const int & flag)
+{
+    this->multilayerCacheEnabled = flag;
+    if (flag == 0)
+    {
+        this->clearMultilayerCache();
+    }
+}
+
+void XRF::clearMultilayerCache()
+{
+    this->multilayerPlanValid = false;
+    this->multilayerPlan = MultilayerPlan();
+    this->multilayerPlanLibrary = NULL;
+    this->multilayerPlanLibraryGeneration = 0;
+    this->multilayerPlanElementFamilyLayer.clear();
+    this->multilayerPlanFlags.clear();
+    this->multilayerPlanBeam.clear();
+}
+
+void XRF::checkMultilayerPlanSample(const std::vector<Layer> & layers, const int & referenceLayer)
+{
+    const std::vector<Layer> & sample = this->configuration.getSample();
+    std::vector<Layer>::size_type iLayer;
+
+    if (!this->multilayerPlanValid)
+        return;
+    if ((layers.size() != sample.size()) || (referenceLayer != this->configuration.getReferenceLayer()))
+    {
+        this->multilayerPlanValid = false;
+        return;
+    }
+    for (iLayer = 0; iLayer < layers.size(); iLayer++)
+    {
+        if (layers[iLayer].getFunnyFactor() != sample[iLayer].getFunnyFactor())
+        {
+            this->multilayerPlanValid = false;
+            return;
+        }
+    }
+}
+
+bool XRF::updateMultilayerPlan(const Elements & elementsLibrary)
+{
+    const std::vector<Layer> & sample = this->configuration.getSample();
+    std::vector<Layer>::size_type iLayer;
+    std::vector<std::map<std::string, double> > compositions;
+
+    // the plan is not usable if something goes wrong during the update
+    this->multilayerPlanValid = false;
+    compositions.resize(sample.size());
+    for (iLayer = 0; iLayer < sample.size(); iLayer++)
+    {
+        compositions[iLayer] = this->getLayerComposition(sample[iLayer], elementsLibrary);
+        if (compositions[iLayer].size() < 1)
+        {
+            // let the full calculation deal with it
+            return false;
+        }
+    }
+    // the mass thickness changes first because they are cheaper to take into account
+    for (iLayer = 0; iLayer < sample.size(); iLayer++)
+    {
+        if ((sample[iLayer].getDensity() != this->multilayerPlan.getLayerDensity((int) iLayer)) || \
+            (sample[iLayer].getThickness() != this->multilayerPlan.getLayerThickness((int) iLayer)))
+        {
+            this->multilayerPlan.setLayerDensityAndThickness((int) iLayer, \
+                                                             sample[iLayer].getDensity(), \
+                                                             sample[iLayer].getThickness());
+        }
+    }
+    for (iLayer = 0; iLayer < sample.size(); iLayer++)
+    {
+        if (compositions[iLayer] != this->multilayerPlan.getLayerComposition((int) iLayer))
+        {
+            this->multilayerPlan.setLayerComposition((int) iLayer, compositions[iLayer], elementsLibrary);
+        }
+    }
+    this->multilayerPlanValid = true;
+    return true;
+}
+
+void XRF::setConfiguration(const XRFConfig & configuration)
+{
+    this->multilayerPlanValid = false;
+    this->recentBeam = true;
+    this->configuration = configuration;
+}
+
 std::map<std::string, double> XRF::getLayerComposition(const Layer & layer, const Elements & elements) const
 {
     std::map <std::string, double> composition;
@@ -397,10 +570,167 @@ std::map<std::string, std::map<int, std::map<std::string, std::map<std::string,
                 const Elements & elementsLibrary, const int & secondary, \
                 const int & useGeometricEfficiency, const int & useMassFractions, \
                 const double & secondaryCalculationLimit, const Beam & overwritingBeam)
+{
+    std::string fingerprint;
+    std::map<std::string, std::pair<long, expectedLayerEmissionType> >::iterator it;
+
+    if (this->resultCacheSize < 1)
+    {
+        return this->calculateMultilayerFluorescence(elementFamilyLayer, elementsLibrary, secondary, \
+                                                     useGeometricEfficiency, useMassFractions, \
+                                                     secondaryCalculationLimit, overwritingBeam);
+    }
+    fingerprint = this->getMultilayerFingerprint(elementFamilyLayer, elementsLibrary, secondary, \
+                                                 useGeometricEfficiency, useMassFractions, \
+                                                 secondaryCalculationLimit, overwritingBeam);
+    it = this->resultCache.find(fingerprint);
+    if (it != this->resultCache.end())
+    {
+        this->resultCacheHits++;
+        this->resultCacheOrder.erase(it->second.first);
+    }
+    else
+    {
+        this->resultCacheMisses++;
+        it = this->resultCache.insert(std::make_pair(fingerprint, \
+                    std::make_pair(0L, this->calculateMultilayerFluorescence(elementFamilyLayer, \
+                                                    elementsLibrary, secondary, \
+                                                    useGeometricEfficiency, useMassFractions, \
+                                                    secondaryCalculationLimit, overwritingBeam)))).first;
+    }
+    // it becomes the most recently used result
+    this->resultCacheCounter++;
+    it->second.first = this->resultCacheCounter;
+    this->resultCacheOrder[this->resultCacheCounter] = fingerprint;
+    this->trimResultCache();
+    return it->second.second;
+}
+
+std::string XRF::getMultilayerFingerprint(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam) const
+{
+    std::ostringstream o;
+    std::vector<std::vector<double> > beam;
+    std::vector<std::string>::size_type i;
+
+    o << std::setprecision(17);
+    o << "LIBRARY " << (const void *) &elementsLibrary << " " << elementsLibrary.getGeneration() << std::endl;
+    o << "FAMILIES " << elementFamilyLayer.size() << std::endl;
+    for (i = 0; i < elementFamilyLayer.size(); i++)
+    {
+        o << elementFamilyLayer[i] << std::endl;
+    }
+    o << "FLAGS " << secondary << " " << useGeometricEfficiency << " " << useMassFractions << " ";
+    o << secondaryCalculationLimit << " " << this->outputLevel << " " << this->secondaryTolerance << " ";
+    o << this->beamCompressionTolerance << std::endl;
+    beam = overwritingBeam.getBeamAsDoubleVectors();
+    o << "OVERWRITING BEAM " << beam[0].size();
+    for (i = 0; i < beam[0].size(); i++)
+    {
+        o << " " << beam[0][i] << " " << beam[1][i] << " " << beam[2][i] << " " << beam[3][i];
+    }
+    o << std::endl;
+    o << this->configuration.getFingerprint();
+    return o.str();
+}
+
+void XRF::setResultCacheSize(const int & size)
+{
+    if (size < 0)
+    {
+        throw std::invalid_argument("Result cache size cannot be negative");
+    }
+    this->resultCacheSize = size;
+    this->trimResultCache();
+}
+
+void XRF::trimResultCache()
+{
+    // discard the least recently used results
+    while (this->resultCache.size() > (std::vector<int>::size_type) this->resultCacheSize)
+    {
+        this->resultCache.erase(this->resultCacheOrder.begin()->second);
+        this->resultCacheOrder.erase(this->resultCacheOrder.begin());
+    }
+}
+
+void XRF::clearResultCache()
+{
+    this->resultCache.clear();
+    this->resultCacheOrder.clear();
+    this->resultCacheCounter = 0;
+    this->resultCacheHits = 0;
+    this->resultCacheMisses = 0;
+}
+
+std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > \
+                XRF::calculateMultilayerFluorescence(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam)
+{
+    std::vector<double> flags;
+    std::vector<std::vector<double> > beam;
+
+    if (!this->multilayerCacheEnabled)
+    {
+        return this->getMultilayerPlan(elementFamilyLayer, elementsLibrary, secondary, \
+                                       useGeometricEfficiency, useMassFractions, \
+                                       secondaryCalculationLimit, overwritingBeam).getMultilayerFluorescence();
+    }
+    flags.push_back(secondary);
+    flags.push_back(useGeometricEfficiency);
+    flags.push_back(useMassFractions);
+    flags.push_back(secondaryCalculationLimit);
+    beam = overwritingBeam.getBeamAsDoubleVectors();
+    // a modified library or material invalidates all the terms of the plan
+    if (!(this->multilayerPlanValid && \
+          (this->multilayerPlanLibrary == &elementsLibrary) && \
+          (this->multilayerPlanLibraryGeneration == elementsLibrary.getGeneration()) && \
+          (this->multilayerPlanElementFamilyLayer == elementFamilyLayer) && \
+          (this->multilayerPlanFlags == flags) && \
+          (this->multilayerPlanBeam == beam) && \
+          this->updateMultilayerPlan(elementsLibrary)))
+    {
+        this->multilayerPlanValid = false;
+        this->multilayerPlan = this->getMultilayerPlan(elementFamilyLayer, elementsLibrary, secondary, \
+                                                       useGeometricEfficiency, useMassFractions, \
+                                                       secondaryCalculationLimit, overwritingBeam);
+        this->multilayerPlanLibrary = &elementsLibrary;
+        this->multilayerPlanLibraryGeneration = elementsLibrary.getGeneration();
+        this->multilayerPlanElementFamilyLayer = elementFamilyLayer;
+        this->multilayerPlanFlags = flags;
+        this->multilayerPlanBeam = beam;
+        this->multilayerPlanValid = true;
+    }
+    this->multilayerPlan.setNumberOfThreads(this->nThreads);
+    this->multilayerPlan.setOutputLevel(this->outputLevel);
+    this->multilayerPlan.setSecondaryTolerance(this->secondaryTolerance);
+    return this->multilayerPlan.getMultilayerFluorescence();
+}
+
+MultilayerPlan XRF::getMultilayerPlan(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam) const
 {
     std::vector<std::string> elementList;
     std::vector<std::string> familyList;
     std::vector<int> layerList;
+
+    XRF::parseElementFamilyLayer(elementFamilyLayer, elementList, familyList, layerList);
+    return this->getMultilayerPlan(elementList, elementsLibrary, \
+                                   layerList, familyList, secondary, useGeometricEfficiency, \
+                                   useMassFractions, secondaryCalculationLimit, overwritingBeam);
+}
+
+void XRF::parseElementFamilyLayer(const std::vector<std::string> & elementFamilyLayer, \
+                                  std::vector<std::string> & elementList, \
+                                  std::vector<std::string> & familyList, \
+                                  std::vector<int> & layerList)
+{
     std::vector<std::string>::size_type i;
     int layerIndex;
     std::string tmpString;
@@ -440,9 +770,52 @@ std::map<std::string, std::map<int, std::map<std::string, std::map<std::string,
             layerList[i] = -1;
         }
     }
-    return this->getMultilayerFluorescence(elementList, elementsLibrary, \
-                                           layerList, familyList, secondary, useGeometricEfficiency, \
-                                           useMassFractions, secondaryCalculationLimit, overwritingBeam);
+}
+
+MultilayerPlan XRF::getMultilayerScanPlan(const std::vector<double> & incidentEnergies, \
+                const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit) const
+{
+    std::vector<std::string> elementList;
+    std::vector<std::string> familyList;
+    std::vector<int> layerList;
+    MultilayerPlan plan;
+
+    XRF::parseElementFamilyLayer(elementFamilyLayer, elementList, familyList, layerList);
+    this->setMultilayerPlanSettings(plan);
+    plan.buildScan(this->configuration, elementsLibrary, elementList, layerList, familyList, \
+                   incidentEnergies, secondary, useGeometricEfficiency, useMassFractions, \
+                   secondaryCalculationLimit);
+    return plan;
+}
+
+std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                XRF::getMultilayerFluorescenceScan(const std::vector<double> & incidentEnergies, \
+                const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit) const
+{
+    return this->getMultilayerScanPlan(incidentEnergies, elementFamilyLayer, elementsLibrary, \
+                                       secondary, useGeometricEfficiency, useMassFractions, \
+                                       secondaryCalculationLimit).getMultilayerFluorescenceScan();
+}
+
+std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                XRF::getMultilayerFluorescence(const std::vector<std::map<std::string, double> > & compositions, \
+                const int & layerIndex, const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam) const
+{
+    return this->getMultilayerPlan(elementFamilyLayer, elementsLibrary, secondary, \
+                                   useGeometricEfficiency, useMassFractions, \
+                                   secondaryCalculationLimit, \
+                                   overwritingBeam).getMultilayerFluorescence(compositions, \
+                                                                              layerIndex, \
+                                                                              elementsLibrary);
 }
 
 void XRF::printConfiguration() const
@@ -29,6 +29,7 @@
 #define FISX_XRF_H
 #include "fisx_xrfconfig.h"
 #include "fisx_elements.h"
+#include "fisx_multilayerplan.h"
 #include <iostream>
 
 namespace fisx
@@ -163,6 +164,92 @@ public:
     void setCollimators();
     void addCollimator();
 
+    /*!
+    Number of threads used to evaluate the multilayer fluorescence. The beam rays are distributed among them.
+    The result does not depend on the number of threads.
+    */
+    void setNumberOfThreads(const int & nThreads);
+    const int & getNumberOfThreads() const {return this->nThreads;};
+
+    /*!
+    Amount of information returned by the multilayer fluorescence calculation, one of the
+    MultilayerResult::OutputLevel values:
+    RATES_ONLY (0) - Only the rate of each line
+    PRIMARY_SECONDARY (1) - All the quantities of each line but the secondary excitation contributions
+    FULL_BREAKDOWN (2) - Everything, including the contribution of each secondary excitation source (default)
+    The secondary excitation contributions are not calculated if they are not requested, unless they are
+    needed to approximate the tertiary excitation.
+    */
+    void setOutputLevel(const int & outputLevel);
+    const int & getOutputLevel() const {return this->outputLevel;};
+
+    /*!
+    Relative tolerance used to neglect secondary excitation sources (see
+    MultilayerPlan::setSecondaryTolerance). If positive, the upper bound of the neglected secondary
+    rate of each line is given in the output under the key "secondary_neglected".
+    */
+    void setSecondaryTolerance(const double & tolerance);
+    const double & getSecondaryTolerance() const {return this->secondaryTolerance;};
+
+    /*!
+    Relative tolerance used to reduce the number of beam rays prior to the multilayer calculation (see
+    MultilayerPlan::setBeamCompressionTolerance). Adjacent rays between absorption edges are merged
+    as long as the primary rate of every requested line changes by less than the tolerance.
+    Zero (default) evaluates every ray.
+    */
+    void setBeamCompressionTolerance(const double & tolerance);
+    const double & getBeamCompressionTolerance() const {return this->beamCompressionTolerance;};
+
+    /*!
+    If non-zero, the plans returned by getMultilayerPlan also calculate the derivatives of the rates
+    with respect to the mass fractions of the elements of the sample layers (see
+    MultilayerPlan::setMassFractionDerivatives). The map output of getMultilayerFluorescence does not
+    include them. Default is 0.
+    */
+    void setMassFractionDerivatives(const int & flag);
+    const int & getMassFractionDerivatives() const {return this->massFractionDerivatives;};
+
+    /*!
+    If non-zero, the plans returned by getMultilayerPlan also calculate the derivatives of the rates
+    with respect to the mass thickness (density * thickness) of the sample layers (see
+    MultilayerPlan::setMassThicknessDerivatives). Default is 0.
+    */
+    void setMassThicknessDerivatives(const int & flag);
+    const int & getMassThicknessDerivatives() const {return this->massThicknessDerivatives;};
+
+    /*!
+    Keep the plan of the last multilayer calculation requested via element, family and layer strings.
+    When the next calculation is requested with the same arguments and the configuration has only
+    changed by the density, the thickness or the material of some sample layers, only the terms
+    depending on those changes are calculated again (see MultilayerPlan::setLayerDensityAndThickness
+    and MultilayerPlan::setLayerComposition). Any other change of configuration discards the plan.
+    For a beamline sample series with a monochromatic beam, only the sample terms are then calculated
+    again from one call to the next. A modification of the elements library or of the materials it holds
+    (see Elements::getGeneration) discards the plan.
+    */
+    void setMultilayerCacheEnabled(const int & flag = 1);
+    int isMultilayerCacheEnabled() const {return this->multilayerCacheEnabled;};
+    void clearMultilayerCache();
+
+    /*!
+    Keep the results of the last calls to getMultilayerFluorescence using element, family and layer
+    strings. A call with the same arguments, the same elements library instance and generation (see
+    Elements::getGeneration), the same calculation settings and the same configuration (see
+    XRFConfig::getFingerprint) returns the kept result without any calculation. Modifying the library,
+    its elements or its materials therefore never returns a kept result. At most size results are kept,
+    the least recently used one being discarded first. Zero (default) disables the cache.
+    */
+    void setResultCacheSize(const int & size);
+    const int & getResultCacheSize() const {return this->resultCacheSize;};
+    void clearResultCache();
+
+    /*!
+    Number of calls answered from the result cache and number of calls calculated since the cache was
+    last cleared
+    */
+    const long & getResultCacheHits() const {return this->resultCacheHits;};
+    const long & getResultCacheMisses() const {return this->resultCacheMisses;};
+
     /*!
     For debugging purposes
     */
@@ -251,6 +338,65 @@ public:
                 const double & secondaryCalculationLimit = 0.0,
                 const Beam & overwritingBeam = Beam());
 
+    /*!
+    Precalculate all the quantities needed by the getMultilayerFluorescence method taking the same
+    arguments. The returned plan can be evaluated as many times as needed.
+    */
+    MultilayerPlan getMultilayerPlan(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, \
+                const int & secondary = 0, \
+                const int & useGeometricEfficiency = 1, \
+                const int & useMassFractions = 0, \
+                const double & secondaryCalculationLimit = 0.0,
+                const Beam & overwritingBeam = Beam()) const;
+
+    /*!
+    Mapping mode. Evaluate the getMultilayerFluorescence method taking the same elementFamilyLayer
+    argument for each of the supplied compositions of the sample layer layerIndex. The compositions
+    are given as element mass fractions. Everything not depending on the sample composition is
+    calculated once and the compositions are distributed among the configured number of threads.
+    \return One output per composition, as returned by getMultilayerFluorescence
+    */
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                getMultilayerFluorescence(const std::vector<std::map<std::string, double> > & compositions, \
+                const int & layerIndex, \
+                const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, \
+                const int & secondary = 0, \
+                const int & useGeometricEfficiency = 1, \
+                const int & useMassFractions = 0, \
+                const double & secondaryCalculationLimit = 0.0,
+                const Beam & overwritingBeam = Beam()) const;
+
+    /*!
+    Incident energy scan. Evaluate the getMultilayerFluorescence method taking the same elementFamilyLayer
+    argument for a monochromatic beam at each of the supplied incident energies, as if the beam was set by
+    setSingleEnergyBeam. The quantities depending on the energies of the emitted lines are calculated once
+    and the energies are distributed among the configured number of threads. The emission lines are those
+    excited by at least one of the energies. See MultilayerPlan::buildScan.
+    \return One output per incident energy, as returned by getMultilayerFluorescence
+    */
+    std::vector<std::map<std::string, std::map<int, std::map<std::string, std::map<std::string, double> > > > > \
+                getMultilayerFluorescenceScan(const std::vector<double> & incidentEnergies, \
+                const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, \
+                const int & secondary = 0, \
+                const int & useGeometricEfficiency = 1, \
+                const int & useMassFractions = 0, \
+                const double & secondaryCalculationLimit = 0.0) const;
+
+    /*!
+    Precalculate all the quantities needed by the getMultilayerFluorescenceScan method taking the same
+    arguments. The returned plan is evaluated by MultilayerPlan::getMultilayerFluorescenceScan.
+    */
+    MultilayerPlan getMultilayerScanPlan(const std::vector<double> & incidentEnergies, \
+                const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, \
+                const int & secondary = 0, \
+                const int & useGeometricEfficiency = 1, \
+                const int & useMassFractions = 0, \
+                const double & secondaryCalculationLimit = 0.0) const;
+
     /*!
     Basis method called by all the other convenience methods.
     \param elementList - Vector of strings. Each string represents one element.\n
@@ -294,6 +440,21 @@ public:
                                           const double & secondaryCalculationLimit = 0.0,
                                           const Beam & overwritingBeam = Beam()) const;
 
+    /*!
+    Precalculate all the quantities needed by the basis getMultilayerFluorescence method. The returned
+    plan can be evaluated as many times as needed without accessing the elements library.
+    The arguments are the same as those of the basis getMultilayerFluorescence method.
+    */
+    MultilayerPlan getMultilayerPlan(const std::vector<std::string> & elementList,
+                                     const Elements & elementsLibrary, \
+                                     const std::vector<int> & layerList, \
+                                     const std::vector<std::string> &  familyList, \
+                                     const int & secondary = 0, \
+                                     const int & useGeometricEfficiency = 1, \
+                                     const int & useMassFractions = 0, \
+                                     const double & secondaryCalculationLimit = 0.0,
+                                     const Beam & overwritingBeam = Beam()) const;
+
 
     double getEnergyThreshold(const std::string & elementName, const std::string & family, \
                                 const Elements & elementsLibrary) const;
@@ -419,7 +580,105 @@ private:
     */
     bool recentBeam;
 
-    expectedLayerEmissionType lastMultilayerFluorescence;
+    /*!
+    Number of threads used by the multilayer calculation
+    */
+    int nThreads;
+
+    /*!
+    Amount of information returned by the multilayer calculation
+    */
+    int outputLevel;
+
+    /*!
+    Relative tolerance used to neglect secondary excitation sources
+    */
+    double secondaryTolerance;
+
+    /*!
+    Relative tolerance used to reduce the number of beam rays
+    */
+    double beamCompressionTolerance;
+
+    /*!
+    Calculate the derivatives with respect to the mass fractions in the returned plans
+    */
+    int massFractionDerivatives;
+
+    /*!
+    Calculate the derivatives with respect to the layer mass thicknesses in the returned plans
+    */
+    int massThicknessDerivatives;
+
+    /*!
+    Split the element, family and layer strings of the multilayer methods into the element, family
+    and layer lists of the basis methods. A negative layer stands for all the layers.
+    */
+    static void parseElementFamilyLayer(const std::vector<std::string> & elementFamilyLayer, \
+                                        std::vector<std::string> & elementList, \
+                                        std::vector<std::string> & familyList, \
+                                        std::vector<int> & layerList);
+
+    /*!
+    Apply the multilayer calculation settings (threads, output level, tolerances and derivatives)
+    to a plan prior to building it
+    */
+    void setMultilayerPlanSettings(MultilayerPlan & plan) const;
+
+    /*!
+    Discard the kept multilayer plan unless the new sample has the same number of layers,
+    the same reference layer and the same funny factors as the current one.
+    */
+    void checkMultilayerPlanSample(const std::vector<Layer> & layers, const int & referenceLayer);
+
+    /*!
+    Bring the kept multilayer plan up to date with the current sample. It returns false if
+    the plan cannot be updated and has to be built again.
+    */
+    bool updateMultilayerPlan(const Elements & elementsLibrary);
+
+    /*!
+    Kept multilayer plan and the arguments used to obtain it
+    */
+    int multilayerCacheEnabled;
+    bool multilayerPlanValid;
+    MultilayerPlan multilayerPlan;
+    const Elements * multilayerPlanLibrary;
+    unsigned long long multilayerPlanLibraryGeneration;
+    std::vector<std::string> multilayerPlanElementFamilyLayer;
+    std::vector<double> multilayerPlanFlags;
+    std::vector<std::vector<double> > multilayerPlanBeam;
+
+    /*!
+    Calculation behind getMultilayerFluorescence using element, family and layer strings
+    */
+    expectedLayerEmissionType calculateMultilayerFluorescence(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam);
+
+    /*!
+    Key of the result cache identifying the arguments, the settings and the configuration of a calculation
+    */
+    std::string getMultilayerFingerprint(const std::vector<std::string> & elementFamilyLayer, \
+                const Elements & elementsLibrary, const int & secondary, \
+                const int & useGeometricEfficiency, const int & useMassFractions, \
+                const double & secondaryCalculationLimit, const Beam & overwritingBeam) const;
+
+    /*!
+    Discard the least recently used results exceeding the size of the result cache
+    */
+    void trimResultCache();
+
+    /*!
+    Kept results and their last use by fingerprint, and fingerprints by last use
+    */
+    int resultCacheSize;
+    std::map<std::string, std::pair<long, expectedLayerEmissionType> > resultCache;
+    std::map<long, std::string> resultCacheOrder;
+    long resultCacheCounter;
+    long resultCacheHits;
+    long resultCacheMisses;
 };
 
 } // namespace fisx
@@ -30,6 +30,8 @@
 #include <stdexcept>
 #include <iostream>
 #include <algorithm>
+#include <sstream>
+#include <iomanip>
 
 namespace fisx
 {
@@ -570,6 +572,73 @@ void XRFConfig::setDetector(const Detector & detector)
     this->detector = detector;
 }
 
+std::string XRFConfig::getFingerprint() const
+{
+    std::ostringstream o;
+    std::vector<std::vector<double> > rays;
+    std::vector<double>::size_type i;
+    std::vector<Layer>::size_type iLayer;
+    std::vector<TransmissionTable>::size_type iTable;
+    std::map<std::string, double> composition;
+    std::map<std::string, double>::const_iterator c_it;
+    std::map<double, double> table;
+    std::map<double, double>::const_iterator t_it;
+    const std::vector<Layer> * layerLists[3] = {&(this->beamFilters), &(this->sample), &(this->attenuators)};
+    const std::vector<TransmissionTable> * tableLists[2] = {&(this->userBeamFilters), &(this->userAttenuators)};
+    std::vector<Layer> detectorLayer(1, this->detector);
+    int iList;
+
+    o << std::setprecision(17);
+    rays = this->beam.getBeamAsDoubleVectors();
+    o << "BEAM " << rays[0].size();
+    for (i = 0; i < rays[0].size(); i++)
+    {
+        o << " " << rays[0][i] << " " << rays[1][i] << " " << rays[2][i] << " " << rays[3][i];
+    }
+    o << std::endl;
+    for (iList = 0; iList < 4; iList++)
+    {
+        const std::vector<Layer> & layers = (iList < 3) ? *(layerLists[iList]) : detectorLayer;
+        o << "LAYERS " << layers.size() << std::endl;
+        for (iLayer = 0; iLayer < layers.size(); iLayer++)
+        {
+            o << layers[iLayer].getName() << "|" << layers[iLayer].getMaterialName() << "|";
+            o << layers[iLayer].getDensity() << " " << layers[iLayer].getThickness() << " ";
+            o << layers[iLayer].getFunnyFactor();
+            if (layers[iLayer].hasMaterialComposition())
+            {
+                composition = layers[iLayer].getMaterial().getComposition();
+                o << " MATERIAL " << layers[iLayer].getMaterial().getName();
+                for (c_it = composition.begin(); c_it != composition.end(); ++c_it)
+                {
+                    o << " " << c_it->first << " " << c_it->second;
+                }
+            }
+            o << std::endl;
+        }
+    }
+    for (iList = 0; iList < 2; iList++)
+    {
+        o << "TABLES " << tableLists[iList]->size() << std::endl;
+        for (iTable = 0; iTable < tableLists[iList]->size(); iTable++)
+        {
+            table = (*(tableLists[iList]))[iTable].getTransmissionTable();
+            o << (*(tableLists[iList]))[iTable].getName();
+            for (t_it = table.begin(); t_it != table.end(); ++t_it)
+            {
+                o << " " << t_it->first << " " << t_it->second;
+            }
+            o << std::endl;
+        }
+    }
+    o << "DETECTOR " << this->detector.getDiameter() << " " << this->detector.getDistance() << " ";
+    o << this->detector.getEscapePeakEnergyThreshold() << " " << this->detector.getEscapePeakIntensityThreshold();
+    o << " " << this->detector.getEscapePeakNThreshold() << " " << this->detector.getEscapePeakAlphaIn() << std::endl;
+    o << "GEOMETRY " << this->alphaIn << " " << this->alphaOut << " " << this->scatteringAngle << " ";
+    o << this->referenceLayer << std::endl;
+    return o.str();
+}
+
 std::ostream& operator<< (std::ostream& o, XRFConfig const& config)
 {
     std::vector<Layer>::size_type i;
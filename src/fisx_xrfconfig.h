@@ -148,6 +148,14 @@ public:
    const double & getScatteringAngle() const {return this->scatteringAngle;};
    const int & getReferenceLayer() const {return this->referenceLayer;};
 
+    /*!
+    Text uniquely describing the configuration: beam rays, beam filters, sample, attenuators, transmission
+    tables, detector and geometry. All the numbers are written at full precision, so two configurations
+    giving the same fingerprint lead to the same results. Materials referenced by name are only described
+    by their name.
+    */
+    std::string getFingerprint() const;
+
 private:
     Beam beam;
     std::vector<Material> materials;